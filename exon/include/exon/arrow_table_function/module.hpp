@@ -20,6 +20,9 @@
 #include <duckdb/parser/parsed_data/create_scalar_function_info.hpp>
 #include <duckdb/parser/tableref/table_function_ref.hpp>
 #include "duckdb/function/table/arrow.hpp"
+#include "duckdb/optimizer/optimizer_extension.hpp"
+
+#include "rust.hpp"
 
 using namespace duckdb;
 
@@ -34,6 +37,13 @@ namespace exon
         std::string file_type;
     };
 
+    //! Bind data of scans that know the order of their records: sorted by the columns `sort_columns`, in the order
+    //! their batch indexes return them. Empty when the order isn't known.
+    struct SortedScanFunctionData : public TableFunctionData
+    {
+        vector<column_t> sort_columns;
+    };
+
     struct WTArrowTableFunction : duckdb::ArrowTableFunction
     {
     private:
@@ -53,9 +63,60 @@ namespace exon
                                                                       TableFunctionInitInput &input,
                                                                       GlobalTableFunctionState *global_state);
 
+        static bool ExonScanParallelStateNext(ClientContext &context, const FunctionData *bind_data_p,
+                                              ArrowScanLocalState &state, ArrowScanGlobalState &global_state);
+
     public:
         static void Register(std::string name, std::string file_type, duckdb::ClientContext &context);
         static unique_ptr<TableRef> ReplacementScan(ClientContext &context, const string &table_name,
                                                     ReplacementScanData *data);
+
+        //! Answers `COUNT(*)` over an unfiltered scan of an indexed BAM, VCF or BCF file from the
+        //! record counts in its index, replacing the scan and aggregate with a constant.
+        static void OptimizeIndexCount(ClientContext &context, OptimizerExtensionInfo *info,
+                                       duckdb::unique_ptr<LogicalOperator> &plan);
+
+        //! Drops the ORDER BY at the root of `plan` when a scan's sort order already satisfies it, and turns a top-N
+        //! into a limit. The result keeps the scan's order through its batch indexes, so this needs
+        //! preserve_insertion_order.
+        static void OptimizeSortedScan(ClientContext &context, OptimizerExtensionInfo *info,
+                                       duckdb::unique_ptr<LogicalOperator> &plan);
+
+        //! The columns a scan of the local `file_format` file `file_name` is sorted by: `reference_column`, then
+        //! `position_column`, if the file's header or index guarantees that order and the reference column is an ENUM
+        //! in header order. Empty otherwise.
+        static vector<column_t> GetSortColumns(const string &file_name, const string &file_format,
+                                               const vector<string> &names, const vector<LogicalType> &types,
+                                               const string &reference_column, const string &position_column);
+
+        //! Renders the filters DuckDB pushed into a scan as a SQL predicate for the Rust readers.
+        static string FilterClause(const TableFilterSet &set, const vector<idx_t> &column_ids,
+                                   const vector<string> &column_names);
+
+        //! Opens the local VCF or BCF file `file_name` with new_subset_reader, keeping only `samples` and the INFO
+        //! keys `info_fields`, all of them if empty, and reading the records overlapping `regions`, or all of them if
+        //! empty. The genotypes and INFO values are only decoded if `columns` is null or names their column.
+        static void OpenSubsetReader(ClientContext &context, const string &file_name, const string &file_type,
+                                     const vector<string> &samples, const vector<string> &info_fields,
+                                     const vector<string> &regions, const vector<string> *columns, const char *filters,
+                                     struct ArrowArrayStream *stream);
+
+        //! The type of column `col_idx` with Arrow schema `schema`, as GetArrowLogicalType gives it. Dictionary-encoded
+        //! columns have the type of their values and are read as DuckDB dictionary vectors. The reference sequence
+        //! columns of `file_format` files are instead read as an ENUM of the sequences reference_names gives for
+        //! `file_name`, read through `file_system` if it isn't null and built once into `reference_type`: the
+        //! dictionary keys of `keyed` readers, like new_bam_scan or new_genotype_reader, are keys into it, other readers'
+        //! names are looked up in it. Names stay text if it gives none, as for a VCF file without an index.
+        static LogicalType GetArrowColumnType(ArrowSchema &schema,
+                                              unordered_map<idx_t, unique_ptr<ArrowConvertData>> &arrow_convert_data,
+                                              idx_t col_idx, const string &file_name, const string &file_format,
+                                              bool keyed, const DuckDBFileSystem *file_system,
+                                              LogicalType &reference_type);
+
+        //! ArrowToDuckDB for scans with ENUM columns, which it can't convert: keys into the header are copied from the
+        //! dictionary arrays as they are, names are looked up in the ENUM.
+        static void EnumArrowToDuckDB(ArrowScanLocalState &state,
+                                      unordered_map<idx_t, unique_ptr<ArrowConvertData>> &arrow_convert_data,
+                                      DataChunk &output, idx_t start);
     };
 }
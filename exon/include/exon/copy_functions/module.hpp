@@ -0,0 +1,33 @@
+// Copyright 2023 WHERE TRUE Technologies.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#pragma once
+
+#include <duckdb.hpp>
+#include <duckdb/parser/parsed_data/create_copy_function_info.hpp>
+
+namespace exon
+{
+
+    class CopyFunctions
+    {
+    public:
+        //! COPY ... TO (FORMAT <file_format>): writes rows as fasta, fastq, gff, bed or vcf records,
+        //! bgzipped when the file ends in .gz or COMPRESSION 'gzip' is given, or as BAM records with
+        //! the header of HEADER_FROM, indexed in the same pass with INDEX_FORMAT 'bai' or 'csi'.
+        static duckdb::unique_ptr<duckdb::CreateCopyFunctionInfo> GetCopyFunction(const std::string &file_format);
+    };
+
+} // namespace exon
@@ -0,0 +1,37 @@
+// Copyright 2023 WHERE TRUE Technologies.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <duckdb.hpp>
+
+#include "rust.hpp"
+
+namespace exon
+{
+
+    class ExonFileSystem
+    {
+    public:
+        //! Registers the settings that control how the exon readers do I/O.
+        static void RegisterSettings(duckdb::DBConfig &config);
+
+        //! True if readers should go through DuckDB's FileSystem rather than exon's object stores.
+        static bool Enabled(duckdb::ClientContext &context);
+
+        //! The callback table handed to the Rust readers, valid for the lifetime of the context.
+        static DuckDBFileSystem GetFFI(duckdb::ClientContext &context);
+    };
+
+} // namespace exon
@@ -0,0 +1,41 @@
+// Copyright 2023 WHERE TRUE Technologies.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#pragma once
+
+#include <duckdb.hpp>
+#include <duckdb/parser/parsed_data/create_table_function_info.hpp>
+
+namespace exon
+{
+
+    class IndexFunctions
+    {
+    public:
+        //! <name>(path): per-reference mapped and unmapped record counts read from the index of a
+        //! `file_format` file, like `samtools idxstats`.
+        static duckdb::unique_ptr<duckdb::CreateTableFunctionInfo> GetIndexStatsTableFunction(const std::string &name,
+                                                                                              const std::string &file_format);
+
+        //! exon_index(path): builds the BAI, CSI, tabix or FAI index of a local file and returns the
+        //! index files written with the number of records each covers.
+        static duckdb::unique_ptr<duckdb::CreateTableFunctionInfo> GetBuildIndexTableFunction();
+
+        //! exon_build_name_index(path): writes the `.nai` read name index next to a local BAM file, which
+        //! read_bam_file_records uses for filters on the read name, and returns it with the records indexed.
+        static duckdb::unique_ptr<duckdb::CreateTableFunctionInfo> GetBuildNameIndexTableFunction();
+    };
+
+} // namespace exon
@@ -1,9 +1,15 @@
+#pragma once
+
 #include <cstdarg>
 #include <cstdint>
 #include <cstdlib>
 #include <ostream>
 #include <new>
 
+struct CopyWriter;
+
+struct EncodedRecords;
+
 struct ReaderResult {
   const char *error;
 };
@@ -16,10 +22,144 @@ struct BAMReaderResult {
   const char *error;
 };
 
+struct BAMScanResult {
+  const char *error;
+};
+
+struct ReferenceNamesResult {
+  const char *const *names;
+  uintptr_t count;
+  const char *error;
+};
+
+struct SortOrderResult {
+  bool coordinate;
+  const char *error;
+};
+
 struct BCFReaderResult {
   const char *error;
 };
 
+struct CopyWriterResult {
+  CopyWriter *writer;
+  const char *error;
+};
+
+struct CopyBuffer {
+  const uint8_t *data;
+  uintptr_t length;
+  /// The records to index, handed back through `copy_writer_commit`.
+  EncodedRecords *records;
+  const char *error;
+};
+
+struct CopyStatus {
+  const char *error;
+};
+
+struct CRAMReaderResult {
+  const char *error;
+};
+
+/// Callbacks into DuckDB's `FileSystem`, filled in on the extension side.
+///
+/// `context` is handed back to `open` and `glob`, the handle returned by `open` is handed back to
+/// the per-file callbacks. `read_at` returns the number of bytes read or -1 on error.
+struct DuckDBFileSystem {
+  void *context;
+  void *(*open)(void *context, const char *path);
+  int64_t (*read_at)(void *handle, uint8_t *buffer, uintptr_t length, uint64_t offset);
+  int64_t (*file_size)(void *handle);
+  int64_t (*last_modified)(void *handle);
+  void (*close)(void *handle);
+  char *(*glob)(void *context, const char *pattern);
+  void (*free_string)(char *value);
+};
+
+struct DuplicateReaderResult {
+  const char *error;
+};
+
+struct DiskCacheResult {
+  const char *error;
+};
+
+struct FastaFetchResult {
+  /// The sequence name, only set by `fasta_fetch_region`.
+  const char *name;
+  const char *sequence;
+  uintptr_t length;
+  /// The fetched interval, one-based and inclusive, after clamping to the sequence.
+  uint64_t start;
+  uint64_t end;
+  const char *error;
+};
+
+struct FastaWindowReaderResult {
+  const char *error;
+};
+
+struct GenotypeReaderResult {
+  const char *error;
+};
+
+struct MatePairReaderResult {
+  const char *error;
+};
+
+struct ScanPartitionsResult {
+  const char *const *regions;
+  uintptr_t count;
+  const char *error;
+};
+
+struct PartitionReaderResult {
+  const char *error;
+};
+
+struct SortedMergeReaderResult {
+  const char *error;
+};
+
+struct SubsetReaderResult {
+  const char *error;
+};
+
+struct IndexFile {
+  const char *path;
+  uint64_t records;
+};
+
+struct BuildIndexResult {
+  const IndexFile *files;
+  uintptr_t count;
+  const char *error;
+};
+
+struct IndexReferenceStats {
+  const char *name;
+  /// -1 when unknown, as are `mapped` and `unmapped`.
+  int64_t length;
+  int64_t mapped;
+  int64_t unmapped;
+};
+
+struct IndexStatsResult {
+  const IndexReferenceStats *references;
+  uintptr_t count;
+  const char *error;
+};
+
+struct IndexRecordCountResult {
+  uint64_t count;
+  bool known;
+};
+
+struct OffsetReaderResult {
+  const char *error;
+};
+
 struct VCFReaderResult {
   const char *error;
 };
@@ -43,24 +183,276 @@ ReaderResult new_reader(ArrowArrayStream *stream_ptr,
                         uintptr_t batch_size,
                         const char *compression,
                         const char *file_format,
-                        const char *filters);
+                        const char *filters,
+                        const DuckDBFileSystem *file_system);
 
 ReplacementScanResult replacement_scan(const char *uri);
 
+/// Reads the records of the indexed file at `uri` overlapping any of the `region_count` regions at
+/// `regions`. Each region is samtools-style, e.g. `chr1:100-200`, or the path of a BED file.
+/// Overlapping regions are merged and every record is returned once. The reference column is
+/// dictionary-encoded as `new_bam_scan` returns it, and `filters` is a SQL predicate applied to
+/// the records.
 BAMReaderResult bam_query_reader(ArrowArrayStream *stream_ptr,
                                  const char *uri,
-                                 const char *query,
-                                 uintptr_t batch_size);
+                                 const char *const *regions,
+                                 uintptr_t region_count,
+                                 uintptr_t batch_size,
+                                 const DuckDBFileSystem *file_system,
+                                 const char *filters);
+
+/// Reads the local BAM file at `uri` with the columns of `read_bam_file_records`, followed by a
+/// typed column for each of the `tag_count` aux tags at `tags`, e.g. `NM`, and, if
+/// `virtual_offset` is set, the virtual offset of each record. Only the `column_count` columns
+/// named at `columns` are decoded, the others are all null; if `columns` is null every column is
+/// decoded.
+///
+/// With no regions the whole file is read. Otherwise the records overlapping any of the
+/// `region_count` regions at `regions` are read, each samtools-style or the path of a BED file,
+/// as `bam_query_reader` does; if `partition` is set, `regions` is one region planned by
+/// `scan_partitions` and only records starting in it are read. `filters` is a SQL predicate
+/// applied to the records.
+///
+/// `read_names`, if not null, lists the `read_name_count` names `filters` keeps records of; a
+/// whole-file scan of a file with a name index then reads only the records the index lists for
+/// them. `filters` must still select the names, the index can return other records too.
+///
+/// Whole files are inflated by `threads` threads, DuckDB's own thread count, while a thread of the
+/// scan decodes them. A partition is decoded by the DuckDB thread reading it, as it reads it.
+BAMScanResult new_bam_scan(ArrowArrayStream *stream_ptr,
+                           const char *uri,
+                           const char *const *regions,
+                           uintptr_t region_count,
+                           bool partition,
+                           const char *const *tags,
+                           uintptr_t tag_count,
+                           const char *const *columns,
+                           uintptr_t column_count,
+                           bool virtual_offset,
+                           const char *const *read_names,
+                           uintptr_t read_name_count,
+                           uintptr_t batch_size,
+                           uintptr_t threads,
+                           const char *filters);
+
+/// The reference sequences declared in the header of the BAM, VCF or BCF file at `uri`, in header
+/// order, which the dictionary-encoded reference columns of `new_bam_scan` and
+/// `new_genotype_reader` are keys into and the other readers' reference columns are read as. VCF
+/// records may name contigs the header doesn't declare: those a tabix index lists follow the
+/// declared ones, and a VCF file without one has no names, so its chrom column stays text.
+/// `file_format` is `bam`, `bcf`, or `vcf`, which also reads local BCF files. Files that aren't
+/// local, or are read through the DuckDB file system if `file_system` isn't null, have their
+/// header fetched from the object store.
+ReferenceNamesResult reference_names(const char *uri, const char *file_format,
+                                     const DuckDBFileSystem *file_system);
+
+/// Releases the names and error of a `ReferenceNamesResult`.
+void free_reference_names(ReferenceNamesResult result);
+
+/// Whether the records of the local BAM, VCF or BCF file at `uri` are sorted by reference
+/// sequence, in header order, then by position: indexed BAM files whose header declares
+/// `SO:coordinate`, and indexed VCF and BCF files, whose references follow the header.
+/// `file_format` is `bam`, or `vcf` for either variant format.
+SortOrderResult sort_order(const char *uri, const char *file_format);
 
+/// Reads the records of the indexed file at `uri` overlapping any of the `region_count` regions at
+/// `regions`. Each region is samtools-style, e.g. `chr1:100-200`, or the path of a BED file.
+/// Overlapping regions are merged and every record is returned once. `filters` is a SQL
+/// predicate applied to the records.
 BCFReaderResult bcf_query_reader(ArrowArrayStream *stream_ptr,
                                  const char *uri,
-                                 const char *query,
-                                 uintptr_t batch_size);
+                                 const char *const *regions,
+                                 uintptr_t region_count,
+                                 uintptr_t batch_size,
+                                 const DuckDBFileSystem *file_system,
+                                 const char *filters);
+
+/// Creates a writer of `file_format` records for rows with the Arrow `schema`, which is moved
+/// out of. `header_from` is the VCF, BAM or SAM file whose header is copied, null for a default
+/// one; `index_format` is `bai` or `csi` to index BAM output as it is written, null for none.
+CopyWriterResult new_copy_writer(const char *file_format,
+                                 ArrowSchema *schema,
+                                 const char *path,
+                                 const char *compression,
+                                 const char *header_from,
+                                 const char *index_format);
+
+/// The bytes to write before the first record.
+CopyBuffer copy_writer_header(const CopyWriter *writer);
+
+/// The bytes to write after the last record.
+CopyBuffer copy_writer_footer(const CopyWriter *writer);
+
+/// Formats the `count` chunks at `arrays`, which are moved out of, into bytes that can be
+/// written after any earlier output. Safe to call from several threads at once.
+CopyBuffer copy_writer_encode(const CopyWriter *writer, ArrowArray *arrays, uintptr_t count);
+
+/// Tells the writer `buffer` is written next. Must be called for every buffer, header and footer
+/// included, in the order they are written. The data of `buffer` may be replaced, with the bytes
+/// to write instead.
+CopyStatus copy_writer_commit(const CopyWriter *writer, CopyBuffer *buffer);
+
+/// Writes the index of the output, if one was asked for, once everything has been written.
+CopyStatus copy_writer_finish(CopyWriter *writer);
+
+/// Releases the data, records and error of a `CopyBuffer`.
+void free_copy_buffer(CopyBuffer buffer);
+
+/// Releases the error of a `CopyStatus`.
+void free_copy_status(CopyStatus status);
+
+/// Releases the error of a `CopyWriterResult`, and the writer, if any.
+void free_copy_writer(CopyWriterResult result);
+
+/// Reads the CRAM file at `uri`, with the same schema as BAM files. Bases are resolved against
+/// the FASTA file `reference`, which must have a `.fai` index, or against the references
+/// embedded in the file if it is null. If `region_count` is positive only records overlapping
+/// the regions at `regions` are returned, reading just the containers the `.crai` index points
+/// at when there is one. `filters` is a SQL predicate applied to the records. `threads`
+/// containers are decoded at once, a thread each.
+CRAMReaderResult new_cram_reader(ArrowArrayStream *stream_ptr,
+                                 const char *uri,
+                                 const char *reference,
+                                 const char *const *regions,
+                                 uintptr_t region_count,
+                                 uintptr_t batch_size,
+                                 uintptr_t threads,
+                                 const char *filters);
+
+/// Plans the partitions `new_duplicate_reader` can mark the local BAM file at `uri` in, one per
+/// reference sequence. No partitions and no error means the file should be marked as a whole,
+/// e.g. it has no index. Released with `free_scan_partitions`.
+ScanPartitionsResult duplicate_partitions(const char *uri);
+
+/// Reads the records of the local coordinate-sorted BAM file at `uri` with duplicates marked,
+/// with the columns of `duplicates_schema`. If `partition` is not null, one planned by
+/// `duplicate_partitions`, only its records are read. Only the `column_count` columns named at
+/// `columns` are decoded, the others are all null; if `columns` is null every column is decoded.
+/// `filters` is a SQL predicate applied to the marked records. Whole files are inflated by
+/// `threads` threads.
+DuplicateReaderResult new_duplicate_reader(ArrowArrayStream *stream_ptr,
+                                           const char *uri,
+                                           const char *partition,
+                                           const char *const *columns,
+                                           uintptr_t column_count,
+                                           uintptr_t batch_size,
+                                           uintptr_t threads,
+                                           const char *filters);
+
+/// Reads the FASTA file(s) at `uri` as windows of `window_size` bases overlapping by `overlap`,
+/// with the schema `id, start, sequence`. `start` is the one-based position of the window's
+/// first base in its record.
+FastaWindowReaderResult new_fasta_window_reader(ArrowArrayStream *stream_ptr,
+                                                const char *uri,
+                                                uintptr_t batch_size,
+                                                const char *compression,
+                                                uintptr_t window_size,
+                                                uintptr_t overlap,
+                                                const char *filters,
+                                                const DuckDBFileSystem *file_system);
+
+/// Reads the genotypes of the local VCF or BCF file at `uri` as a matrix, a row per site with
+/// columns `chrom`, `pos`, `ref`, `alt` and `genotypes`, the latter holding the genotypes of the
+/// `sample_count` samples named at `samples`, in that order, or of every sample if null. Each
+/// genotype is an int8 dosage, or with `packed` a 2-bit PLINK 1 code. VCF files may be
+/// uncompressed or bgzipped.
+///
+/// With a null `region` the whole file is read. Otherwise the sites overlapping it, samtools-style
+/// or the path of a BED file, are read with the file's index. `filters` is a SQL predicate applied
+/// to the rows. Whole files are inflated by `threads` threads.
+GenotypeReaderResult new_genotype_reader(ArrowArrayStream *stream_ptr,
+                                         const char *uri,
+                                         const char *const *samples,
+                                         uintptr_t sample_count,
+                                         const char *region,
+                                         bool packed,
+                                         uintptr_t batch_size,
+                                         uintptr_t threads,
+                                         const char *filters);
+
+/// Reads the read pairs of the local coordinate-sorted BAM file at `uri` with the columns of
+/// `mate_pairs_schema`. If `region` is not null, a samtools-style region read with the file's
+/// index, only pairs whose leftmost mate starts in it and whose other mate is on the same
+/// reference sequence are read. `filters` is a SQL predicate applied to the pairs. Whole files are
+/// inflated by `threads` threads.
+MatePairReaderResult new_mate_pair_reader(ArrowArrayStream *stream_ptr,
+                                          const char *uri,
+                                          const char *region,
+                                          uintptr_t batch_size,
+                                          uintptr_t threads,
+                                          const char *filters);
+
+/// Plans about `target_partitions` regions for a full scan of the BAM, VCF or BCF file at `uri`,
+/// each to be read with `new_partition_reader`. No regions and no error means the file should be
+/// scanned as a whole, e.g. it has no index or holds unmapped reads.
+ScanPartitionsResult scan_partitions(const char *uri,
+                                     const char *file_format,
+                                     uintptr_t target_partitions,
+                                     const DuckDBFileSystem *file_system);
+
+/// Releases the regions and error of a `ScanPartitionsResult`.
+void free_scan_partitions(ScanPartitionsResult result);
+
+/// Reads one partition planned by `scan_partitions` from the file at `uri`, applying the SQL
+/// `filters` as a full scan would.
+PartitionReaderResult new_partition_reader(ArrowArrayStream *stream_ptr,
+                                           const char *uri,
+                                           const char *file_format,
+                                           const char *region,
+                                           uintptr_t batch_size,
+                                           const char *filters,
+                                           const DuckDBFileSystem *file_system);
+
+/// Reads the `uri_count` local coordinate-sorted BAM files at `uris` as one stream sorted by
+/// reference sequence, in the order of their shared header, then position, with the columns of
+/// `read_bam_file_records`. Only the `column_count` columns named at `columns` are decoded, the
+/// others are all null; if `columns` is null every column is decoded. `filters` is a SQL predicate
+/// applied to the records.
+SortedMergeReaderResult new_sorted_merge_reader(ArrowArrayStream *stream_ptr,
+                                                const char *const *uris,
+                                                uintptr_t uri_count,
+                                                const char *const *columns,
+                                                uintptr_t column_count,
+                                                uintptr_t batch_size,
+                                                const char *filters);
 
+/// Reads the local VCF or BCF file at `uri`, keeping only the `sample_count` samples named at
+/// `samples` in its `formats` column, in that order, and the `info_field_count` INFO keys named
+/// at `info_fields` in its `info` column. A null list keeps everything. If `decode_samples` is
+/// false the `formats` column isn't needed and a single sample is decoded; if `decode_info` is
+/// false no INFO values are. VCF files may be uncompressed or bgzipped.
+///
+/// With no regions the whole file is read. Otherwise the records overlapping any of the
+/// `region_count` regions at `regions` are read with the file's index, each samtools-style or
+/// the path of a BED file; overlapping regions are merged and every record is returned once.
+/// `filters` is a SQL predicate applied to the records. Whole files are inflated by `threads`
+/// threads.
+SubsetReaderResult new_subset_reader(ArrowArrayStream *stream_ptr,
+                                     const char *uri,
+                                     const char *file_format,
+                                     const char *const *samples,
+                                     uintptr_t sample_count,
+                                     bool decode_samples,
+                                     const char *const *info_fields,
+                                     uintptr_t info_field_count,
+                                     bool decode_info,
+                                     const char *const *regions,
+                                     uintptr_t region_count,
+                                     uintptr_t batch_size,
+                                     uintptr_t threads,
+                                     const char *filters);
+
+/// Reads the records of the indexed file at `uri` overlapping any of the `region_count` regions at
+/// `regions`. Each region is samtools-style, e.g. `chr1:100-200`, or the path of a BED file.
+/// Overlapping regions are merged and every record is returned once. `filters` is a SQL
+/// predicate applied to the records.
 VCFReaderResult vcf_query_reader(ArrowArrayStream *stream_ptr,
                                  const char *uri,
-                                 const char *query,
-                                 uintptr_t batch_size);
+                                 const char *const *regions,
+                                 uintptr_t region_count,
+                                 uintptr_t batch_size,
+                                 const DuckDBFileSystem *file_system,
+                                 const char *filters);
 
 bool is_segmented(uint16_t flag);
 
@@ -90,4 +482,62 @@ CResult parse_cigar(const char *cigar);
 
 CExtractResponse extract_from_cigar(const char *sequence_str, const char *cigar_str);
 
+/// Sets the block cache size in bytes, zero disables the cache and prefetching.
+void set_block_cache_capacity(uintptr_t capacity);
+
+/// Points the disk cache at `directory`, holding at most `capacity` bytes. A null or empty
+/// directory, or a zero capacity, disables it.
+DiskCacheResult set_disk_cache(const char *directory, uint64_t capacity);
+
+/// Fetches `name:start-end` (one-based, inclusive) from the indexed FASTA at `path`.
+FastaFetchResult fasta_fetch(const char *path, const char *name, uint64_t start, uint64_t end);
+
+/// Fetches a samtools-style region, e.g. `chr1:100-200`, from the indexed FASTA at `path`.
+FastaFetchResult fasta_fetch_region(const char *path, const char *region);
+
+/// Releases the strings of a `FastaFetchResult`.
+void free_fasta_fetch_result(FastaFetchResult result);
+
+/// Builds the index of the local file at `path`, see `build`. Empty or null `file_format`,
+/// `index_format` and `index_path` take their defaults.
+BuildIndexResult build_index(const char *path,
+                             const char *file_format,
+                             const char *index_format,
+                             const char *index_path,
+                             uintptr_t threads);
+
+/// Releases the files and error of a `BuildIndexResult`.
+void free_build_index(BuildIndexResult result);
+
+/// Reads the per-reference record counts of the BAM, VCF or BCF file at `uri` from its index.
+IndexStatsResult index_stats(const char *uri,
+                             const char *file_format,
+                             const DuckDBFileSystem *file_system);
+
+/// Releases the references and error of an `IndexStatsResult`.
+void free_index_stats(IndexStatsResult result);
+
+/// The number of records in the BAM, VCF or BCF file at `uri` according to its index. `known` is
+/// false, rather than an error being raised, whenever the index can't answer: no index, an index
+/// older than the file, or one without pseudo-bins.
+IndexRecordCountResult index_record_count(const char *uri,
+                                          const char *file_format,
+                                          const DuckDBFileSystem *file_system);
+
+/// Builds the name index of the local BAM file at `path`, see `build_name_index`.
+BuildIndexResult build_bam_name_index(const char *path, uintptr_t threads);
+
+/// Reads the local BAM or bgzipped VCF file at `uri` with a trailing `virtual_offset` column
+/// holding the BGZF virtual offset of each record. If `offsets` is not null only the
+/// `offset_count` records starting at those virtual offsets are read, in file order. `filters` is
+/// a SQL predicate applied to the records. Whole files are inflated by `threads` threads.
+OffsetReaderResult new_offset_reader(ArrowArrayStream *stream_ptr,
+                                     const char *uri,
+                                     const char *file_format,
+                                     const uint64_t *offsets,
+                                     uintptr_t offset_count,
+                                     uintptr_t batch_size,
+                                     uintptr_t threads,
+                                     const char *filters);
+
 } // extern "C"
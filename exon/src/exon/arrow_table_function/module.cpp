@@ -14,23 +14,66 @@
 
 #include <iostream>
 #include <cmath>
+#include <algorithm>
+#include <functional>
 
 #include <duckdb.hpp>
 #include <duckdb/common/file_system.hpp>
 #include <duckdb/parser/expression/constant_expression.hpp>
 #include <duckdb/parser/expression/function_expression.hpp>
 #include <duckdb/function/table/read_csv.hpp>
+#include <duckdb/parallel/task_scheduler.hpp>
+#include <duckdb/planner/expression/bound_aggregate_expression.hpp>
+#include <duckdb/planner/expression/bound_columnref_expression.hpp>
+#include <duckdb/planner/expression/bound_constant_expression.hpp>
+#include <duckdb/planner/operator/logical_aggregate.hpp>
+#include <duckdb/planner/operator/logical_dummy_scan.hpp>
+#include <duckdb/planner/operator/logical_get.hpp>
+#include <duckdb/planner/operator/logical_limit.hpp>
+#include <duckdb/planner/operator/logical_order.hpp>
+#include <duckdb/planner/operator/logical_projection.hpp>
+#include <duckdb/planner/operator/logical_top_n.hpp>
 
 #include "exon/arrow_table_function/module.hpp"
+#include "exon/file_system/module.hpp"
+#include "exon/genotype_matrix_function/module.hpp"
+#include "exon/merge_sorted_function/module.hpp"
 #include "rust.hpp"
 
 namespace exon
 {
-    struct ExonScanFunctionData : public TableFunctionData
+    struct ExonScanFunctionData : public SortedScanFunctionData
     {
         string file_type;
         string compression;
         string file_name;
+        bool use_duckdb_file_system = false;
+
+        //! Set for read_fasta(..., window_size=) to stream records as windows rather than whole.
+        idx_t window_size = 0;
+        idx_t overlap = 0;
+
+        //! The reference FASTA read_cram_file_records resolves bases against, empty to use the
+        //! references embedded in the file.
+        string reference;
+
+        //! Set for read_bam_file_records/read_vcf_file_records(..., virtual_offset=true) to add
+        //! each record's BGZF virtual offset, which bam_fetch and vcf_fetch take back.
+        bool virtual_offset = false;
+
+        //! Set for local BAM files, read by the decoder that only decodes the projected columns.
+        bool bam_scan = false;
+
+        //! The aux tags read_bam_file_records(..., tags=) returns as columns of their own.
+        vector<string> tags;
+
+        //! The samples and INFO keys read_vcf_file_records/read_bcf_file_records(..., samples=, info_fields=) keep
+        //! in the formats and info columns.
+        vector<string> samples;
+        vector<string> info_fields;
+
+        //! Set when samples or INFO keys are given, read by the decoder that cuts records down to them.
+        bool subset = false;
 
         unordered_map<idx_t, unique_ptr<ArrowConvertData>> arrow_convert_data;
         idx_t max_threads = 6;
@@ -42,10 +85,27 @@ namespace exon
 
     struct ExonScanGlobalState : ArrowScanGlobalState
     {
+        //! Regions of an index-partitioned scan, handed out to threads in order. Empty when the
+        //! file is read as one shared stream.
+        vector<string> partitions;
+        atomic<idx_t> next_partition{0};
+        string filter_clause;
+
+        //! The names of the columns the scan reads, projected and filtered ones.
+        vector<string> columns;
     };
 
     struct ExonScanLocalState : ArrowScanLocalState
     {
+        explicit ExonScanLocalState(unique_ptr<ArrowArrayWrapper> current_chunk)
+            : ArrowScanLocalState(std::move(current_chunk))
+        {
+        }
+
+        //! The partition this thread is reading, its stream and the chunks read from it so far.
+        unique_ptr<ArrowArrayStreamWrapper> partition_stream;
+        idx_t partition = 0;
+        idx_t partition_chunks = 0;
     };
 
     unique_ptr<LocalTableFunctionState>
@@ -55,7 +115,7 @@ namespace exon
 
         auto &global_state = global_state_p->Cast<ArrowScanGlobalState>();
         auto current_chunk = make_uniq<ArrowArrayWrapper>();
-        auto result = make_uniq<ArrowScanLocalState>(std::move(current_chunk));
+        auto result = make_uniq<ExonScanLocalState>(std::move(current_chunk));
         result->column_ids = input.column_ids;
         result->filters = input.filters.get();
 
@@ -65,13 +125,544 @@ namespace exon
             result->all_columns.Initialize(context, asgs.scanned_types);
         }
 
-        if (!ArrowScanParallelStateNext(context, input.bind_data.get(), *result, global_state))
+        if (!ExonScanParallelStateNext(context, input.bind_data.get(), *result, global_state))
         {
             return nullptr;
         }
         return std::move(result);
     }
 
+    unique_ptr<LocalTableFunctionState> WTArrowTableFunction::ArrowScanInitLocal(ExecutionContext &context,
+                                                                                 TableFunctionInitInput &input,
+                                                                                 GlobalTableFunctionState *global_state_p)
+    {
+        return ArrowScanInitLocalInternal(context.client, input, global_state_p);
+    }
+
+    //! Whether the file is a single local file, which the crate's own decoders can read.
+    static bool IsLocalFile(ClientContext &context, const ExonScanFunctionData &data)
+    {
+        if (data.use_duckdb_file_system || data.file_name.find("://") != string::npos)
+        {
+            return false;
+        }
+
+        return FileSystem::GetFileSystem(context).FileExists(data.file_name);
+    }
+
+    //! Opens a local BAM file with new_bam_scan, decoding only `columns`, or every column if null. A
+    //! non-null `region` is a partition planned by scan_partitions. `read_names` are the names
+    //! `filters` keeps, looked up in the file's name index if it has one.
+    static void OpenBamScan(ClientContext &context, const ExonScanFunctionData &data, const char *region,
+                            const vector<string> *columns, const vector<string> &read_names, const char *filters,
+                            struct ArrowArrayStream *stream)
+    {
+        vector<const char *> tag_ptrs;
+        for (auto &tag : data.tags)
+        {
+            tag_ptrs.push_back(tag.c_str());
+        }
+
+        vector<const char *> column_ptrs;
+        if (columns)
+        {
+            for (auto &column : *columns)
+            {
+                column_ptrs.push_back(column.c_str());
+            }
+        }
+
+        // A null column list decodes every column, so an empty list still passes a valid pointer.
+        const char *no_column = NULL;
+        auto column_list = !columns ? NULL : column_ptrs.empty() ? &no_column : column_ptrs.data();
+
+        vector<const char *> read_name_ptrs;
+        for (auto &read_name : read_names)
+        {
+            read_name_ptrs.push_back(read_name.c_str());
+        }
+
+        auto result = new_bam_scan(stream, data.file_name.c_str(), region ? &region : NULL, region ? 1 : 0, region != NULL,
+                                   tag_ptrs.data(), tag_ptrs.size(), column_list, column_ptrs.size(), data.virtual_offset,
+                                   read_names.empty() ? NULL : read_name_ptrs.data(), read_name_ptrs.size(),
+                                   STANDARD_VECTOR_SIZE, TaskScheduler::GetScheduler(context).NumberOfThreads(),
+                                   filters);
+        if (result.error != NULL)
+        {
+            throw std::runtime_error(result.error);
+        }
+    }
+
+    //! The C strings of `strings`, for the Rust readers.
+    static vector<const char *> StringPointers(const vector<string> &strings)
+    {
+        vector<const char *> ptrs;
+        for (auto &string : strings)
+        {
+            ptrs.push_back(string.c_str());
+        }
+
+        return ptrs;
+    }
+
+    void WTArrowTableFunction::OpenSubsetReader(ClientContext &context, const string &file_name,
+                                                const string &file_type, const vector<string> &samples,
+                                                const vector<string> &info_fields, const vector<string> &regions,
+                                                const vector<string> *columns, const char *filters,
+                                                struct ArrowArrayStream *stream)
+    {
+        auto sample_ptrs = StringPointers(samples);
+        auto info_field_ptrs = StringPointers(info_fields);
+        auto region_ptrs = StringPointers(regions);
+
+        auto decode_samples = !columns || std::find(columns->begin(), columns->end(), "formats") != columns->end();
+        auto decode_info = !columns || std::find(columns->begin(), columns->end(), "info") != columns->end();
+
+        // An empty list keeps everything, which the reader takes as a null list.
+        auto result = new_subset_reader(stream, file_name.c_str(), file_type.c_str(),
+                                        samples.empty() ? NULL : sample_ptrs.data(), sample_ptrs.size(), decode_samples,
+                                        info_fields.empty() ? NULL : info_field_ptrs.data(), info_field_ptrs.size(),
+                                        decode_info, region_ptrs.data(), region_ptrs.size(), STANDARD_VECTOR_SIZE,
+                                        TaskScheduler::GetScheduler(context).NumberOfThreads(), filters);
+        if (result.error != NULL)
+        {
+            throw std::runtime_error(result.error);
+        }
+    }
+
+    //! Whether `name` is a reference sequence column of `file_format` files.
+    static bool IsReferenceColumn(const string &file_format, const string &name)
+    {
+        if (file_format == "bam")
+        {
+            return name == "reference" || name == "mate_reference";
+        }
+
+        return (file_format == "vcf" || file_format == "bcf") && name == "chrom";
+    }
+
+    //! The ENUM of the reference sequences declared in the header of the `file_format` file `file_name`.
+    static LogicalType ReferenceEnum(const string &file_name, const string &file_format,
+                                     const DuckDBFileSystem *file_system)
+    {
+        auto result = reference_names(file_name.c_str(), file_format.c_str(), file_system);
+        if (result.error != NULL)
+        {
+            auto error = string(result.error);
+            free_reference_names(result);
+            throw std::runtime_error(error);
+        }
+
+        Vector names(LogicalType::VARCHAR, MaxValue<idx_t>(result.count, 1));
+        auto name_data = FlatVector::GetData<string_t>(names);
+        for (idx_t i = 0; i < result.count; i++)
+        {
+            name_data[i] = StringVector::AddString(names, result.names[i]);
+        }
+
+        auto reference_type = LogicalType::ENUM("reference", names, result.count);
+        free_reference_names(result);
+
+        return reference_type;
+    }
+
+    LogicalType WTArrowTableFunction::GetArrowColumnType(ArrowSchema &schema,
+                                                         unordered_map<idx_t, unique_ptr<ArrowConvertData>> &arrow_convert_data,
+                                                         idx_t col_idx, const string &file_name, const string &file_format,
+                                                         bool keyed, const DuckDBFileSystem *file_system,
+                                                         LogicalType &reference_type)
+    {
+        auto &values = schema.dictionary ? *schema.dictionary : schema;
+        auto reference_column = IsReferenceColumn(file_format, schema.name) && string(values.format) == "u";
+
+        if (reference_column && schema.dictionary && string(schema.format) != "i")
+        {
+            throw std::runtime_error("dictionary column " + string(schema.name) + " must have int32 keys");
+        }
+
+        if (reference_column && reference_type.id() != LogicalTypeId::ENUM)
+        {
+            reference_type = ReferenceEnum(file_name, file_format, file_system);
+        }
+
+        // Keys into the header are read as they are, even if it declares no sequence and all of them are null. Names
+        // can only be read as an ENUM of the sequences the header declares.
+        if (reference_column && ((keyed && schema.dictionary) || EnumType::GetSize(reference_type) > 0))
+        {
+            if (!keyed || !schema.dictionary)
+            {
+                // EnumArrowToDuckDB looks the names of the columns it has convert data for up in the ENUM.
+                arrow_convert_data[col_idx] = make_uniq<ArrowConvertData>(LogicalType::VARCHAR);
+            }
+
+            return reference_type;
+        }
+
+        if (!schema.dictionary)
+        {
+            return GetArrowLogicalType(schema, arrow_convert_data, col_idx);
+        }
+
+        // As DuckDB's own Arrow scan binds them: the key type, then the values the column has.
+        arrow_convert_data[col_idx] = make_uniq<ArrowConvertData>(GetArrowLogicalType(schema, arrow_convert_data, col_idx));
+        return GetArrowLogicalType(*schema.dictionary, arrow_convert_data, col_idx);
+    }
+
+    //! Copies `count` int32 dictionary keys into an ENUM vector of physical type T, nulls where the
+    //! Arrow validity bitmap, read from `bit_offset`, has them. Keys must be positions in the ENUM.
+    template <class T>
+    static void CopyEnumKeys(Vector &vector, const int32_t *keys, const uint8_t *validity, idx_t bit_offset,
+                             idx_t count)
+    {
+        auto data = FlatVector::GetData<T>(vector);
+        auto &mask = FlatVector::Validity(vector);
+        auto size = EnumType::GetSize(vector.GetType());
+
+        for (idx_t row = 0; row < count; row++)
+        {
+            auto bit = bit_offset + row;
+            if (validity && !((validity[bit / 8] >> (bit % 8)) & 1))
+            {
+                mask.SetInvalid(row);
+                continue;
+            }
+
+            if (keys[row] < 0 || (idx_t)keys[row] >= size)
+            {
+                throw std::runtime_error("reference sequence key " + to_string(keys[row]) +
+                                         " is not in the file header");
+            }
+
+            data[row] = (T)keys[row];
+        }
+    }
+
+    //! The position in ENUM `type` of string `index` of the Arrow string array `array`.
+    static idx_t EnumPosition(const LogicalType &type, const ArrowArray &array, idx_t index)
+    {
+        auto offsets = (const int32_t *)array.buffers[1] + array.offset;
+        auto data = (const char *)array.buffers[2];
+        auto value = string_t(data + offsets[index], offsets[index + 1] - offsets[index]);
+
+        auto position = EnumType::GetPos(type, value);
+        if (position < 0)
+        {
+            throw std::runtime_error("reference sequence " + value.GetString() + " is not declared in the file header");
+        }
+
+        return position;
+    }
+
+    //! Looks `count` reference sequence names of the string or dictionary array `array`, from row `row_offset`, up
+    //! in the ENUM of `result`, of physical type T.
+    template <class T>
+    static void CopyEnumValues(Vector &result, const ArrowArray &array, idx_t row_offset, idx_t count)
+    {
+        auto &type = result.GetType();
+        auto data = FlatVector::GetData<T>(result);
+        auto &mask = FlatVector::Validity(result);
+
+        auto offset = array.offset + row_offset;
+        auto validity = array.null_count == 0 ? NULL : (const uint8_t *)array.buffers[0];
+
+        // Each dictionary value is looked up once, when a row first uses it.
+        auto keys = array.dictionary ? (const int32_t *)array.buffers[1] + offset : NULL;
+        vector<int64_t> positions(array.dictionary ? array.dictionary->length : 0, -1);
+
+        for (idx_t row = 0; row < count; row++)
+        {
+            auto bit = offset + row;
+            if (validity && !((validity[bit / 8] >> (bit % 8)) & 1))
+            {
+                mask.SetInvalid(row);
+                continue;
+            }
+
+            if (!keys)
+            {
+                data[row] = (T)EnumPosition(type, array, row_offset + row);
+                continue;
+            }
+
+            auto key = keys[row];
+            if (key < 0 || key >= array.dictionary->length)
+            {
+                throw std::runtime_error("dictionary key " + to_string(key) + " is out of range");
+            }
+
+            if (positions[key] < 0)
+            {
+                positions[key] = EnumPosition(type, *array.dictionary, key);
+            }
+            data[row] = (T)positions[key];
+        }
+    }
+
+    void WTArrowTableFunction::EnumArrowToDuckDB(ArrowScanLocalState &state,
+                                                 unordered_map<idx_t, unique_ptr<ArrowConvertData>> &arrow_convert_data,
+                                                 DataChunk &output, idx_t start)
+    {
+        // ArrowToDuckDB skips columns marked as row ids, so the ENUM columns are hidden from it in a
+        // copy of the column ids and filled here.
+        vector<pair<idx_t, column_t>> enum_columns;
+        auto column_ids = state.column_ids;
+        for (idx_t idx = 0; idx < output.ColumnCount(); idx++)
+        {
+            auto column_id = column_ids[idx];
+            if (column_id != COLUMN_IDENTIFIER_ROW_ID && output.data[idx].GetType().id() == LogicalTypeId::ENUM)
+            {
+                enum_columns.emplace_back(idx, column_id);
+                column_ids[idx] = COLUMN_IDENTIFIER_ROW_ID;
+            }
+        }
+
+        // ArrowToDuckDB reads the ids from the state, which gets its own back even if it throws.
+        std::swap(state.column_ids, column_ids);
+        try
+        {
+            ArrowToDuckDB(state, arrow_convert_data, output, start, false);
+        }
+        catch (...)
+        {
+            std::swap(state.column_ids, column_ids);
+            throw;
+        }
+        std::swap(state.column_ids, column_ids);
+
+        for (auto &enum_column : enum_columns)
+        {
+            auto &array = *state.chunk->arrow_array.children[enum_column.second];
+            auto &vector = output.data[enum_column.first];
+            auto offset = array.offset + state.chunk_offset;
+            auto keys = (const int32_t *)array.buffers[1] + offset;
+            auto validity = array.null_count == 0 ? NULL : (const uint8_t *)array.buffers[0];
+
+            vector.SetVectorType(VectorType::FLAT_VECTOR);
+
+            // Names are looked up, keys into the header copied as they are.
+            if (arrow_convert_data.count(enum_column.second))
+            {
+                switch (vector.GetType().InternalType())
+                {
+                case PhysicalType::UINT8:
+                    CopyEnumValues<uint8_t>(vector, array, state.chunk_offset, output.size());
+                    break;
+                case PhysicalType::UINT16:
+                    CopyEnumValues<uint16_t>(vector, array, state.chunk_offset, output.size());
+                    break;
+                case PhysicalType::UINT32:
+                    CopyEnumValues<uint32_t>(vector, array, state.chunk_offset, output.size());
+                    break;
+                default:
+                    throw NotImplementedException("EnumArrowToDuckDB: unsupported ENUM size");
+                }
+
+                continue;
+            }
+
+            switch (vector.GetType().InternalType())
+            {
+            case PhysicalType::UINT8:
+                CopyEnumKeys<uint8_t>(vector, keys, validity, offset, output.size());
+                break;
+            case PhysicalType::UINT16:
+                CopyEnumKeys<uint16_t>(vector, keys, validity, offset, output.size());
+                break;
+            case PhysicalType::UINT32:
+                CopyEnumKeys<uint32_t>(vector, keys, validity, offset, output.size());
+                break;
+            default:
+                throw NotImplementedException("EnumArrowToDuckDB: unsupported ENUM size");
+            }
+        }
+    }
+
+    //! Opens the stream of the whole file. `columns` lists the columns to decode, every column if
+    //! null; only the BAM and VCF/BCF subset decoders skip the others. `read_names` are the BAM read
+    //! names `filters` keeps, if it only keeps some.
+    static void OpenReader(ClientContext &context, const ExonScanFunctionData &data, const char *filters,
+                           const vector<string> *columns, const vector<string> &read_names,
+                           struct ArrowArrayStream *stream)
+    {
+        auto vector_size = STANDARD_VECTOR_SIZE;
+        auto file_system = ExonFileSystem::GetFFI(context);
+        auto file_system_ptr = data.use_duckdb_file_system ? &file_system : NULL;
+        auto compression = data.compression != "auto_detect" ? data.compression.c_str() : NULL;
+
+        if (data.window_size > 0)
+        {
+            auto result = new_fasta_window_reader(stream, data.file_name.c_str(), vector_size, compression, data.window_size,
+                                                  data.overlap, filters, file_system_ptr);
+            if (result.error != NULL)
+            {
+                throw std::runtime_error(result.error);
+            }
+
+            return;
+        }
+
+        // Local BAM files are decoded column by column, virtual offsets included.
+        if (data.bam_scan)
+        {
+            OpenBamScan(context, data, NULL, columns, read_names, filters, stream);
+            return;
+        }
+
+        if (data.virtual_offset)
+        {
+            auto result = new_offset_reader(stream, data.file_name.c_str(), data.file_type.c_str(), NULL, 0, vector_size,
+                                            TaskScheduler::GetScheduler(context).NumberOfThreads(), filters);
+            if (result.error != NULL)
+            {
+                throw std::runtime_error(result.error);
+            }
+
+            return;
+        }
+
+        if (data.file_type == "cram")
+        {
+            auto reference = data.reference.empty() ? NULL : data.reference.c_str();
+            auto result = new_cram_reader(stream, data.file_name.c_str(), reference, NULL, 0, vector_size,
+                                          TaskScheduler::GetScheduler(context).NumberOfThreads(), filters);
+            if (result.error != NULL)
+            {
+                throw std::runtime_error(result.error);
+            }
+
+            return;
+        }
+
+        if (data.subset)
+        {
+            OpenSubsetReader(context, data.file_name, data.file_type, data.samples, data.info_fields, {}, columns,
+                             filters, stream);
+            return;
+        }
+
+        auto result = new_reader(stream, data.file_name.c_str(), vector_size, compression, data.file_type.c_str(), filters,
+                                 file_system_ptr);
+        if (result.error != NULL)
+        {
+            throw std::runtime_error(result.error);
+        }
+    }
+
+    static void OpenPartitionReader(ClientContext &context, const ExonScanFunctionData &data, const string &region,
+                                    const string &filters, const vector<string> &columns,
+                                    struct ArrowArrayStream *stream)
+    {
+        if (data.bam_scan)
+        {
+            OpenBamScan(context, data, region.c_str(), &columns, {}, filters.c_str(), stream);
+            return;
+        }
+
+        auto file_system = ExonFileSystem::GetFFI(context);
+        auto file_system_ptr = data.use_duckdb_file_system ? &file_system : NULL;
+
+        auto result = new_partition_reader(stream, data.file_name.c_str(), data.file_type.c_str(), region.c_str(),
+                                           STANDARD_VECTOR_SIZE, filters.c_str(), file_system_ptr);
+        if (result.error != NULL)
+        {
+            throw std::runtime_error(result.error);
+        }
+    }
+
+    //! Plans the regions of an index-partitioned scan, or none if the file is read as one stream.
+    static vector<string> GetScanPartitions(ClientContext &context, const ExonScanFunctionData &data)
+    {
+        vector<string> partitions;
+
+        auto threads = TaskScheduler::GetScheduler(context).NumberOfThreads();
+        if (threads <= 1)
+        {
+            return partitions;
+        }
+
+        if (data.file_type != "bam" && data.file_type != "vcf" && data.file_type != "bcf")
+        {
+            return partitions;
+        }
+
+        auto file_system = ExonFileSystem::GetFFI(context);
+        auto file_system_ptr = data.use_duckdb_file_system ? &file_system : NULL;
+
+        // A few partitions per thread, so threads finishing early pick up the remainder.
+        auto result = scan_partitions(data.file_name.c_str(), data.file_type.c_str(), threads * 4, file_system_ptr);
+        if (result.error != NULL)
+        {
+            auto error = string(result.error);
+            free_scan_partitions(result);
+            throw std::runtime_error(error);
+        }
+
+        for (idx_t i = 0; i < result.count; i++)
+        {
+            partitions.push_back(result.regions[i]);
+        }
+
+        free_scan_partitions(result);
+
+        return partitions;
+    }
+
+    bool WTArrowTableFunction::ExonScanParallelStateNext(ClientContext &context, const FunctionData *bind_data_p,
+                                                         ArrowScanLocalState &state_p,
+                                                         ArrowScanGlobalState &global_state_p)
+    {
+        // Every batch has dictionaries of its own, which ArrowToDuckDB would otherwise keep using
+        // from the first batch it converted.
+        state_p.arrow_dictionary_vectors.clear();
+
+        auto &global_state = (ExonScanGlobalState &)global_state_p;
+        if (global_state.partitions.empty())
+        {
+            return ArrowScanParallelStateNext(context, bind_data_p, state_p, global_state_p);
+        }
+
+        auto &data = (const ExonScanFunctionData &)*bind_data_p;
+        auto &state = (ExonScanLocalState &)state_p;
+
+        while (true)
+        {
+            if (state.partition_stream)
+            {
+                auto current_chunk = state.partition_stream->GetNextChunk();
+                while (current_chunk->arrow_array.length == 0 && current_chunk->arrow_array.release)
+                {
+                    current_chunk = state.partition_stream->GetNextChunk();
+                }
+
+                if (current_chunk->arrow_array.release)
+                {
+                    state.chunk_offset = 0;
+                    // Ordered by partition, then by chunk within it, which is the file order.
+                    state.batch_index = (state.partition << 32) | state.partition_chunks++;
+                    state.chunk = std::move(current_chunk);
+                    return true;
+                }
+
+                state.partition_stream.reset();
+            }
+
+            auto partition = global_state.next_partition++;
+            if (partition >= global_state.partitions.size())
+            {
+                return false;
+            }
+
+            struct ArrowArrayStream stream;
+            OpenPartitionReader(context, data, global_state.partitions[partition], global_state.filter_clause,
+                                global_state.columns, &stream);
+
+            state.partition = partition;
+            state.partition_chunks = 0;
+            state.partition_stream = make_uniq<ArrowArrayStreamWrapper>();
+            state.partition_stream->arrow_array_stream = stream;
+        }
+    }
+
     duckdb::unique_ptr<FunctionData> WTArrowTableFunction::FileTypeBind(ClientContext &context, TableFunctionBindInput &input,
                                                                         vector<LogicalType> &return_types, vector<string> &names)
     {
@@ -80,33 +671,100 @@ namespace exon
         auto file_name = input.inputs[0].GetValue<std::string>();
 
         struct ArrowArrayStream stream;
-        auto vector_size = STANDARD_VECTOR_SIZE;
 
-        auto compression = string("auto_detect");
+        auto result = duckdb::make_uniq<ExonScanFunctionData>();
+
+        result->file_name = file_name;
+        result->file_type = info.file_type;
+        result->compression = string("auto_detect");
+        result->use_duckdb_file_system = ExonFileSystem::Enabled(context);
+
+        int64_t window_size = 0;
+        int64_t overlap = 0;
 
         for (auto &kv : input.named_parameters)
         {
             if (kv.first == "compression")
             {
-                compression = kv.second.GetValue<string>();
-            };
+                result->compression = kv.second.GetValue<string>();
+            }
+            else if (kv.first == "window_size")
+            {
+                window_size = kv.second.GetValue<int64_t>();
+            }
+            else if (kv.first == "overlap")
+            {
+                overlap = kv.second.GetValue<int64_t>();
+            }
+            else if (kv.first == "reference")
+            {
+                result->reference = kv.second.GetValue<string>();
+            }
+            else if (kv.first == "virtual_offset")
+            {
+                result->virtual_offset = kv.second.GetValue<bool>();
+            }
+            else if (kv.first == "tags")
+            {
+                for (auto &tag : ListValue::GetChildren(kv.second))
+                {
+                    result->tags.push_back(tag.GetValue<string>());
+                }
+            }
+            else if (kv.first == "samples")
+            {
+                for (auto &sample : ListValue::GetChildren(kv.second))
+                {
+                    result->samples.push_back(sample.GetValue<string>());
+                }
+
+                if (result->samples.empty())
+                {
+                    throw std::runtime_error("samples must name at least one sample");
+                }
+            }
+            else if (kv.first == "info_fields")
+            {
+                for (auto &info_field : ListValue::GetChildren(kv.second))
+                {
+                    result->info_fields.push_back(info_field.GetValue<string>());
+                }
+
+                if (result->info_fields.empty())
+                {
+                    throw std::runtime_error("info_fields must name at least one INFO field");
+                }
+            }
         }
 
-        ReaderResult read_stream_result;
-        if (compression != "auto_detect")
+        if (input.named_parameters.count("window_size") && window_size <= 0)
         {
-            read_stream_result = new_reader(&stream, file_name.c_str(), vector_size, compression.c_str(), info.file_type.c_str(), NULL);
+            throw std::runtime_error("window_size must be positive");
         }
-        else
+
+        if (overlap < 0 || (overlap > 0 && overlap >= window_size))
+        {
+            throw std::runtime_error("overlap must be non-negative and smaller than window_size");
+        }
+
+        result->window_size = window_size;
+        result->overlap = overlap;
+        result->bam_scan = result->file_type == "bam" && IsLocalFile(context, *result);
+
+        if (!result->tags.empty() && !result->bam_scan)
         {
-            read_stream_result = new_reader(&stream, file_name.c_str(), vector_size, NULL, info.file_type.c_str(), NULL);
+            throw std::runtime_error("tags can only be read from a local BAM file");
         }
 
-        if (read_stream_result.error != NULL)
+        result->subset = !result->samples.empty() || !result->info_fields.empty();
+
+        if (result->subset && (result->virtual_offset || !IsLocalFile(context, *result)))
         {
-            throw std::runtime_error(read_stream_result.error);
+            throw std::runtime_error("samples and info_fields can only be selected from a local file, without virtual_offset");
         }
 
+        OpenReader(context, *result, NULL, NULL, {}, &stream);
+
         struct ArrowSchema arrow_schema;
 
         if (stream.get_schema(&stream, &arrow_schema) != 0)
@@ -118,10 +776,12 @@ namespace exon
             throw std::runtime_error("Failed to get schema");
         }
 
-        auto result = duckdb::make_uniq<ExonScanFunctionData>();
-
         result->all_names.reserve(arrow_schema.n_children);
 
+        auto file_system = ExonFileSystem::GetFFI(context);
+        auto file_system_ptr = result->use_duckdb_file_system ? &file_system : NULL;
+
+        LogicalType reference_type;
         auto n_children = arrow_schema.n_children;
         for (idx_t col_idx = 0; col_idx < n_children; col_idx++)
         {
@@ -132,8 +792,12 @@ namespace exon
                 throw InvalidInputException("arrow_scan: released schema passed");
             }
 
-            // TODO: handle dictionary
-            return_types.emplace_back(GetArrowLogicalType(schema, result->arrow_convert_data, col_idx));
+            // Only the local BAM decoder keys its reference columns into the header, exon's readers
+            // dictionary-encode low-cardinality text columns batch by batch and have their reference
+            // names looked up in the header.
+            return_types.emplace_back(GetArrowColumnType(schema, result->arrow_convert_data, col_idx, result->file_name,
+                                                         result->file_type, result->bam_scan, file_system_ptr,
+                                                         reference_type));
 
             auto format = string(schema.format);
             auto name = string(schema.name);
@@ -148,9 +812,10 @@ namespace exon
 
         RenameArrowColumns(names);
 
-        result->file_name = file_name;
-        result->file_type = info.file_type;
-        result->compression = compression;
+        if (result->bam_scan)
+        {
+            result->sort_columns = GetSortColumns(result->file_name, "bam", names, return_types, "reference", "start");
+        }
 
         return std::move(result);
     }
@@ -199,8 +864,8 @@ namespace exon
         }
     }
 
-    static string FilterToString(const TableFilterSet &set, const vector<idx_t> &column_ids,
-                                 const vector<string> &column_names)
+    string WTArrowTableFunction::FilterClause(const TableFilterSet &set, const vector<idx_t> &column_ids,
+                                              const vector<string> &column_names)
     {
 
         vector<string> filters;
@@ -208,11 +873,85 @@ namespace exon
         {
             auto col_idx = column_ids[input_filter.first];
             auto &col_name = column_names[col_idx];
-            filters.push_back(FilterToString(*input_filter.second, col_name));
+
+            // Quoted, so DataFusion keeps the case of tag columns like NM and reads "end" as a name.
+            auto quoted_name = "\"" + StringUtil::Replace(col_name, "\"", "\"\"") + "\"";
+            filters.push_back(FilterToString(*input_filter.second, quoted_name));
         }
         return StringUtil::Join(filters, " AND ");
     }
 
+    //! Adds the values `filter` limits its column to, if it only passes equal values, and returns
+    //! whether it does.
+    static bool FilterEqualValues(const TableFilter &filter, vector<string> &values)
+    {
+        switch (filter.filter_type)
+        {
+        case TableFilterType::CONSTANT_COMPARISON:
+        {
+            auto &constant_filter = (const ConstantFilter &)filter;
+            if (constant_filter.comparison_type != ExpressionType::COMPARE_EQUAL)
+            {
+                return false;
+            }
+
+            values.push_back(constant_filter.constant.ToString());
+            return true;
+        }
+        case TableFilterType::CONJUNCTION_AND:
+        {
+            // Any one of the children is enough, the others can only drop more.
+            auto &and_filter = (const ConjunctionAndFilter &)filter;
+            for (const auto &child_filter : and_filter.child_filters)
+            {
+                vector<string> child_values;
+                if (FilterEqualValues(*child_filter, child_values))
+                {
+                    values.insert(values.end(), child_values.begin(), child_values.end());
+                    return true;
+                }
+            }
+            return false;
+        }
+        case TableFilterType::CONJUNCTION_OR:
+        {
+            auto &or_filter = (const ConjunctionOrFilter &)filter;
+            for (const auto &child_filter : or_filter.child_filters)
+            {
+                if (!FilterEqualValues(*child_filter, values))
+                {
+                    return false;
+                }
+            }
+            return true;
+        }
+        default:
+            return false;
+        }
+    }
+
+    //! The read names a BAM scan's filters keep, e.g. `name = 'A00123:8:H2:1:1101:1000:1000'`, or none if
+    //! they don't limit the name to a list.
+    static vector<string> ReadNameFilter(const TableFilterSet &set, const vector<idx_t> &column_ids,
+                                         const vector<string> &column_names)
+    {
+        for (auto &input_filter : set.filters)
+        {
+            if (column_names[column_ids[input_filter.first]] != "name")
+            {
+                continue;
+            }
+
+            vector<string> read_names;
+            if (FilterEqualValues(*input_filter.second, read_names))
+            {
+                return read_names;
+            }
+        }
+
+        return {};
+    }
+
     unique_ptr<GlobalTableFunctionState> WTArrowTableFunction::InitGlobal(ClientContext &context,
                                                                           TableFunctionInitInput &input)
     {
@@ -220,34 +959,44 @@ namespace exon
         auto global_state = make_uniq<ExonScanGlobalState>();
 
         string filter_clause = "";
+        vector<string> read_names;
         if (input.filters)
         {
-            filter_clause = FilterToString(*input.filters, input.column_ids, data.all_names);
-        }
-
-        struct ArrowArrayStream stream;
+            filter_clause = FilterClause(*input.filters, input.column_ids, data.all_names);
 
-        auto compression = data.compression;
-        auto file_name = data.file_name;
-        auto file_type = data.file_type;
-        auto vector_size = STANDARD_VECTOR_SIZE;
-
-        ReaderResult read_stream_result;
+            // Without a name index the names are found by scanning the file, in partitions as usual.
+            if (data.bam_scan && FileSystem::GetFileSystem(context).FileExists(data.file_name + ".nai"))
+            {
+                read_names = ReadNameFilter(*input.filters, input.column_ids, data.all_names);
+            }
+        }
 
-        if (compression != "auto_detect")
+        for (auto &column_id : input.column_ids)
         {
-            read_stream_result = new_reader(&stream, file_name.c_str(), vector_size, compression.c_str(), file_type.c_str(), filter_clause.c_str());
+            if (column_id != COLUMN_IDENTIFIER_ROW_ID)
+            {
+                global_state->columns.push_back(data.all_names[column_id]);
+            }
         }
-        else
+
+        // A scan for a few read names reads their records by the name index rather than in partitions.
+        if (data.window_size == 0 && (!data.virtual_offset || data.bam_scan) && !data.subset && read_names.empty())
         {
-            read_stream_result = new_reader(&stream, file_name.c_str(), vector_size, NULL, file_type.c_str(), filter_clause.c_str());
+            global_state->partitions = GetScanPartitions(context, data);
         }
 
-        if (read_stream_result.error != NULL)
+        if (!global_state->partitions.empty())
         {
-            throw std::runtime_error(read_stream_result.error);
+            global_state->filter_clause = filter_clause;
+            global_state->max_threads = global_state->partitions.size();
+
+            return std::move(global_state);
         }
 
+        struct ArrowArrayStream stream;
+
+        OpenReader(context, data, filter_clause.c_str(), &global_state->columns, read_names, &stream);
+
         global_state->stream = make_uniq<ArrowArrayStreamWrapper>();
         global_state->stream->arrow_array_stream = std::move(stream);
 
@@ -267,7 +1016,7 @@ namespace exon
         //! Out of tuples in this chunk
         if (state.chunk_offset >= (idx_t)state.chunk->arrow_array.length)
         {
-            if (!ArrowScanParallelStateNext(context, input.bind_data.get(), state, global_state))
+            if (!ExonScanParallelStateNext(context, input.bind_data.get(), state, global_state))
             {
                 return;
             }
@@ -279,14 +1028,14 @@ namespace exon
         {
             state.all_columns.Reset();
             state.all_columns.SetCardinality(output_size);
-            ArrowToDuckDB(state, data.arrow_convert_data, state.all_columns, data.lines_read - output_size, false);
+            EnumArrowToDuckDB(state, data.arrow_convert_data, state.all_columns, data.lines_read - output_size);
             output.ReferenceColumns(state.all_columns, global_state.projection_ids);
         }
         else
         {
             output.SetCardinality(output_size);
 
-            ArrowToDuckDB(state, data.arrow_convert_data, output, data.lines_read - output_size, false);
+            EnumArrowToDuckDB(state, data.arrow_convert_data, output, data.lines_read - output_size);
         }
 
         output.Verify();
@@ -297,13 +1046,40 @@ namespace exon
     {
         TableFunction scan;
         scan = TableFunction(name, {LogicalType::VARCHAR}, WTArrowTableFunction::Scan, WTArrowTableFunction::FileTypeBind,
-                             WTArrowTableFunction::InitGlobal, ArrowTableFunction::ArrowScanInitLocal);
+                             WTArrowTableFunction::InitGlobal, WTArrowTableFunction::ArrowScanInitLocal);
 
         auto function_info = make_uniq<WTArrowTableScanInfo>(file_type);
         scan.function_info = std::move(function_info);
 
         scan.named_parameters["compression"] = LogicalType::VARCHAR;
 
+        if (file_type == "fasta")
+        {
+            scan.named_parameters["window_size"] = LogicalType::BIGINT;
+            scan.named_parameters["overlap"] = LogicalType::BIGINT;
+        }
+
+        if (file_type == "cram")
+        {
+            scan.named_parameters["reference"] = LogicalType::VARCHAR;
+        }
+
+        if (file_type == "bam" || file_type == "vcf")
+        {
+            scan.named_parameters["virtual_offset"] = LogicalType::BOOLEAN;
+        }
+
+        if (file_type == "bam")
+        {
+            scan.named_parameters["tags"] = LogicalType::LIST(LogicalType::VARCHAR);
+        }
+
+        if (file_type == "vcf" || file_type == "bcf")
+        {
+            scan.named_parameters["samples"] = LogicalType::LIST(LogicalType::VARCHAR);
+            scan.named_parameters["info_fields"] = LogicalType::LIST(LogicalType::VARCHAR);
+        }
+
         scan.cardinality = ArrowTableFunction::ArrowScanCardinality;
         scan.get_batch_index = ArrowTableFunction::ArrowGetBatchIndex;
 
@@ -317,6 +1093,255 @@ namespace exon
         catalog.CreateTableFunction(context, &info);
     }
 
+    //! The record count of the file `get` scans, if it is a whole-file scan its index can count.
+    static bool GetIndexRecordCount(ClientContext &context, LogicalGet &get, idx_t &count)
+    {
+        if (!get.table_filters.filters.empty() || !get.bind_data)
+        {
+            return false;
+        }
+
+        auto &data = (ExonScanFunctionData &)*get.bind_data;
+        if (data.file_type != "bam" && data.file_type != "vcf" && data.file_type != "bcf")
+        {
+            return false;
+        }
+
+        auto file_system = ExonFileSystem::GetFFI(context);
+        auto file_system_ptr = data.use_duckdb_file_system ? &file_system : NULL;
+
+        auto result = index_record_count(data.file_name.c_str(), data.file_type.c_str(), file_system_ptr);
+        if (!result.known)
+        {
+            return false;
+        }
+
+        count = result.count;
+        return true;
+    }
+
+    void WTArrowTableFunction::OptimizeIndexCount(ClientContext &context, OptimizerExtensionInfo *info,
+                                                  duckdb::unique_ptr<LogicalOperator> &plan)
+    {
+        for (auto &child : plan->children)
+        {
+            OptimizeIndexCount(context, info, child);
+        }
+
+        if (plan->type != LogicalOperatorType::LOGICAL_AGGREGATE_AND_GROUP_BY || plan->children.size() != 1)
+        {
+            return;
+        }
+
+        auto &aggregate = (LogicalAggregate &)*plan;
+        if (!aggregate.groups.empty() || !aggregate.grouping_functions.empty())
+        {
+            return;
+        }
+
+        for (auto &expression : aggregate.expressions)
+        {
+            if (expression->GetExpressionClass() != ExpressionClass::BOUND_AGGREGATE)
+            {
+                return;
+            }
+
+            auto &bound_aggregate = (BoundAggregateExpression &)*expression;
+            if (bound_aggregate.function.name != "count_star" || bound_aggregate.IsDistinct() || bound_aggregate.filter)
+            {
+                return;
+            }
+        }
+
+        auto &child = aggregate.children[0];
+        if (child->type != LogicalOperatorType::LOGICAL_GET)
+        {
+            return;
+        }
+
+        auto &get = (LogicalGet &)*child;
+        if (get.function.function != WTArrowTableFunction::Scan)
+        {
+            return;
+        }
+
+        idx_t count;
+        if (!GetIndexRecordCount(context, get, count))
+        {
+            return;
+        }
+
+        // A projection under the aggregate's table index exposes the same column bindings, so
+        // the operators above are left untouched.
+        vector<unique_ptr<Expression>> counts;
+        for (idx_t i = 0; i < aggregate.expressions.size(); i++)
+        {
+            counts.push_back(make_uniq<BoundConstantExpression>(Value::BIGINT(count)));
+        }
+
+        auto projection = make_uniq<LogicalProjection>(aggregate.aggregate_index, std::move(counts));
+        projection->children.push_back(make_uniq<LogicalDummyScan>(get.table_index));
+
+        plan = std::move(projection);
+    }
+
+    vector<column_t> WTArrowTableFunction::GetSortColumns(const string &file_name, const string &file_format,
+                                                          const vector<string> &names, const vector<LogicalType> &types,
+                                                          const string &reference_column, const string &position_column)
+    {
+        auto reference = std::find(names.begin(), names.end(), reference_column) - names.begin();
+        auto position = std::find(names.begin(), names.end(), position_column) - names.begin();
+
+        // Only an ENUM sorts references in header order, text sorts them by name.
+        if (reference == (int64_t)names.size() || position == (int64_t)names.size() ||
+            types[reference].id() != LogicalTypeId::ENUM)
+        {
+            return {};
+        }
+
+        auto result = sort_order(file_name.c_str(), file_format.c_str());
+        if (result.error != NULL)
+        {
+            throw std::runtime_error(result.error);
+        }
+
+        if (!result.coordinate)
+        {
+            return {};
+        }
+
+        return {(column_t)reference, (column_t)position};
+    }
+
+    //! The scan below `op` the column `binding` is read from, through projections and filters, setting
+    //! `column_id` to its column of the scan. Null if it is computed or read from anything else.
+    static LogicalGet *GetScanColumn(LogicalOperator &op, ColumnBinding binding, column_t &column_id)
+    {
+        switch (op.type)
+        {
+        case LogicalOperatorType::LOGICAL_PROJECTION:
+        {
+            auto &projection = (LogicalProjection &)op;
+            if (binding.table_index != projection.table_index)
+            {
+                return nullptr;
+            }
+
+            auto &expression = *projection.expressions[binding.column_index];
+            if (expression.type != ExpressionType::BOUND_COLUMN_REF)
+            {
+                return nullptr;
+            }
+
+            return GetScanColumn(*op.children[0], ((BoundColumnRefExpression &)expression).binding, column_id);
+        }
+        case LogicalOperatorType::LOGICAL_FILTER:
+            return GetScanColumn(*op.children[0], binding, column_id);
+        case LogicalOperatorType::LOGICAL_GET:
+        {
+            auto &get = (LogicalGet &)op;
+            if (binding.table_index != get.table_index || binding.column_index >= get.column_ids.size())
+            {
+                return nullptr;
+            }
+
+            column_id = get.column_ids[binding.column_index];
+            return &get;
+        }
+        default:
+            return nullptr;
+        }
+    }
+
+    //! The scan all of `orders` over `child` read their columns from, setting `column_ids` to those columns. Null if
+    //! there is none or an order isn't ascending with nulls last, the order the scans sort unplaced records in.
+    static LogicalGet *GetOrderScan(const vector<BoundOrderByNode> &orders, LogicalOperator &child,
+                                    vector<column_t> &column_ids)
+    {
+        LogicalGet *scan = nullptr;
+
+        for (auto &order : orders)
+        {
+            if (order.type != OrderType::ASCENDING || order.null_order != OrderByNullType::NULLS_LAST ||
+                order.expression->type != ExpressionType::BOUND_COLUMN_REF)
+            {
+                return nullptr;
+            }
+
+            column_t column_id;
+            auto get = GetScanColumn(child, ((BoundColumnRefExpression &)*order.expression).binding, column_id);
+            if (!get || (scan && get != scan))
+            {
+                return nullptr;
+            }
+
+            scan = get;
+            column_ids.push_back(column_id);
+        }
+
+        return scan;
+    }
+
+    //! Whether `orders` over `child` are a prefix of the sort order of the scan they read from.
+    static bool IsSortedScanOrder(const vector<BoundOrderByNode> &orders, LogicalOperator &child,
+                                  const std::function<bool(const LogicalGet &)> &is_sorted_scan)
+    {
+        vector<column_t> column_ids;
+        auto scan = GetOrderScan(orders, child, column_ids);
+        if (!scan || !is_sorted_scan(*scan))
+        {
+            return false;
+        }
+
+        auto &sort_columns = ((SortedScanFunctionData &)*scan->bind_data).sort_columns;
+
+        return column_ids.size() <= sort_columns.size() &&
+               std::equal(column_ids.begin(), column_ids.end(), sort_columns.begin());
+    }
+
+    void WTArrowTableFunction::OptimizeSortedScan(ClientContext &context, OptimizerExtensionInfo *info,
+                                                  duckdb::unique_ptr<LogicalOperator> &plan)
+    {
+        if (!DBConfig::GetConfig(context).options.preserve_insertion_order)
+        {
+            return;
+        }
+
+        auto is_sorted_scan = [](const LogicalGet &get)
+        {
+            return get.function.function == WTArrowTableFunction::Scan ||
+                   get.function.function == GenotypeMatrixTableFunction::Scan ||
+                   get.function.function == MergeSortedTableFunction::Scan;
+        };
+
+        // Only operators that keep their input order may sit above the sort.
+        auto op = &plan;
+        while ((*op)->type == LogicalOperatorType::LOGICAL_PROJECTION ||
+               (*op)->type == LogicalOperatorType::LOGICAL_LIMIT)
+        {
+            op = &(*op)->children[0];
+        }
+
+        if ((*op)->type == LogicalOperatorType::LOGICAL_ORDER_BY)
+        {
+            auto &order = (LogicalOrder &)**op;
+            if (order.projections.empty() && IsSortedScanOrder(order.orders, *order.children[0], is_sorted_scan))
+            {
+                *op = std::move(order.children[0]);
+            }
+        }
+        else if ((*op)->type == LogicalOperatorType::LOGICAL_TOP_N)
+        {
+            auto &top_n = (LogicalTopN &)**op;
+            if (IsSortedScanOrder(top_n.orders, *top_n.children[0], is_sorted_scan))
+            {
+                auto limit = make_uniq<LogicalLimit>(top_n.limit, top_n.offset, nullptr, nullptr);
+                limit->children.push_back(std::move(top_n.children[0]));
+                *op = std::move(limit);
+            }
+        }
+    }
+
     unique_ptr<TableRef> WTArrowTableFunction::ReplacementScan(ClientContext &context, const string &table_name,
                                                                ReplacementScanData *data)
     {
@@ -19,9 +19,11 @@
 #include <duckdb/common/file_system.hpp>
 #include <duckdb/parser/expression/constant_expression.hpp>
 #include <duckdb/parser/expression/function_expression.hpp>
+#include <duckdb/parallel/task_scheduler.hpp>
 
 #include "exon/arrow_table_function/module.hpp"
 #include "exon/bam_query_function/module.hpp"
+#include "exon/file_system/module.hpp"
 #include "rust.hpp"
 
 namespace exon
@@ -29,7 +31,14 @@ namespace exon
     struct BAMQueryScanFunctionData : public TableFunctionData
     {
         string file_name;
-        string query;
+        vector<string> regions;
+        bool use_duckdb_file_system = false;
+
+        //! Set for local BAM files, read by the decoder that only decodes the projected columns.
+        bool bam_scan = false;
+
+        //! The aux tags bam_query(..., tags=) returns as columns of their own.
+        vector<string> tags;
 
         unordered_map<idx_t, unique_ptr<ArrowConvertData>> arrow_convert_data;
         idx_t max_threads = 6;
@@ -39,6 +48,96 @@ namespace exon
         atomic<idx_t> lines_read;
     };
 
+    //! The region argument is either a single region (or BED path) or a list of them.
+    static vector<string> GetRegions(const Value &value)
+    {
+        vector<string> regions;
+
+        if (value.type().id() == LogicalTypeId::LIST)
+        {
+            for (auto &region : ListValue::GetChildren(value))
+            {
+                if (!region.IsNull())
+                {
+                    regions.push_back(region.GetValue<std::string>());
+                }
+            }
+        }
+        else
+        {
+            regions.push_back(value.GetValue<std::string>());
+        }
+
+        if (regions.empty())
+        {
+            throw std::runtime_error("bam_query requires at least one region");
+        }
+
+        return regions;
+    }
+
+    static vector<const char *> GetRegionPointers(const vector<string> &regions)
+    {
+        vector<const char *> region_ptrs;
+        for (auto &region : regions)
+        {
+            region_ptrs.push_back(region.c_str());
+        }
+
+        return region_ptrs;
+    }
+
+    //! Opens the query's stream, applying the SQL `filters`. Local BAM files decode only `columns`, or every column
+    //! if null.
+    static void OpenReader(ClientContext &context, const BAMQueryScanFunctionData &data, const vector<string> *columns,
+                           const char *filters, struct ArrowArrayStream *stream)
+    {
+        auto region_ptrs = GetRegionPointers(data.regions);
+        auto vector_size = STANDARD_VECTOR_SIZE;
+
+        if (data.bam_scan)
+        {
+            vector<const char *> tag_ptrs;
+            for (auto &tag : data.tags)
+            {
+                tag_ptrs.push_back(tag.c_str());
+            }
+
+            vector<const char *> column_ptrs;
+            if (columns)
+            {
+                for (auto &column : *columns)
+                {
+                    column_ptrs.push_back(column.c_str());
+                }
+            }
+
+            // A null column list decodes every column, so an empty list still passes a valid pointer.
+            const char *no_column = NULL;
+            auto column_list = !columns ? NULL : column_ptrs.empty() ? &no_column : column_ptrs.data();
+
+            auto result = new_bam_scan(stream, data.file_name.c_str(), region_ptrs.data(), region_ptrs.size(), false,
+                                       tag_ptrs.data(), tag_ptrs.size(), column_list, column_ptrs.size(), false, NULL, 0,
+                                       vector_size, TaskScheduler::GetScheduler(context).NumberOfThreads(), filters);
+            if (result.error != NULL)
+            {
+                throw std::runtime_error(result.error);
+            }
+
+            return;
+        }
+
+        auto file_system = ExonFileSystem::GetFFI(context);
+
+        auto bam_query_reader_result = bam_query_reader(stream, data.file_name.c_str(), region_ptrs.data(), region_ptrs.size(),
+                                                        vector_size, data.use_duckdb_file_system ? &file_system : NULL,
+                                                        filters);
+        if (bam_query_reader_result.error != NULL)
+        {
+            throw std::runtime_error(bam_query_reader_result.error);
+        }
+    }
+
     duckdb::unique_ptr<FunctionData> BAMQueryTableFunction::TableBind(ClientContext &context,
                                                                       TableFunctionBindInput &input,
                                                                       vector<LogicalType> &return_types,
@@ -46,20 +145,31 @@ namespace exon
     {
         auto result = make_uniq<BAMQueryScanFunctionData>();
 
-        auto file_name = input.inputs[0].GetValue<std::string>();
-        auto query = input.inputs[1].GetValue<std::string>();
+        result->file_name = input.inputs[0].GetValue<std::string>();
+        result->regions = GetRegions(input.inputs[1]);
+        result->use_duckdb_file_system = ExonFileSystem::Enabled(context);
+        result->bam_scan = !result->use_duckdb_file_system && result->file_name.find("://") == string::npos &&
+                           FileSystem::GetFileSystem(context).FileExists(result->file_name);
 
-        struct ArrowArrayStream stream;
-        auto vector_size = STANDARD_VECTOR_SIZE;
-
-        // BAMQueryReaderResult bam_query_reader_result
-        auto bam_query_reader_result = bam_query_reader(&stream, file_name.c_str(), query.c_str(), vector_size);
+        for (auto &kv : input.named_parameters)
+        {
+            if (kv.first == "tags")
+            {
+                for (auto &tag : ListValue::GetChildren(kv.second))
+                {
+                    result->tags.push_back(tag.GetValue<string>());
+                }
+            }
+        }
 
-        if (bam_query_reader_result.error != NULL)
+        if (!result->tags.empty() && !result->bam_scan)
         {
-            throw std::runtime_error(bam_query_reader_result.error);
+            throw std::runtime_error("tags can only be read from a local BAM file");
         }
 
+        struct ArrowArrayStream stream;
+        OpenReader(context, *result, NULL, NULL, &stream);
+
         struct ArrowSchema arrow_schema;
 
         if (stream.get_schema(&stream, &arrow_schema) != 0)
@@ -73,6 +183,10 @@ namespace exon
 
         result->all_names.reserve(arrow_schema.n_children);
 
+        auto file_system = ExonFileSystem::GetFFI(context);
+        auto file_system_ptr = result->use_duckdb_file_system ? &file_system : NULL;
+
+        LogicalType reference_type;
         auto n_children = arrow_schema.n_children;
         for (idx_t col_idx = 0; col_idx < n_children; col_idx++)
         {
@@ -83,8 +197,9 @@ namespace exon
                 throw InvalidInputException("arrow_scan: released schema passed");
             }
 
-            // TODO: handle dictionary
-            return_types.emplace_back(GetArrowLogicalType(schema, result->arrow_convert_data, col_idx));
+            return_types.emplace_back(WTArrowTableFunction::GetArrowColumnType(
+                schema, result->arrow_convert_data, col_idx, result->file_name, "bam", true, file_system_ptr,
+                reference_type));
 
             auto format = string(schema.format);
             auto name = string(schema.name);
@@ -99,9 +214,6 @@ namespace exon
 
         RenameArrowColumns(names);
 
-        result->file_name = file_name;
-        result->query = query;
-
         return std::move(result);
     };
 
@@ -112,18 +224,25 @@ namespace exon
 
         auto global_state = make_uniq<ArrowScanGlobalState>();
 
-        struct ArrowArrayStream stream;
-
-        auto file_name = data.file_name;
-        auto query = data.query;
-        auto vector_size = STANDARD_VECTOR_SIZE;
+        vector<string> columns;
+        for (auto &column_id : input.column_ids)
+        {
+            if (column_id != COLUMN_IDENTIFIER_ROW_ID)
+            {
+                columns.push_back(data.all_names[column_id]);
+            }
+        }
 
-        auto bam_query_reader_result = bam_query_reader(&stream, file_name.c_str(), query.c_str(), vector_size);
-        if (bam_query_reader_result.error != NULL)
+        // DuckDB drops the filters it pushes down from the plan, so the reader applies them.
+        string filter_clause = "";
+        if (input.filters)
         {
-            throw std::runtime_error(bam_query_reader_result.error);
+            filter_clause = WTArrowTableFunction::FilterClause(*input.filters, input.column_ids, data.all_names);
         }
 
+        struct ArrowArrayStream stream;
+        OpenReader(context, data, &columns, filter_clause.c_str(), &stream);
+
         global_state->stream = make_uniq<ArrowArrayStreamWrapper>();
         global_state->stream->arrow_array_stream = std::move(stream);
 
@@ -155,14 +274,15 @@ namespace exon
         {
             state.all_columns.Reset();
             state.all_columns.SetCardinality(output_size);
-            ArrowToDuckDB(state, data.arrow_convert_data, state.all_columns, data.lines_read - output_size, false);
+            WTArrowTableFunction::EnumArrowToDuckDB(state, data.arrow_convert_data, state.all_columns,
+                                                    data.lines_read - output_size);
             output.ReferenceColumns(state.all_columns, global_state.projection_ids);
         }
         else
         {
             output.SetCardinality(output_size);
 
-            ArrowToDuckDB(state, data.arrow_convert_data, output, data.lines_read - output_size, false);
+            WTArrowTableFunction::EnumArrowToDuckDB(state, data.arrow_convert_data, output, data.lines_read - output_size);
         }
 
         output.Verify();
@@ -171,6 +291,8 @@ namespace exon
 
     void BAMQueryTableFunction::Register(duckdb::ClientContext &context)
     {
+        TableFunctionSet set("bam_query");
+
         TableFunction scan;
         scan = TableFunction("bam_query", {LogicalType::VARCHAR, LogicalType::VARCHAR},
                              BAMQueryTableFunction::Scan,
@@ -184,9 +306,16 @@ namespace exon
         scan.projection_pushdown = true;
         scan.filter_pushdown = true;
 
+        scan.named_parameters["tags"] = LogicalType::LIST(LogicalType::VARCHAR);
+
+        set.AddFunction(scan);
+
+        scan.arguments = {LogicalType::VARCHAR, LogicalType::LIST(LogicalType::VARCHAR)};
+        set.AddFunction(scan);
+
         auto &catalog = Catalog::GetSystemCatalog(context);
 
-        CreateTableFunctionInfo info(scan);
+        CreateTableFunctionInfo info(set);
 
         catalog.CreateTableFunction(context, &info);
     };
@@ -0,0 +1,353 @@
+// Copyright 2023 WHERE TRUE Technologies.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include <mutex>
+
+#include <duckdb.hpp>
+#include <duckdb/common/arrow/arrow_converter.hpp>
+#include <duckdb/common/types/column/column_data_collection.hpp>
+#include <duckdb/function/copy_function.hpp>
+
+#include "exon/copy_functions/module.hpp"
+#include "rust.hpp"
+
+namespace exon
+{
+
+    // Rows a thread buffers before formatting them when the output order doesn't matter.
+    static constexpr duckdb::idx_t FLUSH_ROW_COUNT = 122880;
+
+    struct CopyBindData : public duckdb::FunctionData
+    {
+        std::string file_format;
+        std::string compression = "auto";
+        std::string header_from;
+        std::string index_format;
+        bool force = false;
+
+        duckdb::vector<std::string> names;
+        duckdb::vector<duckdb::LogicalType> types;
+
+        duckdb::unique_ptr<duckdb::FunctionData> Copy() const override
+        {
+            return duckdb::make_uniq<CopyBindData>(*this);
+        }
+
+        bool Equals(const duckdb::FunctionData &other) const override
+        {
+            auto &other_data = (const CopyBindData &)other;
+            return file_format == other_data.file_format && compression == other_data.compression &&
+                   header_from == other_data.header_from && index_format == other_data.index_format &&
+                   force == other_data.force && names == other_data.names && types == other_data.types;
+        }
+    };
+
+    struct CopyGlobalState : public duckdb::GlobalFunctionData
+    {
+        ~CopyGlobalState() override
+        {
+            free_copy_writer(writer);
+        }
+
+        std::mutex lock;
+        duckdb::unique_ptr<duckdb::FileHandle> handle;
+        CopyWriterResult writer = {NULL, NULL};
+    };
+
+    struct CopyLocalState : public duckdb::LocalFunctionData
+    {
+        duckdb::unique_ptr<duckdb::ColumnDataCollection> buffer;
+    };
+
+    struct CopyBatchData : public duckdb::PreparedBatchData
+    {
+        explicit CopyBatchData(CopyBuffer buffer_p) : buffer(buffer_p) {}
+
+        ~CopyBatchData() override
+        {
+            free_copy_buffer(buffer);
+        }
+
+        CopyBuffer buffer;
+    };
+
+    static void ThrowIfError(CopyBuffer &buffer)
+    {
+        if (buffer.error != NULL)
+        {
+            std::string error(buffer.error);
+            free_copy_buffer(buffer);
+
+            throw std::runtime_error(error);
+        }
+    }
+
+    static void ThrowIfError(CopyStatus status)
+    {
+        if (status.error != NULL)
+        {
+            std::string error(status.error);
+            free_copy_status(status);
+
+            throw std::runtime_error(error);
+        }
+    }
+
+    // Formats and compresses the rows of `collection` into bytes that can follow any earlier output.
+    static CopyBuffer Encode(CopyGlobalState &state, duckdb::ColumnDataCollection &collection)
+    {
+        duckdb::ArrowOptions options;
+        std::vector<ArrowArray> arrays(collection.ChunkCount());
+
+        duckdb::idx_t i = 0;
+        for (auto &chunk : collection.Chunks())
+        {
+            duckdb::ArrowConverter::ToArrowArray(chunk, &arrays[i++], options);
+        }
+
+        auto buffer = copy_writer_encode(state.writer.writer, arrays.data(), arrays.size());
+
+        // The arrays are moved out of on success, release whatever an error left behind.
+        for (auto &array : arrays)
+        {
+            if (array.release)
+            {
+                array.release(&array);
+            }
+        }
+
+        ThrowIfError(buffer);
+        return buffer;
+    }
+
+    // Commits `buffer` before writing it, with the lock held, so an index being built or a zstd frame
+    // sees the buffers in file order. Committing zstd output swaps its data for the compressed bytes.
+    static CopyStatus WriteLocked(CopyGlobalState &state, CopyBuffer &buffer)
+    {
+        auto status = copy_writer_commit(state.writer.writer, &buffer);
+        if (status.error == NULL)
+        {
+            state.handle->Write((void *)buffer.data, buffer.length);
+        }
+
+        return status;
+    }
+
+    static void Write(CopyGlobalState &state, CopyBuffer buffer)
+    {
+        ThrowIfError(buffer);
+
+        CopyStatus status;
+        {
+            std::lock_guard<std::mutex> guard(state.lock);
+            status = WriteLocked(state, buffer);
+        }
+
+        free_copy_buffer(buffer);
+        ThrowIfError(status);
+    }
+
+    static duckdb::unique_ptr<duckdb::FunctionData> CopyBind(duckdb::ClientContext &context, duckdb::CopyInfo &info,
+                                                             duckdb::vector<std::string> &names,
+                                                             duckdb::vector<duckdb::LogicalType> &sql_types)
+    {
+        auto result = duckdb::make_uniq<CopyBindData>();
+        result->file_format = info.format;
+        result->names = names;
+        result->types = sql_types;
+
+        for (auto &option : info.options)
+        {
+            auto name = duckdb::StringUtil::Lower(option.first);
+            if (option.second.empty())
+            {
+                throw std::runtime_error("COPY option " + name + " needs a value");
+            }
+
+            if (name == "compression")
+            {
+                result->compression = option.second[0].GetValue<std::string>();
+            }
+            else if (name == "header_from")
+            {
+                result->header_from = option.second[0].GetValue<std::string>();
+            }
+            else if (name == "index_format")
+            {
+                result->index_format = option.second[0].GetValue<std::string>();
+            }
+            else if (name == "force")
+            {
+                result->force = option.second[0].GetValue<bool>();
+            }
+            else
+            {
+                throw std::runtime_error("unknown COPY option for " + info.format + ": " + name);
+            }
+        }
+
+        return std::move(result);
+    }
+
+    static duckdb::unique_ptr<duckdb::GlobalFunctionData> CopyInitGlobal(duckdb::ClientContext &context,
+                                                                         duckdb::FunctionData &bind_data,
+                                                                         const std::string &file_path)
+    {
+        auto &data = (CopyBindData &)bind_data;
+        auto result = duckdb::make_uniq<CopyGlobalState>();
+
+        auto &fs = duckdb::FileSystem::GetFileSystem(context);
+        if (!data.force && fs.FileExists(file_path))
+        {
+            throw std::runtime_error(file_path + " already exists, set FORCE true to overwrite it");
+        }
+
+        ArrowSchema schema;
+        duckdb::ArrowOptions options;
+        duckdb::ArrowConverter::ToArrowSchema(&schema, data.types, data.names, options);
+
+        result->writer = new_copy_writer(data.file_format.c_str(), &schema, file_path.c_str(),
+                                         data.compression.c_str(), data.header_from.c_str(),
+                                         data.index_format.c_str());
+
+        if (schema.release)
+        {
+            schema.release(&schema);
+        }
+
+        if (result->writer.error != NULL)
+        {
+            throw std::runtime_error(result->writer.error);
+        }
+
+        // Compression is done by the writer, a .gz path must not be compressed a second time.
+        auto flags = duckdb::FileFlags::FILE_FLAGS_WRITE | duckdb::FileFlags::FILE_FLAGS_FILE_CREATE_NEW;
+        result->handle = fs.OpenFile(file_path, flags, duckdb::FileLockType::WRITE_LOCK,
+                                     duckdb::FileCompressionType::UNCOMPRESSED);
+
+        Write(*result, copy_writer_header(result->writer.writer));
+
+        return std::move(result);
+    }
+
+    static duckdb::unique_ptr<duckdb::LocalFunctionData> CopyInitLocal(duckdb::ExecutionContext &context,
+                                                                       duckdb::FunctionData &bind_data)
+    {
+        auto &data = (CopyBindData &)bind_data;
+        auto result = duckdb::make_uniq<CopyLocalState>();
+
+        result->buffer = duckdb::make_uniq<duckdb::ColumnDataCollection>(duckdb::Allocator::Get(context.client), data.types);
+
+        return std::move(result);
+    }
+
+    static void CopySink(duckdb::ExecutionContext &context, duckdb::FunctionData &bind_data,
+                         duckdb::GlobalFunctionData &gstate, duckdb::LocalFunctionData &lstate, duckdb::DataChunk &input)
+    {
+        auto &state = (CopyGlobalState &)gstate;
+        auto &local = (CopyLocalState &)lstate;
+
+        local.buffer->Append(input);
+
+        if (local.buffer->Count() >= FLUSH_ROW_COUNT)
+        {
+            Write(state, Encode(state, *local.buffer));
+            local.buffer->Reset();
+        }
+    }
+
+    static void CopyCombine(duckdb::ExecutionContext &context, duckdb::FunctionData &bind_data,
+                            duckdb::GlobalFunctionData &gstate, duckdb::LocalFunctionData &lstate)
+    {
+        auto &state = (CopyGlobalState &)gstate;
+        auto &local = (CopyLocalState &)lstate;
+
+        if (local.buffer->Count() > 0)
+        {
+            Write(state, Encode(state, *local.buffer));
+            local.buffer->Reset();
+        }
+    }
+
+    static void CopyFinalize(duckdb::ClientContext &context, duckdb::FunctionData &bind_data,
+                             duckdb::GlobalFunctionData &gstate)
+    {
+        auto &state = (CopyGlobalState &)gstate;
+
+        Write(state, copy_writer_footer(state.writer.writer));
+
+        state.handle->Sync();
+        state.handle.reset();
+
+        // The index goes in once the file it describes is complete.
+        ThrowIfError(copy_writer_finish(state.writer.writer));
+    }
+
+    // With an ordered input each batch is formatted and compressed on its own thread, then written
+    // in batch order; unordered input is written as soon as a thread has a buffer full.
+    static duckdb::CopyFunctionExecutionMode CopyExecutionMode(bool preserve_insertion_order, bool supports_batch_index)
+    {
+        if (!preserve_insertion_order)
+        {
+            return duckdb::CopyFunctionExecutionMode::PARALLEL_COPY_TO_FILE;
+        }
+
+        if (supports_batch_index)
+        {
+            return duckdb::CopyFunctionExecutionMode::BATCH_COPY_TO_FILE;
+        }
+
+        return duckdb::CopyFunctionExecutionMode::REGULAR_COPY_TO_FILE;
+    }
+
+    static duckdb::unique_ptr<duckdb::PreparedBatchData> CopyPrepareBatch(duckdb::ClientContext &context,
+                                                                          duckdb::FunctionData &bind_data,
+                                                                          duckdb::GlobalFunctionData &gstate,
+                                                                          duckdb::unique_ptr<duckdb::ColumnDataCollection> collection)
+    {
+        auto &state = (CopyGlobalState &)gstate;
+
+        return duckdb::make_uniq<CopyBatchData>(Encode(state, *collection));
+    }
+
+    static void CopyFlushBatch(duckdb::ClientContext &context, duckdb::FunctionData &bind_data,
+                               duckdb::GlobalFunctionData &gstate, duckdb::PreparedBatchData &batch)
+    {
+        auto &state = (CopyGlobalState &)gstate;
+        auto &data = (CopyBatchData &)batch;
+
+        std::lock_guard<std::mutex> guard(state.lock);
+        ThrowIfError(WriteLocked(state, data.buffer));
+    }
+
+    duckdb::unique_ptr<duckdb::CreateCopyFunctionInfo> CopyFunctions::GetCopyFunction(const std::string &file_format)
+    {
+        duckdb::CopyFunction function(file_format);
+
+        function.copy_to_bind = CopyBind;
+        function.copy_to_initialize_global = CopyInitGlobal;
+        function.copy_to_initialize_local = CopyInitLocal;
+        function.copy_to_sink = CopySink;
+        function.copy_to_combine = CopyCombine;
+        function.copy_to_finalize = CopyFinalize;
+        function.execution_mode = CopyExecutionMode;
+        function.prepare_batch = CopyPrepareBatch;
+        function.flush_batch = CopyFlushBatch;
+        function.extension = file_format;
+
+        return duckdb::make_uniq<duckdb::CreateCopyFunctionInfo>(function);
+    }
+
+} // namespace exon
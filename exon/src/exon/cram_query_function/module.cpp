@@ -0,0 +1,257 @@
+// Copyright 2023 WHERE TRUE Technologies.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <iostream>
+#include <cmath>
+
+#include <duckdb.hpp>
+#include <duckdb/common/file_system.hpp>
+#include <duckdb/parser/expression/constant_expression.hpp>
+#include <duckdb/parser/expression/function_expression.hpp>
+#include <duckdb/parallel/task_scheduler.hpp>
+
+#include "exon/arrow_table_function/module.hpp"
+#include "exon/cram_query_function/module.hpp"
+#include "rust.hpp"
+
+namespace exon
+{
+    struct CRAMQueryScanFunctionData : public TableFunctionData
+    {
+        string file_name;
+        vector<string> regions;
+        string reference;
+
+        unordered_map<idx_t, unique_ptr<ArrowConvertData>> arrow_convert_data;
+        idx_t max_threads = 6;
+
+        vector<string> all_names;
+
+        atomic<idx_t> lines_read;
+    };
+
+    //! The region argument is either a single region (or BED path) or a list of them.
+    static vector<string> GetRegions(const Value &value)
+    {
+        vector<string> regions;
+
+        if (value.type().id() == LogicalTypeId::LIST)
+        {
+            for (auto &region : ListValue::GetChildren(value))
+            {
+                if (!region.IsNull())
+                {
+                    regions.push_back(region.GetValue<std::string>());
+                }
+            }
+        }
+        else
+        {
+            regions.push_back(value.GetValue<std::string>());
+        }
+
+        if (regions.empty())
+        {
+            throw std::runtime_error("cram_query requires at least one region");
+        }
+
+        return regions;
+    }
+
+    static vector<const char *> GetRegionPointers(const vector<string> &regions)
+    {
+        vector<const char *> region_ptrs;
+        for (auto &region : regions)
+        {
+            region_ptrs.push_back(region.c_str());
+        }
+
+        return region_ptrs;
+    }
+
+    //! Opens the records of the regions, applying the SQL predicate `filters` if it isn't null.
+    static void OpenReader(ClientContext &context, const CRAMQueryScanFunctionData &data, const char *filters,
+                           struct ArrowArrayStream *stream)
+    {
+        auto region_ptrs = GetRegionPointers(data.regions);
+        auto reference = data.reference.empty() ? NULL : data.reference.c_str();
+
+        auto result = new_cram_reader(stream, data.file_name.c_str(), reference, region_ptrs.data(), region_ptrs.size(),
+                                      STANDARD_VECTOR_SIZE, TaskScheduler::GetScheduler(context).NumberOfThreads(),
+                                      filters);
+        if (result.error != NULL)
+        {
+            throw std::runtime_error(result.error);
+        }
+    }
+
+    duckdb::unique_ptr<FunctionData> CRAMQueryTableFunction::TableBind(ClientContext &context,
+                                                                       TableFunctionBindInput &input,
+                                                                       vector<LogicalType> &return_types,
+                                                                       vector<string> &names)
+    {
+        auto result = make_uniq<CRAMQueryScanFunctionData>();
+
+        result->file_name = input.inputs[0].GetValue<std::string>();
+        result->regions = GetRegions(input.inputs[1]);
+
+        for (auto &kv : input.named_parameters)
+        {
+            if (kv.first == "reference")
+            {
+                result->reference = kv.second.GetValue<string>();
+            }
+        }
+
+        struct ArrowArrayStream stream;
+        OpenReader(context, *result, NULL, &stream);
+
+        struct ArrowSchema arrow_schema;
+
+        if (stream.get_schema(&stream, &arrow_schema) != 0)
+        {
+            if (stream.release)
+            {
+                stream.release(&stream);
+            }
+            throw std::runtime_error("Failed to get schema");
+        }
+
+        result->all_names.reserve(arrow_schema.n_children);
+
+        LogicalType reference_type;
+        auto n_children = arrow_schema.n_children;
+        for (idx_t col_idx = 0; col_idx < n_children; col_idx++)
+        {
+            auto &schema = *arrow_schema.children[col_idx];
+
+            if (!schema.release)
+            {
+                throw InvalidInputException("arrow_scan: released schema passed");
+            }
+
+            return_types.emplace_back(WTArrowTableFunction::GetArrowColumnType(
+                schema, result->arrow_convert_data, col_idx, result->file_name, "cram", false, NULL, reference_type));
+
+            auto format = string(schema.format);
+            auto name = string(schema.name);
+            if (name.empty())
+            {
+                name = string("v") + to_string(col_idx);
+            }
+            names.push_back(name);
+
+            result->all_names.push_back(name);
+        }
+
+        RenameArrowColumns(names);
+
+        return std::move(result);
+    };
+
+    unique_ptr<GlobalTableFunctionState> CRAMQueryTableFunction::InitGlobal(ClientContext &context,
+                                                                            TableFunctionInitInput &input)
+    {
+        auto &data = (CRAMQueryScanFunctionData &)*input.bind_data;
+
+        auto global_state = make_uniq<ArrowScanGlobalState>();
+
+        // DuckDB drops the filters it pushes down from the plan, so the reader applies them.
+        string filter_clause = "";
+        if (input.filters)
+        {
+            filter_clause = WTArrowTableFunction::FilterClause(*input.filters, input.column_ids, data.all_names);
+        }
+
+        struct ArrowArrayStream stream;
+        OpenReader(context, data, filter_clause.c_str(), &stream);
+
+        global_state->stream = make_uniq<ArrowArrayStreamWrapper>();
+        global_state->stream->arrow_array_stream = std::move(stream);
+
+        return std::move(global_state);
+    }
+
+    void CRAMQueryTableFunction::Scan(ClientContext &context, TableFunctionInput &input, DataChunk &output)
+    {
+        if (!input.local_state)
+        {
+            return;
+        }
+        auto &data = (CRAMQueryScanFunctionData &)*input.bind_data;
+        auto &state = (ArrowScanLocalState &)*input.local_state;
+        auto &global_state = (ArrowScanGlobalState &)*input.global_state;
+
+        //! Out of tuples in this chunk
+        if (state.chunk_offset >= (idx_t)state.chunk->arrow_array.length)
+        {
+            if (!ArrowScanParallelStateNext(context, input.bind_data.get(), state, global_state))
+            {
+                return;
+            }
+        }
+        auto output_size = MinValue<int64_t>(STANDARD_VECTOR_SIZE, state.chunk->arrow_array.length - state.chunk_offset);
+        data.lines_read += output_size;
+
+        if (global_state.CanRemoveFilterColumns())
+        {
+            state.all_columns.Reset();
+            state.all_columns.SetCardinality(output_size);
+            WTArrowTableFunction::EnumArrowToDuckDB(state, data.arrow_convert_data, state.all_columns,
+                                                    data.lines_read - output_size);
+            output.ReferenceColumns(state.all_columns, global_state.projection_ids);
+        }
+        else
+        {
+            output.SetCardinality(output_size);
+
+            WTArrowTableFunction::EnumArrowToDuckDB(state, data.arrow_convert_data, output, data.lines_read - output_size);
+        }
+
+        output.Verify();
+        state.chunk_offset += output.size();
+    }
+
+    void CRAMQueryTableFunction::Register(duckdb::ClientContext &context)
+    {
+        TableFunctionSet set("cram_query");
+
+        TableFunction scan;
+        scan = TableFunction("cram_query", {LogicalType::VARCHAR, LogicalType::VARCHAR},
+                             CRAMQueryTableFunction::Scan,
+                             CRAMQueryTableFunction::TableBind,
+                             CRAMQueryTableFunction::InitGlobal,
+                             ArrowTableFunction::ArrowScanInitLocal);
+
+        scan.named_parameters["reference"] = LogicalType::VARCHAR;
+
+        scan.cardinality = ArrowTableFunction::ArrowScanCardinality;
+        scan.get_batch_index = ArrowTableFunction::ArrowGetBatchIndex;
+
+        scan.projection_pushdown = true;
+        scan.filter_pushdown = true;
+
+        set.AddFunction(scan);
+
+        scan.arguments = {LogicalType::VARCHAR, LogicalType::LIST(LogicalType::VARCHAR)};
+        set.AddFunction(scan);
+
+        auto &catalog = Catalog::GetSystemCatalog(context);
+
+        CreateTableFunctionInfo info(set);
+
+        catalog.CreateTableFunction(context, &info);
+    };
+
+}
@@ -0,0 +1,176 @@
+// Copyright 2023 WHERE TRUE Technologies.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include <duckdb.hpp>
+#include <duckdb/function/table_function.hpp>
+
+#include "exon/fasta_functions/module.hpp"
+#include "rust.hpp"
+
+namespace exon
+{
+
+    // Copies a fetched sequence into `result` and releases the Rust allocation, rethrowing any
+    // error as a runtime_error.
+    static duckdb::string_t TakeSequence(FastaFetchResult fetched, duckdb::Vector &result)
+    {
+        if (fetched.error)
+        {
+            std::string error(fetched.error);
+            free_fasta_fetch_result(fetched);
+
+            throw std::runtime_error(error);
+        }
+
+        auto sequence = duckdb::StringVector::AddString(result, fetched.sequence, fetched.length);
+        free_fasta_fetch_result(fetched);
+
+        return sequence;
+    }
+
+    static void FastaFetch(duckdb::DataChunk &args, duckdb::ExpressionState &state, duckdb::Vector &result)
+    {
+        auto count = args.size();
+
+        duckdb::UnifiedVectorFormat path_data, name_data, start_data, end_data;
+        args.data[0].ToUnifiedFormat(count, path_data);
+        args.data[1].ToUnifiedFormat(count, name_data);
+        args.data[2].ToUnifiedFormat(count, start_data);
+        args.data[3].ToUnifiedFormat(count, end_data);
+
+        auto paths = (duckdb::string_t *)path_data.data;
+        auto names = (duckdb::string_t *)name_data.data;
+        auto starts = (int64_t *)start_data.data;
+        auto ends = (int64_t *)end_data.data;
+
+        result.SetVectorType(duckdb::VectorType::FLAT_VECTOR);
+        auto result_data = duckdb::FlatVector::GetData<duckdb::string_t>(result);
+        auto &result_validity = duckdb::FlatVector::Validity(result);
+
+        for (duckdb::idx_t i = 0; i < count; i++)
+        {
+            auto path_idx = path_data.sel->get_index(i);
+            auto name_idx = name_data.sel->get_index(i);
+            auto start_idx = start_data.sel->get_index(i);
+            auto end_idx = end_data.sel->get_index(i);
+
+            if (!path_data.validity.RowIsValid(path_idx) || !name_data.validity.RowIsValid(name_idx) ||
+                !start_data.validity.RowIsValid(start_idx) || !end_data.validity.RowIsValid(end_idx))
+            {
+                result_validity.SetInvalid(i);
+                continue;
+            }
+
+            auto start = starts[start_idx];
+            auto end = ends[end_idx];
+            if (start < 1 || end < 0)
+            {
+                throw std::runtime_error("fasta_fetch positions are one-based and must be positive");
+            }
+
+            auto path = paths[path_idx].GetString();
+            auto name = names[name_idx].GetString();
+
+            result_data[i] = TakeSequence(fasta_fetch(path.c_str(), name.c_str(), start, end), result);
+        }
+
+        if (args.AllConstant())
+        {
+            result.SetVectorType(duckdb::VectorType::CONSTANT_VECTOR);
+        }
+    }
+
+    duckdb::unique_ptr<duckdb::CreateScalarFunctionInfo> FastaFunctions::GetFastaFetchFunction()
+    {
+        duckdb::ScalarFunctionSet set("fasta_fetch");
+
+        set.AddFunction(duckdb::ScalarFunction({duckdb::LogicalType::VARCHAR, duckdb::LogicalType::VARCHAR,
+                                                duckdb::LogicalType::BIGINT, duckdb::LogicalType::BIGINT},
+                                               duckdb::LogicalType::VARCHAR, FastaFetch));
+
+        return duckdb::make_uniq<duckdb::CreateScalarFunctionInfo>(set);
+    }
+
+    struct FastaQueryBindData : public duckdb::TableFunctionData
+    {
+        std::string file_name;
+        std::string region;
+    };
+
+    struct FastaQueryGlobalState : public duckdb::GlobalTableFunctionState
+    {
+        bool done = false;
+    };
+
+    static duckdb::unique_ptr<duckdb::FunctionData> FastaQueryBind(duckdb::ClientContext &context,
+                                                                   duckdb::TableFunctionBindInput &input,
+                                                                   duckdb::vector<duckdb::LogicalType> &return_types,
+                                                                   duckdb::vector<std::string> &names)
+    {
+        auto result = duckdb::make_uniq<FastaQueryBindData>();
+
+        result->file_name = input.inputs[0].GetValue<std::string>();
+        result->region = input.inputs[1].GetValue<std::string>();
+
+        names.push_back("id");
+        return_types.push_back(duckdb::LogicalType::VARCHAR);
+        names.push_back("start");
+        return_types.push_back(duckdb::LogicalType::BIGINT);
+        names.push_back("end");
+        return_types.push_back(duckdb::LogicalType::BIGINT);
+        names.push_back("sequence");
+        return_types.push_back(duckdb::LogicalType::VARCHAR);
+
+        return std::move(result);
+    }
+
+    static duckdb::unique_ptr<duckdb::GlobalTableFunctionState> FastaQueryInitGlobal(duckdb::ClientContext &context,
+                                                                                     duckdb::TableFunctionInitInput &input)
+    {
+        return duckdb::make_uniq<FastaQueryGlobalState>();
+    }
+
+    static void FastaQueryScan(duckdb::ClientContext &context, duckdb::TableFunctionInput &input, duckdb::DataChunk &output)
+    {
+        auto &data = (FastaQueryBindData &)*input.bind_data;
+        auto &state = (FastaQueryGlobalState &)*input.global_state;
+
+        if (state.done)
+        {
+            return;
+        }
+        state.done = true;
+
+        auto fetched = fasta_fetch_region(data.file_name.c_str(), data.region.c_str());
+        if (!fetched.error)
+        {
+            output.SetValue(0, 0, duckdb::Value(fetched.name));
+            output.SetValue(1, 0, duckdb::Value::BIGINT(fetched.start));
+            output.SetValue(2, 0, duckdb::Value::BIGINT(fetched.end));
+        }
+
+        duckdb::FlatVector::GetData<duckdb::string_t>(output.data[3])[0] = TakeSequence(fetched, output.data[3]);
+        output.SetCardinality(1);
+    }
+
+    duckdb::unique_ptr<duckdb::CreateTableFunctionInfo> FastaFunctions::GetFastaQueryTableFunction()
+    {
+        duckdb::TableFunction scan("fasta_query", {duckdb::LogicalType::VARCHAR, duckdb::LogicalType::VARCHAR},
+                                   FastaQueryScan, FastaQueryBind, FastaQueryInitGlobal);
+
+        return duckdb::make_uniq<duckdb::CreateTableFunctionInfo>(scan);
+    }
+
+} // namespace exon
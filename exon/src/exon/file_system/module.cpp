@@ -0,0 +1,232 @@
+// Copyright 2023 WHERE TRUE Technologies.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <cstdlib>
+#include <cstring>
+
+#include <duckdb.hpp>
+#include <duckdb/common/file_system.hpp>
+#include <duckdb/common/file_opener.hpp>
+#include <duckdb/main/config.hpp>
+
+#include "exon/file_system/module.hpp"
+
+namespace exon
+{
+    const char *USE_DUCKDB_FILE_SYSTEM_SETTING = "exon_use_duckdb_file_system";
+    const char *BLOCK_CACHE_SIZE_SETTING = "exon_block_cache_size";
+    const char *DISK_CACHE_DIRECTORY_SETTING = "exon_disk_cache_directory";
+    const char *DISK_CACHE_SIZE_SETTING = "exon_disk_cache_size";
+
+    const int64_t DEFAULT_BLOCK_CACHE_SIZE = 256 * 1024 * 1024;
+    const int64_t DEFAULT_DISK_CACHE_SIZE = 10LL * 1024 * 1024 * 1024;
+
+    // The callbacks below are invoked from Rust, so they must never let an exception escape.
+
+    static void *OpenFile(void *context_p, const char *path)
+    {
+        try
+        {
+            auto &context = *reinterpret_cast<duckdb::ClientContext *>(context_p);
+            auto &fs = duckdb::FileSystem::GetFileSystem(context);
+            auto opener = duckdb::FileSystem::GetFileOpener(context);
+
+            auto handle = fs.OpenFile(path, duckdb::FileFlags::FILE_FLAGS_READ, duckdb::FileSystem::DEFAULT_LOCK,
+                                      duckdb::FileCompressionType::UNCOMPRESSED, opener);
+
+            return handle.release();
+        }
+        catch (...)
+        {
+            return nullptr;
+        }
+    }
+
+    static int64_t ReadAt(void *handle_p, uint8_t *buffer, uintptr_t length, uint64_t offset)
+    {
+        try
+        {
+            auto handle = reinterpret_cast<duckdb::FileHandle *>(handle_p);
+            handle->Read(buffer, length, offset);
+
+            return length;
+        }
+        catch (...)
+        {
+            return -1;
+        }
+    }
+
+    static int64_t FileSize(void *handle_p)
+    {
+        try
+        {
+            auto handle = reinterpret_cast<duckdb::FileHandle *>(handle_p);
+            return handle->GetFileSize();
+        }
+        catch (...)
+        {
+            return -1;
+        }
+    }
+
+    static int64_t LastModified(void *handle_p)
+    {
+        try
+        {
+            auto handle = reinterpret_cast<duckdb::FileHandle *>(handle_p);
+            return handle->file_system.GetLastModifiedTime(*handle);
+        }
+        catch (...)
+        {
+            return 0;
+        }
+    }
+
+    static void CloseFile(void *handle_p)
+    {
+        try
+        {
+            auto handle = reinterpret_cast<duckdb::FileHandle *>(handle_p);
+            delete handle;
+        }
+        catch (...)
+        {
+        }
+    }
+
+    static char *Glob(void *context_p, const char *pattern)
+    {
+        try
+        {
+            auto &context = *reinterpret_cast<duckdb::ClientContext *>(context_p);
+            auto &fs = duckdb::FileSystem::GetFileSystem(context);
+
+            auto paths = fs.Glob(pattern, duckdb::FileSystem::GetFileOpener(context));
+            auto joined = duckdb::StringUtil::Join(paths, "\n");
+
+            auto result = reinterpret_cast<char *>(malloc(joined.size() + 1));
+            memcpy(result, joined.c_str(), joined.size() + 1);
+
+            return result;
+        }
+        catch (...)
+        {
+            return nullptr;
+        }
+    }
+
+    static void FreeString(char *value)
+    {
+        free(value);
+    }
+
+    static void SetBlockCacheSize(duckdb::ClientContext &context, duckdb::SetScope scope, duckdb::Value &parameter)
+    {
+        auto capacity = parameter.IsNull() ? DEFAULT_BLOCK_CACHE_SIZE : duckdb::BigIntValue::Get(parameter);
+        if (capacity < 0)
+        {
+            throw std::runtime_error("exon_block_cache_size must be non-negative");
+        }
+
+        set_block_cache_capacity(capacity);
+    }
+
+    static void ConfigureDiskCache(const std::string &directory, int64_t capacity)
+    {
+        if (capacity < 0)
+        {
+            throw std::runtime_error("exon_disk_cache_size must be non-negative");
+        }
+
+        auto result = set_disk_cache(directory.c_str(), capacity);
+        if (result.error)
+        {
+            throw std::runtime_error(result.error);
+        }
+    }
+
+    // Each setting's callback runs before the new value is stored, so the other half of the disk
+    // cache configuration is read from the context.
+
+    static void SetDiskCacheDirectory(duckdb::ClientContext &context, duckdb::SetScope scope, duckdb::Value &parameter)
+    {
+        duckdb::Value size;
+        auto capacity = context.TryGetCurrentSetting(DISK_CACHE_SIZE_SETTING, size) && !size.IsNull()
+                            ? duckdb::BigIntValue::Get(size)
+                            : DEFAULT_DISK_CACHE_SIZE;
+
+        ConfigureDiskCache(parameter.IsNull() ? "" : parameter.ToString(), capacity);
+    }
+
+    static void SetDiskCacheSize(duckdb::ClientContext &context, duckdb::SetScope scope, duckdb::Value &parameter)
+    {
+        duckdb::Value directory;
+        if (!context.TryGetCurrentSetting(DISK_CACHE_DIRECTORY_SETTING, directory) || directory.IsNull())
+        {
+            directory = duckdb::Value("");
+        }
+
+        ConfigureDiskCache(directory.ToString(), parameter.IsNull() ? DEFAULT_DISK_CACHE_SIZE : duckdb::BigIntValue::Get(parameter));
+    }
+
+    void ExonFileSystem::RegisterSettings(duckdb::DBConfig &config)
+    {
+        config.AddExtensionOption(USE_DUCKDB_FILE_SYSTEM_SETTING,
+                                  "Read exon files through DuckDB's file system (httpfs, credentials, caching) instead of exon's object stores",
+                                  duckdb::LogicalType::BOOLEAN, duckdb::Value::BOOLEAN(false));
+
+        config.AddExtensionOption(BLOCK_CACHE_SIZE_SETTING,
+                                  "Bytes of remote BGZF blocks and index chunks cached across region queries (0 disables the cache)",
+                                  duckdb::LogicalType::BIGINT, duckdb::Value::BIGINT(DEFAULT_BLOCK_CACHE_SIZE),
+                                  SetBlockCacheSize);
+
+        config.AddExtensionOption(DISK_CACHE_DIRECTORY_SETTING,
+                                  "Directory of the persistent cache of remote index files and data blocks (empty disables it)",
+                                  duckdb::LogicalType::VARCHAR, duckdb::Value(""), SetDiskCacheDirectory);
+
+        config.AddExtensionOption(DISK_CACHE_SIZE_SETTING,
+                                  "Bytes the persistent disk cache may hold before evicting the least recently used entries",
+                                  duckdb::LogicalType::BIGINT, duckdb::Value::BIGINT(DEFAULT_DISK_CACHE_SIZE),
+                                  SetDiskCacheSize);
+    }
+
+    bool ExonFileSystem::Enabled(duckdb::ClientContext &context)
+    {
+        duckdb::Value value;
+        if (!context.TryGetCurrentSetting(USE_DUCKDB_FILE_SYSTEM_SETTING, value) || value.IsNull())
+        {
+            return false;
+        }
+
+        return duckdb::BooleanValue::Get(value);
+    }
+
+    DuckDBFileSystem ExonFileSystem::GetFFI(duckdb::ClientContext &context)
+    {
+        DuckDBFileSystem file_system;
+
+        file_system.context = &context;
+        file_system.open = OpenFile;
+        file_system.read_at = ReadAt;
+        file_system.file_size = FileSize;
+        file_system.last_modified = LastModified;
+        file_system.close = CloseFile;
+        file_system.glob = Glob;
+        file_system.free_string = FreeString;
+
+        return file_system;
+    }
+
+} // namespace exon
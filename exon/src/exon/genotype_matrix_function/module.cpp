@@ -0,0 +1,243 @@
+// Copyright 2023 WHERE TRUE Technologies.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <iostream>
+#include <cmath>
+
+#include <duckdb.hpp>
+#include <duckdb/common/file_system.hpp>
+#include <duckdb/parser/expression/constant_expression.hpp>
+#include <duckdb/parser/expression/function_expression.hpp>
+#include <duckdb/parallel/task_scheduler.hpp>
+
+#include "exon/arrow_table_function/module.hpp"
+#include "exon/genotype_matrix_function/module.hpp"
+#include "exon/file_system/module.hpp"
+#include "rust.hpp"
+
+namespace exon
+{
+    struct GenotypeMatrixScanFunctionData : public SortedScanFunctionData
+    {
+        string file_name;
+        vector<string> samples;
+        string region;
+        bool packed = false;
+
+        unordered_map<idx_t, unique_ptr<ArrowConvertData>> arrow_convert_data;
+        idx_t max_threads = 6;
+
+        vector<string> all_names;
+
+        atomic<idx_t> lines_read;
+    };
+
+    static void OpenReader(ClientContext &context, const GenotypeMatrixScanFunctionData &data, const char *filters,
+                           struct ArrowArrayStream *stream)
+    {
+        vector<const char *> sample_ptrs;
+        for (auto &sample : data.samples)
+        {
+            sample_ptrs.push_back(sample.c_str());
+        }
+
+        auto result = new_genotype_reader(stream, data.file_name.c_str(),
+                                          data.samples.empty() ? NULL : sample_ptrs.data(), sample_ptrs.size(),
+                                          data.region.empty() ? NULL : data.region.c_str(), data.packed,
+                                          STANDARD_VECTOR_SIZE, TaskScheduler::GetScheduler(context).NumberOfThreads(),
+                                          filters);
+        if (result.error != NULL)
+        {
+            throw std::runtime_error(result.error);
+        }
+    }
+
+    duckdb::unique_ptr<FunctionData> GenotypeMatrixTableFunction::TableBind(ClientContext &context,
+                                                                            TableFunctionBindInput &input,
+                                                                            vector<LogicalType> &return_types,
+                                                                            vector<string> &names)
+    {
+        auto result = make_uniq<GenotypeMatrixScanFunctionData>();
+
+        result->file_name = input.inputs[0].GetValue<std::string>();
+
+        for (auto &kv : input.named_parameters)
+        {
+            if (kv.first == "samples")
+            {
+                for (auto &sample : ListValue::GetChildren(kv.second))
+                {
+                    result->samples.push_back(sample.GetValue<string>());
+                }
+
+                if (result->samples.empty())
+                {
+                    throw std::runtime_error("samples must name at least one sample");
+                }
+            }
+            else if (kv.first == "region")
+            {
+                result->region = kv.second.GetValue<string>();
+            }
+            else if (kv.first == "packed")
+            {
+                result->packed = kv.second.GetValue<bool>();
+            }
+        }
+
+        // The genotypes are read straight from the file's records, which the DuckDB file system can't map.
+        if (ExonFileSystem::Enabled(context) || result->file_name.find("://") != string::npos ||
+            !FileSystem::GetFileSystem(context).FileExists(result->file_name))
+        {
+            throw std::runtime_error("vcf_genotype_matrix can only read a local file");
+        }
+
+        struct ArrowArrayStream stream;
+        OpenReader(context, *result, NULL, &stream);
+
+        struct ArrowSchema arrow_schema;
+
+        if (stream.get_schema(&stream, &arrow_schema) != 0)
+        {
+            if (stream.release)
+            {
+                stream.release(&stream);
+            }
+            throw std::runtime_error("Failed to get schema");
+        }
+
+        result->all_names.reserve(arrow_schema.n_children);
+
+        LogicalType reference_type;
+        auto n_children = arrow_schema.n_children;
+        for (idx_t col_idx = 0; col_idx < n_children; col_idx++)
+        {
+            auto &schema = *arrow_schema.children[col_idx];
+
+            if (!schema.release)
+            {
+                throw InvalidInputException("arrow_scan: released schema passed");
+            }
+
+            return_types.emplace_back(WTArrowTableFunction::GetArrowColumnType(
+                schema, result->arrow_convert_data, col_idx, result->file_name, "vcf", true, NULL, reference_type));
+
+            auto format = string(schema.format);
+            auto name = string(schema.name);
+            if (name.empty())
+            {
+                name = string("v") + to_string(col_idx);
+            }
+            names.push_back(name);
+
+            result->all_names.push_back(name);
+        }
+
+        RenameArrowColumns(names);
+
+        result->sort_columns =
+            WTArrowTableFunction::GetSortColumns(result->file_name, "vcf", names, return_types, "chrom", "pos");
+
+        return std::move(result);
+    };
+
+    unique_ptr<GlobalTableFunctionState> GenotypeMatrixTableFunction::InitGlobal(ClientContext &context,
+                                                                                 TableFunctionInitInput &input)
+    {
+        auto &data = (GenotypeMatrixScanFunctionData &)*input.bind_data;
+
+        auto global_state = make_uniq<ArrowScanGlobalState>();
+
+        string filter_clause = "";
+        if (input.filters)
+        {
+            filter_clause = WTArrowTableFunction::FilterClause(*input.filters, input.column_ids, data.all_names);
+        }
+
+        struct ArrowArrayStream stream;
+        OpenReader(context, data, filter_clause.c_str(), &stream);
+
+        global_state->stream = make_uniq<ArrowArrayStreamWrapper>();
+        global_state->stream->arrow_array_stream = std::move(stream);
+
+        return std::move(global_state);
+    }
+
+    void GenotypeMatrixTableFunction::Scan(ClientContext &context, TableFunctionInput &input, DataChunk &output)
+    {
+        if (!input.local_state)
+        {
+            return;
+        }
+        auto &data = (GenotypeMatrixScanFunctionData &)*input.bind_data;
+        auto &state = (ArrowScanLocalState &)*input.local_state;
+        auto &global_state = (ArrowScanGlobalState &)*input.global_state;
+
+        //! Out of tuples in this chunk
+        if (state.chunk_offset >= (idx_t)state.chunk->arrow_array.length)
+        {
+            if (!ArrowScanParallelStateNext(context, input.bind_data.get(), state, global_state))
+            {
+                return;
+            }
+        }
+        auto output_size = MinValue<int64_t>(STANDARD_VECTOR_SIZE, state.chunk->arrow_array.length - state.chunk_offset);
+        data.lines_read += output_size;
+
+        if (global_state.CanRemoveFilterColumns())
+        {
+            state.all_columns.Reset();
+            state.all_columns.SetCardinality(output_size);
+            WTArrowTableFunction::EnumArrowToDuckDB(state, data.arrow_convert_data, state.all_columns,
+                                                    data.lines_read - output_size);
+            output.ReferenceColumns(state.all_columns, global_state.projection_ids);
+        }
+        else
+        {
+            output.SetCardinality(output_size);
+
+            WTArrowTableFunction::EnumArrowToDuckDB(state, data.arrow_convert_data, output, data.lines_read - output_size);
+        }
+
+        output.Verify();
+        state.chunk_offset += output.size();
+    }
+
+    void GenotypeMatrixTableFunction::Register(duckdb::ClientContext &context)
+    {
+        TableFunction scan;
+        scan = TableFunction("vcf_genotype_matrix", {LogicalType::VARCHAR},
+                             GenotypeMatrixTableFunction::Scan,
+                             GenotypeMatrixTableFunction::TableBind,
+                             GenotypeMatrixTableFunction::InitGlobal,
+                             ArrowTableFunction::ArrowScanInitLocal);
+
+        scan.cardinality = ArrowTableFunction::ArrowScanCardinality;
+        scan.get_batch_index = ArrowTableFunction::ArrowGetBatchIndex;
+
+        scan.projection_pushdown = true;
+        scan.filter_pushdown = true;
+
+        scan.named_parameters["samples"] = LogicalType::LIST(LogicalType::VARCHAR);
+        scan.named_parameters["region"] = LogicalType::VARCHAR;
+        scan.named_parameters["packed"] = LogicalType::BOOLEAN;
+
+        auto &catalog = Catalog::GetSystemCatalog(context);
+
+        CreateTableFunctionInfo info(scan);
+
+        catalog.CreateTableFunction(context, &info);
+    };
+
+}
@@ -0,0 +1,266 @@
+// Copyright 2023 WHERE TRUE Technologies.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include <duckdb.hpp>
+#include <duckdb/function/table_function.hpp>
+#include <duckdb/parallel/task_scheduler.hpp>
+
+#include "exon/index_functions/module.hpp"
+#include "exon/file_system/module.hpp"
+#include "rust.hpp"
+
+namespace exon
+{
+
+    struct IndexStatsInfo : public duckdb::TableFunctionInfo
+    {
+        explicit IndexStatsInfo(std::string file_format_p) : file_format(std::move(file_format_p)) {}
+
+        std::string file_format;
+    };
+
+    struct IndexReferenceRow
+    {
+        std::string name;
+        int64_t length;
+        int64_t mapped;
+        int64_t unmapped;
+    };
+
+    struct IndexStatsBindData : public duckdb::TableFunctionData
+    {
+        std::vector<IndexReferenceRow> rows;
+    };
+
+    struct IndexStatsGlobalState : public duckdb::GlobalTableFunctionState
+    {
+        duckdb::idx_t offset = 0;
+    };
+
+    static duckdb::unique_ptr<duckdb::FunctionData> IndexStatsBind(duckdb::ClientContext &context,
+                                                                   duckdb::TableFunctionBindInput &input,
+                                                                   duckdb::vector<duckdb::LogicalType> &return_types,
+                                                                   duckdb::vector<std::string> &names)
+    {
+        auto &info = input.info->Cast<IndexStatsInfo>();
+        auto result = duckdb::make_uniq<IndexStatsBindData>();
+
+        auto file_name = input.inputs[0].GetValue<std::string>();
+
+        auto file_system = ExonFileSystem::GetFFI(context);
+        auto file_system_ptr = ExonFileSystem::Enabled(context) ? &file_system : NULL;
+
+        // The index is small, read it whole at bind time so a missing one fails the query early.
+        auto stats = index_stats(file_name.c_str(), info.file_format.c_str(), file_system_ptr);
+        if (stats.error != NULL)
+        {
+            std::string error(stats.error);
+            free_index_stats(stats);
+
+            throw std::runtime_error(error);
+        }
+
+        for (duckdb::idx_t i = 0; i < stats.count; i++)
+        {
+            auto &reference = stats.references[i];
+            result->rows.push_back({reference.name, reference.length, reference.mapped, reference.unmapped});
+        }
+
+        free_index_stats(stats);
+
+        names.push_back("reference");
+        return_types.push_back(duckdb::LogicalType::VARCHAR);
+        names.push_back("length");
+        return_types.push_back(duckdb::LogicalType::BIGINT);
+        names.push_back("mapped");
+        return_types.push_back(duckdb::LogicalType::BIGINT);
+        names.push_back("unmapped");
+        return_types.push_back(duckdb::LogicalType::BIGINT);
+
+        return std::move(result);
+    }
+
+    static duckdb::unique_ptr<duckdb::GlobalTableFunctionState> IndexStatsInitGlobal(duckdb::ClientContext &context,
+                                                                                     duckdb::TableFunctionInitInput &input)
+    {
+        return duckdb::make_uniq<IndexStatsGlobalState>();
+    }
+
+    // Unknown counts come over as -1.
+    static duckdb::Value CountValue(int64_t count)
+    {
+        return count < 0 ? duckdb::Value(duckdb::LogicalType::BIGINT) : duckdb::Value::BIGINT(count);
+    }
+
+    static void IndexStatsScan(duckdb::ClientContext &context, duckdb::TableFunctionInput &input, duckdb::DataChunk &output)
+    {
+        auto &data = (IndexStatsBindData &)*input.bind_data;
+        auto &state = (IndexStatsGlobalState &)*input.global_state;
+
+        duckdb::idx_t count = 0;
+        while (state.offset < data.rows.size() && count < STANDARD_VECTOR_SIZE)
+        {
+            auto &row = data.rows[state.offset];
+
+            output.SetValue(0, count, duckdb::Value(row.name));
+            output.SetValue(1, count, CountValue(row.length));
+            output.SetValue(2, count, CountValue(row.mapped));
+            output.SetValue(3, count, CountValue(row.unmapped));
+
+            state.offset++;
+            count++;
+        }
+
+        output.SetCardinality(count);
+    }
+
+    struct BuildIndexBindData : public duckdb::TableFunctionData
+    {
+        std::string file_name;
+        std::string file_format;
+        std::string index_format;
+        std::string index_path;
+
+        //! Set for exon_build_name_index, which writes a read name index rather than a coordinate one.
+        bool name_index = false;
+    };
+
+    struct BuildIndexGlobalState : public duckdb::GlobalTableFunctionState
+    {
+        bool finished = false;
+    };
+
+    static duckdb::unique_ptr<duckdb::FunctionData> BuildIndexBind(duckdb::ClientContext &context,
+                                                                   duckdb::TableFunctionBindInput &input,
+                                                                   duckdb::vector<duckdb::LogicalType> &return_types,
+                                                                   duckdb::vector<std::string> &names)
+    {
+        auto result = duckdb::make_uniq<BuildIndexBindData>();
+        result->file_name = input.inputs[0].GetValue<std::string>();
+
+        for (auto &kv : input.named_parameters)
+        {
+            if (kv.first == "file_format")
+            {
+                result->file_format = kv.second.GetValue<std::string>();
+            }
+            else if (kv.first == "index_format")
+            {
+                result->index_format = kv.second.GetValue<std::string>();
+            }
+            else if (kv.first == "index_path")
+            {
+                result->index_path = kv.second.GetValue<std::string>();
+            }
+        }
+
+        names.push_back("index_path");
+        return_types.push_back(duckdb::LogicalType::VARCHAR);
+        names.push_back("records");
+        return_types.push_back(duckdb::LogicalType::UBIGINT);
+
+        return std::move(result);
+    }
+
+    static duckdb::unique_ptr<duckdb::GlobalTableFunctionState> BuildIndexInitGlobal(duckdb::ClientContext &context,
+                                                                                     duckdb::TableFunctionInitInput &input)
+    {
+        return duckdb::make_uniq<BuildIndexGlobalState>();
+    }
+
+    static void BuildIndexScan(duckdb::ClientContext &context, duckdb::TableFunctionInput &input, duckdb::DataChunk &output)
+    {
+        auto &data = (BuildIndexBindData &)*input.bind_data;
+        auto &state = (BuildIndexGlobalState &)*input.global_state;
+
+        if (state.finished)
+        {
+            output.SetCardinality(0);
+            return;
+        }
+
+        state.finished = true;
+
+        // The index is written here rather than at bind time, so preparing a query writes nothing.
+        auto threads = duckdb::TaskScheduler::GetScheduler(context).NumberOfThreads();
+        auto result = data.name_index ? build_bam_name_index(data.file_name.c_str(), threads)
+                                      : build_index(data.file_name.c_str(), data.file_format.c_str(),
+                                                    data.index_format.c_str(), data.index_path.c_str(), threads);
+
+        if (result.error != NULL)
+        {
+            std::string error(result.error);
+            free_build_index(result);
+
+            throw std::runtime_error(error);
+        }
+
+        for (duckdb::idx_t i = 0; i < result.count; i++)
+        {
+            output.SetValue(0, i, duckdb::Value(result.files[i].path));
+            output.SetValue(1, i, duckdb::Value::UBIGINT(result.files[i].records));
+        }
+
+        output.SetCardinality(result.count);
+        free_build_index(result);
+    }
+
+    duckdb::unique_ptr<duckdb::CreateTableFunctionInfo> IndexFunctions::GetBuildIndexTableFunction()
+    {
+        duckdb::TableFunction scan("exon_index", {duckdb::LogicalType::VARCHAR}, BuildIndexScan, BuildIndexBind,
+                                   BuildIndexInitGlobal);
+        scan.named_parameters["file_format"] = duckdb::LogicalType::VARCHAR;
+        scan.named_parameters["index_format"] = duckdb::LogicalType::VARCHAR;
+        scan.named_parameters["index_path"] = duckdb::LogicalType::VARCHAR;
+
+        return duckdb::make_uniq<duckdb::CreateTableFunctionInfo>(scan);
+    }
+
+    static duckdb::unique_ptr<duckdb::FunctionData> BuildNameIndexBind(duckdb::ClientContext &context,
+                                                                       duckdb::TableFunctionBindInput &input,
+                                                                       duckdb::vector<duckdb::LogicalType> &return_types,
+                                                                       duckdb::vector<std::string> &names)
+    {
+        auto result = duckdb::make_uniq<BuildIndexBindData>();
+        result->file_name = input.inputs[0].GetValue<std::string>();
+        result->name_index = true;
+
+        names.push_back("index_path");
+        return_types.push_back(duckdb::LogicalType::VARCHAR);
+        names.push_back("records");
+        return_types.push_back(duckdb::LogicalType::UBIGINT);
+
+        return std::move(result);
+    }
+
+    duckdb::unique_ptr<duckdb::CreateTableFunctionInfo> IndexFunctions::GetBuildNameIndexTableFunction()
+    {
+        duckdb::TableFunction scan("exon_build_name_index", {duckdb::LogicalType::VARCHAR}, BuildIndexScan,
+                                   BuildNameIndexBind, BuildIndexInitGlobal);
+
+        return duckdb::make_uniq<duckdb::CreateTableFunctionInfo>(scan);
+    }
+
+    duckdb::unique_ptr<duckdb::CreateTableFunctionInfo> IndexFunctions::GetIndexStatsTableFunction(const std::string &name,
+                                                                                                   const std::string &file_format)
+    {
+        duckdb::TableFunction scan(name, {duckdb::LogicalType::VARCHAR}, IndexStatsScan, IndexStatsBind,
+                                   IndexStatsInitGlobal);
+        scan.function_info = duckdb::make_uniq<IndexStatsInfo>(file_format);
+
+        return duckdb::make_uniq<duckdb::CreateTableFunctionInfo>(scan);
+    }
+
+} // namespace exon
@@ -0,0 +1,360 @@
+// Copyright 2023 WHERE TRUE Technologies.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <iostream>
+
+#include <duckdb.hpp>
+#include <duckdb/common/file_system.hpp>
+#include <duckdb/parallel/task_scheduler.hpp>
+
+#include "exon/arrow_table_function/module.hpp"
+#include "exon/mark_duplicates_function/module.hpp"
+#include "exon/file_system/module.hpp"
+#include "rust.hpp"
+
+namespace exon
+{
+    struct MarkDuplicatesScanFunctionData : public TableFunctionData
+    {
+        string file_name;
+
+        unordered_map<idx_t, unique_ptr<ArrowConvertData>> arrow_convert_data;
+        idx_t max_threads = 6;
+
+        vector<string> all_names;
+
+        atomic<idx_t> lines_read;
+    };
+
+    struct MarkDuplicatesGlobalState : ArrowScanGlobalState
+    {
+        //! Reference sequences marked by a thread each, handed out in order. Empty when the file is
+        //! marked as one shared stream.
+        vector<string> partitions;
+        atomic<idx_t> next_partition{0};
+        string filter_clause;
+
+        //! The names of the columns the scan reads, projected and filtered ones.
+        vector<string> columns;
+    };
+
+    struct MarkDuplicatesLocalState : ArrowScanLocalState
+    {
+        explicit MarkDuplicatesLocalState(unique_ptr<ArrowArrayWrapper> current_chunk)
+            : ArrowScanLocalState(std::move(current_chunk))
+        {
+        }
+
+        //! The partition this thread is marking, its stream and the chunks read from it so far.
+        unique_ptr<ArrowArrayStreamWrapper> partition_stream;
+        idx_t partition = 0;
+        idx_t partition_chunks = 0;
+    };
+
+    //! Opens the marked records of the file, or of one partition of it if `partition` isn't null, decoding only
+    //! `columns`, or every column if null.
+    static void OpenReader(ClientContext &context, const MarkDuplicatesScanFunctionData &data, const char *partition,
+                           const vector<string> *columns, const char *filters, struct ArrowArrayStream *stream)
+    {
+        vector<const char *> column_ptrs;
+        if (columns)
+        {
+            for (auto &column : *columns)
+            {
+                column_ptrs.push_back(column.c_str());
+            }
+        }
+
+        // A null column list decodes every column, so an empty list still passes a valid pointer.
+        const char *no_column = NULL;
+        auto column_list = !columns ? NULL : column_ptrs.empty() ? &no_column : column_ptrs.data();
+
+        auto result = new_duplicate_reader(stream, data.file_name.c_str(), partition, column_list, column_ptrs.size(),
+                                           STANDARD_VECTOR_SIZE, TaskScheduler::GetScheduler(context).NumberOfThreads(),
+                                           filters);
+        if (result.error != NULL)
+        {
+            throw std::runtime_error(result.error);
+        }
+    }
+
+    //! Plans a partition per reference sequence of an indexed file, or none if it is marked as one stream.
+    static vector<string> GetPartitions(ClientContext &context, const MarkDuplicatesScanFunctionData &data)
+    {
+        vector<string> partitions;
+
+        if (TaskScheduler::GetScheduler(context).NumberOfThreads() <= 1)
+        {
+            return partitions;
+        }
+
+        auto result = duplicate_partitions(data.file_name.c_str());
+        if (result.error != NULL)
+        {
+            auto error = string(result.error);
+            free_scan_partitions(result);
+            throw std::runtime_error(error);
+        }
+
+        for (idx_t i = 0; i < result.count; i++)
+        {
+            partitions.push_back(result.regions[i]);
+        }
+
+        free_scan_partitions(result);
+
+        return partitions;
+    }
+
+    duckdb::unique_ptr<FunctionData> MarkDuplicatesTableFunction::TableBind(ClientContext &context,
+                                                                            TableFunctionBindInput &input,
+                                                                            vector<LogicalType> &return_types,
+                                                                            vector<string> &names)
+    {
+        auto result = make_uniq<MarkDuplicatesScanFunctionData>();
+
+        result->file_name = input.inputs[0].GetValue<string>();
+
+        // The records are read straight from the file, which the DuckDB file system can't map.
+        if (ExonFileSystem::Enabled(context) || result->file_name.find("://") != string::npos ||
+            !FileSystem::GetFileSystem(context).FileExists(result->file_name))
+        {
+            throw std::runtime_error("mark_duplicates can only read a local file");
+        }
+
+        struct ArrowArrayStream stream;
+        OpenReader(context, *result, NULL, NULL, NULL, &stream);
+
+        struct ArrowSchema arrow_schema;
+
+        if (stream.get_schema(&stream, &arrow_schema) != 0)
+        {
+            if (stream.release)
+            {
+                stream.release(&stream);
+            }
+            throw std::runtime_error("Failed to get schema");
+        }
+
+        result->all_names.reserve(arrow_schema.n_children);
+
+        LogicalType reference_type;
+        auto n_children = arrow_schema.n_children;
+        for (idx_t col_idx = 0; col_idx < n_children; col_idx++)
+        {
+            auto &schema = *arrow_schema.children[col_idx];
+
+            if (!schema.release)
+            {
+                throw InvalidInputException("arrow_scan: released schema passed");
+            }
+
+            return_types.emplace_back(WTArrowTableFunction::GetArrowColumnType(
+                schema, result->arrow_convert_data, col_idx, result->file_name, "bam", true, NULL, reference_type));
+
+            auto name = string(schema.name);
+            if (name.empty())
+            {
+                name = string("v") + to_string(col_idx);
+            }
+            names.push_back(name);
+
+            result->all_names.push_back(name);
+        }
+
+        RenameArrowColumns(names);
+
+        return std::move(result);
+    };
+
+    unique_ptr<GlobalTableFunctionState> MarkDuplicatesTableFunction::InitGlobal(ClientContext &context,
+                                                                                 TableFunctionInitInput &input)
+    {
+        auto &data = (MarkDuplicatesScanFunctionData &)*input.bind_data;
+
+        auto global_state = make_uniq<MarkDuplicatesGlobalState>();
+
+        string filter_clause = "";
+        if (input.filters)
+        {
+            filter_clause = WTArrowTableFunction::FilterClause(*input.filters, input.column_ids, data.all_names);
+        }
+
+        for (auto &column_id : input.column_ids)
+        {
+            if (column_id != COLUMN_IDENTIFIER_ROW_ID)
+            {
+                global_state->columns.push_back(data.all_names[column_id]);
+            }
+        }
+
+        global_state->partitions = GetPartitions(context, data);
+
+        if (!global_state->partitions.empty())
+        {
+            global_state->filter_clause = filter_clause;
+            global_state->max_threads = global_state->partitions.size();
+
+            return std::move(global_state);
+        }
+
+        struct ArrowArrayStream stream;
+        OpenReader(context, data, NULL, &global_state->columns, filter_clause.c_str(), &stream);
+
+        global_state->stream = make_uniq<ArrowArrayStreamWrapper>();
+        global_state->stream->arrow_array_stream = std::move(stream);
+
+        return std::move(global_state);
+    }
+
+    unique_ptr<LocalTableFunctionState> MarkDuplicatesTableFunction::InitLocal(ExecutionContext &context,
+                                                                               TableFunctionInitInput &input,
+                                                                               GlobalTableFunctionState *global_state_p)
+    {
+        auto &global_state = global_state_p->Cast<ArrowScanGlobalState>();
+        auto current_chunk = make_uniq<ArrowArrayWrapper>();
+        auto result = make_uniq<MarkDuplicatesLocalState>(std::move(current_chunk));
+        result->column_ids = input.column_ids;
+        result->filters = input.filters.get();
+
+        if (input.CanRemoveFilterColumns())
+        {
+            result->all_columns.Initialize(context.client, global_state.scanned_types);
+        }
+
+        if (!ParallelStateNext(context.client, input.bind_data.get(), *result, global_state))
+        {
+            return nullptr;
+        }
+        return std::move(result);
+    }
+
+    bool MarkDuplicatesTableFunction::ParallelStateNext(ClientContext &context, const FunctionData *bind_data_p,
+                                                        ArrowScanLocalState &state_p,
+                                                        ArrowScanGlobalState &global_state_p)
+    {
+        // Every batch has dictionaries of its own, as in the file scans.
+        state_p.arrow_dictionary_vectors.clear();
+
+        auto &global_state = (MarkDuplicatesGlobalState &)global_state_p;
+        if (global_state.partitions.empty())
+        {
+            return ArrowScanParallelStateNext(context, bind_data_p, state_p, global_state_p);
+        }
+
+        auto &data = (const MarkDuplicatesScanFunctionData &)*bind_data_p;
+        auto &state = (MarkDuplicatesLocalState &)state_p;
+
+        while (true)
+        {
+            if (state.partition_stream)
+            {
+                auto current_chunk = state.partition_stream->GetNextChunk();
+                while (current_chunk->arrow_array.length == 0 && current_chunk->arrow_array.release)
+                {
+                    current_chunk = state.partition_stream->GetNextChunk();
+                }
+
+                if (current_chunk->arrow_array.release)
+                {
+                    state.chunk_offset = 0;
+                    // Ordered by partition, then by chunk within it, which is the file order.
+                    state.batch_index = (state.partition << 32) | state.partition_chunks++;
+                    state.chunk = std::move(current_chunk);
+                    return true;
+                }
+
+                state.partition_stream.reset();
+            }
+
+            auto partition = global_state.next_partition++;
+            if (partition >= global_state.partitions.size())
+            {
+                return false;
+            }
+
+            struct ArrowArrayStream stream;
+            OpenReader(context, data, global_state.partitions[partition].c_str(), &global_state.columns,
+                       global_state.filter_clause.c_str(), &stream);
+
+            state.partition = partition;
+            state.partition_chunks = 0;
+            state.partition_stream = make_uniq<ArrowArrayStreamWrapper>();
+            state.partition_stream->arrow_array_stream = stream;
+        }
+    }
+
+    void MarkDuplicatesTableFunction::Scan(ClientContext &context, TableFunctionInput &input, DataChunk &output)
+    {
+        if (!input.local_state)
+        {
+            return;
+        }
+        auto &data = (MarkDuplicatesScanFunctionData &)*input.bind_data;
+        auto &state = (ArrowScanLocalState &)*input.local_state;
+        auto &global_state = (ArrowScanGlobalState &)*input.global_state;
+
+        //! Out of tuples in this chunk
+        if (state.chunk_offset >= (idx_t)state.chunk->arrow_array.length)
+        {
+            if (!ParallelStateNext(context, input.bind_data.get(), state, global_state))
+            {
+                return;
+            }
+        }
+        auto output_size = MinValue<int64_t>(STANDARD_VECTOR_SIZE, state.chunk->arrow_array.length - state.chunk_offset);
+        data.lines_read += output_size;
+
+        if (global_state.CanRemoveFilterColumns())
+        {
+            state.all_columns.Reset();
+            state.all_columns.SetCardinality(output_size);
+            WTArrowTableFunction::EnumArrowToDuckDB(state, data.arrow_convert_data, state.all_columns,
+                                                    data.lines_read - output_size);
+            output.ReferenceColumns(state.all_columns, global_state.projection_ids);
+        }
+        else
+        {
+            output.SetCardinality(output_size);
+
+            WTArrowTableFunction::EnumArrowToDuckDB(state, data.arrow_convert_data, output, data.lines_read - output_size);
+        }
+
+        output.Verify();
+        state.chunk_offset += output.size();
+    }
+
+    void MarkDuplicatesTableFunction::Register(duckdb::ClientContext &context)
+    {
+        TableFunction scan;
+        scan = TableFunction("mark_duplicates", {LogicalType::VARCHAR},
+                             MarkDuplicatesTableFunction::Scan,
+                             MarkDuplicatesTableFunction::TableBind,
+                             MarkDuplicatesTableFunction::InitGlobal,
+                             MarkDuplicatesTableFunction::InitLocal);
+
+        scan.cardinality = ArrowTableFunction::ArrowScanCardinality;
+        scan.get_batch_index = ArrowTableFunction::ArrowGetBatchIndex;
+
+        scan.projection_pushdown = true;
+        scan.filter_pushdown = true;
+
+        auto &catalog = Catalog::GetSystemCatalog(context);
+
+        CreateTableFunctionInfo info(scan);
+
+        catalog.CreateTableFunction(context, &info);
+    };
+
+}
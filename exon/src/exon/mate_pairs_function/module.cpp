@@ -0,0 +1,209 @@
+// Copyright 2023 WHERE TRUE Technologies.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <iostream>
+
+#include <duckdb.hpp>
+#include <duckdb/common/file_system.hpp>
+#include <duckdb/parallel/task_scheduler.hpp>
+
+#include "exon/arrow_table_function/module.hpp"
+#include "exon/mate_pairs_function/module.hpp"
+#include "exon/file_system/module.hpp"
+#include "rust.hpp"
+
+namespace exon
+{
+    struct MatePairsScanFunctionData : public TableFunctionData
+    {
+        string file_name;
+        string region;
+
+        unordered_map<idx_t, unique_ptr<ArrowConvertData>> arrow_convert_data;
+        idx_t max_threads = 6;
+
+        vector<string> all_names;
+
+        atomic<idx_t> lines_read;
+    };
+
+    static void OpenReader(ClientContext &context, const MatePairsScanFunctionData &data, const char *filters,
+                           struct ArrowArrayStream *stream)
+    {
+        auto result = new_mate_pair_reader(stream, data.file_name.c_str(),
+                                           data.region.empty() ? NULL : data.region.c_str(), STANDARD_VECTOR_SIZE,
+                                           TaskScheduler::GetScheduler(context).NumberOfThreads(), filters);
+        if (result.error != NULL)
+        {
+            throw std::runtime_error(result.error);
+        }
+    }
+
+    duckdb::unique_ptr<FunctionData> MatePairsTableFunction::TableBind(ClientContext &context,
+                                                                       TableFunctionBindInput &input,
+                                                                       vector<LogicalType> &return_types,
+                                                                       vector<string> &names)
+    {
+        auto result = make_uniq<MatePairsScanFunctionData>();
+
+        result->file_name = input.inputs[0].GetValue<string>();
+        if (input.inputs.size() > 1)
+        {
+            result->region = input.inputs[1].GetValue<string>();
+        }
+
+        // The records are read straight from the file, which the DuckDB file system can't map.
+        if (ExonFileSystem::Enabled(context) || result->file_name.find("://") != string::npos ||
+            !FileSystem::GetFileSystem(context).FileExists(result->file_name))
+        {
+            throw std::runtime_error("bam_mate_pairs can only read a local file");
+        }
+
+        struct ArrowArrayStream stream;
+        OpenReader(context, *result, NULL, &stream);
+
+        struct ArrowSchema arrow_schema;
+
+        if (stream.get_schema(&stream, &arrow_schema) != 0)
+        {
+            if (stream.release)
+            {
+                stream.release(&stream);
+            }
+            throw std::runtime_error("Failed to get schema");
+        }
+
+        result->all_names.reserve(arrow_schema.n_children);
+
+        LogicalType reference_type;
+        auto n_children = arrow_schema.n_children;
+        for (idx_t col_idx = 0; col_idx < n_children; col_idx++)
+        {
+            auto &schema = *arrow_schema.children[col_idx];
+
+            if (!schema.release)
+            {
+                throw InvalidInputException("arrow_scan: released schema passed");
+            }
+
+            return_types.emplace_back(WTArrowTableFunction::GetArrowColumnType(
+                schema, result->arrow_convert_data, col_idx, result->file_name, "bam", true, NULL, reference_type));
+
+            auto name = string(schema.name);
+            if (name.empty())
+            {
+                name = string("v") + to_string(col_idx);
+            }
+            names.push_back(name);
+
+            result->all_names.push_back(name);
+        }
+
+        RenameArrowColumns(names);
+
+        return std::move(result);
+    };
+
+    unique_ptr<GlobalTableFunctionState> MatePairsTableFunction::InitGlobal(ClientContext &context,
+                                                                            TableFunctionInitInput &input)
+    {
+        auto &data = (MatePairsScanFunctionData &)*input.bind_data;
+
+        auto global_state = make_uniq<ArrowScanGlobalState>();
+
+        string filter_clause = "";
+        if (input.filters)
+        {
+            filter_clause = WTArrowTableFunction::FilterClause(*input.filters, input.column_ids, data.all_names);
+        }
+
+        struct ArrowArrayStream stream;
+        OpenReader(context, data, filter_clause.c_str(), &stream);
+
+        global_state->stream = make_uniq<ArrowArrayStreamWrapper>();
+        global_state->stream->arrow_array_stream = std::move(stream);
+
+        return std::move(global_state);
+    }
+
+    void MatePairsTableFunction::Scan(ClientContext &context, TableFunctionInput &input, DataChunk &output)
+    {
+        if (!input.local_state)
+        {
+            return;
+        }
+        auto &data = (MatePairsScanFunctionData &)*input.bind_data;
+        auto &state = (ArrowScanLocalState &)*input.local_state;
+        auto &global_state = (ArrowScanGlobalState &)*input.global_state;
+
+        //! Out of tuples in this chunk
+        if (state.chunk_offset >= (idx_t)state.chunk->arrow_array.length)
+        {
+            if (!ArrowScanParallelStateNext(context, input.bind_data.get(), state, global_state))
+            {
+                return;
+            }
+        }
+        auto output_size = MinValue<int64_t>(STANDARD_VECTOR_SIZE, state.chunk->arrow_array.length - state.chunk_offset);
+        data.lines_read += output_size;
+
+        if (global_state.CanRemoveFilterColumns())
+        {
+            state.all_columns.Reset();
+            state.all_columns.SetCardinality(output_size);
+            WTArrowTableFunction::EnumArrowToDuckDB(state, data.arrow_convert_data, state.all_columns,
+                                                    data.lines_read - output_size);
+            output.ReferenceColumns(state.all_columns, global_state.projection_ids);
+        }
+        else
+        {
+            output.SetCardinality(output_size);
+
+            WTArrowTableFunction::EnumArrowToDuckDB(state, data.arrow_convert_data, output, data.lines_read - output_size);
+        }
+
+        output.Verify();
+        state.chunk_offset += output.size();
+    }
+
+    void MatePairsTableFunction::Register(duckdb::ClientContext &context)
+    {
+        TableFunctionSet set("bam_mate_pairs");
+
+        TableFunction scan;
+        scan = TableFunction("bam_mate_pairs", {LogicalType::VARCHAR},
+                             MatePairsTableFunction::Scan,
+                             MatePairsTableFunction::TableBind,
+                             MatePairsTableFunction::InitGlobal,
+                             ArrowTableFunction::ArrowScanInitLocal);
+
+        scan.cardinality = ArrowTableFunction::ArrowScanCardinality;
+        scan.get_batch_index = ArrowTableFunction::ArrowGetBatchIndex;
+
+        scan.projection_pushdown = true;
+        scan.filter_pushdown = true;
+
+        set.AddFunction(scan);
+
+        scan.arguments = {LogicalType::VARCHAR, LogicalType::VARCHAR};
+        set.AddFunction(scan);
+
+        auto &catalog = Catalog::GetSystemCatalog(context);
+
+        CreateTableFunctionInfo info(set);
+
+        catalog.CreateTableFunction(context, &info);
+    };
+
+}
@@ -0,0 +1,245 @@
+// Copyright 2023 WHERE TRUE Technologies.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <iostream>
+#include <algorithm>
+
+#include <duckdb.hpp>
+#include <duckdb/common/file_system.hpp>
+
+#include "exon/arrow_table_function/module.hpp"
+#include "exon/merge_sorted_function/module.hpp"
+#include "exon/file_system/module.hpp"
+#include "rust.hpp"
+
+namespace exon
+{
+    struct MergeSortedScanFunctionData : public SortedScanFunctionData
+    {
+        vector<string> file_names;
+
+        unordered_map<idx_t, unique_ptr<ArrowConvertData>> arrow_convert_data;
+        idx_t max_threads = 6;
+
+        vector<string> all_names;
+
+        atomic<idx_t> lines_read;
+    };
+
+    //! Opens the merge of the files, decoding only `columns`, or every column if null.
+    static void OpenReader(const MergeSortedScanFunctionData &data, const vector<string> *columns, const char *filters,
+                           struct ArrowArrayStream *stream)
+    {
+        vector<const char *> file_ptrs;
+        for (auto &file_name : data.file_names)
+        {
+            file_ptrs.push_back(file_name.c_str());
+        }
+
+        vector<const char *> column_ptrs;
+        if (columns)
+        {
+            for (auto &column : *columns)
+            {
+                column_ptrs.push_back(column.c_str());
+            }
+        }
+
+        // A null column list decodes every column, so an empty list still passes a valid pointer.
+        const char *no_column = NULL;
+        auto column_list = !columns ? NULL : column_ptrs.empty() ? &no_column : column_ptrs.data();
+
+        auto result = new_sorted_merge_reader(stream, file_ptrs.data(), file_ptrs.size(), column_list,
+                                              column_ptrs.size(), STANDARD_VECTOR_SIZE, filters);
+        if (result.error != NULL)
+        {
+            throw std::runtime_error(result.error);
+        }
+    }
+
+    duckdb::unique_ptr<FunctionData> MergeSortedTableFunction::TableBind(ClientContext &context,
+                                                                         TableFunctionBindInput &input,
+                                                                         vector<LogicalType> &return_types,
+                                                                         vector<string> &names)
+    {
+        auto result = make_uniq<MergeSortedScanFunctionData>();
+
+        for (auto &file_name : ListValue::GetChildren(input.inputs[0]))
+        {
+            result->file_names.push_back(file_name.GetValue<string>());
+        }
+
+        if (result->file_names.empty())
+        {
+            throw std::runtime_error("merge_sorted needs at least one file");
+        }
+
+        // The records are read straight from the files, which the DuckDB file system can't map.
+        for (auto &file_name : result->file_names)
+        {
+            if (ExonFileSystem::Enabled(context) || file_name.find("://") != string::npos ||
+                !FileSystem::GetFileSystem(context).FileExists(file_name))
+            {
+                throw std::runtime_error("merge_sorted can only read local files");
+            }
+        }
+
+        struct ArrowArrayStream stream;
+        OpenReader(*result, NULL, NULL, &stream);
+
+        struct ArrowSchema arrow_schema;
+
+        if (stream.get_schema(&stream, &arrow_schema) != 0)
+        {
+            if (stream.release)
+            {
+                stream.release(&stream);
+            }
+            throw std::runtime_error("Failed to get schema");
+        }
+
+        result->all_names.reserve(arrow_schema.n_children);
+
+        // The files share their reference sequences, so the first one's header names the ENUM.
+        LogicalType reference_type;
+        auto n_children = arrow_schema.n_children;
+        for (idx_t col_idx = 0; col_idx < n_children; col_idx++)
+        {
+            auto &schema = *arrow_schema.children[col_idx];
+
+            if (!schema.release)
+            {
+                throw InvalidInputException("arrow_scan: released schema passed");
+            }
+
+            return_types.emplace_back(WTArrowTableFunction::GetArrowColumnType(
+                schema, result->arrow_convert_data, col_idx, result->file_names[0], "bam", true, NULL, reference_type));
+
+            auto name = string(schema.name);
+            if (name.empty())
+            {
+                name = string("v") + to_string(col_idx);
+            }
+            names.push_back(name);
+
+            result->all_names.push_back(name);
+        }
+
+        RenameArrowColumns(names);
+
+        // The merge is sorted whatever order the files declare, it fails on a file that isn't.
+        auto reference = std::find(names.begin(), names.end(), "reference");
+        auto start = std::find(names.begin(), names.end(), "start");
+        if (reference != names.end() && start != names.end())
+        {
+            result->sort_columns = {column_t(reference - names.begin()), column_t(start - names.begin())};
+        }
+
+        return std::move(result);
+    };
+
+    unique_ptr<GlobalTableFunctionState> MergeSortedTableFunction::InitGlobal(ClientContext &context,
+                                                                              TableFunctionInitInput &input)
+    {
+        auto &data = (MergeSortedScanFunctionData &)*input.bind_data;
+
+        auto global_state = make_uniq<ArrowScanGlobalState>();
+
+        string filter_clause = "";
+        if (input.filters)
+        {
+            filter_clause = WTArrowTableFunction::FilterClause(*input.filters, input.column_ids, data.all_names);
+        }
+
+        vector<string> columns;
+        for (auto &column_id : input.column_ids)
+        {
+            if (column_id != COLUMN_IDENTIFIER_ROW_ID)
+            {
+                columns.push_back(data.all_names[column_id]);
+            }
+        }
+
+        struct ArrowArrayStream stream;
+        OpenReader(data, &columns, filter_clause.c_str(), &stream);
+
+        global_state->stream = make_uniq<ArrowArrayStreamWrapper>();
+        global_state->stream->arrow_array_stream = std::move(stream);
+
+        return std::move(global_state);
+    }
+
+    void MergeSortedTableFunction::Scan(ClientContext &context, TableFunctionInput &input, DataChunk &output)
+    {
+        if (!input.local_state)
+        {
+            return;
+        }
+        auto &data = (MergeSortedScanFunctionData &)*input.bind_data;
+        auto &state = (ArrowScanLocalState &)*input.local_state;
+        auto &global_state = (ArrowScanGlobalState &)*input.global_state;
+
+        //! Out of tuples in this chunk
+        if (state.chunk_offset >= (idx_t)state.chunk->arrow_array.length)
+        {
+            if (!ArrowScanParallelStateNext(context, input.bind_data.get(), state, global_state))
+            {
+                return;
+            }
+        }
+        auto output_size = MinValue<int64_t>(STANDARD_VECTOR_SIZE, state.chunk->arrow_array.length - state.chunk_offset);
+        data.lines_read += output_size;
+
+        if (global_state.CanRemoveFilterColumns())
+        {
+            state.all_columns.Reset();
+            state.all_columns.SetCardinality(output_size);
+            WTArrowTableFunction::EnumArrowToDuckDB(state, data.arrow_convert_data, state.all_columns,
+                                                    data.lines_read - output_size);
+            output.ReferenceColumns(state.all_columns, global_state.projection_ids);
+        }
+        else
+        {
+            output.SetCardinality(output_size);
+
+            WTArrowTableFunction::EnumArrowToDuckDB(state, data.arrow_convert_data, output, data.lines_read - output_size);
+        }
+
+        output.Verify();
+        state.chunk_offset += output.size();
+    }
+
+    void MergeSortedTableFunction::Register(duckdb::ClientContext &context)
+    {
+        TableFunction scan;
+        scan = TableFunction("merge_sorted", {LogicalType::LIST(LogicalType::VARCHAR)},
+                             MergeSortedTableFunction::Scan,
+                             MergeSortedTableFunction::TableBind,
+                             MergeSortedTableFunction::InitGlobal,
+                             ArrowTableFunction::ArrowScanInitLocal);
+
+        scan.cardinality = ArrowTableFunction::ArrowScanCardinality;
+        scan.get_batch_index = ArrowTableFunction::ArrowGetBatchIndex;
+
+        scan.projection_pushdown = true;
+        scan.filter_pushdown = true;
+
+        auto &catalog = Catalog::GetSystemCatalog(context);
+
+        CreateTableFunctionInfo info(scan);
+
+        catalog.CreateTableFunction(context, &info);
+    };
+
+}
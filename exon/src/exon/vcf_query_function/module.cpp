@@ -22,6 +22,7 @@
 
 #include "exon/arrow_table_function/module.hpp"
 #include "exon/vcf_query_function/module.hpp"
+#include "exon/file_system/module.hpp"
 #include "rust.hpp"
 
 namespace exon
@@ -29,7 +30,13 @@ namespace exon
     struct VCFQueryScanFunctionData : public TableFunctionData
     {
         string file_name;
-        string query;
+        vector<string> regions;
+        bool use_duckdb_file_system = false;
+
+        //! The samples and INFO keys vcf_query(..., samples=, info_fields=) keeps in the formats and info columns,
+        //! read by the local decoder that cuts records down to them.
+        vector<string> samples;
+        vector<string> info_fields;
 
         unordered_map<idx_t, unique_ptr<ArrowConvertData>> arrow_convert_data;
         idx_t max_threads = 6;
@@ -39,6 +46,69 @@ namespace exon
         atomic<idx_t> lines_read;
     };
 
+    //! The region argument is either a single region (or BED path) or a list of them.
+    static vector<string> GetRegions(const Value &value)
+    {
+        vector<string> regions;
+
+        if (value.type().id() == LogicalTypeId::LIST)
+        {
+            for (auto &region : ListValue::GetChildren(value))
+            {
+                if (!region.IsNull())
+                {
+                    regions.push_back(region.GetValue<std::string>());
+                }
+            }
+        }
+        else
+        {
+            regions.push_back(value.GetValue<std::string>());
+        }
+
+        if (regions.empty())
+        {
+            throw std::runtime_error("vcf_query requires at least one region");
+        }
+
+        return regions;
+    }
+
+    static vector<const char *> GetRegionPointers(const vector<string> &regions)
+    {
+        vector<const char *> region_ptrs;
+        for (auto &region : regions)
+        {
+            region_ptrs.push_back(region.c_str());
+        }
+
+        return region_ptrs;
+    }
+
+    //! Opens the query's stream, applying the SQL `filters`. With samples or INFO keys, the local file is read by
+    //! new_subset_reader, which decodes the genotypes and INFO values only if `columns` is null or names them.
+    static void OpenReader(ClientContext &context, const VCFQueryScanFunctionData &data, const vector<string> *columns,
+                           const char *filters, struct ArrowArrayStream *stream)
+    {
+        if (!data.samples.empty() || !data.info_fields.empty())
+        {
+            WTArrowTableFunction::OpenSubsetReader(context, data.file_name, "vcf", data.samples, data.info_fields,
+                                                   data.regions, columns, filters, stream);
+            return;
+        }
+
+        auto region_ptrs = GetRegionPointers(data.regions);
+        auto file_system = ExonFileSystem::GetFFI(context);
+
+        auto vcf_query_reader_result = vcf_query_reader(stream, data.file_name.c_str(), region_ptrs.data(), region_ptrs.size(),
+                                                        STANDARD_VECTOR_SIZE, data.use_duckdb_file_system ? &file_system : NULL,
+                                                        filters);
+        if (vcf_query_reader_result.error != NULL)
+        {
+            throw std::runtime_error(vcf_query_reader_result.error);
+        }
+    }
+
     duckdb::unique_ptr<FunctionData> VCFQueryTableFunction::TableBind(ClientContext &context,
                                                                       TableFunctionBindInput &input,
                                                                       vector<LogicalType> &return_types,
@@ -46,20 +116,48 @@ namespace exon
     {
         auto result = make_uniq<VCFQueryScanFunctionData>();
 
-        auto file_name = input.inputs[0].GetValue<std::string>();
-        auto query = input.inputs[1].GetValue<std::string>();
-
-        struct ArrowArrayStream stream;
-        auto vector_size = STANDARD_VECTOR_SIZE;
+        result->file_name = input.inputs[0].GetValue<std::string>();
+        result->regions = GetRegions(input.inputs[1]);
+        result->use_duckdb_file_system = ExonFileSystem::Enabled(context);
 
-        // VCFQueryReaderResult vcf_query_reader_result
-        auto vcf_query_reader_result = vcf_query_reader(&stream, file_name.c_str(), query.c_str(), vector_size);
+        for (auto &kv : input.named_parameters)
+        {
+            if (kv.first == "samples")
+            {
+                for (auto &sample : ListValue::GetChildren(kv.second))
+                {
+                    result->samples.push_back(sample.GetValue<string>());
+                }
+
+                if (result->samples.empty())
+                {
+                    throw std::runtime_error("samples must name at least one sample");
+                }
+            }
+            else if (kv.first == "info_fields")
+            {
+                for (auto &info_field : ListValue::GetChildren(kv.second))
+                {
+                    result->info_fields.push_back(info_field.GetValue<string>());
+                }
+
+                if (result->info_fields.empty())
+                {
+                    throw std::runtime_error("info_fields must name at least one INFO field");
+                }
+            }
+        }
 
-        if (vcf_query_reader_result.error != NULL)
+        auto subset = !result->samples.empty() || !result->info_fields.empty();
+        if (subset && (result->use_duckdb_file_system || result->file_name.find("://") != string::npos ||
+                                         !FileSystem::GetFileSystem(context).FileExists(result->file_name)))
         {
-            throw std::runtime_error(vcf_query_reader_result.error);
+            throw std::runtime_error("samples and info_fields can only be selected from a local file");
         }
 
+        struct ArrowArrayStream stream;
+        OpenReader(context, *result, NULL, NULL, &stream);
+
         struct ArrowSchema arrow_schema;
 
         if (stream.get_schema(&stream, &arrow_schema) != 0)
@@ -73,6 +171,10 @@ namespace exon
 
         result->all_names.reserve(arrow_schema.n_children);
 
+        auto file_system = ExonFileSystem::GetFFI(context);
+        auto file_system_ptr = result->use_duckdb_file_system ? &file_system : NULL;
+
+        LogicalType reference_type;
         auto n_children = arrow_schema.n_children;
         for (idx_t col_idx = 0; col_idx < n_children; col_idx++)
         {
@@ -83,8 +185,9 @@ namespace exon
                 throw InvalidInputException("arrow_scan: released schema passed");
             }
 
-            // TODO: handle dictionary
-            return_types.emplace_back(GetArrowLogicalType(schema, result->arrow_convert_data, col_idx));
+            return_types.emplace_back(WTArrowTableFunction::GetArrowColumnType(
+                schema, result->arrow_convert_data, col_idx, result->file_name, "vcf", false, file_system_ptr,
+                reference_type));
 
             auto format = string(schema.format);
             auto name = string(schema.name);
@@ -99,9 +202,6 @@ namespace exon
 
         RenameArrowColumns(names);
 
-        result->file_name = file_name;
-        result->query = query;
-
         return std::move(result);
     };
 
@@ -112,18 +212,25 @@ namespace exon
 
         auto global_state = make_uniq<ArrowScanGlobalState>();
 
-        struct ArrowArrayStream stream;
-
-        auto file_name = data.file_name;
-        auto query = data.query;
-        auto vector_size = STANDARD_VECTOR_SIZE;
+        vector<string> columns;
+        for (auto &column_id : input.column_ids)
+        {
+            if (column_id != COLUMN_IDENTIFIER_ROW_ID)
+            {
+                columns.push_back(data.all_names[column_id]);
+            }
+        }
 
-        auto vcf_query_reader_result = vcf_query_reader(&stream, file_name.c_str(), query.c_str(), vector_size);
-        if (vcf_query_reader_result.error != NULL)
+        // DuckDB drops the filters it pushes down from the plan, so the reader applies them.
+        string filter_clause = "";
+        if (input.filters)
         {
-            throw std::runtime_error(vcf_query_reader_result.error);
+            filter_clause = WTArrowTableFunction::FilterClause(*input.filters, input.column_ids, data.all_names);
         }
 
+        struct ArrowArrayStream stream;
+        OpenReader(context, data, &columns, filter_clause.c_str(), &stream);
+
         global_state->stream = make_uniq<ArrowArrayStreamWrapper>();
         global_state->stream->arrow_array_stream = std::move(stream);
 
@@ -155,14 +262,15 @@ namespace exon
         {
             state.all_columns.Reset();
             state.all_columns.SetCardinality(output_size);
-            ArrowToDuckDB(state, data.arrow_convert_data, state.all_columns, data.lines_read - output_size, false);
+            WTArrowTableFunction::EnumArrowToDuckDB(state, data.arrow_convert_data, state.all_columns,
+                                                    data.lines_read - output_size);
             output.ReferenceColumns(state.all_columns, global_state.projection_ids);
         }
         else
         {
             output.SetCardinality(output_size);
 
-            ArrowToDuckDB(state, data.arrow_convert_data, output, data.lines_read - output_size, false);
+            WTArrowTableFunction::EnumArrowToDuckDB(state, data.arrow_convert_data, output, data.lines_read - output_size);
         }
 
         output.Verify();
@@ -171,6 +279,7 @@ namespace exon
 
     void VCFQueryTableFunction::Register(duckdb::ClientContext &context)
     {
+        TableFunctionSet set("vcf_query");
 
         TableFunction scan;
         scan = TableFunction("vcf_query", {LogicalType::VARCHAR, LogicalType::VARCHAR},
@@ -185,9 +294,17 @@ namespace exon
         scan.projection_pushdown = true;
         scan.filter_pushdown = true;
 
+        scan.named_parameters["samples"] = LogicalType::LIST(LogicalType::VARCHAR);
+        scan.named_parameters["info_fields"] = LogicalType::LIST(LogicalType::VARCHAR);
+
+        set.AddFunction(scan);
+
+        scan.arguments = {LogicalType::VARCHAR, LogicalType::LIST(LogicalType::VARCHAR)};
+        set.AddFunction(scan);
+
         auto &catalog = Catalog::GetSystemCatalog(context);
 
-        CreateTableFunctionInfo info(scan);
+        CreateTableFunctionInfo info(set);
 
         catalog.CreateTableFunction(context, &info);
     };
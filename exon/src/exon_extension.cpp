@@ -6,10 +6,20 @@
 #include "exon/sequence_functions/module.hpp"
 #include "exon/gff_functions/module.hpp"
 #include "exon/fastq_functions/module.hpp"
+#include "exon/fasta_functions/module.hpp"
+#include "exon/index_functions/module.hpp"
+#include "exon/copy_functions/module.hpp"
 #include "exon/vcf_query_function/module.hpp"
 #include "exon/bcf_query_function/module.hpp"
 #include "exon/bam_query_function/module.hpp"
+#include "exon/cram_query_function/module.hpp"
+#include "exon/fetch_function/module.hpp"
+#include "exon/genotype_matrix_function/module.hpp"
+#include "exon/merge_sorted_function/module.hpp"
+#include "exon/mate_pairs_function/module.hpp"
+#include "exon/mark_duplicates_function/module.hpp"
 #include "exon/core/module.hpp"
+#include "exon/file_system/module.hpp"
 
 #if defined(WFA2_ENABLED)
 #include "exon/alignment_functions/module.hpp"
@@ -32,6 +42,8 @@ namespace duckdb
 
 		auto &config = DBConfig::GetConfig(context);
 
+		exon::ExonFileSystem::RegisterSettings(config);
+
 		auto get_sam_functions = exon::SamFunctions::GetSamFunctions();
 		for (auto &func : get_sam_functions)
 		{
@@ -51,6 +63,7 @@ namespace duckdb
 		exon::WTArrowTableFunction::Register("read_fastq", "fastq", context);
 		exon::WTArrowTableFunction::Register("read_sam_file_records", "sam", context);
 		exon::WTArrowTableFunction::Register("read_bam_file_records", "bam", context);
+		exon::WTArrowTableFunction::Register("read_cram_file_records", "cram", context);
 		exon::WTArrowTableFunction::Register("read_bed_file", "bed", context);
 		exon::WTArrowTableFunction::Register("read_vcf_file_records", "vcf", context);
 		exon::WTArrowTableFunction::Register("read_bcf_file_records", "bcf", context);
@@ -60,6 +73,33 @@ namespace duckdb
 		auto get_quality_scores_string_to_list = exon::FastqFunctions::GetQualityScoreStringToList();
 		catalog.CreateFunction(context, *get_quality_scores_string_to_list);
 
+		auto fasta_fetch = exon::FastaFunctions::GetFastaFetchFunction();
+		catalog.CreateFunction(context, *fasta_fetch);
+
+		auto fasta_query = exon::FastaFunctions::GetFastaQueryTableFunction();
+		catalog.CreateTableFunction(context, fasta_query.get());
+
+		auto bam_index_stats = exon::IndexFunctions::GetIndexStatsTableFunction("bam_index_stats", "bam");
+		catalog.CreateTableFunction(context, bam_index_stats.get());
+
+		auto vcf_index_stats = exon::IndexFunctions::GetIndexStatsTableFunction("vcf_index_stats", "vcf");
+		catalog.CreateTableFunction(context, vcf_index_stats.get());
+
+		auto bcf_index_stats = exon::IndexFunctions::GetIndexStatsTableFunction("bcf_index_stats", "bcf");
+		catalog.CreateTableFunction(context, bcf_index_stats.get());
+
+		auto exon_index = exon::IndexFunctions::GetBuildIndexTableFunction();
+		catalog.CreateTableFunction(context, exon_index.get());
+
+		auto exon_build_name_index = exon::IndexFunctions::GetBuildNameIndexTableFunction();
+		catalog.CreateTableFunction(context, exon_build_name_index.get());
+
+		for (auto file_format : {"fasta", "fastq", "gff", "bed", "vcf", "bam"})
+		{
+			auto copy_function = exon::CopyFunctions::GetCopyFunction(file_format);
+			catalog.CreateCopyFunction(context, *copy_function);
+		}
+
 		auto gff_parse_attributes = exon::GFFunctions::GetGFFParseAttributesFunction();
 		catalog.CreateFunction(context, gff_parse_attributes);
 
@@ -75,9 +115,24 @@ namespace duckdb
 		exon::VCFQueryTableFunction::Register(context);
 		exon::BCFQueryTableFunction::Register(context);
 		exon::BAMQueryTableFunction::Register(context);
+		exon::CRAMQueryTableFunction::Register(context);
+		exon::FetchTableFunction::Register("bam_fetch", "bam", context);
+		exon::FetchTableFunction::Register("vcf_fetch", "vcf", context);
+		exon::GenotypeMatrixTableFunction::Register(context);
+		exon::MergeSortedTableFunction::Register(context);
+		exon::MatePairsTableFunction::Register(context);
+		exon::MarkDuplicatesTableFunction::Register(context);
 
 		config.replacement_scans.emplace_back(exon::WTArrowTableFunction::ReplacementScan);
 
+		OptimizerExtension count_optimizer;
+		count_optimizer.optimize_function = exon::WTArrowTableFunction::OptimizeIndexCount;
+		config.optimizer_extensions.push_back(count_optimizer);
+
+		OptimizerExtension sort_optimizer;
+		sort_optimizer.optimize_function = exon::WTArrowTableFunction::OptimizeSortedScan;
+		config.optimizer_extensions.push_back(sort_optimizer);
+
 #if defined(WFA2_ENABLED)
 		auto get_align_function = exondb::AlignmentFunctions::GetAlignmentStringFunction("alignment_string_wfa_gap_affine");
 		catalog.CreateFunction(context, get_align_function);
@@ -24,6 +24,7 @@ fn main() {
 
     cbindgen::Builder::new()
         .with_crate(crate_dir)
+        .with_pragma_once(true)
         // .with_header("#include <arrow/c/abi.h>")
         .generate()
         .expect("Unable to generate bindings")
@@ -19,9 +19,13 @@ use std::{
     sync::Arc,
 };
 
-use arrow::ffi_stream::FFI_ArrowArrayStream as ArrowArrayStream;
+use arrow::{datatypes::DataType, ffi_stream::FFI_ArrowArrayStream as ArrowArrayStream};
 use datafusion::{
-    datasource::file_format::file_type::FileCompressionType, prelude::SessionContext,
+    common::DFField,
+    datasource::file_format::file_type::FileCompressionType,
+    error::DataFusionError,
+    logical_expr::{cast, Expr},
+    prelude::{DataFrame, SessionContext},
 };
 use exon::{
     datasources::{ExonFileType, ExonReadOptions},
@@ -30,11 +34,89 @@ use exon::{
 };
 use tokio::runtime::Runtime;
 
+use crate::{
+    block_cache::register_block_cache,
+    duckdb_file_system::{register_duckdb_file_system, DuckDBFileSystem},
+};
+
 #[repr(C)]
 pub struct ReaderResult {
     error: *const c_char,
 }
 
+/// The compression of `uri`, parsed from `compression` or, if that is null, inferred from the file
+/// extension.
+pub(crate) unsafe fn infer_compression(
+    uri: &str,
+    compression: *const c_char,
+) -> Result<FileCompressionType, String> {
+    if compression.is_null() {
+        let extension = match uri.split('.').last() {
+            Some(extension) => extension,
+            None => return Err("could not parse extension".to_string()),
+        };
+
+        return Ok(match extension {
+            "gz" => FileCompressionType::GZIP,
+            "zst" => FileCompressionType::ZSTD,
+            _ => FileCompressionType::UNCOMPRESSED,
+        });
+    }
+
+    let compression = match CStr::from_ptr(compression).to_str() {
+        Ok(compression) => compression,
+        Err(e) => return Err(format!("could not parse compression: {}", e)),
+    };
+
+    Ok(FileCompressionType::from_str(compression).unwrap_or(FileCompressionType::UNCOMPRESSED))
+}
+
+/// Columns of `file_format` files with few distinct values, e.g. GFF feature types and strands.
+fn dictionary_columns(file_format: &str) -> &'static [&'static str] {
+    match file_format.to_lowercase().as_str() {
+        "gff" | "gtf" => &["seqname", "source", "type", "strand"],
+        "bed" => &["reference_sequence_name", "strand"],
+        "sam" | "bam" => &["reference", "mate_reference"],
+        "vcf" | "bcf" => &["chrom"],
+        _ => &[],
+    }
+}
+
+/// `df` with the text columns listed by `dictionary_columns` dictionary-encoded, so DuckDB reads
+/// each distinct value once per batch and compares the rest by key. The exon readers build plain
+/// string arrays, so this costs a hashing pass over each of those columns per batch.
+pub(crate) fn encode_dictionaries(
+    df: DataFrame,
+    file_format: &str,
+) -> Result<DataFrame, DataFusionError> {
+    let columns = dictionary_columns(file_format);
+    let encoded = |field: &DFField| {
+        columns.contains(&field.name().as_str()) && field.data_type() == &DataType::Utf8
+    };
+
+    if !df.schema().fields().iter().any(encoded) {
+        return Ok(df);
+    }
+
+    let exprs = df
+        .schema()
+        .fields()
+        .iter()
+        .map(|field| {
+            let column = Expr::Column(field.qualified_column());
+            if encoded(field) {
+                let dictionary =
+                    DataType::Dictionary(Box::new(DataType::Int32), Box::new(DataType::Utf8));
+                cast(column, dictionary).alias(field.name())
+            } else {
+                column
+            }
+        })
+        .collect::<Vec<_>>();
+
+    df.select(exprs)
+}
+
 #[no_mangle]
 pub unsafe extern "C" fn new_reader(
     stream_ptr: *mut ArrowArrayStream,
@@ -43,6 +125,7 @@ pub unsafe extern "C" fn new_reader(
     compression: *const c_char,
     file_format: *const c_char,
     filters: *const c_char,
+    file_system: *const DuckDBFileSystem,
 ) -> ReaderResult {
     let uri = match CStr::from_ptr(uri).to_str() {
         Ok(uri) => uri,
@@ -56,45 +139,22 @@ pub unsafe extern "C" fn new_reader(
 
     let rt = Arc::new(Runtime::new().unwrap());
 
-    // if compression is null, try to infer from file extension
-    let compression_type = if compression.is_null() {
-        let extension = match uri.split('.').last() {
-            Some(extension) => extension,
-            None => {
-                let error = CString::new("could not parse extension").unwrap();
-                return ReaderResult {
-                    error: error.into_raw(),
-                };
-            }
-        };
-
-        match extension {
-            "gz" => FileCompressionType::GZIP,
-            "zst" => FileCompressionType::ZSTD,
-            _ => FileCompressionType::UNCOMPRESSED,
+    let compression_type = match infer_compression(uri, compression) {
+        Ok(compression_type) => compression_type,
+        Err(e) => {
+            let error = CString::new(e).unwrap();
+            return ReaderResult {
+                error: error.into_raw(),
+            };
         }
-    } else {
-        let compression = match CStr::from_ptr(compression).to_str() {
-            Ok(compression) => compression,
-            Err(e) => {
-                let error = CString::new(format!("could not parse compression: {}", e)).unwrap();
-                return ReaderResult {
-                    error: error.into_raw(),
-                };
-            }
-        };
-
-        let compression =
-            FileCompressionType::from_str(compression).unwrap_or(FileCompressionType::UNCOMPRESSED);
-
-        compression
     };
 
-    let file_type = CStr::from_ptr(file_format).to_str().unwrap();
-    let file_type = match ExonFileType::from_str(file_type) {
+    let file_type_name = CStr::from_ptr(file_format).to_str().unwrap();
+    let file_type = match ExonFileType::from_str(file_type_name) {
         Ok(file_type) => file_type,
         Err(_) => {
-            let error = CString::new(format!("could not parse file_format {}", file_type)).unwrap();
+            let error =
+                CString::new(format!("could not parse file_format {}", file_type_name)).unwrap();
             return ReaderResult {
                 error: error.into_raw(),
             };
@@ -105,7 +165,19 @@ pub unsafe extern "C" fn new_reader(
     let ctx = SessionContext::with_config_exon(config);
 
     rt.block_on(async {
-        if let Err(e) = ctx.runtime_env().exon_register_object_store_uri(uri).await {
+        let registered = if file_system.is_null() {
+            ctx.runtime_env()
+                .exon_register_object_store_uri(uri)
+                .await
+                .map(|_| ())
+                .map_err(|e| e.to_string())
+        } else {
+            register_duckdb_file_system(&ctx, uri, *file_system)
+                .map(|_| ())
+                .map_err(|e| e.to_string())
+        };
+
+        if let Err(e) = registered {
             return ReaderResult {
                 error: CString::new(format!("could not register object store: {}", e))
                     .unwrap()
@@ -113,6 +185,13 @@ pub unsafe extern "C" fn new_reader(
             };
         }
 
+        if let Err(e) = register_block_cache(&ctx, uri) {
+            let error = CString::new(format!("could not register block cache: {}", e)).unwrap();
+            return ReaderResult {
+                error: error.into_raw(),
+            };
+        }
+
         let options = ExonReadOptions::new(file_type).with_compression(compression_type);
 
         if let Err(e) = ctx.register_exon_table("exon_table", uri, options).await {
@@ -140,7 +219,11 @@ pub unsafe extern "C" fn new_reader(
             }
         }
 
-        let df = match ctx.sql(&select_string).await {
+        let df = match ctx
+            .sql(&select_string)
+            .await
+            .and_then(|df| encode_dictionaries(df, file_type_name))
+        {
             Ok(df) => df,
             Err(e) => {
                 let error = CString::new(format!("could not execute sql: {}", e)).unwrap();
@@ -195,3 +278,44 @@ pub unsafe extern "C" fn replacement_scan(uri: *const c_char) -> ReplacementScan
         }
     }
 }
+
+#[cfg(test)]
+mod tests {
+    use arrow::{
+        array::{AsArray, Int64Array, StringArray},
+        datatypes::{Field, Int32Type, Schema},
+        record_batch::RecordBatch,
+    };
+
+    use super::*;
+
+    #[test]
+    fn encode_dictionaries_keys_listed_columns() {
+        let schema = Arc::new(Schema::new(vec![
+            Field::new("type", DataType::Utf8, true),
+            Field::new("attributes", DataType::Utf8, true),
+            Field::new("start", DataType::Int64, false),
+        ]));
+        let batch = RecordBatch::try_new(
+            schema,
+            vec![
+                Arc::new(StringArray::from(vec!["exon", "gene", "exon"])),
+                Arc::new(StringArray::from(vec!["a", "b", "c"])),
+                Arc::new(Int64Array::from(vec![1, 2, 3])),
+            ],
+        )
+        .unwrap();
+
+        let ctx = SessionContext::new();
+        let df = encode_dictionaries(ctx.read_batch(batch).unwrap(), "gff").unwrap();
+        let batches = Runtime::new().unwrap().block_on(df.collect()).unwrap();
+
+        let types = batches[0].column(0).as_dictionary::<Int32Type>();
+        assert_eq!(types.keys().values().to_vec(), vec![0, 1, 0]);
+        assert_eq!(types.values().len(), 2);
+
+        // Columns that aren't listed, or aren't text, are left alone.
+        assert_eq!(batches[0].column(1).data_type(), &DataType::Utf8);
+        assert_eq!(batches[0].column(2).data_type(), &DataType::Int64);
+    }
+}
@@ -0,0 +1,940 @@
+// Copyright 2023 WHERE TRUE Technologies.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+//! Decodes BAM records straight from the uncompressed BGZF stream into the columns of
+//! `read_bam_file_records`.
+
+use std::{fmt::Write, io, ops::Range, sync::Arc};
+
+use arrow::{
+    array::{
+        new_null_array, ArrayRef, Float32Builder, Int32Builder, Int32DictionaryArray, Int64Builder,
+        StringArray, StringBuilder,
+    },
+    datatypes::{DataType, Field, Schema, SchemaRef},
+    record_batch::RecordBatch,
+};
+
+use crate::{
+    bgzf::BgzfRead,
+    index_builder::{le_i32, le_u16, le_u32},
+};
+
+fn invalid_data<E: Into<Box<dyn std::error::Error + Send + Sync>>>(e: E) -> io::Error {
+    io::Error::new(io::ErrorKind::InvalidData, e)
+}
+
+/// The column holding the BGZF virtual offset of each record, when requested.
+pub const VIRTUAL_OFFSET_COLUMN: &str = "virtual_offset";
+
+/// The columns of `read_bam_file_records`, optionally followed by the virtual offset of each
+/// record.
+pub fn bam_schema(virtual_offset: bool) -> SchemaRef {
+    let mut fields = vec![
+        Field::new("name", DataType::Utf8, false),
+        Field::new("flag", DataType::Int32, false),
+        Field::new("reference", DataType::Utf8, true),
+        Field::new("start", DataType::Int32, true),
+        Field::new("end", DataType::Int32, true),
+        Field::new("mapping_quality", DataType::Utf8, true),
+        Field::new("cigar", DataType::Utf8, false),
+        Field::new("mate_reference", DataType::Utf8, true),
+        Field::new("sequence", DataType::Utf8, false),
+        Field::new("quality_score", DataType::Utf8, false),
+    ];
+
+    if virtual_offset {
+        fields.push(Field::new(VIRTUAL_OFFSET_COLUMN, DataType::Int64, false));
+    }
+
+    Arc::new(Schema::new(fields))
+}
+
+/// `schema` with a column per aux tag in `tags`, named after the tag, before the virtual offset
+/// column if it has one.
+pub fn with_tag_fields(schema: &Schema, tags: &[(String, DataType)]) -> SchemaRef {
+    let mut fields = schema
+        .fields()
+        .iter()
+        .map(|field| field.as_ref().clone())
+        .collect::<Vec<_>>();
+
+    let position = schema
+        .index_of(VIRTUAL_OFFSET_COLUMN)
+        .unwrap_or(fields.len());
+    for (i, (tag, data_type)) in tags.iter().enumerate() {
+        fields.insert(position + i, Field::new(tag, data_type.clone(), true));
+    }
+
+    Arc::new(Schema::new(fields))
+}
+
+/// `schema` with its reference and mate reference columns dictionary-encoded: keys into every
+/// reference sequence of the header, in order, the same dictionary for every batch.
+pub fn with_reference_dictionary(schema: &Schema) -> SchemaRef {
+    let fields = schema
+        .fields()
+        .iter()
+        .enumerate()
+        .map(|(i, field)| {
+            if i == REFERENCE || i == MATE_REFERENCE {
+                Field::new(
+                    field.name(),
+                    DataType::Dictionary(Box::new(DataType::Int32), Box::new(DataType::Utf8)),
+                    field.is_nullable(),
+                )
+            } else {
+                field.as_ref().clone()
+            }
+        })
+        .collect::<Vec<_>>();
+
+    Arc::new(Schema::new(fields))
+}
+
+/// The column type of an aux tag of SAM type `kind`: integers as Int64, floats as Float32 and
+/// everything else, arrays included, as their SAM text.
+pub fn tag_data_type(kind: u8) -> DataType {
+    match kind {
+        b'c' | b'C' | b's' | b'S' | b'i' | b'I' => DataType::Int64,
+        b'f' => DataType::Float32,
+        _ => DataType::Utf8,
+    }
+}
+
+/// Reads the SAM types of `tags` from the aux fields of the records at `reader`, stopping once
+/// every tag has been seen or `max_records` have been read. Tags never seen have no type.
+pub fn read_tag_types<R: BgzfRead + ?Sized>(
+    reader: &mut R,
+    tags: &[[u8; 2]],
+    max_records: usize,
+) -> io::Result<Vec<Option<u8>>> {
+    let mut kinds = vec![None; tags.len()];
+    let mut record = vec![];
+
+    for _ in 0..max_records {
+        if kinds.iter().all(Option::is_some) || !read_bam_record(reader, &mut record)? {
+            break;
+        }
+
+        let aux_start = aux_start(&record)?;
+        walk_aux(&record[aux_start..], |tag, kind, _| {
+            if let Some(i) = tags.iter().position(|wanted| *wanted == tag) {
+                kinds[i].get_or_insert(kind);
+            }
+        })?;
+    }
+
+    Ok(kinds)
+}
+
+/// The offset of the aux fields in a whole record.
+fn aux_start(record: &[u8]) -> io::Result<usize> {
+    if record.len() < 32 {
+        return Err(invalid_data("truncated BAM record"));
+    }
+
+    let l_read_name = record[8] as usize;
+    let n_cigar_op = le_u16(&record[12..]) as usize;
+    let l_seq = le_u32(&record[16..]) as usize;
+
+    let start = 32 + l_read_name + n_cigar_op * 4 + (l_seq + 1) / 2 + l_seq;
+    if record.len() < start {
+        return Err(invalid_data("truncated BAM record"));
+    }
+
+    Ok(start)
+}
+
+/// The SAM type and value bytes of the aux field `tag` of a whole record, if it has one.
+pub(crate) fn record_tag(record: &[u8], tag: [u8; 2]) -> io::Result<Option<(u8, &[u8])>> {
+    let aux = &record[aux_start(record)?..];
+
+    let mut found = None;
+    walk_aux(aux, |field, kind, range| {
+        if field == tag && found.is_none() {
+            found = Some((kind, range));
+        }
+    })?;
+
+    Ok(found.map(|(kind, range)| (kind, &aux[range])))
+}
+
+/// Calls `f` with the tag, SAM type and value bytes of each aux field in `data`.
+fn walk_aux<F>(data: &[u8], mut f: F) -> io::Result<()>
+where
+    F: FnMut([u8; 2], u8, Range<usize>),
+{
+    let truncated = || invalid_data("truncated BAM aux field");
+    let mut i = 0;
+
+    while i < data.len() {
+        if i + 3 > data.len() {
+            return Err(truncated());
+        }
+
+        let tag = [data[i], data[i + 1]];
+        let kind = data[i + 2];
+        let start = i + 3;
+
+        let end = match kind {
+            b'A' | b'c' | b'C' => start + 1,
+            b's' | b'S' => start + 2,
+            b'i' | b'I' | b'f' => start + 4,
+            b'Z' | b'H' => match data[start..].iter().position(|b| *b == 0) {
+                Some(n) => start + n + 1,
+                None => return Err(truncated()),
+            },
+            b'B' => {
+                let header = data.get(start..start + 5).ok_or_else(truncated)?;
+                let size = match header[0] {
+                    b'c' | b'C' => 1,
+                    b's' | b'S' => 2,
+                    b'i' | b'I' | b'f' => 4,
+                    _ => return Err(invalid_data("invalid BAM aux array type")),
+                };
+
+                start + 5 + size * le_u32(&header[1..]) as usize
+            }
+            _ => return Err(invalid_data("invalid BAM aux field type")),
+        };
+
+        if end > data.len() {
+            return Err(truncated());
+        }
+
+        f(tag, kind, start..end);
+        i = end;
+    }
+
+    Ok(())
+}
+
+/// The value of an integer aux field of SAM type `kind`.
+fn aux_integer(kind: u8, value: &[u8]) -> Option<i64> {
+    match kind {
+        b'c' => Some(value[0] as i8 as i64),
+        b'C' => Some(value[0] as i64),
+        b's' => Some(le_u16(value) as i16 as i64),
+        b'S' => Some(le_u16(value) as i64),
+        b'i' => Some(le_i32(value) as i64),
+        b'I' => Some(le_u32(value) as i64),
+        _ => None,
+    }
+}
+
+/// Writes an aux field value of SAM type `kind` to `text` as SAM does, e.g. `c,1,2` for arrays.
+fn write_aux_text(kind: u8, value: &[u8], text: &mut String) {
+    match kind {
+        b'A' => text.push(value[0] as char),
+        b'Z' | b'H' => {
+            let value = value.strip_suffix(b"\0").unwrap_or(value);
+            text.push_str(&String::from_utf8_lossy(value));
+        }
+        b'f' => {
+            let _ = write!(text, "{}", f32::from_bits(le_u32(value)));
+        }
+        b'B' => {
+            let subtype = value[0];
+            let size = match subtype {
+                b'c' | b'C' => 1,
+                b's' | b'S' => 2,
+                _ => 4,
+            };
+
+            text.push(subtype as char);
+            for element in value[5..].chunks_exact(size) {
+                text.push(',');
+                write_aux_text(subtype, element, text);
+            }
+        }
+        _ => {
+            if let Some(integer) = aux_integer(kind, value) {
+                let _ = write!(text, "{}", integer);
+            }
+        }
+    }
+}
+
+/// A projected aux tag column.
+struct TagColumn {
+    tag: [u8; 2],
+    values: TagValues,
+}
+
+enum TagValues {
+    Integer(Int64Builder),
+    Float(Float32Builder),
+    Text(StringBuilder),
+}
+
+impl TagColumn {
+    fn new(field: &Field) -> Self {
+        let name = field.name().as_bytes();
+        let tag = [
+            name.first().copied().unwrap_or(0),
+            name.get(1).copied().unwrap_or(0),
+        ];
+
+        let values = match field.data_type() {
+            DataType::Int64 => TagValues::Integer(Int64Builder::new()),
+            DataType::Float32 => TagValues::Float(Float32Builder::new()),
+            _ => TagValues::Text(StringBuilder::new()),
+        };
+
+        Self { tag, values }
+    }
+
+    /// Appends the value of SAM type `kind`, or null if the record has no such tag or its value
+    /// doesn't fit the column's type.
+    fn append(&mut self, value: Option<(u8, &[u8])>, text: &mut String) {
+        match (&mut self.values, value) {
+            (TagValues::Integer(values), Some((kind, value))) => {
+                values.append_option(aux_integer(kind, value))
+            }
+            (TagValues::Float(values), Some((kind, value))) => values.append_option(match kind {
+                b'f' => Some(f32::from_bits(le_u32(value))),
+                _ => aux_integer(kind, value).map(|integer| integer as f32),
+            }),
+            (TagValues::Text(values), Some((kind, value))) => {
+                text.clear();
+                write_aux_text(kind, value, text);
+                values.append_value(text.as_str());
+            }
+            (TagValues::Integer(values), None) => values.append_null(),
+            (TagValues::Float(values), None) => values.append_null(),
+            (TagValues::Text(values), None) => values.append_null(),
+        }
+    }
+
+    fn finish(&mut self) -> ArrayRef {
+        match &mut self.values {
+            TagValues::Integer(values) => Arc::new(values.finish()),
+            TagValues::Float(values) => Arc::new(values.finish()),
+            TagValues::Text(values) => Arc::new(values.finish()),
+        }
+    }
+}
+
+/// Reads the header at the start of a BAM file, returning the reference sequence names.
+pub fn read_bam_header<R: BgzfRead + ?Sized>(reader: &mut R) -> io::Result<Vec<String>> {
+    read_bam_header_text(reader).map(|(_, names)| names)
+}
+
+/// Reads the header at the start of a BAM file, returning its SAM text and the reference
+/// sequence names.
+pub fn read_bam_header_text<R: BgzfRead + ?Sized>(
+    reader: &mut R,
+) -> io::Result<(String, Vec<String>)> {
+    let mut buf = vec![];
+
+    reader.read_header(4, &mut buf)?;
+    if buf != b"BAM\x01" {
+        return Err(invalid_data("not a BAM file"));
+    }
+
+    reader.read_header(4, &mut buf)?;
+    let l_text = le_u32(&buf) as usize;
+    reader.read_header(l_text, &mut buf)?;
+
+    let text = String::from_utf8_lossy(&buf);
+    let text = text.trim_end_matches('\0').to_string();
+
+    reader.read_header(4, &mut buf)?;
+    let reference_count = le_u32(&buf) as usize;
+
+    let mut names = Vec::with_capacity(reference_count);
+    for _ in 0..reference_count {
+        reader.read_header(4, &mut buf)?;
+        let l_name = le_u32(&buf) as usize;
+        reader.read_header(l_name + 4, &mut buf)?;
+
+        let name = &buf[..l_name];
+        let name = name.strip_suffix(b"\0").unwrap_or(name);
+        names.push(String::from_utf8_lossy(name).into_owned());
+    }
+
+    Ok((text, names))
+}
+
+/// Whether the SAM header `text` declares its records sorted by coordinate, `@HD SO:coordinate`.
+pub fn is_coordinate_sorted(text: &str) -> bool {
+    text.lines()
+        .filter(|line| line.starts_with("@HD\t"))
+        .flat_map(|line| line.split('\t'))
+        .any(|field| field == "SO:coordinate")
+}
+
+/// How much of each record a scan reads, set by the columns it decodes. The rest of the record
+/// is skipped by its length without being copied.
+#[derive(Clone, Copy, Debug, PartialEq, Eq, PartialOrd, Ord)]
+pub enum RecordExtent {
+    /// Nothing past the length, e.g. for `COUNT(*)`.
+    Length,
+    /// The fixed-length fields: reference ids, position, mapping quality and flag.
+    Fixed,
+    /// Up to the end of the CIGAR, for the name, CIGAR and end position.
+    Cigar,
+    /// The whole record, for the sequence and quality scores.
+    All,
+}
+
+/// Appends the next `n` bytes to `buf`, which must not end early.
+fn append_exact<R: BgzfRead + ?Sized>(
+    reader: &mut R,
+    n: usize,
+    buf: &mut Vec<u8>,
+) -> io::Result<()> {
+    let end = buf.len() + n;
+
+    while buf.len() < end && reader.fill()? {
+        let available = reader.available();
+        let take = (end - buf.len()).min(available.len());
+
+        buf.extend_from_slice(&available[..take]);
+        reader.consume(take);
+    }
+
+    if buf.len() < end {
+        return Err(invalid_data("truncated BAM record"));
+    }
+
+    Ok(())
+}
+
+/// Reads the next record, without its length prefix, into `buf`. Returns false at the end of the
+/// file.
+pub fn read_bam_record<R: BgzfRead + ?Sized>(
+    reader: &mut R,
+    buf: &mut Vec<u8>,
+) -> io::Result<bool> {
+    read_bam_record_prefix(reader, buf, RecordExtent::All)
+}
+
+/// Reads the start of the next record covering `extent` into `buf` and skips the rest. Returns
+/// false at the end of the file.
+pub fn read_bam_record_prefix<R: BgzfRead + ?Sized>(
+    reader: &mut R,
+    buf: &mut Vec<u8>,
+    extent: RecordExtent,
+) -> io::Result<bool> {
+    if !reader.read_exact(4, buf)? {
+        return Ok(false);
+    }
+
+    let block_size = le_u32(buf) as usize;
+    if block_size < 32 {
+        return Err(invalid_data("truncated BAM record"));
+    }
+
+    buf.clear();
+
+    let read = match extent {
+        RecordExtent::Length => 0,
+        RecordExtent::Fixed => 32,
+        RecordExtent::Cigar => {
+            append_exact(reader, 32, buf)?;
+            let l_read_name = buf[8] as usize;
+            let n_cigar_op = le_u16(&buf[12..]) as usize;
+
+            (32 + l_read_name + n_cigar_op * 4).min(block_size)
+        }
+        RecordExtent::All => block_size,
+    };
+
+    let copied = buf.len();
+    append_exact(reader, read - copied, buf)?;
+
+    if !reader.skip(block_size - read)? {
+        return Err(invalid_data("truncated BAM record"));
+    }
+
+    Ok(true)
+}
+
+/// The name of reference sequence `id` in `references`, `None` for unplaced records.
+fn reference_name(references: &[String], id: i32) -> io::Result<Option<&str>> {
+    if id < 0 {
+        return Ok(None);
+    }
+
+    match references.get(id as usize) {
+        Some(name) => Ok(Some(name)),
+        None => Err(invalid_data(format!(
+            "reference id {} is not in the BAM header",
+            id
+        ))),
+    }
+}
+
+/// A column of reference sequence names, as text or, if its field is dictionary-encoded, as keys
+/// into the header's reference sequences.
+pub(crate) enum ReferenceColumn {
+    Text(StringBuilder),
+    Keys(Int32Builder, ArrayRef),
+}
+
+impl ReferenceColumn {
+    pub(crate) fn new(field: &Field, references: &[String]) -> Self {
+        match field.data_type() {
+            DataType::Dictionary(_, _) => Self::Keys(
+                Int32Builder::new(),
+                Arc::new(StringArray::from_iter_values(references)),
+            ),
+            _ => Self::Text(StringBuilder::new()),
+        }
+    }
+
+    /// Appends reference sequence `id` of `references`, null for unplaced records.
+    pub(crate) fn append(&mut self, references: &[String], id: i32) -> io::Result<()> {
+        let name = reference_name(references, id)?;
+
+        match self {
+            Self::Text(names) => names.append_option(name),
+            Self::Keys(keys, _) => keys.append_option(name.map(|_| id)),
+        }
+
+        Ok(())
+    }
+
+    /// Appends the reference sequence `name` to a text column, for files that don't number them.
+    pub(crate) fn append_name(&mut self, name: &str) -> io::Result<()> {
+        match self {
+            Self::Text(names) => names.append_value(name),
+            Self::Keys(_, _) => return Err(invalid_data(format!("{} is not numbered", name))),
+        }
+
+        Ok(())
+    }
+
+    pub(crate) fn finish(&mut self) -> io::Result<ArrayRef> {
+        match self {
+            Self::Text(names) => Ok(Arc::new(names.finish())),
+            Self::Keys(keys, dictionary) => {
+                let array = Int32DictionaryArray::try_new(keys.finish(), dictionary.clone())
+                    .map_err(invalid_data)?;
+                Ok(Arc::new(array))
+            }
+        }
+    }
+}
+
+const CIGAR_OPS: &[u8; 9] = b"MIDNSHP=X";
+const BASES: &[u8; 16] = b"=ACMGRSVTWYHKDBN";
+
+// Positions of the columns in `bam_schema`.
+const NAME: usize = 0;
+const FLAG: usize = 1;
+const REFERENCE: usize = 2;
+const START: usize = 3;
+const END: usize = 4;
+const MAPPING_QUALITY: usize = 5;
+const CIGAR: usize = 6;
+const MATE_REFERENCE: usize = 7;
+const SEQUENCE: usize = 8;
+const QUALITY_SCORE: usize = 9;
+
+/// Which columns of `schema` to decode: those named in `columns`, or every column if `None`.
+pub fn bam_projection(schema: &Schema, columns: Option<&[&str]>) -> Vec<bool> {
+    schema
+        .fields()
+        .iter()
+        .map(|field| columns.map_or(true, |columns| columns.contains(&field.name().as_str())))
+        .collect()
+}
+
+/// `schema` with the columns outside `projection` made nullable, they are filled with nulls.
+pub fn projected_schema(schema: &Schema, projection: &[bool]) -> SchemaRef {
+    let fields = schema
+        .fields()
+        .iter()
+        .zip(projection)
+        .map(|(field, projected)| {
+            let field = field.as_ref().clone();
+            if *projected {
+                field
+            } else {
+                field.with_nullable(true)
+            }
+        })
+        .collect::<Vec<_>>();
+
+    Arc::new(Schema::new(fields))
+}
+
+/// The reference bases covered by the CIGAR operations `cigar`: M, D, N, = and X.
+fn reference_span(cigar: &[u8]) -> i32 {
+    cigar
+        .chunks_exact(4)
+        .map(le_u32)
+        .filter(|op| matches!(op & 0xf, 0 | 2 | 3 | 7 | 8))
+        .map(|op| (op >> 4) as i32)
+        .sum()
+}
+
+/// The reference id and zero-based, half-open interval of a record read up to at least
+/// `RecordExtent::Cigar`. Records without reference bases cover their start position alone.
+pub fn record_interval(record: &[u8]) -> io::Result<(i32, i32, i32)> {
+    let reference_id = le_i32(&record[0..]);
+    let position = le_i32(&record[4..]);
+    let cigar_start = 32 + record[8] as usize;
+    let cigar_end = cigar_start + le_u16(&record[12..]) as usize * 4;
+
+    let cigar = record
+        .get(cigar_start..cigar_end)
+        .ok_or_else(|| invalid_data("truncated BAM record"))?;
+
+    Ok((
+        reference_id,
+        position,
+        position + reference_span(cigar).max(1),
+    ))
+}
+
+/// Accumulates decoded BAM records into record batches. Only the projected columns are decoded,
+/// the others are returned as nulls.
+pub struct BamBatchBuilder {
+    schema: SchemaRef,
+    references: Arc<Vec<String>>,
+    projection: Vec<bool>,
+    extent: RecordExtent,
+    names: StringBuilder,
+    flags: Int32Builder,
+    reference_names: ReferenceColumn,
+    starts: Int32Builder,
+    ends: Int32Builder,
+    mapping_qualities: StringBuilder,
+    cigars: StringBuilder,
+    mate_references: ReferenceColumn,
+    sequences: StringBuilder,
+    quality_scores: StringBuilder,
+    tags: Vec<TagColumn>,
+    // The value bytes of each tag column in the record being decoded.
+    tag_values: Vec<Option<(u8, Range<usize>)>>,
+    virtual_offsets: Option<Int64Builder>,
+    text: String,
+    rows: usize,
+}
+
+impl BamBatchBuilder {
+    /// A builder for records of a file with the reference sequences `references`. The aux tag
+    /// columns added by `with_tag_fields` and the virtual offset column are filled if `schema`
+    /// has them.
+    pub fn new(schema: SchemaRef, references: Arc<Vec<String>>) -> Self {
+        let projection = vec![true; schema.fields().len()];
+        Self::with_projection(schema, references, projection)
+    }
+
+    /// A builder decoding only the columns of `schema` set in `projection`.
+    pub fn with_projection(
+        schema: SchemaRef,
+        references: Arc<Vec<String>>,
+        projection: Vec<bool>,
+    ) -> Self {
+        let schema = projected_schema(&schema, &projection);
+
+        let virtual_offsets = schema
+            .column_with_name(VIRTUAL_OFFSET_COLUMN)
+            .map(|_| Int64Builder::new());
+
+        // Every column after the fixed ones, other than the virtual offset, is a tag.
+        let tag_range = QUALITY_SCORE + 1
+            ..schema
+                .index_of(VIRTUAL_OFFSET_COLUMN)
+                .unwrap_or(schema.fields().len());
+        let tags = tag_range
+            .clone()
+            .map(|i| TagColumn::new(schema.field(i)))
+            .collect::<Vec<_>>();
+
+        let projected = |columns: &[usize]| columns.iter().any(|i| projection[*i]);
+        let extent =
+            if projected(&[SEQUENCE, QUALITY_SCORE]) || tag_range.clone().any(|i| projection[i]) {
+                RecordExtent::All
+            } else if projected(&[NAME, END, CIGAR]) {
+                RecordExtent::Cigar
+            } else if projected(&[FLAG, REFERENCE, START, MAPPING_QUALITY, MATE_REFERENCE]) {
+                RecordExtent::Fixed
+            } else {
+                RecordExtent::Length
+            };
+
+        let reference_names = ReferenceColumn::new(schema.field(REFERENCE), &references);
+        let mate_references = ReferenceColumn::new(schema.field(MATE_REFERENCE), &references);
+
+        Self {
+            schema,
+            references,
+            projection,
+            extent,
+            names: StringBuilder::new(),
+            flags: Int32Builder::new(),
+            reference_names,
+            starts: Int32Builder::new(),
+            ends: Int32Builder::new(),
+            mapping_qualities: StringBuilder::new(),
+            cigars: StringBuilder::new(),
+            mate_references,
+            sequences: StringBuilder::new(),
+            quality_scores: StringBuilder::new(),
+            tag_values: vec![None; tags.len()],
+            tags,
+            virtual_offsets,
+            text: String::new(),
+            rows: 0,
+        }
+    }
+
+    /// The schema of the batches, with the columns outside the projection nullable.
+    pub fn schema(&self) -> SchemaRef {
+        self.schema.clone()
+    }
+
+    /// How much of each record `append` needs.
+    pub fn extent(&self) -> RecordExtent {
+        self.extent
+    }
+
+    pub fn rows(&self) -> usize {
+        self.rows
+    }
+
+    /// Appends the record `record`, read by `read_bam_record_prefix` up to at least `extent()`,
+    /// that starts at `virtual_offset`.
+    pub fn append(&mut self, record: &[u8], virtual_offset: u64) -> io::Result<()> {
+        if self.extent > RecordExtent::Length {
+            self.decode(record)?;
+        }
+
+        if let Some(virtual_offsets) = &mut self.virtual_offsets {
+            virtual_offsets.append_value(virtual_offset as i64);
+        }
+
+        self.rows += 1;
+
+        Ok(())
+    }
+
+    fn decode(&mut self, record: &[u8]) -> io::Result<()> {
+        if record.len() < 32 {
+            return Err(invalid_data("truncated BAM record"));
+        }
+
+        let reference_id = le_i32(&record[0..]);
+        let position = le_i32(&record[4..]);
+        let l_read_name = record[8] as usize;
+        let mapping_quality = record[9];
+        let n_cigar_op = le_u16(&record[12..]) as usize;
+        let flag = le_u16(&record[14..]);
+        let l_seq = le_u32(&record[16..]) as usize;
+        let mate_reference_id = le_i32(&record[20..]);
+
+        let cigar_start = 32 + l_read_name;
+        let sequence_start = cigar_start + n_cigar_op * 4;
+        let quality_start = sequence_start + (l_seq + 1) / 2;
+        let quality_end = quality_start + l_seq;
+
+        let needed = match self.extent {
+            RecordExtent::Length | RecordExtent::Fixed => 32,
+            RecordExtent::Cigar => sequence_start,
+            RecordExtent::All => quality_end,
+        };
+
+        if record.len() < needed {
+            return Err(invalid_data("truncated BAM record"));
+        }
+
+        if self.projection[NAME] {
+            let name = &record[32..cigar_start];
+            let name = name.strip_suffix(b"\0").unwrap_or(name);
+            self.names.append_value(String::from_utf8_lossy(name));
+        }
+
+        if self.projection[FLAG] {
+            self.flags.append_value(flag as i32);
+        }
+
+        if self.projection[REFERENCE] {
+            self.reference_names
+                .append(&self.references, reference_id)?;
+        }
+
+        if self.projection[START] {
+            if position >= 0 {
+                self.starts.append_value(position + 1);
+            } else {
+                self.starts.append_null();
+            }
+        }
+
+        if self.projection[END] {
+            let span = reference_span(&record[cigar_start..sequence_start]);
+
+            if position >= 0 && span > 0 {
+                self.ends.append_value(position + span);
+            } else {
+                self.ends.append_null();
+            }
+        }
+
+        if self.projection[MAPPING_QUALITY] {
+            if mapping_quality == 255 {
+                self.mapping_qualities.append_null();
+            } else {
+                self.mapping_qualities
+                    .append_value(mapping_quality.to_string());
+            }
+        }
+
+        if self.projection[CIGAR] {
+            self.text.clear();
+            for op in record[cigar_start..sequence_start]
+                .chunks_exact(4)
+                .map(le_u32)
+            {
+                let kind = CIGAR_OPS
+                    .get((op & 0xf) as usize)
+                    .ok_or_else(|| invalid_data("invalid CIGAR operation"))?;
+                let _ = write!(self.text, "{}{}", op >> 4, *kind as char);
+            }
+            self.append_text(TextColumn::Cigar);
+        }
+
+        if self.projection[MATE_REFERENCE] {
+            self.mate_references
+                .append(&self.references, mate_reference_id)?;
+        }
+
+        if self.projection[SEQUENCE] {
+            self.text.clear();
+            let sequence = &record[sequence_start..quality_start];
+            for i in 0..l_seq {
+                let packed = sequence[i / 2];
+                let code = if i % 2 == 0 {
+                    packed >> 4
+                } else {
+                    packed & 0xf
+                };
+                self.text.push(BASES[code as usize] as char);
+            }
+            self.append_text(TextColumn::Sequence);
+        }
+
+        if self.projection[QUALITY_SCORE] {
+            self.text.clear();
+            let quality_scores = &record[quality_start..quality_end];
+            if quality_scores.first() != Some(&0xff) {
+                for score in quality_scores {
+                    self.text.push(score.saturating_add(33) as char);
+                }
+            }
+            self.append_text(TextColumn::QualityScores);
+        }
+
+        let tags_start = QUALITY_SCORE + 1;
+        if self.projection[tags_start..tags_start + self.tags.len()].contains(&true) {
+            self.decode_tags(&record[quality_end..])?;
+        }
+
+        Ok(())
+    }
+
+    /// Appends the projected tags found in the aux fields `aux`.
+    fn decode_tags(&mut self, aux: &[u8]) -> io::Result<()> {
+        let tags = &self.tags;
+        let tag_values = &mut self.tag_values;
+        tag_values.iter_mut().for_each(|value| *value = None);
+
+        walk_aux(aux, |tag, kind, range| {
+            if let Some(i) = tags.iter().position(|column| column.tag == tag) {
+                tag_values[i] = Some((kind, range));
+            }
+        })?;
+
+        for (i, column) in self.tags.iter_mut().enumerate() {
+            if self.projection[QUALITY_SCORE + 1 + i] {
+                let value = self.tag_values[i]
+                    .as_ref()
+                    .map(|(kind, range)| (*kind, &aux[range.clone()]));
+                column.append(value, &mut self.text);
+            }
+        }
+
+        Ok(())
+    }
+
+    /// Appends `text` to `column`, writing `*` for an empty value as SAM does.
+    fn append_text(&mut self, column: TextColumn) {
+        let value = if self.text.is_empty() {
+            "*"
+        } else {
+            self.text.as_str()
+        };
+
+        match column {
+            TextColumn::Cigar => self.cigars.append_value(value),
+            TextColumn::Sequence => self.sequences.append_value(value),
+            TextColumn::QualityScores => self.quality_scores.append_value(value),
+        }
+    }
+
+    pub fn finish(&mut self) -> io::Result<RecordBatch> {
+        let rows = self.rows;
+        self.rows = 0;
+
+        let mut decoded: Vec<ArrayRef> = vec![
+            Arc::new(self.names.finish()),
+            Arc::new(self.flags.finish()),
+            self.reference_names.finish()?,
+            Arc::new(self.starts.finish()),
+            Arc::new(self.ends.finish()),
+            Arc::new(self.mapping_qualities.finish()),
+            Arc::new(self.cigars.finish()),
+            self.mate_references.finish()?,
+            Arc::new(self.sequences.finish()),
+            Arc::new(self.quality_scores.finish()),
+        ];
+
+        decoded.extend(self.tags.iter_mut().map(TagColumn::finish));
+
+        if let Some(virtual_offsets) = &mut self.virtual_offsets {
+            decoded.push(Arc::new(virtual_offsets.finish()));
+        }
+
+        // Columns outside the projection were never appended to.
+        let columns = self
+            .schema
+            .fields()
+            .iter()
+            .zip(&self.projection)
+            .zip(decoded)
+            .map(|((field, projected), array)| {
+                if *projected {
+                    array
+                } else {
+                    new_null_array(field.data_type(), rows)
+                }
+            })
+            .collect::<Vec<_>>();
+
+        RecordBatch::try_new(self.schema.clone(), columns).map_err(invalid_data)
+    }
+}
+
+/// The text columns `BamBatchBuilder::append_text` writes to.
+enum TextColumn {
+    Cigar,
+    Sequence,
+    QualityScores,
+}
@@ -0,0 +1,1043 @@
+// Copyright 2023 WHERE TRUE Technologies.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+//! Scans local BAM files with the decoder in `bam_reader`, decoding only the projected columns.
+//! Each record is read only as far as those columns need and the rest is skipped by its length,
+//! so e.g. flag counts never unpack sequences or quality scores. Aux tags asked for by name are
+//! returned as typed columns of their own, and only the projected ones are parsed.
+//!
+//! Whole files are read in file order; region queries and index partitions read the chunks the
+//! BAI or CSI index lists for each region. Region queries of files that aren't local read those
+//! chunks through the object store the file is registered with. Scans filtered to read names look the names up in the
+//! file's name index, if it has one, and read only the records at the offsets it lists.
+
+use std::{
+    collections::VecDeque,
+    ffi::{c_char, CStr, CString},
+    fs::{self, File},
+    io, iter,
+    ptr::null,
+    slice,
+    str::Utf8Error,
+    sync::Arc,
+};
+
+use arrow::{
+    datatypes::{DataType, SchemaRef},
+    ffi_stream::FFI_ArrowArrayStream as ArrowArrayStream,
+    record_batch::RecordBatch,
+};
+use datafusion::{
+    datasource::{listing::ListingTableUrl, streaming::StreamingTable},
+    error::DataFusionError,
+    execution::TaskContext,
+    physical_plan::{
+        stream::RecordBatchStreamAdapter, streaming::PartitionStream, SendableRecordBatchStream,
+    },
+    prelude::SessionContext,
+};
+use exon::{ffi::create_dataset_stream_from_table_provider, new_exon_config};
+use futures::{
+    stream::{self, BoxStream},
+    StreamExt,
+};
+use memmap2::Mmap;
+use tokio::runtime::Runtime;
+
+use crate::{
+    bam_reader::{
+        bam_projection, bam_schema, is_coordinate_sorted, projected_schema, read_bam_header,
+        read_bam_header_text, read_bam_record_prefix, read_tag_types, record_interval,
+        tag_data_type, with_reference_dictionary, with_tag_fields, BamBatchBuilder, RecordExtent,
+    },
+    bgzf::{BgzfRead, BlockCursor, BlockSource},
+    binning_index::{BinningIndex, Chunk},
+    block_cache::{prefetch_chunks, read_header_names, read_index, IndexedFormat, ObjectBlocks},
+    duckdb_file_system::DuckDBFileSystem,
+    index_builder::file_reader,
+    name_index::NameIndex,
+    partition_reader::{blocking_stream, new_runtime, register_store},
+    region::{merge_regions, parse_vcf_contigs, Region},
+    region_query::{regions_from_ffi, resolve_regions},
+    subset_reader::{self, chrom_names, read_header, VariantFormat},
+};
+
+fn invalid_data<E: Into<Box<dyn std::error::Error + Send + Sync>>>(e: E) -> io::Error {
+    io::Error::new(io::ErrorKind::InvalidData, e)
+}
+
+/// Records read to find the types of requested aux tags.
+const TAG_SAMPLE_RECORDS: usize = 10000;
+
+/// Reads the `count` strings at `strings`, `None` if `strings` is null.
+pub(crate) unsafe fn strings_from_ffi<'a>(
+    strings: *const *const c_char,
+    count: usize,
+) -> Result<Option<Vec<&'a str>>, Utf8Error> {
+    if strings.is_null() {
+        return Ok(None);
+    }
+
+    slice::from_raw_parts(strings, count)
+        .iter()
+        .map(|string| CStr::from_ptr(*string).to_str())
+        .collect::<Result<Vec<_>, _>>()
+        .map(Some)
+}
+
+fn map_file(path: &str) -> io::Result<Mmap> {
+    let file =
+        File::open(path).map_err(|e| io::Error::new(e.kind(), format!("{}: {}", path, e)))?;
+
+    // SAFETY: the map is read only, as in the index builder.
+    unsafe { Mmap::map(&file) }
+}
+
+/// Reads the `.bai` or `.csi` index next to the BAM file at `path`.
+pub(crate) fn read_local_index(path: &str) -> io::Result<BinningIndex> {
+    for extension in IndexedFormat::Bam.index_extensions() {
+        if let Ok(raw) = fs::read(format!("{}.{}", path, extension)) {
+            return BinningIndex::parse(&raw);
+        }
+    }
+
+    Err(io::Error::new(
+        io::ErrorKind::NotFound,
+        format!("no index found for {}", path),
+    ))
+}
+
+/// A region of one reference sequence, as a zero-based, half-open interval. Only records
+/// starting past the one-based position `min_start` are read, earlier ones were returned by the
+/// region before it.
+#[derive(Clone, Copy)]
+struct ScanRegion {
+    reference_id: usize,
+    start: u64,
+    end: u64,
+    min_start: u64,
+}
+
+impl ScanRegion {
+    fn new(references: &[String], region: &Region, min_start: u64) -> io::Result<Self> {
+        let reference_id = references
+            .iter()
+            .position(|name| *name == region.name)
+            .ok_or_else(|| {
+                invalid_data(format!(
+                    "reference sequence {} is not in the BAM header",
+                    region.name
+                ))
+            })?;
+
+        let (start, end) = region.zero_based(i32::MAX as u64);
+
+        Ok(Self {
+            reference_id,
+            start,
+            end,
+            min_start,
+        })
+    }
+
+    /// The chunks of `index` holding the region's records.
+    fn chunks(&self, index: &BinningIndex) -> Vec<Chunk> {
+        index.query(self.reference_id, self.start, self.end)
+    }
+}
+
+/// The regions of `entries`, each samtools-style or the path of a BED file, on the `references`
+/// of a BAM header. Overlapping regions are merged.
+async fn merged_scan_regions(
+    ctx: &SessionContext,
+    entries: &[String],
+    references: &[String],
+) -> Result<Vec<ScanRegion>, String> {
+    let regions = resolve_regions(ctx, entries, references)
+        .await
+        .map_err(|e| format!("could not read regions: {}", e))?;
+
+    merge_regions(&regions)
+        .iter()
+        .map(|merged| {
+            let min_start = merged.previous_end.unwrap_or(0);
+            ScanRegion::new(references, &merged.region, min_start)
+        })
+        .collect::<io::Result<Vec<_>>>()
+        .map_err(|e| format!("could not read regions: {}", e))
+}
+
+/// The records of a BAM file overlapping regions of its index, read a batch at a time from a
+/// cursor over the file.
+struct RegionBatches<D: BlockSource> {
+    cursor: BlockCursor<D>,
+    regions: Vec<ScanRegion>,
+    // The chunks of each region still to read, by region, and the region and end of the chunk
+    // being read.
+    chunks: VecDeque<(usize, Chunk)>,
+    current: Option<(usize, u64)>,
+    builder: BamBatchBuilder,
+    extent: RecordExtent,
+    record: Vec<u8>,
+    batch_size: usize,
+}
+
+impl<D: BlockSource> RegionBatches<D> {
+    fn new(
+        data: D,
+        index: &BinningIndex,
+        regions: &[ScanRegion],
+        schema: SchemaRef,
+        projection: Vec<bool>,
+        batch_size: usize,
+    ) -> io::Result<Self> {
+        let mut cursor = BlockCursor::new(data);
+
+        let references = Arc::new(read_bam_header(&mut cursor)?);
+        let builder = BamBatchBuilder::with_projection(schema, references, projection);
+
+        // Overlap is decided on the alignment end, which needs the CIGAR.
+        let extent = builder.extent().max(RecordExtent::Cigar);
+
+        let chunks = regions
+            .iter()
+            .enumerate()
+            .flat_map(|(i, region)| {
+                region
+                    .chunks(index)
+                    .into_iter()
+                    .map(move |chunk| (i, chunk))
+            })
+            .collect();
+
+        Ok(Self {
+            cursor,
+            regions: regions.to_vec(),
+            chunks,
+            current: None,
+            builder,
+            extent,
+            record: vec![],
+            batch_size,
+        })
+    }
+
+    /// The next batch of records, or `None` once every region has been read.
+    fn next_batch(&mut self) -> io::Result<Option<RecordBatch>> {
+        while self.builder.rows() < self.batch_size {
+            let (i, chunk_end) = match self.current {
+                Some(current) => current,
+                None => match self.chunks.pop_front() {
+                    Some((i, chunk)) => {
+                        self.cursor.seek(chunk.start)?;
+                        self.current = Some((i, chunk.end));
+                        continue;
+                    }
+                    None => break,
+                },
+            };
+
+            let offset = self.cursor.virtual_offset();
+            if offset >= chunk_end
+                || !read_bam_record_prefix(&mut self.cursor, &mut self.record, self.extent)?
+            {
+                self.current = None;
+                continue;
+            }
+
+            let region = self.regions[i];
+            let (reference_id, start, end) = record_interval(&self.record)?;
+            if reference_id != region.reference_id as i32 || start < 0 {
+                continue;
+            }
+
+            // Records are sorted by start, none past this one can overlap.
+            if start as u64 >= region.end {
+                self.current = None;
+                self.chunks.retain(|(region, _)| *region != i);
+                continue;
+            }
+
+            if end as u64 <= region.start || start as u64 + 1 <= region.min_start {
+                continue;
+            }
+
+            self.builder.append(&self.record, offset)?;
+        }
+
+        if self.builder.rows() == 0 {
+            return Ok(None);
+        }
+
+        self.builder.finish().map(Some)
+    }
+}
+
+/// One BAM file, read whole, by regions of its index or at the offsets of its name index.
+struct BamScan {
+    path: String,
+    regions: Option<(Arc<BinningIndex>, Vec<ScanRegion>)>,
+    offsets: Option<Vec<u64>>,
+    projection: Vec<bool>,
+    batch_size: usize,
+    // Threads inflating the blocks of a whole-file scan.
+    threads: usize,
+}
+
+impl BamScan {
+    /// Reads the file, handing each batch to `emit` until it returns false.
+    fn run<F>(&self, schema: SchemaRef, mut emit: F) -> io::Result<()>
+    where
+        F: FnMut(RecordBatch) -> bool,
+    {
+        let data = map_file(&self.path)?;
+
+        match (&self.regions, &self.offsets) {
+            (Some(_), _) => {
+                let mut batches = self.region_batches(&data[..], schema)?;
+                while let Some(batch) = batches.next_batch()? {
+                    if !emit(batch) {
+                        break;
+                    }
+                }
+
+                Ok(())
+            }
+            (None, Some(offsets)) => self.run_offsets(&data, offsets, schema, &mut emit),
+            (None, None) => self.run_all(&data, schema, &mut emit),
+        }
+    }
+
+    /// The batches of the scan's regions, read from `data`.
+    fn region_batches<D: AsRef<[u8]>>(
+        &self,
+        data: D,
+        schema: SchemaRef,
+    ) -> io::Result<RegionBatches<D>> {
+        let (index, regions) = match &self.regions {
+            Some((index, regions)) => (index, regions),
+            None => return Err(invalid_data("the scan has no regions")),
+        };
+
+        RegionBatches::new(
+            data,
+            index,
+            regions,
+            schema,
+            self.projection.clone(),
+            self.batch_size,
+        )
+    }
+
+    fn run_offsets<F>(
+        &self,
+        data: &[u8],
+        offsets: &[u64],
+        schema: SchemaRef,
+        emit: &mut F,
+    ) -> io::Result<()>
+    where
+        F: FnMut(RecordBatch) -> bool,
+    {
+        let mut cursor = BlockCursor::new(data);
+
+        let references = Arc::new(read_bam_header(&mut cursor)?);
+        let mut builder =
+            BamBatchBuilder::with_projection(schema, references, self.projection.clone());
+        let extent = builder.extent();
+        let mut record = vec![];
+
+        for offset in offsets {
+            cursor.seek(*offset)?;
+            if !read_bam_record_prefix(&mut cursor, &mut record, extent)? {
+                return Err(invalid_data("name index points past the end of the file"));
+            }
+
+            builder.append(&record, *offset)?;
+
+            if builder.rows() >= self.batch_size && !emit(builder.finish()?) {
+                return Ok(());
+            }
+        }
+
+        if builder.rows() > 0 {
+            emit(builder.finish()?);
+        }
+
+        Ok(())
+    }
+
+    fn run_all<F>(&self, data: &[u8], schema: SchemaRef, emit: &mut F) -> io::Result<()>
+    where
+        F: FnMut(RecordBatch) -> bool,
+    {
+        let mut reader = file_reader(data, self.threads)?;
+
+        let references = Arc::new(read_bam_header(&mut reader)?);
+        let mut builder =
+            BamBatchBuilder::with_projection(schema, references, self.projection.clone());
+        let extent = builder.extent();
+        let mut record = vec![];
+
+        loop {
+            let offset = reader.virtual_offset();
+            if !read_bam_record_prefix(&mut reader, &mut record, extent)? {
+                break;
+            }
+
+            builder.append(&record, offset)?;
+
+            if builder.rows() >= self.batch_size && !emit(builder.finish()?) {
+                return Ok(());
+            }
+        }
+
+        if builder.rows() > 0 {
+            emit(builder.finish()?);
+        }
+
+        Ok(())
+    }
+}
+
+struct BamScanPartition {
+    schema: SchemaRef,
+    scan: Arc<BamScan>,
+    // Whether the scan is one partition of a parallel scan, decoded by the DuckDB thread that
+    // reads it rather than a thread of its own.
+    partition: bool,
+}
+
+impl BamScanPartition {
+    /// The batches of a partition, each decoded when the stream is polled for it.
+    fn partition_stream(&self) -> SendableRecordBatchStream {
+        let batches = map_file(&self.scan.path)
+            .and_then(|data| self.scan.region_batches(data, self.schema.clone()));
+
+        let batches: BoxStream<'static, Result<RecordBatch, DataFusionError>> = match batches {
+            Ok(mut batches) => {
+                stream::iter(iter::from_fn(move || batches.next_batch().transpose()))
+                    .map(|batch| batch.map_err(DataFusionError::IoError))
+                    .boxed()
+            }
+            Err(e) => stream::once(async { Err(DataFusionError::IoError(e)) }).boxed(),
+        };
+
+        Box::pin(RecordBatchStreamAdapter::new(self.schema.clone(), batches))
+    }
+}
+
+impl PartitionStream for BamScanPartition {
+    fn schema(&self) -> &SchemaRef {
+        &self.schema
+    }
+
+    fn execute(&self, _ctx: Arc<TaskContext>) -> SendableRecordBatchStream {
+        if self.partition {
+            return self.partition_stream();
+        }
+
+        let scan = self.scan.clone();
+        let schema = self.schema.clone();
+
+        blocking_stream(self.schema.clone(), move |emit| scan.run(schema, emit))
+    }
+}
+
+/// The regions of a BAM file read through an object store, with the chunks of all of them
+/// planned from one read of its index.
+struct ObjectRegionPartition {
+    schema: SchemaRef,
+    blocks: ObjectBlocks,
+    index: Arc<BinningIndex>,
+    regions: Vec<ScanRegion>,
+    batch_size: usize,
+}
+
+impl PartitionStream for ObjectRegionPartition {
+    fn schema(&self) -> &SchemaRef {
+        &self.schema
+    }
+
+    fn execute(&self, _ctx: Arc<TaskContext>) -> SendableRecordBatchStream {
+        let blocks = self.blocks.clone();
+        let index = self.index.clone();
+        let regions = self.regions.clone();
+        let schema = self.schema.clone();
+        let batch_size = self.batch_size;
+
+        blocking_stream(self.schema.clone(), move |emit| {
+            let projection = bam_projection(&schema, None);
+            let mut batches =
+                RegionBatches::new(blocks, &index, &regions, schema, projection, batch_size)?;
+
+            while let Some(batch) = batches.next_batch()? {
+                if !emit(batch) {
+                    break;
+                }
+            }
+
+            Ok(())
+        })
+    }
+}
+
+/// The records of the indexed BAM file at `uri` overlapping any of `entries`, each
+/// samtools-style or the path of a BED file, read through its object store, or the DuckDB file
+/// system if `file_system` isn't null, with the columns of `read_bam_file_records`. Overlapping regions are merged and every record
+/// is returned once. The index is read once for all regions, whose chunks are read in order by
+/// one cursor, a planned run of nearby chunks per request, and fetched ahead in parallel through
+/// the block cache.
+pub(crate) async fn object_region_table(
+    ctx: &SessionContext,
+    uri: &str,
+    file_system: *const DuckDBFileSystem,
+    entries: &[String],
+    batch_size: usize,
+    rt: Arc<Runtime>,
+) -> Result<StreamingTable, String> {
+    let cache = register_store(ctx, uri, file_system).await?;
+
+    let table_url = ListingTableUrl::parse(uri).map_err(|e| e.to_string())?;
+    let store = ctx
+        .runtime_env()
+        .object_store(table_url.object_store())
+        .map_err(|e| e.to_string())?;
+    let location = table_url.prefix();
+
+    let references = read_header_names(store.as_ref(), location, IndexedFormat::Bam)
+        .await
+        .map_err(|e| format!("could not read header: {}", e))?;
+    let regions = merged_scan_regions(ctx, entries, &references).await?;
+
+    let index = read_index(store.as_ref(), location, IndexedFormat::Bam)
+        .await
+        .map_err(|e| format!("could not read index: {}", e))?;
+    let chunks = regions
+        .iter()
+        .flat_map(|region| region.chunks(&index))
+        .collect::<Vec<_>>();
+
+    if let Some((cache, _)) = cache {
+        // A failed prefetch only costs the latency it was meant to hide, the reader below still
+        // fetches what it needs.
+        let _ = prefetch_chunks(&cache, location, &chunks).await;
+    }
+
+    let mut blocks = ObjectBlocks::open(store, location.clone(), rt)
+        .await
+        .map_err(|e| format!("could not read file: {}", e))?;
+    blocks.plan(&chunks);
+
+    // References are keys into the header's sequences, as new_bam_scan returns them.
+    let schema = with_reference_dictionary(&bam_schema(false));
+
+    let partition = Arc::new(ObjectRegionPartition {
+        schema: schema.clone(),
+        blocks,
+        index: Arc::new(index),
+        regions,
+        batch_size,
+    }) as Arc<dyn PartitionStream>;
+
+    StreamingTable::try_new(schema, vec![partition])
+        .map_err(|e| format!("could not create table: {}", e))
+}
+
+#[repr(C)]
+pub struct BAMScanResult {
+    error: *const c_char,
+}
+
+impl BAMScanResult {
+    fn error(error: String) -> Self {
+        Self {
+            error: CString::new(error).unwrap().into_raw(),
+        }
+    }
+}
+
+/// Reads the local BAM file at `uri` with the columns of `read_bam_file_records`, followed by a
+/// typed column for each of the `tag_count` aux tags at `tags`, e.g. `NM`, and, if
+/// `virtual_offset` is set, the virtual offset of each record. Only the `column_count` columns
+/// named at `columns` are decoded, the others are all null; if `columns` is null every column is
+/// decoded.
+///
+/// With no regions the whole file is read. Otherwise the records overlapping any of the
+/// `region_count` regions at `regions` are read, each samtools-style or the path of a BED file,
+/// as `bam_query_reader` does; if `partition` is set, `regions` is one region planned by
+/// `scan_partitions` and only records starting in it are read. `filters` is a SQL predicate
+/// applied to the records.
+///
+/// `read_names`, if not null, lists the `read_name_count` names `filters` keeps records of; a
+/// whole-file scan of a file with a name index then reads only the records the index lists for
+/// them. `filters` must still select the names, the index can return other records too.
+///
+/// Whole files are inflated by `threads` threads, DuckDB's own thread count, while a thread of the
+/// scan decodes them. A partition is decoded by the DuckDB thread reading it, as it reads it.
+#[no_mangle]
+pub unsafe extern "C" fn new_bam_scan(
+    stream_ptr: *mut ArrowArrayStream,
+    uri: *const c_char,
+    regions: *const *const c_char,
+    region_count: usize,
+    partition: bool,
+    tags: *const *const c_char,
+    tag_count: usize,
+    columns: *const *const c_char,
+    column_count: usize,
+    virtual_offset: bool,
+    read_names: *const *const c_char,
+    read_name_count: usize,
+    batch_size: usize,
+    threads: usize,
+    filters: *const c_char,
+) -> BAMScanResult {
+    let uri = match CStr::from_ptr(uri).to_str() {
+        Ok(uri) => uri,
+        Err(e) => return BAMScanResult::error(format!("could not parse uri: {}", e)),
+    };
+
+    let regions = if region_count == 0 {
+        None
+    } else {
+        match regions_from_ffi(regions, region_count) {
+            Ok(regions) => Some(regions),
+            Err(e) => return BAMScanResult::error(e),
+        }
+    };
+
+    let tags = match strings_from_ffi(tags, tag_count).map(Option::unwrap_or_default) {
+        Ok(tags) => tags,
+        Err(e) => return BAMScanResult::error(format!("could not parse tags: {}", e)),
+    };
+
+    let mut tag_ids: Vec<[u8; 2]> = vec![];
+    for tag in &tags {
+        match tag.as_bytes() {
+            [a, b] if a.is_ascii_alphabetic() && b.is_ascii_alphanumeric() => {
+                if !tag_ids.contains(&[*a, *b]) {
+                    tag_ids.push([*a, *b]);
+                }
+            }
+            _ => {
+                return BAMScanResult::error(format!(
+                    "invalid tag {}, tags are two characters like NM",
+                    tag
+                ))
+            }
+        }
+    }
+
+    let columns = match strings_from_ffi(columns, column_count) {
+        Ok(columns) => columns,
+        Err(e) => return BAMScanResult::error(format!("could not parse columns: {}", e)),
+    };
+
+    let read_names = match strings_from_ffi(read_names, read_name_count) {
+        Ok(read_names) => read_names,
+        Err(e) => return BAMScanResult::error(format!("could not parse read names: {}", e)),
+    };
+
+    let filters = if filters.is_null() {
+        ""
+    } else {
+        match CStr::from_ptr(filters).to_str() {
+            Ok(filters) => filters,
+            Err(e) => return BAMScanResult::error(format!("could not parse filters: {}", e)),
+        }
+    };
+
+    let data = match map_file(uri) {
+        Ok(data) => data,
+        Err(e) => return BAMScanResult::error(format!("could not read file: {}", e)),
+    };
+
+    let mut cursor = BlockCursor::new(&data);
+    let references = match read_bam_header(&mut cursor) {
+        Ok(references) => references,
+        Err(e) => return BAMScanResult::error(format!("could not read BAM header: {}", e)),
+    };
+
+    // Without a name index, or once the file has changed since it was built, the file is read
+    // whole and the filters alone pick out the names.
+    let offsets = match read_names {
+        Some(read_names) if region_count == 0 => match NameIndex::open(uri, data.len() as u64) {
+            Ok(index) => index.map(|index| index.offsets(&read_names)),
+            Err(e) => return BAMScanResult::error(format!("could not read name index: {}", e)),
+        },
+        _ => None,
+    };
+
+    // Tag columns are typed after the first value of the tag in the file, or text if none is
+    // found near the start.
+    let tag_fields = match read_tag_types(&mut cursor, &tag_ids, TAG_SAMPLE_RECORDS) {
+        Ok(kinds) => tag_ids
+            .iter()
+            .zip(kinds)
+            .map(|(tag, kind)| {
+                let name = String::from_utf8_lossy(tag).into_owned();
+                (name, kind.map_or(DataType::Utf8, tag_data_type))
+            })
+            .collect::<Vec<_>>(),
+        Err(e) => return BAMScanResult::error(format!("could not read BAM records: {}", e)),
+    };
+
+    // References are keys into the header's sequences, which DuckDB reads as an ENUM of them.
+    let schema =
+        with_reference_dictionary(&with_tag_fields(&bam_schema(virtual_offset), &tag_fields));
+    let projection = bam_projection(&schema, columns.as_deref());
+    let schema = projected_schema(&schema, &projection);
+
+    // A partition is decoded on the DuckDB thread that drives its runtime.
+    let rt = if partition {
+        new_runtime()
+    } else {
+        Arc::new(Runtime::new().unwrap())
+    };
+
+    let config = new_exon_config().with_batch_size(batch_size);
+    let ctx = SessionContext::with_config_exon(config);
+
+    rt.block_on(async {
+        let regions = match regions {
+            None => None,
+            Some(regions) => {
+                let scan_regions = if partition {
+                    let is_reference =
+                        |name: &str| references.iter().any(|reference| reference == name);
+
+                    regions
+                        .iter()
+                        .map(|region| match Region::parse_with(region, is_reference) {
+                            Ok(region) => {
+                                let min_start = region.start.saturating_sub(1);
+                                ScanRegion::new(&references, &region, min_start)
+                            }
+                            Err(_) => Err(invalid_data("could not parse region")),
+                        })
+                        .collect::<io::Result<Vec<_>>>()
+                        .map_err(|e| format!("could not read regions: {}", e))
+                } else {
+                    merged_scan_regions(&ctx, &regions, &references).await
+                };
+
+                let scan_regions = match scan_regions {
+                    Ok(scan_regions) => scan_regions,
+                    Err(e) => return BAMScanResult::error(e),
+                };
+
+                match read_local_index(uri) {
+                    Ok(index) => Some((Arc::new(index), scan_regions)),
+                    Err(e) => return BAMScanResult::error(format!("could not read index: {}", e)),
+                }
+            }
+        };
+
+        let partition = Arc::new(BamScanPartition {
+            schema: schema.clone(),
+            scan: Arc::new(BamScan {
+                path: uri.to_string(),
+                regions,
+                offsets,
+                projection,
+                batch_size,
+                threads: threads.max(1),
+            }),
+            partition,
+        }) as Arc<dyn PartitionStream>;
+
+        let table = match StreamingTable::try_new(schema, vec![partition]) {
+            Ok(table) => table,
+            Err(e) => return BAMScanResult::error(format!("could not create table: {}", e)),
+        };
+
+        if let Err(e) = ctx.register_table("exon_table", Arc::new(table)) {
+            return BAMScanResult::error(format!("could not register table: {}", e));
+        }
+
+        let mut select_string = format!("SELECT * FROM exon_table");
+        if filters != "" {
+            select_string.push_str(format!(" WHERE {}", filters).as_str());
+        }
+
+        let df = match ctx.sql(&select_string).await {
+            Ok(df) => df,
+            Err(e) => return BAMScanResult::error(format!("could not execute sql: {}", e)),
+        };
+
+        match create_dataset_stream_from_table_provider(df, rt.clone(), stream_ptr).await {
+            Ok(_) => BAMScanResult {
+                error: std::ptr::null(),
+            },
+            Err(e) => BAMScanResult::error(format!("could not create dataset stream: {}", e)),
+        }
+    })
+}
+
+#[repr(C)]
+pub struct ReferenceNamesResult {
+    names: *const *const c_char,
+    count: usize,
+    error: *const c_char,
+}
+
+impl ReferenceNamesResult {
+    fn error(error: String) -> Self {
+        Self {
+            names: null(),
+            count: 0,
+            error: CString::new(error).unwrap().into_raw(),
+        }
+    }
+}
+
+/// Reads the reference sequence names from the header of `uri` through the object store it is
+/// registered with, or the DuckDB file system if `file_system` isn't null. VCF files have the
+/// names of `chrom_names`, read with their index.
+fn read_remote_reference_names(
+    uri: &str,
+    format: IndexedFormat,
+    file_system: *const DuckDBFileSystem,
+) -> Result<Vec<String>, String> {
+    let rt = new_runtime();
+    let ctx = SessionContext::new();
+
+    rt.block_on(async {
+        register_store(&ctx, uri, file_system).await?;
+
+        let table_url = ListingTableUrl::parse(uri).map_err(|e| e.to_string())?;
+        let store = ctx
+            .runtime_env()
+            .object_store(table_url.object_store())
+            .map_err(|e| e.to_string())?;
+
+        let names = read_header_names(store.as_ref(), table_url.prefix(), format)
+            .await
+            .map_err(|e| format!("could not read header: {}", e))?;
+
+        Ok(match format {
+            IndexedFormat::Vcf => {
+                let index = read_index(store.as_ref(), table_url.prefix(), format).await;
+                chrom_names(VariantFormat::Vcf, names, index.ok().as_ref())
+            }
+            _ => names,
+        })
+    })
+}
+
+/// The reference sequences declared in the header of the BAM, VCF or BCF file at `uri`, in header
+/// order, which the dictionary-encoded reference columns of `new_bam_scan` and
+/// `new_genotype_reader` are keys into and the other readers' reference columns are read as. VCF
+/// records may name contigs the header doesn't declare: those a tabix index lists follow the
+/// declared ones, and a VCF file without one has no names, so its chrom column stays text.
+/// `file_format` is `bam`, `bcf`, or `vcf`, which also reads local BCF files. Files that aren't
+/// local, or are read through the DuckDB file system if `file_system` isn't null, have their
+/// header fetched from the object store.
+#[no_mangle]
+pub unsafe extern "C" fn reference_names(
+    uri: *const c_char,
+    file_format: *const c_char,
+    file_system: *const DuckDBFileSystem,
+) -> ReferenceNamesResult {
+    let uri = match CStr::from_ptr(uri).to_str() {
+        Ok(uri) => uri,
+        Err(e) => return ReferenceNamesResult::error(format!("could not parse uri: {}", e)),
+    };
+
+    let format = match CStr::from_ptr(file_format).to_bytes() {
+        b"bam" => IndexedFormat::Bam,
+        b"bcf" => IndexedFormat::Bcf,
+        _ => IndexedFormat::Vcf,
+    };
+
+    let names = if !file_system.is_null() || uri.contains("://") {
+        read_remote_reference_names(uri, format, file_system)
+    } else {
+        let data = match map_file(uri) {
+            Ok(data) => data,
+            Err(e) => return ReferenceNamesResult::error(format!("could not read file: {}", e)),
+        };
+
+        let names = match format {
+            IndexedFormat::Bam => read_bam_header(&mut BlockCursor::new(&data)),
+            _ => VariantFormat::detect(&data).and_then(|format| {
+                let contigs = parse_vcf_contigs(&read_header(format, &data)?.text);
+                let index = subset_reader::read_local_index(uri, format).ok();
+
+                Ok(chrom_names(format, contigs, index.as_ref()))
+            }),
+        };
+
+        names.map_err(|e| format!("could not read header: {}", e))
+    };
+
+    let names = match names {
+        Ok(names) => names,
+        Err(e) => return ReferenceNamesResult::error(e),
+    };
+
+    let names = names
+        .into_iter()
+        .map(|name| CString::new(name).unwrap().into_raw() as *const c_char)
+        .collect::<Vec<_>>()
+        .into_boxed_slice();
+
+    let count = names.len();
+
+    ReferenceNamesResult {
+        names: Box::into_raw(names) as *const *const c_char,
+        count,
+        error: null(),
+    }
+}
+
+/// Releases the names and error of a `ReferenceNamesResult`.
+#[no_mangle]
+pub unsafe extern "C" fn free_reference_names(result: ReferenceNamesResult) {
+    if !result.names.is_null() {
+        let names = Box::from_raw(slice::from_raw_parts_mut(
+            result.names as *mut *const c_char,
+            result.count,
+        ));
+
+        for name in names.iter() {
+            drop(CString::from_raw(*name as *mut c_char));
+        }
+    }
+
+    if !result.error.is_null() {
+        drop(CString::from_raw(result.error as *mut c_char));
+    }
+}
+
+/// Whether the variant file `data`, at `path`, is sorted by contig in header order, then by
+/// position: it has an index, which only sorted files do, and the contigs are laid out in the
+/// order of the header.
+fn is_variant_file_sorted(path: &str, data: &[u8]) -> io::Result<bool> {
+    let format = VariantFormat::detect(data)?;
+
+    let index = match subset_reader::read_local_index(path, format) {
+        Ok(index) => index,
+        Err(e) if e.kind() == io::ErrorKind::NotFound => return Ok(false),
+        Err(e) => return Err(e),
+    };
+
+    // The order of the chrom ENUM, undeclared contigs after the header's.
+    let contigs = chrom_names(
+        format,
+        parse_vcf_contigs(&read_header(format, data)?.text),
+        Some(&index),
+    );
+
+    // Tabix indexes number references by their own names, CSI indexes of BCF files by the header.
+    Ok(follows_header_order(&index, |reference_id| {
+        match index.reference_names() {
+            Some(names) => names
+                .get(reference_id)
+                .and_then(|name| contigs.iter().position(|contig| contig == name)),
+            None => Some(reference_id),
+        }
+    }))
+}
+
+/// Whether the BAM file `data`, at `path`, is sorted by coordinate: its header declares
+/// `SO:coordinate`, and it has an index, which can't be built from unsorted records, with the
+/// reference sequences laid out in header order. The header alone is only a claim.
+fn is_bam_file_sorted(path: &str, data: &[u8]) -> io::Result<bool> {
+    let (text, _) = read_bam_header_text(&mut BlockCursor::new(data))?;
+    if !is_coordinate_sorted(&text) {
+        return Ok(false);
+    }
+
+    let index = match read_local_index(path) {
+        Ok(index) => index,
+        Err(e) if e.kind() == io::ErrorKind::NotFound => return Ok(false),
+        Err(e) => return Err(e),
+    };
+
+    Ok(follows_header_order(&index, Some))
+}
+
+/// Whether the records of the reference sequences of `index` are laid out in the order of the
+/// header, `header_id` giving the place in it of each reference of the index.
+fn follows_header_order<F>(index: &BinningIndex, header_id: F) -> bool
+where
+    F: Fn(usize) -> Option<usize>,
+{
+    let mut starts = vec![];
+    for reference_id in 0..index.references.len() {
+        let header_id = match header_id(reference_id) {
+            Some(header_id) => header_id,
+            None => return false,
+        };
+
+        if let Some(chunk) = index.reference_chunks(reference_id).first() {
+            starts.push((chunk.start, header_id));
+        }
+    }
+
+    starts.sort_unstable();
+
+    starts.windows(2).all(|pair| pair[0].1 < pair[1].1)
+}
+
+#[repr(C)]
+pub struct SortOrderResult {
+    coordinate: bool,
+    error: *const c_char,
+}
+
+impl SortOrderResult {
+    fn error(error: String) -> Self {
+        Self {
+            coordinate: false,
+            error: CString::new(error).unwrap().into_raw(),
+        }
+    }
+}
+
+/// Whether the records of the local BAM, VCF or BCF file at `uri` are sorted by reference
+/// sequence, in header order, then by position: indexed BAM files whose header declares
+/// `SO:coordinate`, and indexed VCF and BCF files, whose references follow the header.
+/// `file_format` is `bam`, or `vcf` for either variant format.
+#[no_mangle]
+pub unsafe extern "C" fn sort_order(
+    uri: *const c_char,
+    file_format: *const c_char,
+) -> SortOrderResult {
+    let uri = match CStr::from_ptr(uri).to_str() {
+        Ok(uri) => uri,
+        Err(e) => return SortOrderResult::error(format!("could not parse uri: {}", e)),
+    };
+
+    let data = match map_file(uri) {
+        Ok(data) => data,
+        Err(e) => return SortOrderResult::error(format!("could not read file: {}", e)),
+    };
+
+    let coordinate = if CStr::from_ptr(file_format).to_bytes() == b"bam" {
+        is_bam_file_sorted(uri, &data)
+    } else {
+        is_variant_file_sorted(uri, &data)
+    };
+
+    match coordinate {
+        Ok(coordinate) => SortOrderResult {
+            coordinate,
+            error: null(),
+        },
+        Err(e) => SortOrderResult::error(format!("could not read header: {}", e)),
+    }
+}
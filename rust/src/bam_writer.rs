@@ -0,0 +1,540 @@
+// Copyright 2023 WHERE TRUE Technologies.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+//! Encodes alignment rows as BAM records for `COPY ... TO (FORMAT bam)`. Reference names are
+//! resolved against the header copied from the `HEADER_FROM` BAM or SAM file.
+
+use std::{
+    collections::HashMap,
+    fs::File,
+    io::{BufRead, BufReader, Read},
+};
+
+use arrow::{
+    array::{Array, ArrayRef, AsArray, ListArray, StructArray},
+    compute::cast,
+    datatypes::{DataType, Int64Type},
+    error::ArrowError,
+    record_batch::RecordBatch,
+    util::display::{ArrayFormatter, FormatOptions},
+};
+use flate2::read::MultiGzDecoder;
+
+use crate::binning_index::{reg2bin, BAI_DEPTH, BAI_MIN_SHIFT};
+
+/// The accepted names of each column, in the order of the fields they fill, and whether it must
+/// be present.
+pub const COLUMNS: &[(&[&str], bool)] = &[
+    (&["name"], true),
+    (&["flag"], true),
+    (&["reference"], true),
+    (&["start"], true),
+    (&["mapping_quality"], false),
+    (&["cigar"], false),
+    (&["mate_reference"], false),
+    (&["mate_start"], false),
+    (&["template_length"], false),
+    (&["sequence"], false),
+    (&["quality_score", "quality_scores"], false),
+    (&["tags"], false),
+];
+
+const NAME: usize = 0;
+const FLAG: usize = 1;
+const REFERENCE: usize = 2;
+const START: usize = 3;
+const MAPPING_QUALITY: usize = 4;
+const CIGAR: usize = 5;
+const MATE_REFERENCE: usize = 6;
+const MATE_START: usize = 7;
+const TEMPLATE_LENGTH: usize = 8;
+const SEQUENCE: usize = 9;
+const QUALITY_SCORE: usize = 10;
+const TAGS: usize = 11;
+
+/// The bin htslib gives records without a position.
+const UNPLACED_BIN: u16 = 4680;
+const MISSING_MAPPING_QUALITY: u8 = 255;
+const MISSING_QUALITY: u8 = 0xff;
+
+const CIGAR_OPS: &[u8] = b"MIDNSHP=X";
+const BASES: &[u8] = b"=ACMGRSVTWYHKDBN";
+
+/// A record to index once its place in the output is known: reference, zero-based, half-open
+/// span, whether it is mapped, and the offset just past it in the uncompressed batch.
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+pub struct IndexedRecord {
+    pub reference_id: Option<usize>,
+    pub start: u64,
+    pub end: u64,
+    pub mapped: bool,
+    pub end_offset: usize,
+}
+
+pub struct BamHeader {
+    text: String,
+    pub references: Vec<(String, u64)>,
+    ids: HashMap<String, usize>,
+}
+
+fn read_u32(reader: &mut impl Read) -> Result<u32, String> {
+    let mut buf = [0; 4];
+    reader
+        .read_exact(&mut buf)
+        .map_err(|e| format!("truncated BAM header: {}", e))?;
+
+    Ok(u32::from_le_bytes(buf))
+}
+
+fn read_string(reader: &mut impl Read, length: usize) -> Result<String, String> {
+    let mut buf = vec![0; length];
+    reader
+        .read_exact(&mut buf)
+        .map_err(|e| format!("truncated BAM header: {}", e))?;
+
+    Ok(String::from_utf8_lossy(&buf)
+        .trim_end_matches('\0')
+        .to_string())
+}
+
+impl BamHeader {
+    fn new(text: String, references: Vec<(String, u64)>) -> Self {
+        let ids = references
+            .iter()
+            .enumerate()
+            .map(|(id, (name, _))| (name.clone(), id))
+            .collect();
+
+        Self {
+            text,
+            references,
+            ids,
+        }
+    }
+
+    /// Reads the header of the BAM or SAM file at `path`.
+    pub fn read(path: &str) -> Result<Self, String> {
+        let file = File::open(path).map_err(|e| format!("{}: {}", path, e))?;
+
+        let mut reader = BufReader::new(file);
+        let is_gzip = reader
+            .fill_buf()
+            .map(|data| data.starts_with(&[0x1f, 0x8b]))
+            .map_err(|e| format!("{}: {}", path, e))?;
+
+        if is_gzip {
+            Self::read_bam(&mut MultiGzDecoder::new(reader)).map_err(|e| format!("{}: {}", path, e))
+        } else {
+            Self::read_sam(reader).map_err(|e| format!("{}: {}", path, e))
+        }
+    }
+
+    fn read_bam(reader: &mut impl Read) -> Result<Self, String> {
+        let mut magic = [0; 4];
+        reader
+            .read_exact(&mut magic)
+            .map_err(|e| format!("truncated BAM header: {}", e))?;
+
+        if &magic != b"BAM\x01" {
+            return Err("not a BAM file".to_string());
+        }
+
+        let l_text = read_u32(reader)? as usize;
+        let text = read_string(reader, l_text)?;
+
+        let reference_count = read_u32(reader)? as usize;
+        let mut references = Vec::with_capacity(reference_count);
+        for _ in 0..reference_count {
+            let l_name = read_u32(reader)? as usize;
+            let name = read_string(reader, l_name)?;
+            let length = read_u32(reader)? as u64;
+
+            references.push((name, length));
+        }
+
+        Ok(Self::new(text, references))
+    }
+
+    fn read_sam(reader: impl BufRead) -> Result<Self, String> {
+        let mut text = String::new();
+        let mut references = vec![];
+
+        for line in reader.lines() {
+            let line = line.map_err(|e| e.to_string())?;
+            if !line.starts_with('@') {
+                break;
+            }
+
+            if line.starts_with("@SQ\t") {
+                let field = |tag: &str| line.split('\t').find_map(|field| field.strip_prefix(tag));
+
+                let name = field("SN:").ok_or("@SQ line without SN")?;
+                let length = field("LN:")
+                    .and_then(|length| length.parse().ok())
+                    .ok_or("@SQ line without LN")?;
+
+                references.push((name.to_string(), length));
+            }
+
+            text.push_str(&line);
+            text.push('\n');
+        }
+
+        Ok(Self::new(text, references))
+    }
+
+    /// Sets the `SO` field of the `@HD` line to `unknown`, for output whose order is not checked
+    /// as it is written. Readers trust `SO:coordinate` to skip sorting.
+    pub fn clear_sort_order(&mut self) {
+        let mut text = String::with_capacity(self.text.len());
+
+        for line in self.text.split_inclusive('\n') {
+            if !line.starts_with("@HD\t") {
+                text.push_str(line);
+                continue;
+            }
+
+            let (fields, end) = match line.strip_suffix('\n') {
+                Some(fields) => (fields, "\n"),
+                None => (line, ""),
+            };
+
+            let fields = fields
+                .split('\t')
+                .map(|field| {
+                    if field.starts_with("SO:") {
+                        "SO:unknown"
+                    } else {
+                        field
+                    }
+                })
+                .collect::<Vec<_>>();
+
+            text.push_str(&fields.join("\t"));
+            text.push_str(end);
+        }
+
+        self.text = text;
+    }
+
+    /// The header as written at the start of a BAM file.
+    pub fn to_bytes(&self) -> Vec<u8> {
+        let mut out = Vec::with_capacity(self.text.len() + 64 * self.references.len());
+
+        out.extend_from_slice(b"BAM\x01");
+        out.extend_from_slice(&(self.text.len() as u32).to_le_bytes());
+        out.extend_from_slice(self.text.as_bytes());
+        out.extend_from_slice(&(self.references.len() as u32).to_le_bytes());
+
+        for (name, length) in &self.references {
+            out.extend_from_slice(&(name.len() as u32 + 1).to_le_bytes());
+            out.extend_from_slice(name.as_bytes());
+            out.push(0);
+            out.extend_from_slice(&(*length as u32).to_le_bytes());
+        }
+
+        out
+    }
+
+    fn reference_id(&self, name: Option<&str>) -> Result<Option<usize>, ArrowError> {
+        match name {
+            None | Some("*") => Ok(None),
+            Some(name) => match self.ids.get(name) {
+                Some(id) => Ok(Some(*id)),
+                None => Err(ArrowError::InvalidArgumentError(format!(
+                    "reference {} is not in the header",
+                    name
+                ))),
+            },
+        }
+    }
+}
+
+fn invalid(message: String) -> ArrowError {
+    ArrowError::InvalidArgumentError(message)
+}
+
+/// Appends the packed CIGAR operations of `cigar` and returns the reference bases they consume.
+fn encode_cigar(cigar: &str, out: &mut Vec<u8>) -> Result<(u16, u64), ArrowError> {
+    if cigar == "*" || cigar.is_empty() {
+        return Ok((0, 0));
+    }
+
+    let mut count = 0u16;
+    let mut span = 0;
+    let mut length = 0u32;
+
+    for c in cigar.bytes() {
+        if c.is_ascii_digit() {
+            length = length * 10 + (c - b'0') as u32;
+            continue;
+        }
+
+        let op = CIGAR_OPS
+            .iter()
+            .position(|op| *op == c)
+            .ok_or_else(|| invalid(format!("invalid CIGAR {}", cigar)))? as u32;
+
+        // M, D, N, = and X consume the reference.
+        if matches!(op, 0 | 2 | 3 | 7 | 8) {
+            span += length as u64;
+        }
+
+        out.extend_from_slice(&(length << 4 | op).to_le_bytes());
+        count = count
+            .checked_add(1)
+            .ok_or_else(|| invalid(format!("CIGAR {} has too many operations", cigar)))?;
+        length = 0;
+    }
+
+    Ok((count, span))
+}
+
+fn encode_sequence(sequence: &[u8], out: &mut Vec<u8>) {
+    let code = |base: u8| {
+        BASES
+            .iter()
+            .position(|b| *b == base.to_ascii_uppercase())
+            .unwrap_or(15) as u8
+    };
+
+    for pair in sequence.chunks(2) {
+        let high = code(pair[0]) << 4;
+        let low = pair.get(1).map(|base| code(*base)).unwrap_or(0);
+        out.push(high | low);
+    }
+}
+
+/// Appends an aux field, typed as an integer or float if its text parses as one.
+fn encode_tag(tag: &str, value: &str, out: &mut Vec<u8>) -> Result<(), ArrowError> {
+    if tag.len() != 2 {
+        return Err(invalid(format!("invalid tag {}", tag)));
+    }
+
+    out.extend_from_slice(tag.as_bytes());
+
+    if let Ok(value) = value.parse::<i32>() {
+        out.push(b'i');
+        out.extend_from_slice(&value.to_le_bytes());
+    } else if let Ok(value) = value.parse::<f32>() {
+        out.push(b'f');
+        out.extend_from_slice(&value.to_le_bytes());
+    } else {
+        out.push(b'Z');
+        out.extend_from_slice(value.as_bytes());
+        out.push(0);
+    }
+
+    Ok(())
+}
+
+/// The `tag, value` fields of a tags column, formatted as text.
+struct Tags<'a> {
+    list: &'a ListArray,
+    tags: ArrayFormatter<'a>,
+    values: ArrayFormatter<'a>,
+}
+
+impl<'a> Tags<'a> {
+    fn new(array: &'a ArrayRef) -> Result<Self, ArrowError> {
+        let list = array
+            .as_any()
+            .downcast_ref::<ListArray>()
+            .ok_or_else(|| invalid("tags must be a list of (tag, value) structs".to_string()))?;
+
+        let fields = list
+            .values()
+            .as_any()
+            .downcast_ref::<StructArray>()
+            .filter(|fields| fields.num_columns() == 2)
+            .ok_or_else(|| invalid("tags must be a list of (tag, value) structs".to_string()))?;
+
+        let options = FormatOptions::default();
+        Ok(Self {
+            list,
+            tags: ArrayFormatter::try_new(fields.column(0).as_ref(), &options)?,
+            values: ArrayFormatter::try_new(fields.column(1).as_ref(), &options)?,
+        })
+    }
+
+    fn encode(&self, row: usize, out: &mut Vec<u8>) -> Result<(), ArrowError> {
+        if self.list.is_null(row) {
+            return Ok(());
+        }
+
+        let offsets = self.list.value_offsets();
+        for entry in offsets[row] as usize..offsets[row + 1] as usize {
+            let tag = self.tags.value(entry).to_string();
+            let value = self.values.value(entry).to_string();
+            encode_tag(&tag, &value, out)?;
+        }
+
+        Ok(())
+    }
+}
+
+/// Appends the records of `batch` to `out`, as BAM records against `header`. `columns` maps each
+/// entry of `COLUMNS` to its column in the batch. When `records` is given, the position of each
+/// record is added to it for indexing.
+pub fn write_batch(
+    batch: &RecordBatch,
+    header: &BamHeader,
+    columns: &[Option<usize>],
+    out: &mut Vec<u8>,
+    mut records: Option<&mut Vec<IndexedRecord>>,
+) -> Result<(), ArrowError> {
+    let column = |index: usize, data_type: &DataType| -> Result<Option<ArrayRef>, ArrowError> {
+        columns[index]
+            .map(|column| cast(batch.column(column), data_type))
+            .transpose()
+    };
+
+    let mut arrays = vec![None; COLUMNS.len()];
+    for index in [
+        NAME,
+        REFERENCE,
+        CIGAR,
+        MATE_REFERENCE,
+        SEQUENCE,
+        QUALITY_SCORE,
+    ] {
+        arrays[index] = column(index, &DataType::Utf8)?;
+    }
+    for index in [FLAG, START, MAPPING_QUALITY, MATE_START, TEMPLATE_LENGTH] {
+        arrays[index] = column(index, &DataType::Int64)?;
+    }
+
+    let string = |index: usize, row: usize| {
+        arrays[index]
+            .as_ref()
+            .map(|array| array.as_string::<i32>())
+            .filter(|array| !array.is_null(row))
+            .map(|array| array.value(row))
+    };
+
+    let integer = |index: usize, row: usize| {
+        arrays[index]
+            .as_ref()
+            .map(|array| array.as_primitive::<Int64Type>())
+            .filter(|array| !array.is_null(row))
+            .map(|array| array.value(row))
+    };
+
+    let tags = match columns[TAGS] {
+        Some(column) => Some(Tags::new(batch.column(column))?),
+        None => None,
+    };
+
+    let mut cigar = Vec::new();
+
+    for row in 0..batch.num_rows() {
+        let record_start = out.len();
+
+        let name = string(NAME, row).unwrap_or("*");
+        let flag = integer(FLAG, row).unwrap_or(0) as u16;
+        let reference_id = header.reference_id(string(REFERENCE, row))?;
+        let position = integer(START, row).map(|start| start - 1).unwrap_or(-1);
+        let mapping_quality = integer(MAPPING_QUALITY, row)
+            .map(|mapping_quality| mapping_quality as u8)
+            .unwrap_or(MISSING_MAPPING_QUALITY);
+
+        let mate_reference_id = match string(MATE_REFERENCE, row) {
+            Some("=") => reference_id,
+            mate_reference => header.reference_id(mate_reference)?,
+        };
+        let mate_position = integer(MATE_START, row)
+            .map(|start| start - 1)
+            .unwrap_or(-1);
+        let template_length = integer(TEMPLATE_LENGTH, row).unwrap_or(0);
+
+        let sequence = string(SEQUENCE, row).filter(|s| *s != "*").unwrap_or("");
+        let quality = string(QUALITY_SCORE, row).filter(|q| *q != "*");
+
+        if let Some(quality) = quality {
+            if quality.len() != sequence.len() {
+                return Err(invalid(format!(
+                    "{}: {} quality scores for {} bases",
+                    name,
+                    quality.len(),
+                    sequence.len()
+                )));
+            }
+        }
+
+        if name.len() > 254 {
+            return Err(invalid(format!("read name {} is too long", name)));
+        }
+
+        cigar.clear();
+        let (cigar_count, span) = encode_cigar(string(CIGAR, row).unwrap_or("*"), &mut cigar)?;
+
+        let unmapped = flag & 0x4 != 0;
+        let placed = reference_id.is_some() && position >= 0;
+        let start = position.max(0) as u64;
+        let end = if unmapped {
+            start + 1
+        } else {
+            start + span.max(1)
+        };
+        let bin = if position < 0 {
+            UNPLACED_BIN
+        } else {
+            reg2bin(start, end, BAI_MIN_SHIFT, BAI_DEPTH) as u16
+        };
+
+        let to_i32 = |id: Option<usize>| id.map(|id| id as i32).unwrap_or(-1);
+
+        // The block size is filled in once the record is complete.
+        out.extend_from_slice(&[0; 4]);
+        out.extend_from_slice(&to_i32(reference_id).to_le_bytes());
+        out.extend_from_slice(&(position as i32).to_le_bytes());
+        out.push(name.len() as u8 + 1);
+        out.push(mapping_quality);
+        out.extend_from_slice(&bin.to_le_bytes());
+        out.extend_from_slice(&cigar_count.to_le_bytes());
+        out.extend_from_slice(&flag.to_le_bytes());
+        out.extend_from_slice(&(sequence.len() as u32).to_le_bytes());
+        out.extend_from_slice(&to_i32(mate_reference_id).to_le_bytes());
+        out.extend_from_slice(&(mate_position as i32).to_le_bytes());
+        out.extend_from_slice(&(template_length as i32).to_le_bytes());
+        out.extend_from_slice(name.as_bytes());
+        out.push(0);
+        out.extend_from_slice(&cigar);
+        encode_sequence(sequence.as_bytes(), out);
+
+        match quality {
+            Some(quality) => out.extend(quality.bytes().map(|q| q.saturating_sub(33))),
+            None => out.resize(out.len() + sequence.len(), MISSING_QUALITY),
+        }
+
+        if let Some(tags) = &tags {
+            tags.encode(row, out)?;
+        }
+
+        let block_size = (out.len() - record_start - 4) as u32;
+        out[record_start..record_start + 4].copy_from_slice(&block_size.to_le_bytes());
+
+        if let Some(records) = records.as_mut() {
+            records.push(IndexedRecord {
+                reference_id: if placed { reference_id } else { None },
+                start,
+                end,
+                mapped: !unmapped,
+                end_offset: out.len(),
+            });
+        }
+    }
+
+    Ok(())
+}
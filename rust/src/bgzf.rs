@@ -0,0 +1,419 @@
+// Copyright 2023 WHERE TRUE Technologies.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+use std::io::{self, Read};
+
+use flate2::{
+    read::MultiGzDecoder, Compress, Compression, Decompress, FlushCompress, FlushDecompress, Status,
+};
+
+/// The largest a BGZF block can be, compressed or not.
+pub const MAX_BLOCK_SIZE: usize = 65536;
+
+/// The most uncompressed bytes written to one block, leaving room for incompressible data.
+pub const MAX_BLOCK_INPUT: usize = 0xff00;
+
+/// The empty block marking the end of a BGZF file.
+pub const EOF_BLOCK: [u8; 28] = [
+    0x1f, 0x8b, 0x08, 0x04, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff, 0x06, 0x00, 0x42, 0x43, 0x02, 0x00,
+    0x1b, 0x00, 0x03, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+];
+
+const HEADER_SIZE: usize = 18;
+const FOOTER_SIZE: usize = 8;
+
+fn invalid_data<E: Into<Box<dyn std::error::Error + Send + Sync>>>(e: E) -> io::Error {
+    io::Error::new(io::ErrorKind::InvalidData, e)
+}
+
+/// Returns the total size of the BGZF block at the start of `data`, or `None` if `data` is too
+/// short to contain its header.
+pub fn block_size(data: &[u8]) -> io::Result<Option<usize>> {
+    if data.len() < HEADER_SIZE {
+        return Ok(None);
+    }
+
+    if data[0] != 0x1f || data[1] != 0x8b || data[2] != 0x08 || data[3] & 0x04 == 0 {
+        return Err(invalid_data("invalid BGZF header"));
+    }
+
+    let xlen = u16::from_le_bytes([data[10], data[11]]) as usize;
+    if data.len() < 12 + xlen {
+        return Ok(None);
+    }
+
+    let mut extra = &data[12..12 + xlen];
+    while extra.len() >= 4 {
+        let slen = u16::from_le_bytes([extra[2], extra[3]]) as usize;
+        if extra[0] == b'B' && extra[1] == b'C' && slen == 2 && extra.len() >= 6 {
+            let bsize = u16::from_le_bytes([extra[4], extra[5]]) as usize;
+            return Ok(Some(bsize + 1));
+        }
+
+        extra = &extra[(4 + slen).min(extra.len())..];
+    }
+
+    Err(invalid_data("missing BGZF block size"))
+}
+
+/// Inflates the complete BGZF block `block`, appending the uncompressed bytes to `out`.
+pub fn inflate_block(block: &[u8], out: &mut Vec<u8>) -> io::Result<()> {
+    let xlen = u16::from_le_bytes([block[10], block[11]]) as usize;
+    let data_start = 12 + xlen;
+
+    if block.len() < data_start + FOOTER_SIZE {
+        return Err(invalid_data("truncated BGZF block"));
+    }
+
+    let data = &block[data_start..block.len() - FOOTER_SIZE];
+    let footer = &block[block.len() - FOOTER_SIZE..];
+    let isize = u32::from_le_bytes([footer[4], footer[5], footer[6], footer[7]]) as usize;
+
+    let start = out.len();
+    out.reserve(isize);
+
+    let mut decompress = Decompress::new(false);
+    match decompress
+        .decompress_vec(data, out, FlushDecompress::Finish)
+        .map_err(invalid_data)?
+    {
+        Status::StreamEnd => {}
+        _ => return Err(invalid_data("truncated BGZF block")),
+    }
+
+    if out.len() - start != isize {
+        return Err(invalid_data("BGZF block size mismatch"));
+    }
+
+    let crc = u32::from_le_bytes([footer[0], footer[1], footer[2], footer[3]]);
+    if crc32fast::hash(&out[start..]) != crc {
+        return Err(invalid_data("BGZF block checksum mismatch"));
+    }
+
+    Ok(())
+}
+
+/// Compresses `data`, at most `MAX_BLOCK_INPUT` bytes, into one BGZF block appended to `out`.
+pub fn deflate_block(data: &[u8], out: &mut Vec<u8>) -> io::Result<()> {
+    if data.len() > MAX_BLOCK_INPUT {
+        return Err(invalid_data("BGZF block input too large"));
+    }
+
+    let mut compressed = Vec::with_capacity(MAX_BLOCK_SIZE);
+    let mut compress = Compress::new(Compression::default(), false);
+    match compress
+        .compress_vec(data, &mut compressed, FlushCompress::Finish)
+        .map_err(invalid_data)?
+    {
+        Status::StreamEnd => {}
+        _ => return Err(invalid_data("BGZF block overflow")),
+    }
+
+    let bsize = HEADER_SIZE + compressed.len() + FOOTER_SIZE - 1;
+    if bsize >= MAX_BLOCK_SIZE {
+        return Err(invalid_data("BGZF block overflow"));
+    }
+
+    out.extend_from_slice(&[
+        0x1f, 0x8b, 0x08, 0x04, 0, 0, 0, 0, 0, 0xff, 0x06, 0x00, b'B', b'C',
+    ]);
+    out.extend_from_slice(&2u16.to_le_bytes());
+    out.extend_from_slice(&(bsize as u16).to_le_bytes());
+    out.extend_from_slice(&compressed);
+    out.extend_from_slice(&crc32fast::hash(data).to_le_bytes());
+    out.extend_from_slice(&(data.len() as u32).to_le_bytes());
+
+    Ok(())
+}
+
+/// Compresses an entire buffer into BGZF blocks followed by the EOF block, e.g. a tabix or CSI
+/// index.
+pub fn deflate_all(data: &[u8]) -> io::Result<Vec<u8>> {
+    let mut out = Vec::with_capacity(data.len() / 2 + EOF_BLOCK.len());
+    for chunk in data.chunks(MAX_BLOCK_INPUT) {
+        deflate_block(chunk, &mut out)?;
+    }
+
+    out.extend_from_slice(&EOF_BLOCK);
+
+    Ok(out)
+}
+
+/// The offset, compressed size and uncompressed size of every block in the BGZF file `data`,
+/// read from the block headers and footers without inflating anything.
+pub fn block_offsets(data: &[u8]) -> io::Result<Vec<(u64, usize, usize)>> {
+    let mut blocks = vec![];
+    let mut position = 0;
+
+    while position < data.len() {
+        let size = match block_size(&data[position..])? {
+            Some(size) if position + size <= data.len() && size >= HEADER_SIZE + FOOTER_SIZE => {
+                size
+            }
+            _ => return Err(invalid_data("truncated BGZF block")),
+        };
+
+        let footer = &data[position + size - 4..position + size];
+        let isize = u32::from_le_bytes([footer[0], footer[1], footer[2], footer[3]]) as usize;
+
+        blocks.push((position as u64, size, isize));
+        position += size;
+    }
+
+    Ok(blocks)
+}
+
+/// A BGZF block located in the compressed file.
+pub struct Block {
+    /// Offset of the block in the compressed file.
+    pub compressed_offset: u64,
+    /// Size of the block in the compressed file.
+    pub compressed_size: usize,
+    /// The uncompressed bytes.
+    pub data: Vec<u8>,
+}
+
+/// Splits `data` into blocks, inflating every complete block found. `base_offset` is the position
+/// of `data[0]` in the compressed file. Returns the blocks and the number of bytes consumed.
+pub fn inflate_blocks(data: &[u8], base_offset: u64) -> io::Result<(Vec<Block>, usize)> {
+    let mut blocks = vec![];
+    let mut position = 0;
+
+    while let Some(size) = block_size(&data[position..])? {
+        if position + size > data.len() {
+            break;
+        }
+
+        let mut block_data = Vec::new();
+        inflate_block(&data[position..position + size], &mut block_data)?;
+
+        blocks.push(Block {
+            compressed_offset: base_offset + position as u64,
+            compressed_size: size,
+            data: block_data,
+        });
+
+        position += size;
+    }
+
+    Ok((blocks, position))
+}
+
+/// Inflates an entire BGZF (or multi-member gzip) buffer, e.g. a tabix or CSI index.
+pub fn inflate_all(data: &[u8]) -> io::Result<Vec<u8>> {
+    let mut out = Vec::new();
+    MultiGzDecoder::new(data).read_to_end(&mut out)?;
+
+    Ok(out)
+}
+
+/// Splits a virtual offset into its compressed block offset and offset within the block.
+pub fn split_virtual_offset(virtual_offset: u64) -> (u64, u16) {
+    (virtual_offset >> 16, (virtual_offset & 0xffff) as u16)
+}
+
+/// Builds a virtual offset from a compressed block offset and an offset within the block.
+pub fn virtual_offset(compressed_offset: u64, uncompressed_offset: u16) -> u64 {
+    (compressed_offset << 16) | uncompressed_offset as u64
+}
+
+/// The uncompressed stream of a BGZF file, read sequentially while tracking the virtual offset.
+pub trait BgzfRead {
+    /// Moves to a block with unread bytes, returns false at the end of the file.
+    fn fill(&mut self) -> io::Result<bool>;
+
+    /// The unread bytes of the current block.
+    fn available(&self) -> &[u8];
+
+    /// Marks the next `n` bytes of the current block as read.
+    fn consume(&mut self, n: usize);
+
+    /// The virtual offset of the next unread byte. At the end of a block it is the start of the
+    /// following one, as htslib reports it.
+    fn virtual_offset(&self) -> u64;
+
+    /// Reads exactly `n` bytes into `buf`, returns false at the end of the file.
+    fn read_exact(&mut self, n: usize, buf: &mut Vec<u8>) -> io::Result<bool> {
+        buf.clear();
+
+        while buf.len() < n && self.fill()? {
+            let available = self.available();
+            let take = (n - buf.len()).min(available.len());
+
+            buf.extend_from_slice(&available[..take]);
+            self.consume(take);
+        }
+
+        match buf.len() {
+            len if len == n => Ok(true),
+            0 => Ok(false),
+            _ => Err(io::Error::new(
+                io::ErrorKind::UnexpectedEof,
+                "truncated record",
+            )),
+        }
+    }
+
+    /// Moves past the next `n` bytes without copying them, returns false if the file ends first.
+    fn skip(&mut self, mut n: usize) -> io::Result<bool> {
+        while n > 0 && self.fill()? {
+            let take = n.min(self.available().len());
+            self.consume(take);
+            n -= take;
+        }
+
+        Ok(n == 0)
+    }
+
+    /// Reads a line, including its newline, into `buf`, returns false at the end of the file.
+    fn read_line(&mut self, buf: &mut Vec<u8>) -> io::Result<bool> {
+        buf.clear();
+
+        while self.fill()? {
+            let available = self.available();
+
+            match available.iter().position(|b| *b == b'\n') {
+                Some(i) => {
+                    buf.extend_from_slice(&available[..=i]);
+                    self.consume(i + 1);
+
+                    return Ok(true);
+                }
+                None => {
+                    buf.extend_from_slice(available);
+                    let n = available.len();
+                    self.consume(n);
+                }
+            }
+        }
+
+        Ok(!buf.is_empty())
+    }
+
+    /// Reads exactly `n` bytes of a file header into `buf`, which must not end early.
+    fn read_header(&mut self, n: usize, buf: &mut Vec<u8>) -> io::Result<()> {
+        if self.read_exact(n, buf)? {
+            Ok(())
+        } else {
+            Err(invalid_data("truncated header"))
+        }
+    }
+}
+
+/// The compressed bytes a `BlockCursor` reads its blocks from.
+pub trait BlockSource {
+    /// The bytes of the file from `offset` on: at least `MAX_BLOCK_SIZE` of them unless the file
+    /// ends first, and none past its end.
+    fn bytes_from(&mut self, offset: u64) -> io::Result<&[u8]>;
+}
+
+impl<D: AsRef<[u8]>> BlockSource for D {
+    fn bytes_from(&mut self, offset: u64) -> io::Result<&[u8]> {
+        Ok(self.as_ref().get(offset as usize..).unwrap_or(&[]))
+    }
+}
+
+/// Reads a BGZF file one block at a time from any virtual offset, for reads that jump around
+/// the file rather than stream through it. The file is borrowed, or owned, e.g. as a `Mmap`, by
+/// cursors that outlive the scope that opened it, or fetched as it is read.
+pub struct BlockCursor<D: BlockSource> {
+    data: D,
+    // Offset and compressed size of the current block; a size of 0 means no block is loaded and
+    // the next one starts at `block_offset`.
+    block_offset: u64,
+    block_size: usize,
+    block: Vec<u8>,
+    position: usize,
+}
+
+impl<D: BlockSource> BlockCursor<D> {
+    pub fn new(data: D) -> Self {
+        Self {
+            data,
+            block_offset: 0,
+            block_size: 0,
+            block: Vec::with_capacity(MAX_BLOCK_SIZE),
+            position: 0,
+        }
+    }
+
+    /// Moves to `virtual_offset`, inflating its block unless it is the current one.
+    pub fn seek(&mut self, virtual_offset: u64) -> io::Result<()> {
+        let (compressed_offset, position) = split_virtual_offset(virtual_offset);
+
+        if self.block_size == 0 || compressed_offset != self.block_offset {
+            if !self.load(compressed_offset)? {
+                return Err(invalid_data(format!(
+                    "virtual offset {} is past the end of the file",
+                    virtual_offset
+                )));
+            }
+        }
+
+        self.position = position as usize;
+
+        Ok(())
+    }
+
+    /// Inflates the block at `offset`, returns false at the end of the file.
+    fn load(&mut self, offset: u64) -> io::Result<bool> {
+        self.block.clear();
+        self.block_offset = offset;
+        self.block_size = 0;
+        self.position = 0;
+
+        let rest = self.data.bytes_from(offset)?;
+        if rest.is_empty() {
+            return Ok(false);
+        }
+
+        let size = match block_size(rest)? {
+            Some(size) if size <= rest.len() => size,
+            _ => return Err(invalid_data("truncated BGZF block")),
+        };
+
+        inflate_block(&rest[..size], &mut self.block)?;
+        self.block_size = size;
+
+        Ok(true)
+    }
+}
+
+impl<D: BlockSource> BgzfRead for BlockCursor<D> {
+    fn fill(&mut self) -> io::Result<bool> {
+        while self.position >= self.block.len() {
+            if !self.load(self.block_offset + self.block_size as u64)? {
+                return Ok(false);
+            }
+        }
+
+        Ok(true)
+    }
+
+    fn available(&self) -> &[u8] {
+        &self.block[self.position..]
+    }
+
+    fn consume(&mut self, n: usize) {
+        self.position += n;
+    }
+
+    fn virtual_offset(&self) -> u64 {
+        if self.position < self.block.len() {
+            virtual_offset(self.block_offset, self.position as u16)
+        } else {
+            virtual_offset(self.block_offset + self.block_size as u64, 0)
+        }
+    }
+}
@@ -0,0 +1,551 @@
+// Copyright 2023 WHERE TRUE Technologies.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+//! Readers and writers for the BAI, tabix and CSI binning indexes, which share one layout: per
+//! reference sequence, a set of bins holding chunks of virtual offsets plus a pseudo-bin of
+//! metadata.
+
+use std::io;
+
+use crate::bgzf;
+
+const BAI_MAGIC: &[u8; 4] = b"BAI\x01";
+const TBI_MAGIC: &[u8; 4] = b"TBI\x01";
+const CSI_MAGIC: &[u8; 4] = b"CSI\x01";
+
+pub const BAI_MIN_SHIFT: u32 = 14;
+pub const BAI_DEPTH: u32 = 5;
+
+fn invalid_data<E: Into<Box<dyn std::error::Error + Send + Sync>>>(e: E) -> io::Error {
+    io::Error::new(io::ErrorKind::InvalidData, e)
+}
+
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+pub enum IndexFormat {
+    Bai,
+    Tbi,
+    Csi,
+}
+
+/// A range of virtual offsets `[start, end)`.
+#[derive(Clone, Copy, Debug, PartialEq, Eq, PartialOrd, Ord)]
+pub struct Chunk {
+    pub start: u64,
+    pub end: u64,
+}
+
+#[derive(Clone, Debug)]
+pub struct Bin {
+    pub id: u32,
+    /// The smallest virtual offset of a record in the bin, only stored by CSI.
+    pub loffset: u64,
+    pub chunks: Vec<Chunk>,
+}
+
+/// The pseudo-bin of a reference sequence.
+#[derive(Clone, Copy, Debug, Default)]
+pub struct Metadata {
+    pub start: u64,
+    pub end: u64,
+    pub mapped: u64,
+    pub unmapped: u64,
+}
+
+#[derive(Clone, Debug, Default)]
+pub struct ReferenceIndex {
+    pub bins: Vec<Bin>,
+    /// The linear index (BAI and tabix only): smallest virtual offset per 16 kbp window.
+    pub intervals: Vec<u64>,
+    pub metadata: Option<Metadata>,
+}
+
+/// The tabix header, stored by tabix indexes and by CSI indexes of tabix-style files.
+#[derive(Clone, Debug)]
+pub struct TabixHeader {
+    pub format: i32,
+    pub col_seq: i32,
+    pub col_beg: i32,
+    pub col_end: i32,
+    pub meta: u8,
+    pub skip: i32,
+    pub names: Vec<String>,
+}
+
+#[derive(Clone, Debug)]
+pub struct BinningIndex {
+    pub format: IndexFormat,
+    pub min_shift: u32,
+    pub depth: u32,
+    pub tabix: Option<TabixHeader>,
+    pub references: Vec<ReferenceIndex>,
+    pub unplaced_unmapped: Option<u64>,
+}
+
+struct Cursor<'a> {
+    data: &'a [u8],
+    position: usize,
+}
+
+impl<'a> Cursor<'a> {
+    fn new(data: &'a [u8]) -> Self {
+        Self { data, position: 0 }
+    }
+
+    fn take(&mut self, n: usize) -> io::Result<&'a [u8]> {
+        if self.position + n > self.data.len() {
+            return Err(io::Error::new(
+                io::ErrorKind::UnexpectedEof,
+                "truncated index",
+            ));
+        }
+
+        let value = &self.data[self.position..self.position + n];
+        self.position += n;
+
+        Ok(value)
+    }
+
+    fn i32(&mut self) -> io::Result<i32> {
+        let b = self.take(4)?;
+        Ok(i32::from_le_bytes([b[0], b[1], b[2], b[3]]))
+    }
+
+    fn u32(&mut self) -> io::Result<u32> {
+        let b = self.take(4)?;
+        Ok(u32::from_le_bytes([b[0], b[1], b[2], b[3]]))
+    }
+
+    fn u64(&mut self) -> io::Result<u64> {
+        let b = self.take(8)?;
+        let mut buf = [0u8; 8];
+        buf.copy_from_slice(b);
+        Ok(u64::from_le_bytes(buf))
+    }
+
+    fn count(&mut self) -> io::Result<usize> {
+        usize::try_from(self.i32()?).map_err(invalid_data)
+    }
+
+    fn is_empty(&self) -> bool {
+        self.position >= self.data.len()
+    }
+}
+
+fn write_count(out: &mut Vec<u8>, count: usize) -> io::Result<()> {
+    let count = i32::try_from(count).map_err(invalid_data)?;
+    out.extend_from_slice(&count.to_le_bytes());
+
+    Ok(())
+}
+
+fn write_tabix_header(out: &mut Vec<u8>, tabix: &TabixHeader) -> io::Result<()> {
+    let mut names = vec![];
+    for name in &tabix.names {
+        names.extend_from_slice(name.as_bytes());
+        names.push(0);
+    }
+
+    for value in [
+        tabix.format,
+        tabix.col_seq,
+        tabix.col_beg,
+        tabix.col_end,
+        tabix.meta as i32,
+        tabix.skip,
+    ] {
+        out.extend_from_slice(&value.to_le_bytes());
+    }
+
+    write_count(out, names.len())?;
+    out.extend_from_slice(&names);
+
+    Ok(())
+}
+
+/// The id of the pseudo-bin holding a reference's metadata.
+pub fn pseudo_bin(depth: u32) -> u32 {
+    (((1u64 << ((depth + 1) * 3)) - 1) / 7 + 1) as u32
+}
+
+/// The bin fully containing the zero-based, half-open interval `[start, end)`.
+pub fn reg2bin(start: u64, end: u64, min_shift: u32, depth: u32) -> u32 {
+    let end = end.max(start + 1) - 1;
+
+    let mut shift = min_shift;
+    let mut t = ((1u64 << (depth * 3)) - 1) / 7;
+
+    let mut level = depth;
+    while level > 0 {
+        if start >> shift == end >> shift {
+            return (t + (start >> shift)) as u32;
+        }
+
+        shift += 3;
+        t -= 1u64 << ((level - 1) * 3);
+        level -= 1;
+    }
+
+    0
+}
+
+/// All bins that may hold records overlapping the zero-based, half-open interval `[start, end)`.
+pub fn reg2bins(start: u64, end: u64, min_shift: u32, depth: u32) -> Vec<u32> {
+    let max_position = 1u64 << (min_shift + depth * 3);
+    let end = end.min(max_position).max(start + 1) - 1;
+    let start = start.min(end);
+
+    let mut bins = vec![];
+
+    let mut shift = min_shift + depth * 3;
+    let mut t = 0u64;
+
+    for level in 0..=depth {
+        let first = t + (start >> shift);
+        let last = t + (end >> shift);
+
+        for bin in first..=last {
+            bins.push(bin as u32);
+        }
+
+        t += 1u64 << (level * 3);
+        shift = shift.saturating_sub(3);
+    }
+
+    bins
+}
+
+/// Sorts chunks and merges those that overlap or touch.
+pub fn merge_chunks(mut chunks: Vec<Chunk>) -> Vec<Chunk> {
+    chunks.sort();
+
+    let mut merged: Vec<Chunk> = Vec::with_capacity(chunks.len());
+    for chunk in chunks {
+        match merged.last_mut() {
+            Some(last) if chunk.start <= last.end => last.end = last.end.max(chunk.end),
+            _ => merged.push(chunk),
+        }
+    }
+
+    merged
+}
+
+impl BinningIndex {
+    /// Parses an index from the bytes of a `.bai`, `.tbi` or `.csi` file.
+    pub fn parse(raw: &[u8]) -> io::Result<Self> {
+        if raw.starts_with(BAI_MAGIC) {
+            return Self::parse_uncompressed(raw);
+        }
+
+        let data = bgzf::inflate_all(raw)?;
+        Self::parse_uncompressed(&data)
+    }
+
+    fn parse_uncompressed(data: &[u8]) -> io::Result<Self> {
+        let mut cursor = Cursor::new(data);
+        let magic = cursor.take(4)?;
+
+        let (format, min_shift, depth, tabix) = if magic == BAI_MAGIC {
+            (IndexFormat::Bai, BAI_MIN_SHIFT, BAI_DEPTH, None)
+        } else if magic == TBI_MAGIC {
+            let n_ref = cursor.count()?;
+            let tabix = Self::parse_tabix_header(&mut cursor)?;
+
+            return Self::parse_references(
+                cursor,
+                IndexFormat::Tbi,
+                BAI_MIN_SHIFT,
+                BAI_DEPTH,
+                Some(tabix),
+                Some(n_ref),
+            );
+        } else if magic == CSI_MAGIC {
+            let min_shift = cursor.u32()?;
+            let depth = cursor.u32()?;
+            let l_aux = cursor.count()?;
+            let aux = cursor.take(l_aux)?;
+
+            let tabix = if l_aux >= 28 {
+                Some(Self::parse_tabix_header(&mut Cursor::new(aux))?)
+            } else {
+                None
+            };
+
+            (IndexFormat::Csi, min_shift, depth, tabix)
+        } else {
+            return Err(invalid_data("unknown index format"));
+        };
+
+        Self::parse_references(cursor, format, min_shift, depth, tabix, None)
+    }
+
+    fn parse_tabix_header(cursor: &mut Cursor) -> io::Result<TabixHeader> {
+        let format = cursor.i32()?;
+        let col_seq = cursor.i32()?;
+        let col_beg = cursor.i32()?;
+        let col_end = cursor.i32()?;
+        let meta = cursor.i32()? as u8;
+        let skip = cursor.i32()?;
+        let l_nm = cursor.count()?;
+        let names = cursor
+            .take(l_nm)?
+            .split(|b| *b == 0)
+            .filter(|name| !name.is_empty())
+            .map(|name| String::from_utf8_lossy(name).to_string())
+            .collect();
+
+        Ok(TabixHeader {
+            format,
+            col_seq,
+            col_beg,
+            col_end,
+            meta,
+            skip,
+            names,
+        })
+    }
+
+    fn parse_references(
+        mut cursor: Cursor,
+        format: IndexFormat,
+        min_shift: u32,
+        depth: u32,
+        tabix: Option<TabixHeader>,
+        n_ref: Option<usize>,
+    ) -> io::Result<Self> {
+        let n_ref = match n_ref {
+            Some(n_ref) => n_ref,
+            None => cursor.count()?,
+        };
+
+        let metadata_bin = pseudo_bin(depth);
+        let mut references = Vec::with_capacity(n_ref);
+
+        for _ in 0..n_ref {
+            let mut reference = ReferenceIndex::default();
+
+            let n_bin = cursor.count()?;
+            for _ in 0..n_bin {
+                let id = cursor.u32()?;
+                let loffset = if format == IndexFormat::Csi {
+                    cursor.u64()?
+                } else {
+                    0
+                };
+
+                let n_chunk = cursor.count()?;
+                let mut chunks = Vec::with_capacity(n_chunk);
+                for _ in 0..n_chunk {
+                    let start = cursor.u64()?;
+                    let end = cursor.u64()?;
+                    chunks.push(Chunk { start, end });
+                }
+
+                if id == metadata_bin && chunks.len() == 2 {
+                    reference.metadata = Some(Metadata {
+                        start: chunks[0].start,
+                        end: chunks[0].end,
+                        mapped: chunks[1].start,
+                        unmapped: chunks[1].end,
+                    });
+                } else {
+                    reference.bins.push(Bin {
+                        id,
+                        loffset,
+                        chunks,
+                    });
+                }
+            }
+
+            if format != IndexFormat::Csi {
+                let n_intv = cursor.count()?;
+                reference.intervals.reserve(n_intv);
+                for _ in 0..n_intv {
+                    reference.intervals.push(cursor.u64()?);
+                }
+            }
+
+            references.push(reference);
+        }
+
+        let unplaced_unmapped = if cursor.is_empty() {
+            None
+        } else {
+            Some(cursor.u64()?)
+        };
+
+        Ok(Self {
+            format,
+            min_shift,
+            depth,
+            tabix,
+            references,
+            unplaced_unmapped,
+        })
+    }
+
+    /// Serializes the index as the bytes of a `.bai`, `.tbi` or `.csi` file.
+    pub fn to_bytes(&self) -> io::Result<Vec<u8>> {
+        let mut out = vec![];
+
+        match self.format {
+            IndexFormat::Bai => {
+                out.extend_from_slice(BAI_MAGIC);
+                write_count(&mut out, self.references.len())?;
+            }
+            IndexFormat::Tbi => {
+                let tabix = self
+                    .tabix
+                    .as_ref()
+                    .ok_or_else(|| invalid_data("tabix index without a tabix header"))?;
+
+                out.extend_from_slice(TBI_MAGIC);
+                write_count(&mut out, self.references.len())?;
+                write_tabix_header(&mut out, tabix)?;
+            }
+            IndexFormat::Csi => {
+                let mut aux = vec![];
+                if let Some(tabix) = &self.tabix {
+                    write_tabix_header(&mut aux, tabix)?;
+                }
+
+                out.extend_from_slice(CSI_MAGIC);
+                out.extend_from_slice(&self.min_shift.to_le_bytes());
+                out.extend_from_slice(&self.depth.to_le_bytes());
+                write_count(&mut out, aux.len())?;
+                out.extend_from_slice(&aux);
+                write_count(&mut out, self.references.len())?;
+            }
+        }
+
+        let metadata_bin = pseudo_bin(self.depth);
+
+        for reference in &self.references {
+            let n_bin = reference.bins.len() + reference.metadata.is_some() as usize;
+            write_count(&mut out, n_bin)?;
+
+            for bin in &reference.bins {
+                out.extend_from_slice(&bin.id.to_le_bytes());
+                if self.format == IndexFormat::Csi {
+                    out.extend_from_slice(&bin.loffset.to_le_bytes());
+                }
+
+                write_count(&mut out, bin.chunks.len())?;
+                for chunk in &bin.chunks {
+                    out.extend_from_slice(&chunk.start.to_le_bytes());
+                    out.extend_from_slice(&chunk.end.to_le_bytes());
+                }
+            }
+
+            if let Some(metadata) = reference.metadata {
+                out.extend_from_slice(&metadata_bin.to_le_bytes());
+                if self.format == IndexFormat::Csi {
+                    out.extend_from_slice(&0u64.to_le_bytes());
+                }
+
+                write_count(&mut out, 2)?;
+                for value in [
+                    metadata.start,
+                    metadata.end,
+                    metadata.mapped,
+                    metadata.unmapped,
+                ] {
+                    out.extend_from_slice(&value.to_le_bytes());
+                }
+            }
+
+            if self.format != IndexFormat::Csi {
+                write_count(&mut out, reference.intervals.len())?;
+                for interval in &reference.intervals {
+                    out.extend_from_slice(&interval.to_le_bytes());
+                }
+            }
+        }
+
+        if let Some(unplaced_unmapped) = self.unplaced_unmapped {
+            out.extend_from_slice(&unplaced_unmapped.to_le_bytes());
+        }
+
+        match self.format {
+            IndexFormat::Bai => Ok(out),
+            _ => bgzf::deflate_all(&out),
+        }
+    }
+
+    /// Reference sequence names stored in the index itself (tabix-style indexes only).
+    pub fn reference_names(&self) -> Option<&[String]> {
+        self.tabix.as_ref().map(|tabix| tabix.names.as_slice())
+    }
+
+    /// The merged chunks that may hold records overlapping the zero-based, half-open interval
+    /// `[start, end)` of reference `reference_id`.
+    pub fn query(&self, reference_id: usize, start: u64, end: u64) -> Vec<Chunk> {
+        let reference = match self.references.get(reference_id) {
+            Some(reference) => reference,
+            None => return vec![],
+        };
+
+        let bins = reg2bins(start, end, self.min_shift, self.depth);
+
+        // Chunks ending before the smallest offset of the window can't hold overlapping records.
+        let min_offset = match self.format {
+            IndexFormat::Csi => {
+                // Walk up from the leaf bin holding `start` to the first bin present in the index.
+                let mut bin = reg2bin(start, start + 1, self.min_shift, self.depth);
+                loop {
+                    if let Some(found) = reference.bins.iter().find(|b| b.id == bin) {
+                        break found.loffset;
+                    }
+
+                    if bin == 0 {
+                        break 0;
+                    }
+
+                    bin = (bin - 1) >> 3;
+                }
+            }
+            _ => {
+                let window = (start >> BAI_MIN_SHIFT) as usize;
+                reference
+                    .intervals
+                    .get(window.min(reference.intervals.len().saturating_sub(1)))
+                    .copied()
+                    .unwrap_or(0)
+            }
+        };
+
+        let chunks = reference
+            .bins
+            .iter()
+            .filter(|bin| bins.contains(&bin.id))
+            .flat_map(|bin| bin.chunks.iter().copied())
+            .filter(|chunk| chunk.end > min_offset)
+            .collect();
+
+        merge_chunks(chunks)
+    }
+
+    /// All chunks of a reference sequence, merged, i.e. the records placed on it.
+    pub fn reference_chunks(&self, reference_id: usize) -> Vec<Chunk> {
+        match self.references.get(reference_id) {
+            Some(reference) => merge_chunks(
+                reference
+                    .bins
+                    .iter()
+                    .flat_map(|bin| bin.chunks.iter().copied())
+                    .collect(),
+            ),
+            None => vec![],
+        }
+    }
+}
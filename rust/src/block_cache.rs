@@ -0,0 +1,917 @@
+// Copyright 2023 WHERE TRUE Technologies.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+//! An in-memory block cache for remote objects, shared by every query in the process, plus a
+//! planner that turns the index chunks of a region query into a few coalesced, parallel range
+//! requests issued before the reader asks for them. Blocks missing from memory are looked up in
+//! the disk cache, when one is configured, before going to the network.
+
+use std::{
+    collections::HashMap,
+    fmt::Display,
+    io,
+    num::NonZeroUsize,
+    ops::Range,
+    sync::{
+        atomic::{AtomicBool, Ordering},
+        Arc, Mutex, OnceLock,
+    },
+};
+
+use async_trait::async_trait;
+use bytes::{Bytes, BytesMut};
+use datafusion::{
+    datasource::listing::ListingTableUrl, error::DataFusionError, prelude::SessionContext,
+};
+use futures::{stream, StreamExt, TryStreamExt};
+use lru::LruCache;
+use object_store::{
+    path::Path, GetOptions, GetResult, ListResult, MultipartId, ObjectMeta, ObjectStore,
+};
+use tokio::{io::AsyncWrite, runtime::Runtime};
+use url::Url;
+
+use crate::{
+    bgzf,
+    binning_index::{BinningIndex, Chunk},
+    disk_cache::{block_key, disk_cache, DiskCache},
+    region::{parse_bam_references, parse_vcf_contig_lengths},
+};
+
+/// Size of a cached block; requests are widened to block boundaries.
+pub const BLOCK_SIZE: usize = 256 * 1024;
+
+/// Ranges closer than this are fetched with one request, trading a little over-read for a
+/// round trip.
+pub const COALESCE_GAP: usize = 1024 * 1024;
+
+/// Number of range requests in flight at once.
+pub const PREFETCH_PARALLELISM: usize = 8;
+
+const DEFAULT_CAPACITY: usize = 256 * 1024 * 1024;
+
+/// Whole objects of at most this fraction of the memory cache are read through it.
+const SMALL_OBJECT_FRACTION: usize = 8;
+
+type BlockKey = (String, usize);
+
+pub struct BlockCache {
+    blocks: Mutex<LruCache<BlockKey, Bytes>>,
+}
+
+impl BlockCache {
+    fn new(capacity: usize) -> Self {
+        Self {
+            blocks: Mutex::new(LruCache::new(Self::block_count(capacity))),
+        }
+    }
+
+    fn block_count(capacity: usize) -> NonZeroUsize {
+        NonZeroUsize::new((capacity / BLOCK_SIZE).max(1)).unwrap()
+    }
+
+    fn get(&self, key: &BlockKey) -> Option<Bytes> {
+        self.blocks.lock().unwrap().get(key).cloned()
+    }
+
+    fn put(&self, key: BlockKey, block: Bytes) {
+        self.blocks.lock().unwrap().put(key, block);
+    }
+
+    fn capacity(&self) -> usize {
+        self.blocks.lock().unwrap().cap().get() * BLOCK_SIZE
+    }
+
+    /// Resizes the cache to hold `capacity` bytes, evicting the least recently used blocks.
+    pub fn set_capacity(&self, capacity: usize) {
+        self.blocks
+            .lock()
+            .unwrap()
+            .resize(Self::block_count(capacity));
+    }
+}
+
+static BLOCK_CACHE: OnceLock<BlockCache> = OnceLock::new();
+static BLOCK_CACHE_ENABLED: AtomicBool = AtomicBool::new(true);
+
+/// The process-wide block cache.
+pub fn block_cache() -> &'static BlockCache {
+    BLOCK_CACHE.get_or_init(|| BlockCache::new(DEFAULT_CAPACITY))
+}
+
+fn block_cache_enabled() -> bool {
+    BLOCK_CACHE_ENABLED.load(Ordering::Relaxed)
+}
+
+/// Sets the block cache size in bytes, zero disables the cache and prefetching.
+#[no_mangle]
+pub extern "C" fn set_block_cache_capacity(capacity: usize) {
+    BLOCK_CACHE_ENABLED.store(capacity > 0, Ordering::Relaxed);
+
+    block_cache().set_capacity(capacity);
+}
+
+/// Widens `ranges` to block boundaries within an object of `size` bytes and merges ranges whose
+/// gap is at most `COALESCE_GAP`, returning sorted, disjoint requests.
+pub fn plan_requests(ranges: &[Range<usize>], size: usize) -> Vec<Range<usize>> {
+    let mut aligned = ranges
+        .iter()
+        .filter(|range| range.start < range.end && range.start < size)
+        .map(|range| {
+            let start = range.start / BLOCK_SIZE * BLOCK_SIZE;
+            let end = ((range.end + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE).min(size);
+            start..end
+        })
+        .collect::<Vec<_>>();
+
+    aligned.sort_by_key(|range| range.start);
+
+    let mut planned: Vec<Range<usize>> = Vec::with_capacity(aligned.len());
+    for range in aligned {
+        match planned.last_mut() {
+            Some(last) if range.start <= last.end + COALESCE_GAP => {
+                last.end = last.end.max(range.end)
+            }
+            _ => planned.push(range),
+        }
+    }
+
+    planned
+}
+
+/// An `ObjectStore` wrapper serving range reads from the shared block cache.
+#[derive(Debug)]
+pub struct CachingObjectStore {
+    inner: Arc<dyn ObjectStore>,
+    name: String,
+    metas: Mutex<HashMap<Path, ObjectMeta>>,
+}
+
+impl Display for CachingObjectStore {
+    fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+        write!(f, "CachingObjectStore({})", self.inner)
+    }
+}
+
+impl CachingObjectStore {
+    pub fn new(inner: Arc<dyn ObjectStore>, url: &Url) -> Self {
+        Self {
+            inner,
+            name: url.to_string(),
+            metas: Mutex::new(HashMap::new()),
+        }
+    }
+
+    async fn meta(&self, location: &Path) -> object_store::Result<ObjectMeta> {
+        if let Some(meta) = self.metas.lock().unwrap().get(location) {
+            return Ok(meta.clone());
+        }
+
+        let meta = self.inner.head(location).await?;
+        self.metas
+            .lock()
+            .unwrap()
+            .insert(location.clone(), meta.clone());
+
+        Ok(meta)
+    }
+
+    // Cached blocks are keyed on the object version, so a rewritten object is never served stale.
+    fn object_key(&self, meta: &ObjectMeta) -> String {
+        format!(
+            "{}{}@{}:{}:{}",
+            self.name,
+            meta.location,
+            meta.size,
+            meta.last_modified.timestamp_millis(),
+            meta.e_tag.as_deref().unwrap_or("")
+        )
+    }
+
+    /// Looks `block` up in memory, then on disk, promoting disk hits into memory.
+    fn cached_block(&self, key: &str, block: usize) -> Option<Bytes> {
+        let memory = block_cache_enabled().then(block_cache);
+
+        if let Some(data) = memory.and_then(|cache| cache.get(&(key.to_string(), block))) {
+            return Some(data);
+        }
+
+        let data = disk_cache()?.get(&block_key(key, block))?;
+        if let Some(cache) = memory {
+            cache.put((key.to_string(), block), data.clone());
+        }
+
+        Some(data)
+    }
+
+    fn cache_block(&self, key: &str, block: usize, data: &Bytes) {
+        if block_cache_enabled() {
+            block_cache().put((key.to_string(), block), data.clone());
+        }
+
+        if let Some(disk) = disk_cache() {
+            disk.put(&block_key(key, block), data);
+        }
+    }
+
+    /// Reads `ranges` of `location`, fetching the missing blocks with coalesced, parallel requests.
+    pub async fn read_ranges(
+        &self,
+        location: &Path,
+        ranges: &[Range<usize>],
+    ) -> object_store::Result<Vec<Bytes>> {
+        let meta = self.meta(location).await?;
+        let key = self.object_key(&meta);
+
+        // Keep a local copy of every block used, the caches may evict them before assembly.
+        let mut blocks: HashMap<usize, Bytes> = HashMap::new();
+
+        // Split the planned requests into runs of blocks that are not cached yet.
+        let mut missing = vec![];
+        for planned in plan_requests(ranges, meta.size) {
+            let mut run: Option<Range<usize>> = None;
+
+            for block in (planned.start / BLOCK_SIZE)..((planned.end + BLOCK_SIZE - 1) / BLOCK_SIZE)
+            {
+                let block_range = block * BLOCK_SIZE..((block + 1) * BLOCK_SIZE).min(meta.size);
+
+                if let Some(data) = self.cached_block(&key, block) {
+                    blocks.insert(block, data);
+                    missing.extend(run.take());
+                    continue;
+                }
+
+                run = match run {
+                    Some(run) => Some(run.start..block_range.end),
+                    None => Some(block_range),
+                };
+            }
+
+            missing.extend(run);
+        }
+
+        let fetched = stream::iter(missing)
+            .map(|range| async move {
+                self.inner
+                    .get_range(location, range.clone())
+                    .await
+                    .map(|bytes| (range, bytes))
+            })
+            .buffer_unordered(PREFETCH_PARALLELISM)
+            .try_collect::<Vec<_>>()
+            .await?;
+
+        for (range, bytes) in fetched {
+            let mut offset = range.start;
+            while offset < range.end {
+                let block = offset / BLOCK_SIZE;
+                let end = ((block + 1) * BLOCK_SIZE).min(range.end);
+                let data = bytes.slice(offset - range.start..end - range.start);
+
+                self.cache_block(&key, block, &data);
+                blocks.insert(block, data);
+
+                offset = end;
+            }
+        }
+
+        let mut results = Vec::with_capacity(ranges.len());
+        for range in ranges {
+            let end = range.end.min(meta.size);
+            let mut out = BytesMut::with_capacity(end.saturating_sub(range.start));
+
+            let mut offset = range.start;
+            while offset < end {
+                let block = offset / BLOCK_SIZE;
+                let data = match blocks.get(&block) {
+                    Some(data) => data.clone(),
+                    None => match self.cached_block(&key, block) {
+                        Some(data) => data,
+                        None => {
+                            let block_range =
+                                block * BLOCK_SIZE..((block + 1) * BLOCK_SIZE).min(meta.size);
+                            self.inner.get_range(location, block_range).await?
+                        }
+                    },
+                };
+
+                let block_start = block * BLOCK_SIZE;
+                let block_end = (block_start + data.len()).min(end);
+                out.extend_from_slice(&data[offset - block_start..block_end - block_start]);
+
+                offset = block_end;
+            }
+
+            results.push(out.freeze());
+        }
+
+        Ok(results)
+    }
+
+    /// Streams a whole object through the disk cache: served from disk when every block is
+    /// there, otherwise streamed from the inner store and written to disk block by block.
+    async fn get_through_disk(
+        &self,
+        location: &Path,
+        options: GetOptions,
+        disk: Arc<DiskCache>,
+    ) -> object_store::Result<GetResult> {
+        let meta = self.meta(location).await?;
+        let key = self.object_key(&meta);
+        let block_count = (meta.size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+        if (0..block_count).all(|block| disk.contains(&block_key(&key, block))) {
+            let inner = self.inner.clone();
+            let location = location.clone();
+            let size = meta.size;
+
+            let blocks = stream::iter(0..block_count).then(move |block| {
+                let disk = disk.clone();
+                let inner = inner.clone();
+                let location = location.clone();
+                let key = block_key(&key, block);
+
+                async move {
+                    match disk.get(&key) {
+                        Some(data) => Ok(data),
+                        // Evicted since the check above.
+                        None => {
+                            let range = block * BLOCK_SIZE..((block + 1) * BLOCK_SIZE).min(size);
+                            inner.get_range(&location, range).await
+                        }
+                    }
+                }
+            });
+
+            return Ok(GetResult::Stream(blocks.boxed()));
+        }
+
+        let size = meta.size;
+        let mut pending = BytesMut::new();
+        let mut block = 0;
+
+        let stream = self
+            .inner
+            .get_opts(location, options)
+            .await?
+            .into_stream()
+            .map(move |chunk| {
+                if let Ok(bytes) = &chunk {
+                    pending.extend_from_slice(bytes);
+
+                    while pending.len() >= BLOCK_SIZE
+                        || (!pending.is_empty() && block * BLOCK_SIZE + pending.len() == size)
+                    {
+                        let length = pending.len().min(BLOCK_SIZE);
+                        disk.put(&block_key(&key, block), &pending.split_to(length));
+                        block += 1;
+                    }
+                }
+
+                chunk
+            });
+
+        Ok(GetResult::Stream(stream.boxed()))
+    }
+}
+
+#[async_trait]
+impl ObjectStore for CachingObjectStore {
+    async fn put(&self, location: &Path, bytes: Bytes) -> object_store::Result<()> {
+        self.inner.put(location, bytes).await
+    }
+
+    async fn put_multipart(
+        &self,
+        location: &Path,
+    ) -> object_store::Result<(MultipartId, Box<dyn AsyncWrite + Unpin + Send>)> {
+        self.inner.put_multipart(location).await
+    }
+
+    async fn abort_multipart(
+        &self,
+        location: &Path,
+        multipart_id: &MultipartId,
+    ) -> object_store::Result<()> {
+        self.inner.abort_multipart(location, multipart_id).await
+    }
+
+    async fn get_opts(
+        &self,
+        location: &Path,
+        options: GetOptions,
+    ) -> object_store::Result<GetResult> {
+        // Small whole objects, like the indexes exon reads before every region query, are read
+        // through the block caches. Larger whole-object streams (full scans) bypass the memory
+        // cache rather than flushing it, but go through the disk cache when the object fits
+        // comfortably.
+        let conditional = options.if_match.is_some()
+            || options.if_none_match.is_some()
+            || options.if_modified_since.is_some()
+            || options.if_unmodified_since.is_some();
+
+        match options.range.clone() {
+            Some(range) => {
+                let bytes = self.get_range(location, range).await?;
+                Ok(GetResult::Stream(
+                    stream::once(async move { Ok(bytes) }).boxed(),
+                ))
+            }
+            None if conditional => self.inner.get_opts(location, options).await,
+            None => {
+                let size = self.meta(location).await?.size;
+
+                let small = size <= block_cache().capacity() / SMALL_OBJECT_FRACTION;
+                if block_cache_enabled() && small {
+                    let bytes = self.get_range(location, 0..size).await?;
+                    return Ok(GetResult::Stream(
+                        stream::once(async move { Ok(bytes) }).boxed(),
+                    ));
+                }
+
+                match disk_cache() {
+                    Some(disk) if size as u64 <= disk.capacity() / 2 => {
+                        self.get_through_disk(location, options, disk).await
+                    }
+                    _ => self.inner.get_opts(location, options).await,
+                }
+            }
+        }
+    }
+
+    async fn get_range(&self, location: &Path, range: Range<usize>) -> object_store::Result<Bytes> {
+        Ok(self
+            .read_ranges(location, &[range])
+            .await?
+            .pop()
+            .unwrap_or_default())
+    }
+
+    async fn get_ranges(
+        &self,
+        location: &Path,
+        ranges: &[Range<usize>],
+    ) -> object_store::Result<Vec<Bytes>> {
+        self.read_ranges(location, ranges).await
+    }
+
+    async fn head(&self, location: &Path) -> object_store::Result<ObjectMeta> {
+        self.meta(location).await
+    }
+
+    async fn delete(&self, location: &Path) -> object_store::Result<()> {
+        self.inner.delete(location).await
+    }
+
+    async fn list(
+        &self,
+        prefix: Option<&Path>,
+    ) -> object_store::Result<futures::stream::BoxStream<'_, object_store::Result<ObjectMeta>>>
+    {
+        self.inner.list(prefix).await
+    }
+
+    async fn list_with_delimiter(&self, prefix: Option<&Path>) -> object_store::Result<ListResult> {
+        self.inner.list_with_delimiter(prefix).await
+    }
+
+    async fn copy(&self, from: &Path, to: &Path) -> object_store::Result<()> {
+        self.inner.copy(from, to).await
+    }
+
+    async fn copy_if_not_exists(&self, from: &Path, to: &Path) -> object_store::Result<()> {
+        self.inner.copy_if_not_exists(from, to).await
+    }
+}
+
+/// Wraps the object store registered for `uri` with the block and disk caches. Local files are
+/// left alone, the page cache already serves them.
+pub fn register_block_cache(
+    ctx: &SessionContext,
+    uri: &str,
+) -> Result<Option<(Arc<CachingObjectStore>, Path)>, DataFusionError> {
+    let table_url = ListingTableUrl::parse(uri)?;
+    let store_url = table_url.object_store();
+    let url: &Url = store_url.as_ref();
+
+    if url.scheme() == "file" || !(block_cache_enabled() || disk_cache().is_some()) {
+        return Ok(None);
+    }
+
+    let inner = ctx.runtime_env().object_store(&store_url)?;
+    let store = Arc::new(CachingObjectStore::new(inner, url));
+
+    ctx.runtime_env().register_object_store(url, store.clone());
+
+    Ok(Some((store, table_url.prefix().clone())))
+}
+
+/// The kinds of indexed files whose region queries can be planned ahead.
+#[derive(Clone, Copy, Debug)]
+pub enum IndexedFormat {
+    Bam,
+    Vcf,
+    Bcf,
+}
+
+impl IndexedFormat {
+    pub fn index_extensions(&self) -> &'static [&'static str] {
+        match self {
+            IndexedFormat::Bam => &["bai", "csi"],
+            IndexedFormat::Vcf => &["tbi", "csi"],
+            IndexedFormat::Bcf => &["csi"],
+        }
+    }
+}
+
+fn io_error<E: Into<Box<dyn std::error::Error + Send + Sync>>>(e: E) -> io::Error {
+    io::Error::new(io::ErrorKind::Other, e)
+}
+
+/// Finds and parses the index of `location` in `store`, trying each sidecar extension in turn,
+/// returning the index file's metadata alongside it. Through a `CachingObjectStore` the index is
+/// read via the block cache.
+pub async fn find_index(
+    store: &dyn ObjectStore,
+    location: &Path,
+    format: IndexedFormat,
+) -> io::Result<(ObjectMeta, BinningIndex)> {
+    for extension in format.index_extensions() {
+        let index_location = Path::from(format!("{}.{}", location, extension));
+
+        let meta = match store.head(&index_location).await {
+            Ok(meta) => meta,
+            Err(_) => continue,
+        };
+
+        if let Ok(raw) = store.get_range(&index_location, 0..meta.size).await {
+            return Ok((meta, BinningIndex::parse(&raw)?));
+        }
+    }
+
+    Err(io::Error::new(
+        io::ErrorKind::NotFound,
+        format!("no index found for {}", location),
+    ))
+}
+
+/// Finds and parses the index of `location` in `store`.
+pub async fn read_index(
+    store: &dyn ObjectStore,
+    location: &Path,
+    format: IndexedFormat,
+) -> io::Result<BinningIndex> {
+    find_index(store, location, format)
+        .await
+        .map(|(_, index)| index)
+}
+
+/// Parses the header of a BAM, VCF or BCF file with `parse`, growing the read until it has
+/// inflated enough of the file for `parse` to return a value rather than `None`.
+pub async fn read_header_prefix<T, F>(
+    store: &dyn ObjectStore,
+    location: &Path,
+    format: IndexedFormat,
+    parse: F,
+) -> io::Result<T>
+where
+    F: Fn(&[u8]) -> io::Result<Option<T>>,
+{
+    let size = store.head(location).await.map_err(io_error)?.size;
+    let mut prefix_size = BLOCK_SIZE;
+
+    loop {
+        let prefix_size_clamped = prefix_size.min(size);
+        let raw = store
+            .get_range(location, 0..prefix_size_clamped)
+            .await
+            .map_err(io_error)?;
+
+        // Only VCF files may be stored uncompressed.
+        let data = if matches!(format, IndexedFormat::Vcf) && !raw.starts_with(&[0x1f, 0x8b]) {
+            raw.to_vec()
+        } else {
+            let (blocks, _) = bgzf::inflate_blocks(&raw, 0)?;
+            blocks
+                .into_iter()
+                .flat_map(|block| block.data)
+                .collect::<Vec<_>>()
+        };
+
+        if let Some(parsed) = parse(&data)? {
+            return Ok(parsed);
+        }
+
+        if prefix_size_clamped == size {
+            return Err(io::Error::new(
+                io::ErrorKind::InvalidData,
+                "truncated header",
+            ));
+        }
+
+        prefix_size *= 4;
+    }
+}
+
+/// Reads the reference sequence names and lengths of a BAM, VCF or BCF file from its header.
+/// VCF contigs declared without a length have none.
+pub async fn read_header_references(
+    store: &dyn ObjectStore,
+    location: &Path,
+    format: IndexedFormat,
+) -> io::Result<Vec<(String, Option<u64>)>> {
+    read_header_prefix(store, location, format, |data| {
+        Ok(match format {
+            IndexedFormat::Bam => parse_bam_references(data)?.map(|references| {
+                references
+                    .into_iter()
+                    .map(|(name, length)| (name, Some(length)))
+                    .collect()
+            }),
+            IndexedFormat::Vcf => {
+                parse_vcf_header(data).map(|text| parse_vcf_contig_lengths(&text))
+            }
+            IndexedFormat::Bcf => {
+                parse_bcf_header(data).map(|text| parse_vcf_contig_lengths(&text))
+            }
+        })
+    })
+    .await
+}
+
+/// Reads the reference sequence names of a BAM, VCF or BCF file from its header.
+pub async fn read_header_names(
+    store: &dyn ObjectStore,
+    location: &Path,
+    format: IndexedFormat,
+) -> io::Result<Vec<String>> {
+    Ok(read_header_references(store, location, format)
+        .await?
+        .into_iter()
+        .map(|(name, _)| name)
+        .collect())
+}
+
+/// The header text of a VCF file, up to and including the `#CHROM` line, or `None` if `data` does
+/// not yet hold all of it.
+pub fn parse_vcf_header(data: &[u8]) -> Option<String> {
+    let mut position = 0;
+
+    while position < data.len() {
+        let line_end = position + data[position..].iter().position(|b| *b == b'\n')?;
+
+        if data[position..].starts_with(b"#CHROM") {
+            return Some(String::from_utf8_lossy(&data[..line_end]).to_string());
+        }
+
+        position = line_end + 1;
+    }
+
+    None
+}
+
+/// The VCF header text of a BCF file, or `None` if `data` does not yet hold all of it.
+pub fn parse_bcf_header(data: &[u8]) -> Option<String> {
+    if data.len() < 9 {
+        return None;
+    }
+
+    let l_text = u32::from_le_bytes([data[5], data[6], data[7], data[8]]) as usize;
+    data.get(9..9 + l_text).map(|text| {
+        String::from_utf8_lossy(text)
+            .trim_end_matches('\0')
+            .to_string()
+    })
+}
+
+/// The byte ranges of a BGZF file holding `chunks`, each running to the end of its last block.
+pub fn chunk_ranges(chunks: &[Chunk]) -> Vec<Range<usize>> {
+    chunks
+        .iter()
+        .map(|chunk| {
+            let (start, _) = bgzf::split_virtual_offset(chunk.start);
+            let (end, _) = bgzf::split_virtual_offset(chunk.end);
+
+            start as usize..end as usize + bgzf::MAX_BLOCK_SIZE
+        })
+        .collect()
+}
+
+/// Fetches `chunks` of `location` into the block cache in parallel, so the reader that follows
+/// is served from memory. Chunks shared or nearly shared between regions are fetched once.
+pub async fn prefetch_chunks(
+    store: &CachingObjectStore,
+    location: &Path,
+    chunks: &[Chunk],
+) -> io::Result<()> {
+    if chunks.is_empty() {
+        return Ok(());
+    }
+
+    store
+        .read_ranges(location, &chunk_ranges(chunks))
+        .await
+        .map_err(io_error)?;
+
+    Ok(())
+}
+
+/// Bytes fetched at most by one request of an `ObjectBlocks`.
+const OBJECT_WINDOW: usize = 8 * 1024 * 1024;
+
+/// An object read by a `BlockCursor` from a thread outside the runtime, one range request at a
+/// time. A read inside one of the planned ranges fetches the rest of it, up to `OBJECT_WINDOW`
+/// bytes, so the chunks of a region query take a request per run of nearby chunks rather than
+/// one per block; other reads fetch a `BLOCK_SIZE` window.
+#[derive(Clone)]
+pub struct ObjectBlocks {
+    store: Arc<dyn ObjectStore>,
+    location: Path,
+    size: usize,
+    planned: Vec<Range<usize>>,
+    rt: Arc<Runtime>,
+    // The last range fetched and where it starts.
+    start: usize,
+    data: Bytes,
+}
+
+impl ObjectBlocks {
+    pub async fn open(
+        store: Arc<dyn ObjectStore>,
+        location: Path,
+        rt: Arc<Runtime>,
+    ) -> io::Result<Self> {
+        let size = store.head(&location).await.map_err(io_error)?.size;
+
+        Ok(Self {
+            store,
+            location,
+            size,
+            planned: vec![],
+            rt,
+            start: 0,
+            data: Bytes::new(),
+        })
+    }
+
+    /// Plans the requests reading `chunks` will make.
+    pub fn plan(&mut self, chunks: &[Chunk]) {
+        self.planned = plan_requests(&chunk_ranges(chunks), self.size);
+    }
+}
+
+impl bgzf::BlockSource for ObjectBlocks {
+    fn bytes_from(&mut self, offset: u64) -> io::Result<&[u8]> {
+        let offset = offset as usize;
+        if offset >= self.size {
+            return Ok(&[]);
+        }
+
+        let needed = (offset + bgzf::MAX_BLOCK_SIZE).min(self.size);
+        if offset < self.start || needed > self.start + self.data.len() {
+            let planned_end = self
+                .planned
+                .iter()
+                .find(|range| range.start <= offset && offset < range.end)
+                .map_or(0, |range| range.end.min(offset + OBJECT_WINDOW));
+            let end = planned_end.max(offset + BLOCK_SIZE).min(self.size);
+
+            self.data = self
+                .rt
+                .block_on(self.store.get_range(&self.location, offset..end))
+                .map_err(io_error)?;
+            self.start = offset;
+        }
+
+        Ok(&self.data[offset - self.start..])
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use object_store::memory::InMemory;
+
+    use super::*;
+
+    fn object(size: usize) -> Bytes {
+        (0..size)
+            .map(|i| (i % 251) as u8)
+            .collect::<Vec<_>>()
+            .into()
+    }
+
+    fn store(name: &str, data: &Bytes) -> (Arc<InMemory>, CachingObjectStore, Path) {
+        let rt = Runtime::new().unwrap();
+        let inner = Arc::new(InMemory::new());
+        let location = Path::from("test.bam");
+
+        rt.block_on(inner.put(&location, data.clone())).unwrap();
+
+        let url = Url::parse(&format!("memory://{}/", name)).unwrap();
+        let store = CachingObjectStore::new(inner.clone(), &url);
+
+        (inner, store, location)
+    }
+
+    #[test]
+    fn plan_requests_aligns_and_coalesces() {
+        let size = 16 * BLOCK_SIZE + 10;
+
+        let planned = plan_requests(
+            &[
+                // Out of order, and within the gap of the first range.
+                2 * BLOCK_SIZE + 5..2 * BLOCK_SIZE + 10,
+                10..20,
+                // Further than the gap from the others.
+                12 * BLOCK_SIZE + 1..12 * BLOCK_SIZE + 2,
+                // Clipped to the object.
+                16 * BLOCK_SIZE..17 * BLOCK_SIZE,
+                // Empty or past the end.
+                30..30,
+                size..size + 10,
+            ],
+            size,
+        );
+
+        assert_eq!(planned, vec![0..3 * BLOCK_SIZE, 12 * BLOCK_SIZE..size]);
+    }
+
+    #[test]
+    fn read_ranges_serves_cached_blocks() {
+        let rt = Runtime::new().unwrap();
+        let data = object(3 * BLOCK_SIZE + 100);
+        let (inner, store, location) = store("read-ranges", &data);
+
+        let ranges = [
+            10..20,
+            BLOCK_SIZE - 5..BLOCK_SIZE + 5,
+            3 * BLOCK_SIZE + 90..3 * BLOCK_SIZE + 200,
+        ];
+        let read = rt.block_on(store.read_ranges(&location, &ranges)).unwrap();
+
+        assert_eq!(read[0], data.slice(10..20));
+        assert_eq!(read[1], data.slice(BLOCK_SIZE - 5..BLOCK_SIZE + 5));
+        assert_eq!(read[2], data.slice(3 * BLOCK_SIZE + 90..data.len()));
+
+        // Every block read is cached, so the object is no longer needed.
+        rt.block_on(inner.delete(&location)).unwrap();
+
+        let read = rt
+            .block_on(store.get_range(&location, BLOCK_SIZE..BLOCK_SIZE + 10))
+            .unwrap();
+        assert_eq!(read, data.slice(BLOCK_SIZE..BLOCK_SIZE + 10));
+    }
+
+    #[test]
+    fn small_objects_are_cached_whole() {
+        let rt = Runtime::new().unwrap();
+        let data = object(BLOCK_SIZE + 100);
+        let (inner, store, location) = store("whole-object", &data);
+
+        let read = rt
+            .block_on(async { store.get(&location).await?.bytes().await })
+            .unwrap();
+        assert_eq!(read, data);
+
+        rt.block_on(inner.delete(&location)).unwrap();
+
+        let read = rt
+            .block_on(async { store.get(&location).await?.bytes().await })
+            .unwrap();
+        assert_eq!(read, data);
+    }
+
+    #[test]
+    fn block_cache_evicts_least_recently_used() {
+        let cache = BlockCache::new(2 * BLOCK_SIZE);
+        let key = |block| ("object".to_string(), block);
+
+        cache.put(key(0), Bytes::from_static(b"0"));
+        cache.put(key(1), Bytes::from_static(b"1"));
+
+        // Using the first block makes the second the least recently used.
+        assert!(cache.get(&key(0)).is_some());
+        cache.put(key(2), Bytes::from_static(b"2"));
+
+        assert!(cache.get(&key(1)).is_none());
+        assert_eq!(cache.get(&key(0)), Some(Bytes::from_static(b"0")));
+        assert_eq!(cache.get(&key(2)), Some(Bytes::from_static(b"2")));
+
+        cache.set_capacity(BLOCK_SIZE);
+
+        assert_eq!(cache.capacity(), BLOCK_SIZE);
+        assert!(cache.get(&key(0)).is_none());
+        assert!(cache.get(&key(2)).is_some());
+    }
+}
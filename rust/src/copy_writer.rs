@@ -0,0 +1,1269 @@
+// Copyright 2023 WHERE TRUE Technologies.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+//! Formats rows handed over from DuckDB as Arrow arrays into FASTA, FASTQ, GFF, BED, VCF or BAM
+//! records for `COPY ... TO`. Bgzipped output is compressed batch by batch into whole BGZF blocks,
+//! so batches encoded on different threads can be written back to back. Zstd output is compressed
+//! as the batches are written instead, into a single frame. BAM output can be indexed as it is
+//! written, from the records of each batch once its place in the file is known.
+
+use std::{
+    ffi::{c_char, CStr, CString},
+    fmt::Write as _,
+    fs,
+    io::{BufRead, BufReader, Write as _},
+    mem,
+    ptr::{null, null_mut},
+    slice,
+    sync::Mutex,
+};
+
+use arrow::{
+    array::{Array, ArrayRef, AsArray, BooleanArray, ListArray, MapArray, StructArray},
+    compute::cast,
+    datatypes::{DataType, Int64Type, Schema},
+    error::ArrowError,
+    ffi::{from_ffi, FFI_ArrowArray as ArrowArray, FFI_ArrowSchema as ArrowSchema},
+    record_batch::RecordBatch,
+    util::display::{ArrayFormatter, FormatOptions},
+};
+use flate2::read::MultiGzDecoder;
+use zstd::stream::write::Encoder as ZstdEncoder;
+
+use crate::{
+    bam_writer::{self, BamHeader, IndexedRecord},
+    bgzf,
+    binning_index::{IndexFormat, BAI_DEPTH, BAI_MIN_SHIFT},
+    index_builder::{csi_depth, write_file, IndexBuilder},
+};
+
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+pub enum CopyFormat {
+    Fasta,
+    Fastq,
+    Gff,
+    Bed,
+    Vcf,
+    Bam,
+}
+
+impl CopyFormat {
+    fn from_name(name: &str) -> Option<Self> {
+        match name.to_ascii_lowercase().as_str() {
+            "fasta" => Some(Self::Fasta),
+            "fastq" => Some(Self::Fastq),
+            "gff" => Some(Self::Gff),
+            "bed" => Some(Self::Bed),
+            "vcf" => Some(Self::Vcf),
+            "bam" => Some(Self::Bam),
+            _ => None,
+        }
+    }
+
+    /// The accepted names of each column, in output order, and whether it must be present.
+    fn columns(self) -> &'static [(&'static [&'static str], bool)] {
+        match self {
+            Self::Fasta => &[
+                (&["id", "name"], true),
+                (&["description"], false),
+                (&["sequence"], true),
+            ],
+            Self::Fastq => &[
+                (&["name", "id"], true),
+                (&["description"], false),
+                (&["sequence"], true),
+                (&["quality_scores", "quality"], true),
+            ],
+            Self::Gff => &[
+                (&["seqname", "seqid"], true),
+                (&["source"], false),
+                (&["type"], true),
+                (&["start"], true),
+                (&["end"], true),
+                (&["score"], false),
+                (&["strand"], false),
+                (&["phase", "frame"], false),
+                (&["attributes"], false),
+            ],
+            Self::Bed => &[
+                (&["reference_sequence_name", "chrom", "seqname"], true),
+                (&["start"], true),
+                (&["end"], true),
+                (&["name"], false),
+                (&["score"], false),
+                (&["strand"], false),
+                (&["thick_start"], false),
+                (&["thick_end"], false),
+                (&["color", "item_rgb"], false),
+                (&["block_count"], false),
+                (&["block_sizes"], false),
+                (&["block_starts"], false),
+            ],
+            Self::Vcf => &[
+                (&["chrom"], true),
+                (&["pos"], true),
+                (&["id"], false),
+                (&["ref"], true),
+                (&["alt"], false),
+                (&["qual"], false),
+                (&["filters", "filter"], false),
+                (&["info"], false),
+                (&["formats"], false),
+            ],
+            Self::Bam => bam_writer::COLUMNS,
+        }
+    }
+}
+
+// Column positions in `CopyFormat::columns`.
+const BED_START: usize = 1;
+const BED_THICK_START: usize = 6;
+const VCF_INFO: usize = 7;
+const VCF_FORMATS: usize = 8;
+
+/// Formats the values of one column. Nulls and empty lists are written as `.`.
+enum Values<'a> {
+    Scalar(&'a dyn Array, ArrayFormatter<'a>),
+    Boolean(&'a BooleanArray),
+    List(&'a ListArray, Box<Values<'a>>),
+    /// Written as GFF attributes, `key=value,value;key=value`.
+    Map(&'a MapArray, Box<Values<'a>>, Box<Values<'a>>),
+}
+
+impl<'a> Values<'a> {
+    fn new(array: &'a dyn Array) -> Result<Self, ArrowError> {
+        if let Some(list) = array.as_any().downcast_ref::<ListArray>() {
+            return Ok(Self::List(
+                list,
+                Box::new(Self::new(list.values().as_ref())?),
+            ));
+        }
+
+        if let Some(map) = array.as_any().downcast_ref::<MapArray>() {
+            return Ok(Self::Map(
+                map,
+                Box::new(Self::new(map.keys().as_ref())?),
+                Box::new(Self::new(map.values().as_ref())?),
+            ));
+        }
+
+        if let Some(boolean) = array.as_any().downcast_ref::<BooleanArray>() {
+            return Ok(Self::Boolean(boolean));
+        }
+
+        Ok(Self::Scalar(
+            array,
+            ArrayFormatter::try_new(array, &FormatOptions::default())?,
+        ))
+    }
+
+    fn array(&self) -> &dyn Array {
+        match self {
+            Self::Scalar(array, _) => *array,
+            Self::Boolean(array) => *array,
+            Self::List(array, _) => *array,
+            Self::Map(array, _, _) => *array,
+        }
+    }
+
+    /// True if the value at `row` is null or an empty list or map.
+    fn is_missing(&self, row: usize) -> bool {
+        if self.array().is_null(row) {
+            return true;
+        }
+
+        match self {
+            Self::List(list, _) => list.value_length(row) == 0,
+            Self::Map(map, _, _) => map.value_length(row) == 0,
+            _ => false,
+        }
+    }
+
+    /// Writes the value at `row`, joining list elements with `separator`.
+    fn write(&self, out: &mut String, row: usize, separator: char) {
+        if self.is_missing(row) {
+            out.push('.');
+            return;
+        }
+
+        match self {
+            Self::Scalar(_, formatter) => {
+                let _ = write!(out, "{}", formatter.value(row));
+            }
+            Self::Boolean(array) => out.push_str(if array.value(row) { "true" } else { "false" }),
+            Self::List(list, values) => {
+                let offsets = list.value_offsets();
+                for (i, element) in (offsets[row] as usize..offsets[row + 1] as usize).enumerate() {
+                    if i > 0 {
+                        out.push(separator);
+                    }
+
+                    values.write(out, element, separator);
+                }
+            }
+            Self::Map(map, keys, values) => {
+                let offsets = map.value_offsets();
+                for (i, entry) in (offsets[row] as usize..offsets[row + 1] as usize).enumerate() {
+                    if i > 0 {
+                        out.push(';');
+                    }
+
+                    keys.write(out, entry, ',');
+                    out.push('=');
+                    values.write(out, entry, ',');
+                }
+            }
+        }
+    }
+}
+
+/// The VCF header lines, up to and including `#CHROM`, of the VCF file at `path`, bgzipped or not.
+fn read_vcf_header(path: &str) -> Result<String, String> {
+    let file = fs::File::open(path).map_err(|e| format!("{}: {}", path, e))?;
+
+    let mut reader = BufReader::new(file);
+    let is_gzip = reader
+        .fill_buf()
+        .map(|data| data.starts_with(&[0x1f, 0x8b]))
+        .map_err(|e| format!("{}: {}", path, e))?;
+
+    let reader: Box<dyn BufRead> = if is_gzip {
+        Box::new(BufReader::new(MultiGzDecoder::new(reader)))
+    } else {
+        Box::new(reader)
+    };
+
+    let mut header = String::new();
+    for line in reader.lines() {
+        let line = line.map_err(|e| format!("{}: {}", path, e))?;
+        if !line.starts_with('#') {
+            break;
+        }
+
+        header.push_str(&line);
+        header.push('\n');
+
+        if line.starts_with("#CHROM") {
+            return Ok(header);
+        }
+    }
+
+    Err(format!("{}: no #CHROM line in the VCF header", path))
+}
+
+/// The IDs declared by the `##INFO` or `##FORMAT` lines of a VCF header.
+fn vcf_header_ids(header: &str, kind: &str) -> Vec<String> {
+    let prefix = format!("##{}=<ID=", kind);
+
+    header
+        .lines()
+        .filter_map(|line| line.strip_prefix(prefix.as_str()))
+        .filter_map(|rest| rest.split(',').next())
+        .map(|id| id.to_string())
+        .collect()
+}
+
+/// The header ID matching a column name, whose case the reader may have changed.
+fn vcf_key(ids: &[String], name: &str) -> String {
+    ids.iter()
+        .find(|id| id.eq_ignore_ascii_case(name))
+        .cloned()
+        .unwrap_or_else(|| name.to_string())
+}
+
+fn vcf_info_type(data_type: &DataType) -> (&'static str, &'static str) {
+    let (number, data_type) = match data_type {
+        DataType::List(field) => (".", field.data_type()),
+        DataType::Boolean => ("0", data_type),
+        _ => ("1", data_type),
+    };
+
+    let vcf_type = match data_type {
+        DataType::Boolean => "Flag",
+        DataType::Float16 | DataType::Float32 | DataType::Float64 => "Float",
+        data_type if data_type.is_integer() => "Integer",
+        _ => "String",
+    };
+
+    (number, vcf_type)
+}
+
+/// A minimal VCF header declaring the INFO fields of `schema`, used when no header is given.
+fn default_vcf_header(schema: &Schema, info: Option<usize>) -> String {
+    let mut header = String::from("##fileformat=VCFv4.3\n");
+
+    if let Some(DataType::Struct(fields)) = info.map(|info| schema.field(info).data_type()) {
+        for field in fields.iter() {
+            let (number, vcf_type) = vcf_info_type(field.data_type());
+            let _ = writeln!(
+                header,
+                "##INFO=<ID={},Number={},Type={},Description=\"{}\">",
+                field.name(),
+                number,
+                vcf_type,
+                field.name()
+            );
+        }
+    }
+
+    header.push_str("#CHROM\tPOS\tID\tREF\tALT\tQUAL\tFILTER\tINFO\n");
+    header
+}
+
+/// The INFO and FORMAT columns of a VCF batch, with their formatters.
+struct VcfColumns<'a> {
+    info: Option<&'a StructArray>,
+    info_values: Vec<Values<'a>>,
+    samples: Option<(&'a ListArray, &'a StructArray, Vec<Values<'a>>)>,
+}
+
+/// An encoded batch: the bytes to write and, when indexing, the records they hold.
+pub struct Encoded {
+    pub data: Vec<u8>,
+    pub records: Option<EncodedRecords>,
+}
+
+pub struct EncodedRecords {
+    records: Vec<IndexedRecord>,
+    /// The compressed offset of each BGZF block of the batch, then the batch's compressed length.
+    block_offsets: Vec<u64>,
+}
+
+/// An index built as encoded batches are written, in file order.
+struct OnlineIndex {
+    path: String,
+    builder: IndexBuilder,
+    /// Compressed bytes written so far.
+    written: u64,
+}
+
+/// How the output is compressed.
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+enum OutputCompression {
+    None,
+    Bgzf,
+    Zstd,
+}
+
+/// The zstd level of compressed output, the library's default.
+const ZSTD_LEVEL: i32 = 3;
+
+pub struct CopyWriter {
+    format: CopyFormat,
+    data_type: DataType,
+    compression: OutputCompression,
+    /// The frame zstd output is compressed into as it is committed, until the footer ends it.
+    zstd: Mutex<Option<ZstdEncoder<'static, Vec<u8>>>>,
+    /// Per entry of `CopyFormat::columns`, the index of the column in the input.
+    columns: Vec<Option<usize>>,
+    header: String,
+    /// The keys of the VCF INFO and FORMAT fields, per struct field.
+    info_keys: Vec<String>,
+    format_keys: Vec<String>,
+    sample_count: usize,
+    bam_header: Option<BamHeader>,
+    index: Option<Mutex<OnlineIndex>>,
+}
+
+impl CopyWriter {
+    /// `compression` is `auto` to follow the `.gz`/`.bgz` or `.zst`/`.zstd` extension of `path`,
+    /// `gzip` or `bgzip` for BGZF, `zstd`, or `none`. BAM output is always BGZF, and is indexed next to `path` when
+    /// `index_format` is `bai` or `csi`.
+    pub fn try_new(
+        format: CopyFormat,
+        schema: &Schema,
+        path: &str,
+        compression: &str,
+        header_from: Option<&str>,
+        index_format: Option<&str>,
+    ) -> Result<Self, String> {
+        let compression = match compression.to_ascii_lowercase().as_str() {
+            "none" | "uncompressed" if format == CopyFormat::Bam => {
+                return Err("BAM output is always BGZF-compressed".to_string())
+            }
+            _ if format == CopyFormat::Bam => OutputCompression::Bgzf,
+            "auto" | "auto_detect" | "" if path.ends_with(".gz") || path.ends_with(".bgz") => {
+                OutputCompression::Bgzf
+            }
+            "auto" | "auto_detect" | "" if path.ends_with(".zst") || path.ends_with(".zstd") => {
+                OutputCompression::Zstd
+            }
+            "auto" | "auto_detect" | "" => OutputCompression::None,
+            "gzip" | "bgzip" | "bgzf" => OutputCompression::Bgzf,
+            "zstd" | "zst" => OutputCompression::Zstd,
+            "none" | "uncompressed" => OutputCompression::None,
+            other => {
+                return Err(format!(
+                    "unsupported compression {}, expected gzip, zstd or none",
+                    other
+                ))
+            }
+        };
+
+        let zstd = match compression {
+            OutputCompression::Zstd => Some(
+                ZstdEncoder::new(vec![], ZSTD_LEVEL)
+                    .map_err(|e| format!("could not start zstd output: {}", e))?,
+            ),
+            _ => None,
+        };
+
+        let columns = format
+            .columns()
+            .iter()
+            .map(|(names, required)| {
+                let index = names.iter().find_map(|name| schema.index_of(name).ok());
+                match index {
+                    None if *required => Err(format!(
+                        "{:?} output needs a column named {}",
+                        format,
+                        names.join(" or ")
+                    )),
+                    index => Ok(index),
+                }
+            })
+            .collect::<Result<Vec<_>, _>>()?;
+
+        let mut writer = Self {
+            format,
+            data_type: DataType::Struct(schema.fields().clone()),
+            compression,
+            zstd: Mutex::new(zstd),
+            columns,
+            header: String::new(),
+            info_keys: vec![],
+            format_keys: vec![],
+            sample_count: 0,
+            bam_header: None,
+            index: None,
+        };
+
+        match format {
+            CopyFormat::Gff => writer.header = "##gff-version 3\n".to_string(),
+            CopyFormat::Vcf => writer.init_vcf(schema, header_from)?,
+            CopyFormat::Bam => {
+                let path = header_from.ok_or("BAM output needs HEADER_FROM for its header")?;
+                let mut header = BamHeader::read(path)?;
+
+                // Only an indexed output is checked to be sorted as it is written.
+                if index_format.is_none() {
+                    header.clear_sort_order();
+                }
+
+                writer.bam_header = Some(header);
+            }
+            _ => {}
+        }
+
+        if let Some(index_format) = index_format {
+            writer.index = Some(Mutex::new(writer.new_index(path, index_format)?));
+        }
+
+        Ok(writer)
+    }
+
+    fn new_index(&self, path: &str, index_format: &str) -> Result<OnlineIndex, String> {
+        let index_format = index_format.to_ascii_lowercase();
+        let references = match &self.bam_header {
+            Some(header) => &header.references,
+            None => {
+                return Err(format!(
+                    "{:?} output can not be indexed while it is written, use exon_index",
+                    self.format
+                ))
+            }
+        };
+
+        let (format, depth) = match index_format.as_str() {
+            "bai" => (IndexFormat::Bai, BAI_DEPTH),
+            "csi" => {
+                let max_length = references.iter().map(|(_, length)| *length).max();
+                (
+                    IndexFormat::Csi,
+                    csi_depth(BAI_MIN_SHIFT, max_length.unwrap_or(0)),
+                )
+            }
+            _ => {
+                return Err(format!(
+                    "unknown index format {}, expected bai or csi",
+                    index_format
+                ))
+            }
+        };
+
+        // The header ends a block, so the first record starts the next one.
+        let first_offset = bgzf::virtual_offset(self.header()?.len() as u64, 0);
+
+        Ok(OnlineIndex {
+            path: format!("{}.{}", path, index_format),
+            builder: IndexBuilder::new(
+                format,
+                BAI_MIN_SHIFT,
+                depth,
+                references.len(),
+                first_offset,
+            ),
+            written: 0,
+        })
+    }
+
+    fn init_vcf(&mut self, schema: &Schema, header_from: Option<&str>) -> Result<(), String> {
+        let info = self.columns[VCF_INFO];
+        let formats = self.columns[VCF_FORMATS];
+
+        self.header = match header_from {
+            Some(path) => read_vcf_header(path)?,
+            None if formats.is_some() => {
+                return Err("writing VCF genotypes needs HEADER_FROM for the sample names".into())
+            }
+            None => default_vcf_header(schema, info),
+        };
+
+        if let Some(DataType::Struct(fields)) = info.map(|info| schema.field(info).data_type()) {
+            let ids = vcf_header_ids(&self.header, "INFO");
+            self.info_keys = fields
+                .iter()
+                .map(|field| vcf_key(&ids, field.name()))
+                .collect();
+        }
+
+        if let Some(formats) = formats {
+            let fields = match schema.field(formats).data_type() {
+                DataType::List(field) => match field.data_type() {
+                    DataType::Struct(fields) => fields.clone(),
+                    _ => return Err("formats must be a list of structs".into()),
+                },
+                _ => return Err("formats must be a list of structs".into()),
+            };
+
+            let ids = vcf_header_ids(&self.header, "FORMAT");
+            self.format_keys = fields
+                .iter()
+                .map(|field| vcf_key(&ids, field.name()))
+                .collect();
+
+            let chrom_line = self.header.lines().last().unwrap_or_default();
+            self.sample_count = chrom_line.split('\t').count().saturating_sub(9);
+        }
+
+        Ok(())
+    }
+
+    /// Moves the batch out of a DuckDB Arrow array of a chunk.
+    unsafe fn import_batch(&self, array: *mut ArrowArray) -> Result<RecordBatch, ArrowError> {
+        let array = std::ptr::replace(array, ArrowArray::empty());
+        let schema = ArrowSchema::try_from(&self.data_type)?;
+        let data = from_ffi(array, &schema)?;
+
+        Ok(RecordBatch::from(StructArray::from(data)))
+    }
+
+    /// Compresses `data` into BGZF blocks, if the output is bgzipped, also returning the
+    /// compressed offset of each block and then the total length. Zstd output is compressed when
+    /// it is committed.
+    fn compress(&self, data: &[u8]) -> Result<(Vec<u8>, Vec<u64>), String> {
+        if self.compression != OutputCompression::Bgzf {
+            return Ok((data.to_vec(), vec![]));
+        }
+
+        let mut out = Vec::with_capacity(data.len() / 3);
+        let mut block_offsets = Vec::with_capacity(data.len() / bgzf::MAX_BLOCK_INPUT + 2);
+
+        for block in data.chunks(bgzf::MAX_BLOCK_INPUT) {
+            block_offsets.push(out.len() as u64);
+            bgzf::deflate_block(block, &mut out).map_err(|e| e.to_string())?;
+        }
+
+        block_offsets.push(out.len() as u64);
+
+        Ok((out, block_offsets))
+    }
+
+    /// The bytes written before the first record.
+    pub fn header(&self) -> Result<Vec<u8>, String> {
+        let header = match &self.bam_header {
+            Some(header) => header.to_bytes(),
+            None => self.header.as_bytes().to_vec(),
+        };
+
+        self.compress(&header).map(|(data, _)| data)
+    }
+
+    /// The bytes written after the last record: the BGZF EOF marker, or the end of the zstd
+    /// frame. Asked for once everything else has been committed.
+    pub fn footer(&self) -> Result<Vec<u8>, String> {
+        match self.compression {
+            OutputCompression::Bgzf => Ok(bgzf::EOF_BLOCK.to_vec()),
+            OutputCompression::Zstd => match self.zstd.lock().unwrap().take() {
+                Some(encoder) => encoder
+                    .finish()
+                    .map_err(|e| format!("could not finish zstd output: {}", e)),
+                None => Ok(vec![]),
+            },
+            OutputCompression::None => Ok(vec![]),
+        }
+    }
+
+    /// Formats and compresses `batches`, ready to be written after any earlier output.
+    pub fn encode(&self, batches: &[RecordBatch]) -> Result<Encoded, String> {
+        let error = |e: ArrowError| format!("could not format {:?} record: {}", self.format, e);
+
+        let mut records = self.index.as_ref().map(|_| vec![]);
+
+        let data = match &self.bam_header {
+            Some(header) => {
+                let mut data = vec![];
+                for batch in batches {
+                    bam_writer::write_batch(
+                        batch,
+                        header,
+                        &self.columns,
+                        &mut data,
+                        records.as_mut(),
+                    )
+                    .map_err(error)?;
+                }
+
+                data
+            }
+            None => {
+                let mut text = String::new();
+                for batch in batches {
+                    self.write_batch(batch, &mut text).map_err(error)?;
+                }
+
+                text.into_bytes()
+            }
+        };
+
+        let (data, block_offsets) = self.compress(&data)?;
+
+        Ok(Encoded {
+            data,
+            records: records.map(|records| EncodedRecords {
+                records,
+                block_offsets,
+            }),
+        })
+    }
+
+    /// Records that `data` holding `records` is being written next, indexing them. Called for
+    /// every write, in file order. Zstd output is compressed here, returning the bytes to write
+    /// instead: the whole file is one frame, as some readers stop at the end of the first.
+    pub fn commit(
+        &self,
+        data: &[u8],
+        records: Option<&EncodedRecords>,
+    ) -> Result<Option<Vec<u8>>, String> {
+        if let Some(encoder) = self.zstd.lock().unwrap().as_mut() {
+            encoder
+                .write_all(data)
+                .and_then(|_| encoder.flush())
+                .map_err(|e| format!("could not compress zstd output: {}", e))?;
+
+            return Ok(Some(mem::take(encoder.get_mut())));
+        }
+
+        let mut index = match &self.index {
+            Some(index) => index.lock().unwrap(),
+            None => return Ok(None),
+        };
+
+        let base = index.written;
+
+        if let Some(encoded) = records {
+            for record in &encoded.records {
+                let block = record.end_offset / bgzf::MAX_BLOCK_INPUT;
+                let end_offset = bgzf::virtual_offset(
+                    base + encoded.block_offsets[block],
+                    (record.end_offset % bgzf::MAX_BLOCK_INPUT) as u16,
+                );
+
+                index
+                    .builder
+                    .push(
+                        record.reference_id,
+                        record.start,
+                        record.end,
+                        end_offset,
+                        record.mapped,
+                    )
+                    .map_err(|e| {
+                        format!(
+                            "could not index the output, write it sorted by position or without an index: {}",
+                            e
+                        )
+                    })?;
+            }
+        }
+
+        index.written += data.len() as u64;
+
+        Ok(None)
+    }
+
+    /// Writes the index of the output once all of it has been committed, returning its path.
+    pub fn finish(&mut self) -> Result<Option<String>, String> {
+        let index = match self.index.take() {
+            Some(index) => index.into_inner().unwrap(),
+            None => return Ok(None),
+        };
+
+        let end_offset = bgzf::virtual_offset(index.written, 0);
+        let data = index
+            .builder
+            .finish(end_offset, None)
+            .to_bytes()
+            .map_err(|e| e.to_string())?;
+
+        write_file(&index.path, &data).map_err(|e| e.to_string())?;
+
+        Ok(Some(index.path))
+    }
+
+    fn write_batch(&self, batch: &RecordBatch, out: &mut String) -> Result<(), ArrowError> {
+        // BED positions are one-based in DuckDB and zero-based in the file.
+        let shifted = |index: usize| -> Result<Option<ArrayRef>, ArrowError> {
+            match (self.format, self.columns[index]) {
+                (CopyFormat::Bed, Some(column)) => {
+                    Ok(Some(cast(batch.column(column), &DataType::Int64)?))
+                }
+                _ => Ok(None),
+            }
+        };
+
+        let bed_start = shifted(BED_START)?;
+        let bed_thick_start = shifted(BED_THICK_START)?;
+
+        let values = self
+            .columns
+            .iter()
+            .map(|column| {
+                column
+                    .map(|column| Values::new(batch.column(column).as_ref()))
+                    .transpose()
+            })
+            .collect::<Result<Vec<_>, ArrowError>>()?;
+
+        let vcf = match self.format {
+            CopyFormat::Vcf => Some(self.vcf_columns(batch)?),
+            _ => None,
+        };
+
+        for row in 0..batch.num_rows() {
+            match (self.format, &vcf) {
+                (CopyFormat::Fasta, _) => self.write_fasta(out, &values, row),
+                (CopyFormat::Fastq, _) => self.write_fastq(out, &values, row),
+                (CopyFormat::Gff, _) => write_columns(out, &values, row, ','),
+                (CopyFormat::Bed, _) => {
+                    self.write_bed(out, &values, row, &bed_start, &bed_thick_start)
+                }
+                (CopyFormat::Vcf, Some(vcf)) => self.write_vcf(out, &values, vcf, row)?,
+                (CopyFormat::Vcf, None) | (CopyFormat::Bam, _) => unreachable!(),
+            }
+        }
+
+        Ok(())
+    }
+
+    fn vcf_columns<'a>(&self, batch: &'a RecordBatch) -> Result<VcfColumns<'a>, ArrowError> {
+        let struct_column = |column: Option<usize>| {
+            column.and_then(|column| batch.column(column).as_any().downcast_ref::<StructArray>())
+        };
+
+        let info = struct_column(self.columns[VCF_INFO]);
+        let info_values = match info {
+            Some(info) => info
+                .columns()
+                .iter()
+                .map(|column| Values::new(column.as_ref()))
+                .collect::<Result<Vec<_>, _>>()?,
+            None => vec![],
+        };
+
+        let formats = self.columns[VCF_FORMATS]
+            .and_then(|column| batch.column(column).as_any().downcast_ref::<ListArray>());
+
+        let samples = match formats {
+            Some(formats) => {
+                let samples = formats.values().as_struct();
+                let columns = samples
+                    .columns()
+                    .iter()
+                    .map(|column| Values::new(column.as_ref()))
+                    .collect::<Result<Vec<_>, _>>()?;
+
+                Some((formats, samples, columns))
+            }
+            None => None,
+        };
+
+        Ok(VcfColumns {
+            info,
+            info_values,
+            samples,
+        })
+    }
+
+    fn write_fasta(&self, out: &mut String, values: &[Option<Values>], row: usize) {
+        out.push('>');
+        write_header_line(out, values, row);
+        write_optional(out, &values[2], row);
+        out.push('\n');
+    }
+
+    fn write_fastq(&self, out: &mut String, values: &[Option<Values>], row: usize) {
+        out.push('@');
+        write_header_line(out, values, row);
+        write_optional(out, &values[2], row);
+        out.push_str("\n+\n");
+        write_optional(out, &values[3], row);
+        out.push('\n');
+    }
+
+    fn write_bed(
+        &self,
+        out: &mut String,
+        values: &[Option<Values>],
+        row: usize,
+        start: &Option<ArrayRef>,
+        thick_start: &Option<ArrayRef>,
+    ) {
+        // BED columns are positional, stop after the last one the input has.
+        let count = values
+            .iter()
+            .rposition(|values| values.is_some())
+            .unwrap_or(0)
+            + 1;
+
+        for (index, column) in values[..count].iter().enumerate() {
+            if index > 0 {
+                out.push('\t');
+            }
+
+            let shifted = match index {
+                BED_START => start.as_ref(),
+                BED_THICK_START => thick_start.as_ref(),
+                _ => None,
+            };
+
+            match shifted {
+                Some(array) if !array.is_null(row) => {
+                    let position = array.as_primitive::<Int64Type>().value(row);
+                    let _ = write!(out, "{}", position - 1);
+                }
+                _ => match column {
+                    Some(column) => column.write(out, row, ','),
+                    None => out.push('.'),
+                },
+            }
+        }
+
+        out.push('\n');
+    }
+
+    fn write_vcf(
+        &self,
+        out: &mut String,
+        values: &[Option<Values>],
+        vcf: &VcfColumns,
+        row: usize,
+    ) -> Result<(), ArrowError> {
+        let separators = [';', ';', ';', ',', ',', ',', ';'];
+        for (index, separator) in separators.iter().enumerate() {
+            if index > 0 {
+                out.push('\t');
+            }
+
+            match &values[index] {
+                Some(column) => column.write(out, row, *separator),
+                None => out.push('.'),
+            }
+        }
+
+        out.push('\t');
+        self.write_vcf_info(out, vcf, row);
+
+        if let Some((formats, samples, columns)) = &vcf.samples {
+            self.write_vcf_samples(out, formats, samples, columns, row)?;
+        }
+
+        out.push('\n');
+
+        Ok(())
+    }
+
+    fn write_vcf_info(&self, out: &mut String, vcf: &VcfColumns, row: usize) {
+        let start = out.len();
+
+        if vcf.info.map_or(false, |info| !info.is_null(row)) {
+            for (key, values) in self.info_keys.iter().zip(vcf.info_values.iter()) {
+                if values.is_missing(row) {
+                    continue;
+                }
+
+                // Flags are written as their key alone, and left out when unset.
+                let flag = match values {
+                    Values::Boolean(flags) => Some(flags.value(row)),
+                    _ => None,
+                };
+
+                if flag == Some(false) {
+                    continue;
+                }
+
+                if out.len() > start {
+                    out.push(';');
+                }
+
+                out.push_str(key);
+
+                if flag.is_none() {
+                    out.push('=');
+                    values.write(out, row, ',');
+                }
+            }
+        }
+
+        if out.len() == start {
+            out.push('.');
+        }
+    }
+
+    fn write_vcf_samples(
+        &self,
+        out: &mut String,
+        formats: &ListArray,
+        samples: &StructArray,
+        columns: &[Values],
+        row: usize,
+    ) -> Result<(), ArrowError> {
+        let offsets = formats.value_offsets();
+        let (first, last) = (offsets[row] as usize, offsets[row + 1] as usize);
+
+        if formats.is_null(row) || last - first != self.sample_count {
+            return Err(ArrowError::InvalidArgumentError(format!(
+                "expected genotypes for {} samples, found {}",
+                self.sample_count,
+                last - first
+            )));
+        }
+
+        // GT must come first when present.
+        let mut order = (0..columns.len()).collect::<Vec<_>>();
+        if let Some(gt) = self.format_keys.iter().position(|key| key == "GT") {
+            order.retain(|index| *index != gt);
+            order.insert(0, gt);
+        }
+
+        out.push('\t');
+        for (i, index) in order.iter().enumerate() {
+            if i > 0 {
+                out.push(':');
+            }
+
+            out.push_str(&self.format_keys[*index]);
+        }
+
+        for sample in first..last {
+            out.push('\t');
+
+            for (i, index) in order.iter().enumerate() {
+                if i > 0 {
+                    out.push(':');
+                }
+
+                if samples.is_null(sample) {
+                    out.push('.');
+                } else {
+                    columns[*index].write(out, sample, ',');
+                }
+            }
+        }
+
+        Ok(())
+    }
+}
+
+/// Writes a FASTA or FASTQ header line: the name, then the description if there is one.
+fn write_header_line(out: &mut String, values: &[Option<Values>], row: usize) {
+    write_optional(out, &values[0], row);
+
+    if let Some(description) = &values[1] {
+        if !description.is_missing(row) {
+            out.push(' ');
+            description.write(out, row, ' ');
+        }
+    }
+
+    out.push('\n');
+}
+
+/// Writes the value, or nothing if it is null, where a `.` would be read back as data.
+fn write_optional(out: &mut String, values: &Option<Values>, row: usize) {
+    if let Some(values) = values {
+        if !values.array().is_null(row) {
+            values.write(out, row, ',');
+        }
+    }
+}
+
+fn write_columns(out: &mut String, values: &[Option<Values>], row: usize, separator: char) {
+    for (index, column) in values.iter().enumerate() {
+        if index > 0 {
+            out.push('\t');
+        }
+
+        match column {
+            Some(column) => column.write(out, row, separator),
+            None => out.push('.'),
+        }
+    }
+
+    out.push('\n');
+}
+
+#[repr(C)]
+pub struct CopyWriterResult {
+    writer: *mut CopyWriter,
+    error: *const c_char,
+}
+
+#[repr(C)]
+pub struct CopyBuffer {
+    data: *const u8,
+    length: usize,
+    /// The records to index, handed back through `copy_writer_commit`.
+    records: *mut EncodedRecords,
+    error: *const c_char,
+}
+
+impl CopyBuffer {
+    fn from_result(result: Result<Encoded, String>) -> Self {
+        match result {
+            Ok(encoded) => {
+                let data = encoded.data.into_boxed_slice();
+                let length = data.len();
+
+                Self {
+                    data: Box::into_raw(data) as *const u8,
+                    length,
+                    records: encoded
+                        .records
+                        .map(|records| Box::into_raw(Box::new(records)))
+                        .unwrap_or(null_mut()),
+                    error: null(),
+                }
+            }
+            Err(error) => Self {
+                data: null(),
+                length: 0,
+                records: null_mut(),
+                error: CString::new(error).unwrap().into_raw(),
+            },
+        }
+    }
+
+    fn from_data(result: Result<Vec<u8>, String>) -> Self {
+        Self::from_result(result.map(|data| Encoded {
+            data,
+            records: None,
+        }))
+    }
+}
+
+#[repr(C)]
+pub struct CopyStatus {
+    error: *const c_char,
+}
+
+impl CopyStatus {
+    fn from_result<T>(result: Result<T, String>) -> Self {
+        match result {
+            Ok(_) => Self { error: null() },
+            Err(error) => Self {
+                error: CString::new(error).unwrap().into_raw(),
+            },
+        }
+    }
+}
+
+unsafe fn optional_str<'a>(value: *const c_char) -> Result<Option<&'a str>, String> {
+    if value.is_null() {
+        return Ok(None);
+    }
+
+    match CStr::from_ptr(value).to_str() {
+        Ok("") => Ok(None),
+        Ok(value) => Ok(Some(value)),
+        Err(e) => Err(format!("could not parse argument: {}", e)),
+    }
+}
+
+/// Creates a writer of `file_format` records for rows with the Arrow `schema`, which is moved
+/// out of. `header_from` is the VCF, BAM or SAM file whose header is copied, null for a default
+/// one; `index_format` is `bai` or `csi` to index BAM output as it is written, null for none.
+#[no_mangle]
+pub unsafe extern "C" fn new_copy_writer(
+    file_format: *const c_char,
+    schema: *mut ArrowSchema,
+    path: *const c_char,
+    compression: *const c_char,
+    header_from: *const c_char,
+    index_format: *const c_char,
+) -> CopyWriterResult {
+    let ffi_schema = std::ptr::replace(schema, ArrowSchema::empty());
+
+    let writer = (|| {
+        let file_format = optional_str(file_format)?.ok_or("no file_format given")?;
+        let format = CopyFormat::from_name(file_format)
+            .ok_or_else(|| format!("can not write file_format {}", file_format))?;
+
+        let schema =
+            Schema::try_from(&ffi_schema).map_err(|e| format!("could not import schema: {}", e))?;
+
+        CopyWriter::try_new(
+            format,
+            &schema,
+            optional_str(path)?.unwrap_or_default(),
+            optional_str(compression)?.unwrap_or("auto"),
+            optional_str(header_from)?,
+            optional_str(index_format)?,
+        )
+    })();
+
+    match writer {
+        Ok(writer) => CopyWriterResult {
+            writer: Box::into_raw(Box::new(writer)),
+            error: null(),
+        },
+        Err(e) => CopyWriterResult {
+            writer: null_mut(),
+            error: CString::new(e).unwrap().into_raw(),
+        },
+    }
+}
+
+/// The bytes to write before the first record.
+#[no_mangle]
+pub unsafe extern "C" fn copy_writer_header(writer: *const CopyWriter) -> CopyBuffer {
+    CopyBuffer::from_data((*writer).header())
+}
+
+/// The bytes to write after the last record.
+#[no_mangle]
+pub unsafe extern "C" fn copy_writer_footer(writer: *const CopyWriter) -> CopyBuffer {
+    CopyBuffer::from_data((*writer).footer())
+}
+
+/// Formats the `count` chunks at `arrays`, which are moved out of, into bytes that can be
+/// written after any earlier output. Safe to call from several threads at once.
+#[no_mangle]
+pub unsafe extern "C" fn copy_writer_encode(
+    writer: *const CopyWriter,
+    arrays: *mut ArrowArray,
+    count: usize,
+) -> CopyBuffer {
+    let writer = &*writer;
+
+    let batches = match (0..count)
+        .map(|i| writer.import_batch(arrays.add(i)))
+        .collect::<Result<Vec<_>, _>>()
+    {
+        Ok(batches) => batches,
+        Err(e) => return CopyBuffer::from_data(Err(format!("could not import chunk: {}", e))),
+    };
+
+    CopyBuffer::from_result(writer.encode(&batches))
+}
+
+/// Tells the writer `buffer` is written next. Must be called for every buffer, header and footer
+/// included, in the order they are written. The data of `buffer` may be replaced, with the bytes
+/// to write instead.
+#[no_mangle]
+pub unsafe extern "C" fn copy_writer_commit(
+    writer: *const CopyWriter,
+    buffer: *mut CopyBuffer,
+) -> CopyStatus {
+    let buffer = &mut *buffer;
+    let records = buffer.records.as_ref();
+
+    let data = if buffer.data.is_null() {
+        &[]
+    } else {
+        slice::from_raw_parts(buffer.data, buffer.length)
+    };
+
+    let result = (*writer).commit(data, records).map(|replaced| {
+        if let Some(replaced) = replaced {
+            if !buffer.data.is_null() {
+                drop(Box::from_raw(slice::from_raw_parts_mut(
+                    buffer.data as *mut u8,
+                    buffer.length,
+                )));
+            }
+
+            let replaced = replaced.into_boxed_slice();
+            buffer.length = replaced.len();
+            buffer.data = Box::into_raw(replaced) as *const u8;
+        }
+    });
+
+    CopyStatus::from_result(result)
+}
+
+/// Writes the index of the output, if one was asked for, once everything has been written.
+#[no_mangle]
+pub unsafe extern "C" fn copy_writer_finish(writer: *mut CopyWriter) -> CopyStatus {
+    CopyStatus::from_result((*writer).finish())
+}
+
+/// Releases the data, records and error of a `CopyBuffer`.
+#[no_mangle]
+pub unsafe extern "C" fn free_copy_buffer(buffer: CopyBuffer) {
+    if !buffer.data.is_null() {
+        drop(Box::from_raw(slice::from_raw_parts_mut(
+            buffer.data as *mut u8,
+            buffer.length,
+        )));
+    }
+
+    if !buffer.records.is_null() {
+        drop(Box::from_raw(buffer.records));
+    }
+
+    if !buffer.error.is_null() {
+        drop(CString::from_raw(buffer.error as *mut c_char));
+    }
+}
+
+/// Releases the error of a `CopyStatus`.
+#[no_mangle]
+pub unsafe extern "C" fn free_copy_status(status: CopyStatus) {
+    if !status.error.is_null() {
+        drop(CString::from_raw(status.error as *mut c_char));
+    }
+}
+
+/// Releases the error of a `CopyWriterResult`, and the writer, if any.
+#[no_mangle]
+pub unsafe extern "C" fn free_copy_writer(result: CopyWriterResult) {
+    if !result.writer.is_null() {
+        drop(Box::from_raw(result.writer));
+    }
+
+    if !result.error.is_null() {
+        drop(CString::from_raw(result.error as *mut c_char));
+    }
+}
@@ -0,0 +1,511 @@
+// Copyright 2023 WHERE TRUE Technologies.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+//! Reads CRAM files as SAM records, resolving bases against a reference FASTA served from its
+//! memory-mapped `.fai` index. The slices of consecutive containers are decoded in parallel.
+
+use std::{
+    ffi::{c_char, CStr, CString},
+    fs::File,
+    io::{self, BufReader, SeekFrom},
+    sync::Arc,
+    thread,
+};
+
+use arrow::{
+    array::{ArrayRef, Int32Builder, StringBuilder},
+    datatypes::SchemaRef,
+    ffi_stream::FFI_ArrowArrayStream as ArrowArrayStream,
+    record_batch::RecordBatch,
+};
+use datafusion::{
+    datasource::streaming::StreamingTable,
+    execution::TaskContext,
+    physical_plan::{streaming::PartitionStream, SendableRecordBatchStream},
+    prelude::SessionContext,
+};
+use exon::{ffi::create_dataset_stream_from_table_provider, new_exon_config, ExonSessionExt};
+use noodles::{cram, fasta, sam};
+use tokio::runtime::Runtime;
+
+use crate::{
+    bam_reader::bam_schema,
+    fasta_index::{open_cached, IndexedFasta},
+    partition_reader::blocking_stream,
+    region::{merge_regions, Region},
+    region_query::{regions_from_ffi, resolve_regions},
+};
+
+fn invalid_data<E: Into<Box<dyn std::error::Error + Send + Sync>>>(e: E) -> io::Error {
+    io::Error::new(io::ErrorKind::InvalidData, e)
+}
+
+/// Serves whole reference sequences out of an indexed FASTA file. The repository wrapping it
+/// caches every sequence it loads, so each is copied out of the mapping once per scan.
+struct IndexedFastaAdapter {
+    fasta: Arc<IndexedFasta>,
+}
+
+impl fasta::repository::Adapter for IndexedFastaAdapter {
+    fn get(&mut self, name: &str) -> Option<io::Result<fasta::Record>> {
+        let length = match self.fasta.record(name) {
+            Ok(record) => record.length,
+            Err(_) => return None,
+        };
+
+        let record = self.fasta.fetch(name, 0, length).map(|bases| {
+            fasta::Record::new(
+                fasta::record::Definition::new(name, None),
+                fasta::record::Sequence::from(bases),
+            )
+        });
+
+        Some(record)
+    }
+}
+
+/// The reference sequence repository for `reference`, or an empty one for CRAM files that embed
+/// their references or were written without one.
+fn reference_repository(reference: Option<&str>) -> io::Result<fasta::Repository> {
+    match reference {
+        Some(path) => Ok(fasta::Repository::new(IndexedFastaAdapter {
+            fasta: open_cached(path)?,
+        })),
+        None => Ok(fasta::Repository::default()),
+    }
+}
+
+type CramReader = cram::Reader<BufReader<File>>;
+
+fn open_cram(path: &str) -> io::Result<(CramReader, sam::Header)> {
+    let file =
+        File::open(path).map_err(|e| io::Error::new(e.kind(), format!("{}: {}", path, e)))?;
+    let mut reader = cram::Reader::new(BufReader::new(file));
+
+    reader.read_file_definition()?;
+    let header = reader.read_file_header()?.parse().map_err(invalid_data)?;
+
+    Ok((reader, header))
+}
+
+fn reference_name(header: &sam::Header, id: Option<usize>) -> Option<String> {
+    id.and_then(|id| header.reference_sequences().get_index(id))
+        .map(|(name, _)| name.to_string())
+}
+
+/// The offsets of the containers holding records that overlap any of `regions`, in file order,
+/// or `None` if the file has no `.crai` index and must be read whole.
+fn container_offsets(
+    path: &str,
+    header: &sam::Header,
+    regions: &[Region],
+) -> io::Result<Option<Vec<u64>>> {
+    let index = match cram::crai::read(format!("{}.crai", path)) {
+        Ok(index) => index,
+        Err(e) if e.kind() == io::ErrorKind::NotFound => return Ok(None),
+        Err(e) => return Err(e),
+    };
+
+    let mut offsets = vec![];
+
+    for record in index.iter() {
+        let name = match reference_name(header, record.reference_sequence_id()) {
+            Some(name) => name,
+            None => continue,
+        };
+
+        let start = match record.alignment_start() {
+            Some(start) => usize::from(start) as u64,
+            None => continue,
+        };
+        let end = start + (record.alignment_span() as u64).max(1) - 1;
+
+        if regions
+            .iter()
+            .any(|region| region.name == name && region.overlaps(start, end))
+        {
+            offsets.push(record.offset());
+        }
+    }
+
+    offsets.sort_unstable();
+    offsets.dedup();
+
+    Ok(Some(offsets))
+}
+
+/// Decodes the records of every slice of `containers`, one thread per slice. The result holds
+/// the records of each slice in file order.
+fn decode_slices(
+    containers: &[cram::DataContainer],
+    repository: &fasta::Repository,
+    header: &sam::Header,
+) -> io::Result<Vec<Vec<cram::Record>>> {
+    thread::scope(|scope| {
+        let handles = containers
+            .iter()
+            .flat_map(|container| {
+                container
+                    .slices()
+                    .iter()
+                    .map(move |slice| (container.compression_header(), slice))
+            })
+            .map(|(compression_header, slice)| {
+                scope.spawn(move || {
+                    let mut records = slice.records(compression_header)?;
+                    slice.resolve_records(repository, header, compression_header, &mut records)?;
+                    Ok::<_, io::Error>(records)
+                })
+            })
+            .collect::<Vec<_>>();
+
+        handles
+            .into_iter()
+            .map(|handle| handle.join().unwrap())
+            .collect()
+    })
+}
+
+/// Accumulates SAM records into record batches.
+struct SamBatchBuilder {
+    schema: SchemaRef,
+    names: StringBuilder,
+    flags: Int32Builder,
+    references: StringBuilder,
+    starts: Int32Builder,
+    ends: Int32Builder,
+    mapping_qualities: StringBuilder,
+    cigars: StringBuilder,
+    mate_references: StringBuilder,
+    sequences: StringBuilder,
+    quality_scores: StringBuilder,
+    rows: usize,
+}
+
+impl SamBatchBuilder {
+    fn new(schema: SchemaRef) -> Self {
+        Self {
+            schema,
+            names: StringBuilder::new(),
+            flags: Int32Builder::new(),
+            references: StringBuilder::new(),
+            starts: Int32Builder::new(),
+            ends: Int32Builder::new(),
+            mapping_qualities: StringBuilder::new(),
+            cigars: StringBuilder::new(),
+            mate_references: StringBuilder::new(),
+            sequences: StringBuilder::new(),
+            quality_scores: StringBuilder::new(),
+            rows: 0,
+        }
+    }
+
+    fn append(&mut self, record: &sam::alignment::Record, header: &sam::Header) {
+        match record.read_name() {
+            Some(name) => self.names.append_value(name.to_string()),
+            None => self.names.append_value("*"),
+        }
+
+        self.flags.append_value(record.flags().bits() as i32);
+        self.references
+            .append_option(reference_name(header, record.reference_sequence_id()));
+        self.starts.append_option(
+            record
+                .alignment_start()
+                .map(|start| usize::from(start) as i32),
+        );
+        self.ends
+            .append_option(record.alignment_end().map(|end| usize::from(end) as i32));
+        self.mapping_qualities.append_option(
+            record
+                .mapping_quality()
+                .map(|mapping_quality| u8::from(mapping_quality).to_string()),
+        );
+        self.cigars.append_value(record.cigar().to_string());
+        self.mate_references
+            .append_option(reference_name(header, record.mate_reference_sequence_id()));
+        self.sequences.append_value(record.sequence().to_string());
+        self.quality_scores
+            .append_value(record.quality_scores().to_string());
+
+        self.rows += 1;
+    }
+
+    fn finish(&mut self) -> io::Result<RecordBatch> {
+        self.rows = 0;
+
+        let columns: Vec<ArrayRef> = vec![
+            Arc::new(self.names.finish()),
+            Arc::new(self.flags.finish()),
+            Arc::new(self.references.finish()),
+            Arc::new(self.starts.finish()),
+            Arc::new(self.ends.finish()),
+            Arc::new(self.mapping_qualities.finish()),
+            Arc::new(self.cigars.finish()),
+            Arc::new(self.mate_references.finish()),
+            Arc::new(self.sequences.finish()),
+            Arc::new(self.quality_scores.finish()),
+        ];
+
+        RecordBatch::try_new(self.schema.clone(), columns).map_err(invalid_data)
+    }
+}
+
+fn overlaps_any(record: &sam::alignment::Record, header: &sam::Header, regions: &[Region]) -> bool {
+    let (start, end) = match (record.alignment_start(), record.alignment_end()) {
+        (Some(start), Some(end)) => (usize::from(start) as u64, usize::from(end) as u64),
+        _ => return false,
+    };
+
+    match reference_name(header, record.reference_sequence_id()) {
+        Some(name) => regions
+            .iter()
+            .any(|region| region.name == name && region.overlaps(start, end)),
+        None => false,
+    }
+}
+
+/// One CRAM file, optionally restricted to the records overlapping `regions`.
+struct CramScan {
+    path: String,
+    reference: Option<String>,
+    regions: Option<Vec<Region>>,
+    batch_size: usize,
+    threads: usize,
+}
+
+impl CramScan {
+    /// Reads the file, handing each batch to `emit` until it returns false.
+    fn run<F>(&self, schema: SchemaRef, mut emit: F) -> io::Result<()>
+    where
+        F: FnMut(RecordBatch) -> bool,
+    {
+        let repository = reference_repository(self.reference.as_deref())?;
+        let (mut reader, header) = open_cram(&self.path)?;
+
+        let mut offsets = match &self.regions {
+            Some(regions) => container_offsets(&self.path, &header, regions)?.map(Vec::into_iter),
+            None => None,
+        };
+
+        let mut builder = SamBatchBuilder::new(schema);
+        let mut containers = Vec::with_capacity(self.threads);
+        let mut done = false;
+
+        while !done {
+            containers.clear();
+
+            while containers.len() < self.threads {
+                let container = match &mut offsets {
+                    Some(offsets) => match offsets.next() {
+                        Some(offset) => {
+                            reader.seek(SeekFrom::Start(offset))?;
+                            reader.read_data_container()?
+                        }
+                        None => None,
+                    },
+                    None => reader.read_data_container()?,
+                };
+
+                match container {
+                    Some(container) => containers.push(container),
+                    None => {
+                        done = true;
+                        break;
+                    }
+                }
+            }
+
+            for records in decode_slices(&containers, &repository, &header)? {
+                for record in records {
+                    let record = record.try_into_alignment_record(&header)?;
+
+                    if let Some(regions) = &self.regions {
+                        if !overlaps_any(&record, &header, regions) {
+                            continue;
+                        }
+                    }
+
+                    builder.append(&record, &header);
+
+                    if builder.rows >= self.batch_size && !emit(builder.finish()?) {
+                        return Ok(());
+                    }
+                }
+            }
+        }
+
+        if builder.rows > 0 {
+            emit(builder.finish()?);
+        }
+
+        Ok(())
+    }
+}
+
+struct CramPartition {
+    schema: SchemaRef,
+    scan: Arc<CramScan>,
+}
+
+impl PartitionStream for CramPartition {
+    fn schema(&self) -> &SchemaRef {
+        &self.schema
+    }
+
+    fn execute(&self, _ctx: Arc<TaskContext>) -> SendableRecordBatchStream {
+        let scan = self.scan.clone();
+        let schema = self.schema.clone();
+
+        blocking_stream(self.schema.clone(), move |emit| scan.run(schema, emit))
+    }
+}
+
+#[repr(C)]
+pub struct CRAMReaderResult {
+    error: *const c_char,
+}
+
+impl CRAMReaderResult {
+    fn error(error: String) -> Self {
+        Self {
+            error: CString::new(error).unwrap().into_raw(),
+        }
+    }
+}
+
+unsafe fn optional_str<'a>(value: *const c_char, name: &str) -> Result<Option<&'a str>, String> {
+    if value.is_null() {
+        return Ok(None);
+    }
+
+    CStr::from_ptr(value)
+        .to_str()
+        .map(Some)
+        .map_err(|e| format!("could not parse {}: {}", name, e))
+}
+
+/// Reads the CRAM file at `uri`, with the same schema as BAM files. Bases are resolved against
+/// the FASTA file `reference`, which must have a `.fai` index, or against the references
+/// embedded in the file if it is null. If `region_count` is positive only records overlapping
+/// the regions at `regions` are returned, reading just the containers the `.crai` index points
+/// at when there is one. `filters` is a SQL predicate applied to the records. `threads`
+/// containers are decoded at once, a thread each.
+#[no_mangle]
+pub unsafe extern "C" fn new_cram_reader(
+    stream_ptr: *mut ArrowArrayStream,
+    uri: *const c_char,
+    reference: *const c_char,
+    regions: *const *const c_char,
+    region_count: usize,
+    batch_size: usize,
+    threads: usize,
+    filters: *const c_char,
+) -> CRAMReaderResult {
+    let uri = match CStr::from_ptr(uri).to_str() {
+        Ok(uri) => uri,
+        Err(e) => return CRAMReaderResult::error(format!("could not parse uri: {}", e)),
+    };
+
+    let reference = match optional_str(reference, "reference") {
+        Ok(reference) => reference,
+        Err(e) => return CRAMReaderResult::error(e),
+    };
+
+    let filters = match optional_str(filters, "filters") {
+        Ok(filters) => filters.unwrap_or(""),
+        Err(e) => return CRAMReaderResult::error(e),
+    };
+
+    let region_entries = if region_count > 0 {
+        match regions_from_ffi(regions, region_count) {
+            Ok(regions) => Some(regions),
+            Err(e) => return CRAMReaderResult::error(e),
+        }
+    } else {
+        None
+    };
+
+    // Fail at bind time rather than on the first fetch.
+    let references = match open_cram(uri) {
+        Ok((_, header)) => header
+            .reference_sequences()
+            .keys()
+            .map(|name| name.to_string())
+            .collect::<Vec<_>>(),
+        Err(e) => return CRAMReaderResult::error(format!("could not read CRAM file: {}", e)),
+    };
+
+    if let Err(e) = reference_repository(reference) {
+        return CRAMReaderResult::error(format!("could not open reference: {}", e));
+    }
+
+    let rt = Arc::new(Runtime::new().unwrap());
+
+    let config = new_exon_config().with_batch_size(batch_size);
+    let ctx = SessionContext::with_config_exon(config);
+
+    rt.block_on(async {
+        let regions = match region_entries {
+            Some(entries) => match resolve_regions(&ctx, &entries, &references).await {
+                Ok(regions) => Some(
+                    merge_regions(&regions)
+                        .into_iter()
+                        .map(|merged| merged.region)
+                        .collect(),
+                ),
+                Err(e) => return CRAMReaderResult::error(format!("could not read regions: {}", e)),
+            },
+            None => None,
+        };
+
+        let schema = bam_schema(false);
+        let partition = Arc::new(CramPartition {
+            schema: schema.clone(),
+            scan: Arc::new(CramScan {
+                path: uri.to_string(),
+                reference: reference.map(|reference| reference.to_string()),
+                regions,
+                batch_size,
+                threads: threads.max(1),
+            }),
+        }) as Arc<dyn PartitionStream>;
+
+        let table = match StreamingTable::try_new(schema, vec![partition]) {
+            Ok(table) => table,
+            Err(e) => return CRAMReaderResult::error(format!("could not create table: {}", e)),
+        };
+
+        if let Err(e) = ctx.register_table("exon_table", Arc::new(table)) {
+            return CRAMReaderResult::error(format!("could not register table: {}", e));
+        }
+
+        let mut select_string = format!("SELECT * FROM exon_table");
+        if filters != "" {
+            select_string.push_str(format!(" WHERE {}", filters).as_str());
+        }
+
+        let df = match ctx.sql(&select_string).await {
+            Ok(df) => df,
+            Err(e) => return CRAMReaderResult::error(format!("could not execute sql: {}", e)),
+        };
+
+        match create_dataset_stream_from_table_provider(df, rt.clone(), stream_ptr).await {
+            Ok(_) => CRAMReaderResult {
+                error: std::ptr::null(),
+            },
+            Err(e) => CRAMReaderResult::error(format!("could not create dataset stream: {}", e)),
+        }
+    })
+}
@@ -0,0 +1,398 @@
+// Copyright 2023 WHERE TRUE Technologies.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+//! A persistent, size-capped cache of remote object blocks in a local directory. It sits under
+//! the in-memory block cache, so blocks and index files fetched by one session are served from
+//! local disk by the next.
+//!
+//! Each entry is one file named by a hash of its key. The key, which includes the object's size,
+//! modification time and ETag, is stored at the head of the file and checked on every read, so a
+//! hash collision or a rewritten remote object is a miss rather than stale data.
+
+use std::{
+    ffi::{c_char, CStr, CString},
+    fs, io,
+    path::{Path, PathBuf},
+    sync::{
+        atomic::{AtomicUsize, Ordering},
+        Arc, Mutex, RwLock,
+    },
+};
+
+use bytes::Bytes;
+use lru::LruCache;
+
+const ENTRY_EXTENSION: &str = "blk";
+const TEMP_EXTENSION: &str = "tmp";
+
+/// A stable 64-bit FNV-1a hash, so entry names survive across processes and builds.
+fn fnv1a(value: &str) -> u64 {
+    value.bytes().fold(0xcbf29ce484222325, |hash, byte| {
+        (hash ^ byte as u64).wrapping_mul(0x100000001b3)
+    })
+}
+
+struct DiskCacheState {
+    // Entry file name to entry size in bytes, least recently used first.
+    entries: LruCache<String, u64>,
+    size: u64,
+}
+
+pub struct DiskCache {
+    directory: PathBuf,
+    capacity: u64,
+    state: Mutex<DiskCacheState>,
+    temp_counter: AtomicUsize,
+}
+
+impl DiskCache {
+    /// Opens the cache in `directory`, creating it if needed and picking up the entries left by
+    /// earlier processes, oldest first.
+    pub fn open(directory: &Path, capacity: u64) -> io::Result<Self> {
+        fs::create_dir_all(directory)?;
+
+        let mut existing = vec![];
+        for entry in fs::read_dir(directory)? {
+            let entry = entry?;
+            let path = entry.path();
+
+            match path.extension().and_then(|extension| extension.to_str()) {
+                Some(ENTRY_EXTENSION) => {
+                    let metadata = entry.metadata()?;
+                    let modified = metadata.modified()?;
+
+                    existing.push((modified, entry.file_name(), metadata.len()));
+                }
+                // Left behind by a process that died mid-write.
+                Some(TEMP_EXTENSION) => {
+                    let _ = fs::remove_file(&path);
+                }
+                _ => {}
+            }
+        }
+
+        existing.sort_by_key(|(modified, _, _)| *modified);
+
+        let mut state = DiskCacheState {
+            entries: LruCache::unbounded(),
+            size: 0,
+        };
+
+        for (_, name, size) in existing {
+            if let Some(name) = name.to_str() {
+                state.entries.put(name.to_string(), size);
+                state.size += size;
+            }
+        }
+
+        let cache = Self {
+            directory: directory.to_path_buf(),
+            capacity,
+            state: Mutex::new(state),
+            temp_counter: AtomicUsize::new(0),
+        };
+
+        cache.evict(&mut cache.state.lock().unwrap());
+
+        Ok(cache)
+    }
+
+    pub fn capacity(&self) -> u64 {
+        self.capacity
+    }
+
+    fn entry_name(key: &str) -> String {
+        format!("{:016x}.{}", fnv1a(key), ENTRY_EXTENSION)
+    }
+
+    /// True if an entry for `key` is on disk, without reading it or changing its recency.
+    pub fn contains(&self, key: &str) -> bool {
+        self.state
+            .lock()
+            .unwrap()
+            .entries
+            .contains(&Self::entry_name(key))
+    }
+
+    /// Reads the entry for `key`, or `None` if it is missing, unreadable or belongs to another key.
+    pub fn get(&self, key: &str) -> Option<Bytes> {
+        let name = Self::entry_name(key);
+
+        if self.state.lock().unwrap().entries.get(&name).is_none() {
+            return None;
+        }
+
+        let raw = match fs::read(self.directory.join(&name)) {
+            Ok(raw) => raw,
+            Err(_) => {
+                self.remove(&name);
+                return None;
+            }
+        };
+
+        if raw.len() < 4 {
+            self.remove(&name);
+            return None;
+        }
+
+        let key_length = u32::from_le_bytes([raw[0], raw[1], raw[2], raw[3]]) as usize;
+        match raw.get(4..4 + key_length) {
+            Some(stored_key) if stored_key == key.as_bytes() => {
+                Some(Bytes::from(raw).slice(4 + key_length..))
+            }
+            // A hash collision or a damaged entry, which would otherwise be read on every lookup.
+            _ => {
+                self.remove(&name);
+                None
+            }
+        }
+    }
+
+    /// Stores `data` under `key`, evicting the least recently used entries to stay within
+    /// capacity. Failures are ignored, the cache only ever costs a refetch.
+    pub fn put(&self, key: &str, data: &[u8]) {
+        let size = (4 + key.len() + data.len()) as u64;
+        if size > self.capacity {
+            return;
+        }
+
+        let name = Self::entry_name(key);
+
+        // Write to a temporary file and rename it into place, so concurrent readers (including
+        // other processes sharing the directory) never see a partial entry.
+        let temp_path = self.directory.join(format!(
+            "{}.{}.{}.{}",
+            name,
+            std::process::id(),
+            self.temp_counter.fetch_add(1, Ordering::Relaxed),
+            TEMP_EXTENSION
+        ));
+
+        let mut raw = Vec::with_capacity(size as usize);
+        raw.extend_from_slice(&(key.len() as u32).to_le_bytes());
+        raw.extend_from_slice(key.as_bytes());
+        raw.extend_from_slice(data);
+
+        if fs::write(&temp_path, &raw).is_err()
+            || fs::rename(&temp_path, self.directory.join(&name)).is_err()
+        {
+            let _ = fs::remove_file(&temp_path);
+            return;
+        }
+
+        let mut state = self.state.lock().unwrap();
+        if let Some(previous) = state.entries.put(name, size) {
+            state.size -= previous;
+        }
+        state.size += size;
+
+        self.evict(&mut state);
+    }
+
+    fn remove(&self, name: &str) {
+        let mut state = self.state.lock().unwrap();
+        if let Some(size) = state.entries.pop(name) {
+            state.size -= size;
+        }
+
+        let _ = fs::remove_file(self.directory.join(name));
+    }
+
+    fn evict(&self, state: &mut DiskCacheState) {
+        while state.size > self.capacity {
+            match state.entries.pop_lru() {
+                Some((name, size)) => {
+                    state.size -= size;
+                    let _ = fs::remove_file(self.directory.join(name));
+                }
+                None => break,
+            }
+        }
+    }
+}
+
+static DISK_CACHE: RwLock<Option<Arc<DiskCache>>> = RwLock::new(None);
+
+/// The process-wide disk cache, if one has been configured.
+pub fn disk_cache() -> Option<Arc<DiskCache>> {
+    DISK_CACHE.read().unwrap().clone()
+}
+
+/// The key of block `block` of the object identified by `object_key`.
+pub fn block_key(object_key: &str, block: usize) -> String {
+    format!("{}#{}", object_key, block)
+}
+
+#[repr(C)]
+pub struct DiskCacheResult {
+    error: *const c_char,
+}
+
+/// Points the disk cache at `directory`, holding at most `capacity` bytes. A null or empty
+/// directory, or a zero capacity, disables it.
+#[no_mangle]
+pub unsafe extern "C" fn set_disk_cache(directory: *const c_char, capacity: u64) -> DiskCacheResult {
+    let directory = if directory.is_null() {
+        ""
+    } else {
+        match CStr::from_ptr(directory).to_str() {
+            Ok(directory) => directory,
+            Err(e) => {
+                let error = CString::new(format!("could not parse directory: {}", e)).unwrap();
+                return DiskCacheResult {
+                    error: error.into_raw(),
+                };
+            }
+        }
+    };
+
+    if directory.is_empty() || capacity == 0 {
+        *DISK_CACHE.write().unwrap() = None;
+
+        return DiskCacheResult {
+            error: std::ptr::null(),
+        };
+    }
+
+    match DiskCache::open(Path::new(directory), capacity) {
+        Ok(cache) => {
+            *DISK_CACHE.write().unwrap() = Some(Arc::new(cache));
+
+            DiskCacheResult {
+                error: std::ptr::null(),
+            }
+        }
+        Err(e) => {
+            let error = CString::new(format!("could not open disk cache {}: {}", directory, e))
+                .unwrap();
+            DiskCacheResult {
+                error: error.into_raw(),
+            }
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn directory(name: &str) -> PathBuf {
+        let directory =
+            std::env::temp_dir().join(format!("exon-disk-cache-{}-{}", std::process::id(), name));
+        let _ = fs::remove_dir_all(&directory);
+
+        directory
+    }
+
+    fn entry_count(directory: &Path) -> usize {
+        fs::read_dir(directory).unwrap().count()
+    }
+
+    // Each entry below takes 15 bytes: the key length, a one-byte key and ten bytes of data.
+    const DATA: &[u8] = b"0123456789";
+
+    #[test]
+    fn put_get() {
+        let directory = directory("put-get");
+        let cache = DiskCache::open(&directory, 1024).unwrap();
+
+        assert!(cache.get("a").is_none());
+
+        cache.put("a", DATA);
+
+        assert!(cache.contains("a"));
+        assert_eq!(cache.get("a"), Some(Bytes::from_static(DATA)));
+        assert!(!cache.contains("b"));
+
+        // Entries bigger than the cache are never written.
+        cache.put("b", &[0; 1024]);
+
+        assert!(!cache.contains("b"));
+        assert_eq!(entry_count(&directory), 1);
+
+        fs::remove_dir_all(&directory).unwrap();
+    }
+
+    #[test]
+    fn key_mismatch() {
+        let directory = directory("key-mismatch");
+        let cache = DiskCache::open(&directory, 1024).unwrap();
+
+        cache.put("a", DATA);
+        cache.put("b", DATA);
+
+        // Stand in for a hash collision by moving the entry of one key to the name of the other.
+        fs::rename(
+            directory.join(DiskCache::entry_name("b")),
+            directory.join(DiskCache::entry_name("a")),
+        )
+        .unwrap();
+
+        assert!(cache.get("a").is_none());
+        assert!(!cache.contains("a"));
+        assert_eq!(entry_count(&directory), 0);
+
+        fs::remove_dir_all(&directory).unwrap();
+    }
+
+    #[test]
+    fn evicts_least_recently_used() {
+        let directory = directory("evict");
+        let cache = DiskCache::open(&directory, 30).unwrap();
+
+        cache.put("a", DATA);
+        cache.put("b", DATA);
+
+        // Reading the first entry makes the second the least recently used.
+        assert!(cache.get("a").is_some());
+        cache.put("c", DATA);
+
+        assert!(cache.get("b").is_none());
+        assert!(cache.get("a").is_some());
+        assert!(cache.get("c").is_some());
+        assert!(!directory.join(DiskCache::entry_name("b")).exists());
+        assert_eq!(entry_count(&directory), 2);
+
+        fs::remove_dir_all(&directory).unwrap();
+    }
+
+    #[test]
+    fn reopen() {
+        let directory = directory("reopen");
+
+        let cache = DiskCache::open(&directory, 1024).unwrap();
+        cache.put("a", DATA);
+        cache.put("b", DATA);
+        drop(cache);
+
+        // Left behind by a process that died mid-write.
+        fs::write(directory.join(format!("x.{}", TEMP_EXTENSION)), DATA).unwrap();
+
+        let cache = DiskCache::open(&directory, 1024).unwrap();
+
+        assert_eq!(cache.get("a"), Some(Bytes::from_static(DATA)));
+        assert_eq!(cache.get("b"), Some(Bytes::from_static(DATA)));
+        assert_eq!(entry_count(&directory), 2);
+        drop(cache);
+
+        // Reopening with a smaller capacity evicts down to it.
+        let cache = DiskCache::open(&directory, 15).unwrap();
+
+        let kept = ["a", "b"].iter().filter(|key| cache.contains(key)).count();
+        assert_eq!(kept, 1);
+        assert_eq!(entry_count(&directory), 1);
+
+        fs::remove_dir_all(&directory).unwrap();
+    }
+}
@@ -0,0 +1,477 @@
+// Copyright 2023 WHERE TRUE Technologies.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+use std::{
+    collections::HashMap,
+    ffi::{c_char, c_void, CStr, CString},
+    fmt::{Debug, Display},
+    ops::{Deref, Range},
+    sync::{Arc, Mutex},
+};
+
+use async_trait::async_trait;
+use bytes::Bytes;
+use chrono::{DateTime, TimeZone, Utc};
+use datafusion::{datasource::listing::ListingTableUrl, error::DataFusionError, prelude::SessionContext};
+use futures::stream::{self, BoxStream, StreamExt};
+use object_store::{
+    path::Path, GetOptions, GetResult, ListResult, MultipartId, ObjectMeta, ObjectStore,
+};
+use tokio::io::AsyncWrite;
+use url::Url;
+
+const STORE_NAME: &str = "DuckDBFileSystem";
+
+// Size of the reads issued while streaming a whole object.
+const STREAM_CHUNK_SIZE: usize = 4 * 1024 * 1024;
+
+/// Callbacks into DuckDB's `FileSystem`, filled in on the extension side.
+///
+/// `context` is handed back to `open` and `glob`, the handle returned by `open` is handed back to
+/// the per-file callbacks. `read_at` returns the number of bytes read or -1 on error.
+#[repr(C)]
+#[derive(Clone, Copy, Debug)]
+pub struct DuckDBFileSystem {
+    context: *mut c_void,
+    open: unsafe extern "C" fn(context: *mut c_void, path: *const c_char) -> *mut c_void,
+    read_at: unsafe extern "C" fn(
+        handle: *mut c_void,
+        buffer: *mut u8,
+        length: usize,
+        offset: u64,
+    ) -> i64,
+    file_size: unsafe extern "C" fn(handle: *mut c_void) -> i64,
+    last_modified: unsafe extern "C" fn(handle: *mut c_void) -> i64,
+    close: unsafe extern "C" fn(handle: *mut c_void),
+    glob: unsafe extern "C" fn(context: *mut c_void, pattern: *const c_char) -> *mut c_char,
+    free_string: unsafe extern "C" fn(value: *mut c_char),
+}
+
+unsafe impl Send for DuckDBFileSystem {}
+unsafe impl Sync for DuckDBFileSystem {}
+
+/// An open DuckDB `FileHandle`, closed on drop.
+#[derive(Debug)]
+struct FileHandle {
+    file_system: DuckDBFileSystem,
+    handle: *mut c_void,
+}
+
+unsafe impl Send for FileHandle {}
+
+impl FileHandle {
+    fn open(file_system: DuckDBFileSystem, path: &str) -> std::io::Result<Self> {
+        let c_path = CString::new(path)
+            .map_err(|e| std::io::Error::new(std::io::ErrorKind::InvalidInput, e))?;
+
+        let handle = unsafe { (file_system.open)(file_system.context, c_path.as_ptr()) };
+        if handle.is_null() {
+            return Err(std::io::Error::new(
+                std::io::ErrorKind::NotFound,
+                format!("could not open {}", path),
+            ));
+        }
+
+        Ok(Self {
+            file_system,
+            handle,
+        })
+    }
+
+    fn size(&self) -> std::io::Result<usize> {
+        let size = unsafe { (self.file_system.file_size)(self.handle) };
+        if size < 0 {
+            return Err(std::io::Error::new(
+                std::io::ErrorKind::Other,
+                "could not get file size",
+            ));
+        }
+
+        Ok(size as usize)
+    }
+
+    fn last_modified(&self) -> DateTime<Utc> {
+        let seconds = unsafe { (self.file_system.last_modified)(self.handle) };
+        Utc.timestamp_opt(seconds, 0)
+            .single()
+            .unwrap_or_else(Utc::now)
+    }
+
+    fn read_at(&self, range: Range<usize>) -> std::io::Result<Bytes> {
+        let mut buffer = vec![0u8; range.len()];
+        let n = unsafe {
+            (self.file_system.read_at)(
+                self.handle,
+                buffer.as_mut_ptr(),
+                buffer.len(),
+                range.start as u64,
+            )
+        };
+
+        if n < 0 || n as usize != buffer.len() {
+            return Err(std::io::Error::new(
+                std::io::ErrorKind::UnexpectedEof,
+                format!("could not read bytes {}..{}", range.start, range.end),
+            ));
+        }
+
+        Ok(Bytes::from(buffer))
+    }
+}
+
+impl Drop for FileHandle {
+    fn drop(&mut self) {
+        unsafe { (self.file_system.close)(self.handle) };
+    }
+}
+
+/// The file system and idle handles of a `DuckDBObjectStore`, shared with the blocking tasks that
+/// call into DuckDB.
+#[derive(Debug)]
+struct Files {
+    file_system: DuckDBFileSystem,
+    base: String,
+    // Idle handles by path, so repeated range reads don't re-open (and re-HEAD) the file.
+    handles: Mutex<HashMap<Path, Vec<FileHandle>>>,
+}
+
+impl Files {
+    fn duckdb_path(&self, location: &Path) -> String {
+        format!("{}/{}", self.base, location)
+    }
+
+    fn checkout(self: &Arc<Self>, location: &Path) -> object_store::Result<PooledHandle> {
+        let idle = self
+            .handles
+            .lock()
+            .unwrap()
+            .get_mut(location)
+            .and_then(|handles| handles.pop());
+
+        let handle = match idle {
+            Some(handle) => handle,
+            None => {
+                let path = self.duckdb_path(location);
+                FileHandle::open(self.file_system, &path).map_err(|e| {
+                    object_store::Error::NotFound {
+                        path,
+                        source: Box::new(e),
+                    }
+                })?
+            }
+        };
+
+        Ok(PooledHandle {
+            files: self.clone(),
+            location: location.clone(),
+            handle: Some(handle),
+        })
+    }
+
+    fn checkin(&self, location: &Path, handle: FileHandle) {
+        self.handles
+            .lock()
+            .unwrap()
+            .entry(location.clone())
+            .or_default()
+            .push(handle);
+    }
+
+    fn meta(&self, location: &Path, handle: &FileHandle) -> object_store::Result<ObjectMeta> {
+        Ok(ObjectMeta {
+            location: location.clone(),
+            last_modified: handle.last_modified(),
+            size: handle.size().map_err(generic_error)?,
+            e_tag: None,
+        })
+    }
+
+    fn glob(&self, pattern: &str) -> object_store::Result<Vec<String>> {
+        let c_pattern = CString::new(pattern).map_err(generic_error)?;
+
+        let raw = unsafe { (self.file_system.glob)(self.file_system.context, c_pattern.as_ptr()) };
+        if raw.is_null() {
+            return Ok(vec![]);
+        }
+
+        let joined = unsafe { CStr::from_ptr(raw) }.to_string_lossy().to_string();
+        unsafe { (self.file_system.free_string)(raw) };
+
+        Ok(joined
+            .split('\n')
+            .filter(|p| !p.is_empty())
+            .map(|p| p.to_string())
+            .collect())
+    }
+
+    fn to_location(&self, duckdb_path: &str) -> object_store::Result<Path> {
+        let relative = duckdb_path
+            .strip_prefix(self.base.as_str())
+            .unwrap_or(duckdb_path);
+
+        Path::parse(relative.trim_start_matches('/')).map_err(generic_error)
+    }
+}
+
+/// A handle checked out of `Files`, checked back in when dropped, so streams abandoned part way
+/// through still return theirs.
+#[derive(Debug)]
+struct PooledHandle {
+    files: Arc<Files>,
+    location: Path,
+    handle: Option<FileHandle>,
+}
+
+impl Deref for PooledHandle {
+    type Target = FileHandle;
+
+    fn deref(&self) -> &FileHandle {
+        self.handle.as_ref().unwrap()
+    }
+}
+
+impl Drop for PooledHandle {
+    fn drop(&mut self) {
+        if let Some(handle) = self.handle.take() {
+            self.files.checkin(&self.location, handle);
+        }
+    }
+}
+
+/// Runs `f` on tokio's blocking pool: DuckDB's file system blocks the calling thread until its
+/// I/O completes, which would stall every other task of the runtime.
+async fn blocking<T, F>(f: F) -> object_store::Result<T>
+where
+    F: FnOnce() -> object_store::Result<T> + Send + 'static,
+    T: Send + 'static,
+{
+    tokio::task::spawn_blocking(f)
+        .await
+        .map_err(generic_error)?
+}
+
+/// An `ObjectStore` that reads through DuckDB's `FileSystem`, so exon readers share httpfs
+/// connections, credentials and any caching file system registered with the database.
+#[derive(Debug)]
+pub struct DuckDBObjectStore {
+    files: Arc<Files>,
+}
+
+impl DuckDBObjectStore {
+    pub fn new(file_system: DuckDBFileSystem, url: &Url) -> Self {
+        let base = match url.scheme() {
+            "file" => String::new(),
+            scheme => format!("{}://{}", scheme, url.host_str().unwrap_or("")),
+        };
+
+        Self {
+            files: Arc::new(Files {
+                file_system,
+                base,
+                handles: Mutex::new(HashMap::new()),
+            }),
+        }
+    }
+}
+
+impl Display for DuckDBObjectStore {
+    fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+        write!(f, "DuckDBObjectStore({})", self.files.base)
+    }
+}
+
+fn generic_error<E: std::error::Error + Send + Sync + 'static>(e: E) -> object_store::Error {
+    object_store::Error::Generic {
+        store: STORE_NAME,
+        source: Box::new(e),
+    }
+}
+
+#[async_trait]
+impl ObjectStore for DuckDBObjectStore {
+    async fn put(&self, _location: &Path, _bytes: Bytes) -> object_store::Result<()> {
+        Err(object_store::Error::NotImplemented)
+    }
+
+    async fn put_multipart(
+        &self,
+        _location: &Path,
+    ) -> object_store::Result<(MultipartId, Box<dyn AsyncWrite + Unpin + Send>)> {
+        Err(object_store::Error::NotImplemented)
+    }
+
+    async fn abort_multipart(
+        &self,
+        _location: &Path,
+        _multipart_id: &MultipartId,
+    ) -> object_store::Result<()> {
+        Err(object_store::Error::NotImplemented)
+    }
+
+    async fn get_opts(
+        &self,
+        location: &Path,
+        options: GetOptions,
+    ) -> object_store::Result<GetResult> {
+        let files = self.files.clone();
+        let location = location.clone();
+        let (handle, size) = blocking(move || {
+            let handle = files.checkout(&location)?;
+            let size = handle.size().map_err(generic_error)?;
+
+            Ok((handle, size))
+        })
+        .await?;
+
+        let range = options.range.unwrap_or(0..size);
+        let end = range.end.min(size);
+
+        // The handle goes back to the pool once the stream ends or is dropped.
+        let chunks = stream::unfold(
+            (Some(handle), range.start),
+            move |(handle, offset)| async move {
+                let handle = handle?;
+                if offset >= end {
+                    return None;
+                }
+
+                let chunk_end = (offset + STREAM_CHUNK_SIZE).min(end);
+                let read = tokio::task::spawn_blocking(move || {
+                    let result = handle.read_at(offset..chunk_end).map_err(generic_error);
+                    (handle, result)
+                })
+                .await;
+
+                match read {
+                    Ok((handle, result)) => Some((result, (Some(handle), chunk_end))),
+                    Err(e) => Some((Err(generic_error(e)), (None, end))),
+                }
+            },
+        );
+
+        Ok(GetResult::Stream(chunks.boxed()))
+    }
+
+    async fn get_range(&self, location: &Path, range: Range<usize>) -> object_store::Result<Bytes> {
+        let files = self.files.clone();
+        let location = location.clone();
+
+        blocking(move || {
+            let handle = files.checkout(&location)?;
+
+            let size = handle.size().map_err(generic_error)?;
+            let range = range.start.min(size)..range.end.min(size);
+
+            handle.read_at(range).map_err(generic_error)
+        })
+        .await
+    }
+
+    async fn head(&self, location: &Path) -> object_store::Result<ObjectMeta> {
+        let files = self.files.clone();
+        let location = location.clone();
+
+        blocking(move || {
+            let handle = files.checkout(&location)?;
+            files.meta(&location, &handle)
+        })
+        .await
+    }
+
+    async fn delete(&self, _location: &Path) -> object_store::Result<()> {
+        Err(object_store::Error::NotImplemented)
+    }
+
+    async fn list(
+        &self,
+        prefix: Option<&Path>,
+    ) -> object_store::Result<BoxStream<'_, object_store::Result<ObjectMeta>>> {
+        // Every object below the prefix, however deep, as object_store lists them; `**` matches
+        // any number of directories and the final `*` only files.
+        let pattern = match prefix {
+            Some(prefix) => format!("{}/**/*", self.files.duckdb_path(prefix)),
+            None => format!("{}/**/*", self.files.base),
+        };
+
+        let files = self.files.clone();
+        let paths = blocking(move || files.glob(&pattern)).await?;
+
+        let mut metas = vec![];
+        for path in paths {
+            let location = self.files.to_location(&path)?;
+            metas.push(self.head(&location).await);
+        }
+
+        Ok(stream::iter(metas).boxed())
+    }
+
+    async fn list_with_delimiter(&self, prefix: Option<&Path>) -> object_store::Result<ListResult> {
+        let pattern = match prefix {
+            Some(prefix) => format!("{}/**/*", self.files.duckdb_path(prefix)),
+            None => format!("{}/**/*", self.files.base),
+        };
+
+        let files = self.files.clone();
+        let paths = blocking(move || files.glob(&pattern)).await?;
+
+        // Objects directly below the prefix are listed, deeper ones only name their directory.
+        let depth = prefix.map(|prefix| prefix.parts().count()).unwrap_or(0);
+        let mut common_prefixes = vec![];
+        let mut objects = vec![];
+        for path in paths {
+            let location = self.files.to_location(&path)?;
+            let parts = location.parts().collect::<Vec<_>>();
+
+            if parts.len() > depth + 1 {
+                let common_prefix = Path::from_iter(parts[..=depth].iter().cloned());
+                if !common_prefixes.contains(&common_prefix) {
+                    common_prefixes.push(common_prefix);
+                }
+            } else {
+                objects.push(self.head(&location).await?);
+            }
+        }
+
+        Ok(ListResult {
+            common_prefixes,
+            objects,
+        })
+    }
+
+    async fn copy(&self, _from: &Path, _to: &Path) -> object_store::Result<()> {
+        Err(object_store::Error::NotImplemented)
+    }
+
+    async fn copy_if_not_exists(&self, _from: &Path, _to: &Path) -> object_store::Result<()> {
+        Err(object_store::Error::NotImplemented)
+    }
+}
+
+/// Registers a `DuckDBObjectStore` for the object store URL of `uri`, in place of the store
+/// exon would otherwise register for the URI's scheme.
+pub fn register_duckdb_file_system(
+    ctx: &SessionContext,
+    uri: &str,
+    file_system: DuckDBFileSystem,
+) -> Result<Arc<dyn ObjectStore>, DataFusionError> {
+    let table_url = ListingTableUrl::parse(uri)?;
+    let store_url = table_url.object_store();
+    let url: &Url = store_url.as_ref();
+
+    let store: Arc<dyn ObjectStore> = Arc::new(DuckDBObjectStore::new(file_system, url));
+    ctx.runtime_env()
+        .register_object_store(url, store.clone());
+
+    Ok(store)
+}
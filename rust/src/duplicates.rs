@@ -0,0 +1,736 @@
+// Copyright 2023 WHERE TRUE Technologies.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+//! Marks duplicate reads of a local coordinate-sorted BAM file as it is scanned. Reads are
+//! duplicates when they share their library, reference sequence, orientation and unclipped 5'
+//! position, the position the read would start at had it not been clipped. Of each set of
+//! duplicates the read with the highest sum of base qualities of at least 15 is kept, the first
+//! in file order on ties, and the others are marked.
+//!
+//! Records are returned in file order, each held in a window only until no read still to come can
+//! share its 5' position: for reverse reads, whose 5' end is their alignment end, until the scan
+//! passes that position, for forward reads, which may start after it by their clipping, until the
+//! scan is past it by the longest read seen so far. Only primary alignments of mapped reads are
+//! compared; the others are returned as they are.
+//!
+//! Duplicates never span reference sequences, so a file with an index can be marked one
+//! reference sequence per partition, see `duplicate_partitions`.
+
+use std::{
+    collections::{HashMap, VecDeque},
+    ffi::{c_char, CStr, CString},
+    io,
+    sync::Arc,
+};
+
+use arrow::{
+    array::{ArrayRef, BooleanBuilder},
+    datatypes::{DataType, Field, Schema, SchemaRef},
+    ffi_stream::FFI_ArrowArrayStream as ArrowArrayStream,
+    record_batch::RecordBatch,
+};
+use datafusion::{
+    datasource::streaming::StreamingTable,
+    execution::TaskContext,
+    physical_plan::{streaming::PartitionStream, SendableRecordBatchStream},
+    prelude::SessionContext,
+};
+use exon::{ffi::create_dataset_stream_from_table_provider, new_exon_config};
+use tokio::runtime::Runtime;
+
+use crate::{
+    bam_reader::{
+        bam_projection, bam_schema, projected_schema, read_bam_header_text, read_bam_record_prefix,
+        record_interval, record_tag, with_reference_dictionary, BamBatchBuilder, RecordExtent,
+    },
+    bam_scan::{read_local_index, strings_from_ffi},
+    bgzf::{BgzfRead, BlockCursor},
+    binning_index::BinningIndex,
+    index_builder::{file_reader, le_i32, le_u16, le_u32},
+    partition_reader::{blocking_stream, ScanPartitionsResult},
+    subset_reader::{invalid_data, map_file},
+};
+
+const UNMAPPED: u16 = 0x4;
+const REVERSE: u16 = 0x10;
+const SECONDARY: u16 = 0x100;
+const DUPLICATE: u16 = 0x400;
+const SUPPLEMENTARY: u16 = 0x800;
+
+/// Base qualities below this don't count towards a read's score, as in Picard.
+const MIN_SCORED_QUALITY: u8 = 15;
+
+/// The partition of the unplaced records, which follow every reference sequence.
+pub const UNPLACED_PARTITION: &str = "*";
+
+/// The column `mark_duplicates` adds to those of `read_bam_file_records`.
+pub const DUPLICATE_COLUMN: &str = "duplicate";
+
+/// The columns of `read_bam_file_records`, with dictionary-encoded reference columns and those
+/// outside `projection` nullable, followed by whether each record was marked as a duplicate.
+pub fn duplicates_schema(projection: &[bool]) -> SchemaRef {
+    let schema = projected_schema(&with_reference_dictionary(&bam_schema(false)), projection);
+
+    let mut fields = schema
+        .fields()
+        .iter()
+        .map(|field| field.as_ref().clone())
+        .collect::<Vec<_>>();
+    fields.push(Field::new(DUPLICATE_COLUMN, DataType::Boolean, false));
+
+    Arc::new(Schema::new(fields))
+}
+
+/// The scan order of a position: its reference sequence, unplaced last, then zero-based start.
+fn sort_key(reference_id: i32, position: i32) -> (u32, i32) {
+    (reference_id as u32, position)
+}
+
+/// The library number of each read group of the SAM header `text`, by read group id. Read groups
+/// of the same library share a number; 0 is left for reads without a library.
+fn read_group_libraries(text: &str) -> HashMap<Vec<u8>, u32> {
+    let mut names: Vec<&str> = vec![];
+    let mut libraries = HashMap::new();
+
+    for line in text.lines().filter(|line| line.starts_with("@RG\t")) {
+        let field = |tag: &str| line.split('\t').find_map(|field| field.strip_prefix(tag));
+
+        let (id, library) = match (field("ID:"), field("LB:")) {
+            (Some(id), Some(library)) => (id, library),
+            _ => continue,
+        };
+
+        let number = match names.iter().position(|name| *name == library) {
+            Some(i) => i + 1,
+            None => {
+                names.push(library);
+                names.len()
+            }
+        };
+
+        libraries.insert(id.as_bytes().to_vec(), number as u32);
+    }
+
+    libraries
+}
+
+/// What makes reads duplicates of each other, within a reference sequence.
+#[derive(Clone, Copy, Debug, PartialEq, Eq, Hash)]
+struct DuplicateKey {
+    library: u32,
+    five_prime: i32,
+    reverse: bool,
+}
+
+/// The duplicate key of a read with how it ranks among its duplicates.
+struct ReadEnds {
+    key: DuplicateKey,
+    score: u64,
+    /// The read length with hard clips, the most its start can be clipped by.
+    length: i32,
+}
+
+impl ReadEnds {
+    /// The ends of a whole record, `None` unless it is the primary alignment of a mapped read.
+    fn from_record(record: &[u8], libraries: &HashMap<Vec<u8>, u32>) -> io::Result<Option<Self>> {
+        let flag = le_u16(&record[14..]);
+        if flag & (UNMAPPED | SECONDARY | SUPPLEMENTARY) != 0 || le_i32(&record[4..]) < 0 {
+            return Ok(None);
+        }
+
+        let (_, start, end) = record_interval(record)?;
+
+        let cigar_start = 32 + record[8] as usize;
+        let cigar_end = cigar_start + le_u16(&record[12..]) as usize * 4;
+        let cigar = &record[cigar_start..cigar_end];
+
+        // Soft and hard clips, S and H, at either end of the CIGAR.
+        let clips = |ops: &mut dyn Iterator<Item = u32>| {
+            ops.take_while(|op| matches!(op & 0xf, 4 | 5))
+                .map(|op| (op >> 4) as i32)
+                .sum::<i32>()
+        };
+        let leading = clips(&mut cigar.chunks_exact(4).map(le_u32));
+        let trailing = clips(&mut cigar.chunks_exact(4).rev().map(le_u32));
+
+        let hard_clipped = cigar
+            .chunks_exact(4)
+            .map(le_u32)
+            .filter(|op| op & 0xf == 5)
+            .map(|op| (op >> 4) as i32)
+            .sum::<i32>();
+
+        let reverse = flag & REVERSE != 0;
+        let five_prime = if reverse {
+            end + trailing - 1
+        } else {
+            start - leading
+        };
+
+        let l_seq = le_u32(&record[16..]) as usize;
+        let quality_start = cigar_end + (l_seq + 1) / 2;
+        let qualities = record
+            .get(quality_start..quality_start + l_seq)
+            .ok_or_else(|| invalid_data("truncated BAM record"))?;
+
+        // Qualities of 255 mean none are stored.
+        let score = qualities
+            .iter()
+            .filter(|quality| (MIN_SCORED_QUALITY..255).contains(*quality))
+            .map(|quality| *quality as u64)
+            .sum();
+
+        let library = match record_tag(record, *b"RG")? {
+            Some((b'Z', id)) => {
+                let id = id.strip_suffix(b"\0").unwrap_or(id);
+                libraries.get(id).copied().unwrap_or(0)
+            }
+            _ => 0,
+        };
+
+        Ok(Some(Self {
+            key: DuplicateKey {
+                library,
+                five_prime,
+                reverse,
+            },
+            score,
+            length: l_seq as i32 + hard_clipped,
+        }))
+    }
+}
+
+/// A record waiting in the window for its duplicates to have been read.
+struct Pending {
+    record: Vec<u8>,
+    offset: u64,
+    key: Option<DuplicateKey>,
+    duplicate: bool,
+}
+
+/// The reads sharing a duplicate key so far, by their sequence numbers in the scan.
+struct Group {
+    best: u64,
+    score: u64,
+    last: u64,
+}
+
+/// The records of the reads whose duplicates may still be read, in file order.
+#[derive(Default)]
+struct Window {
+    queue: VecDeque<Pending>,
+    groups: HashMap<DuplicateKey, Group>,
+    /// The sequence number of the record at the front of the queue.
+    front: u64,
+    /// The longest read seen, the most a forward read can start past its 5' position.
+    longest: i32,
+    /// Buffers of records already returned, reused for those still to be read.
+    spare: Vec<Vec<u8>>,
+}
+
+impl Window {
+    fn buffer(&mut self) -> Vec<u8> {
+        self.spare.pop().unwrap_or_default()
+    }
+
+    /// Adds the next record, marking it or the best of its duplicates so far.
+    fn push(&mut self, record: Vec<u8>, offset: u64, ends: Option<ReadEnds>) {
+        let sequence = self.front + self.queue.len() as u64;
+        let mut duplicate = false;
+
+        if let Some(ends) = &ends {
+            self.longest = self.longest.max(ends.length);
+
+            match self.groups.get_mut(&ends.key) {
+                // The best read so far can only be marked while it hasn't been returned.
+                Some(group) if ends.score > group.score && group.best >= self.front => {
+                    self.queue[(group.best - self.front) as usize].duplicate = true;
+                    group.best = sequence;
+                    group.score = ends.score;
+                    group.last = sequence;
+                }
+                Some(group) => {
+                    duplicate = true;
+                    group.last = sequence;
+                }
+                None => {
+                    self.groups.insert(
+                        ends.key,
+                        Group {
+                            best: sequence,
+                            score: ends.score,
+                            last: sequence,
+                        },
+                    );
+                }
+            }
+        }
+
+        self.queue.push_back(Pending {
+            record,
+            offset,
+            key: ends.map(|ends| ends.key),
+            duplicate,
+        });
+    }
+
+    /// Takes the front record if no read starting at `position` or later can be its duplicate,
+    /// or if `position` is `None`, at the end of a reference sequence.
+    fn pop(&mut self, position: Option<i32>) -> Option<Pending> {
+        let front = self.queue.front()?;
+
+        if let (Some(key), Some(position)) = (front.key, position) {
+            let last_start = if key.reverse {
+                key.five_prime
+            } else {
+                key.five_prime.saturating_add(self.longest)
+            };
+
+            if position <= last_start {
+                return None;
+            }
+        }
+
+        let pending = self.queue.pop_front()?;
+
+        if let Some(key) = pending.key {
+            if self.groups.get(&key).map(|group| group.last) == Some(self.front) {
+                self.groups.remove(&key);
+            }
+        }
+
+        self.front += 1;
+
+        Some(pending)
+    }
+}
+
+/// Accumulates marked records into record batches of `duplicates_schema`.
+struct DuplicateBatchBuilder {
+    schema: SchemaRef,
+    records: BamBatchBuilder,
+    duplicates: BooleanBuilder,
+}
+
+impl DuplicateBatchBuilder {
+    /// Appends `pending`, setting the duplicate flag of the reads that were compared.
+    fn append(&mut self, pending: &mut Pending) -> io::Result<()> {
+        if pending.key.is_some() {
+            let flag = le_u16(&pending.record[14..]) & !DUPLICATE;
+            let flag = if pending.duplicate {
+                flag | DUPLICATE
+            } else {
+                flag
+            };
+            pending.record[14..16].copy_from_slice(&flag.to_le_bytes());
+        }
+
+        self.records.append(&pending.record, pending.offset)?;
+        self.duplicates.append_value(pending.duplicate);
+
+        Ok(())
+    }
+
+    fn finish(&mut self) -> io::Result<RecordBatch> {
+        let records = self.records.finish()?;
+
+        let mut columns: Vec<ArrayRef> = records.columns().to_vec();
+        columns.push(Arc::new(self.duplicates.finish()));
+
+        RecordBatch::try_new(self.schema.clone(), columns).map_err(invalid_data)
+    }
+}
+
+/// The first virtual offset of `partition` in a file indexed by `index`: the reference sequence
+/// named `partition` or the unplaced records. `None` if the partition has no records.
+fn partition_start(
+    index: &BinningIndex,
+    references: &[String],
+    partition: &str,
+) -> io::Result<Option<(i32, Option<u64>)>> {
+    if partition == UNPLACED_PARTITION {
+        // Unplaced records follow the last placed one, or the header if there are none.
+        let end = (0..index.references.len())
+            .filter_map(|id| index.reference_chunks(id).last().map(|chunk| chunk.end))
+            .max();
+        return Ok(Some((-1, end)));
+    }
+
+    let reference_id = references
+        .iter()
+        .position(|name| name == partition)
+        .ok_or_else(|| {
+            invalid_data(format!(
+                "reference sequence {} is not in the BAM header",
+                partition
+            ))
+        })?;
+
+    Ok(index
+        .reference_chunks(reference_id)
+        .first()
+        .map(|chunk| (reference_id as i32, Some(chunk.start))))
+}
+
+/// Plans one partition per reference sequence with records in a file indexed by `index`, plus
+/// one for the unplaced records unless the index counts none. `None` if there would be only one.
+pub fn plan_duplicate_partitions(
+    index: &BinningIndex,
+    references: &[String],
+) -> Option<Vec<String>> {
+    let mut partitions = vec![];
+
+    for (reference_id, reference) in index.references.iter().enumerate() {
+        if !reference.bins.is_empty() {
+            partitions.push(references.get(reference_id)?.clone());
+        }
+    }
+
+    if index.unplaced_unmapped != Some(0) {
+        partitions.push(UNPLACED_PARTITION.to_string());
+    }
+
+    if partitions.len() < 2 {
+        return None;
+    }
+
+    Some(partitions)
+}
+
+/// The duplicate marking of one BAM file, read whole or one partition of it.
+struct DuplicateScan {
+    path: String,
+    partition: Option<String>,
+    projection: Vec<bool>,
+    batch_size: usize,
+    threads: usize,
+}
+
+impl DuplicateScan {
+    /// Marks the records, handing each batch to `emit` until it returns false.
+    fn run<F>(&self, schema: SchemaRef, mut emit: F) -> io::Result<()>
+    where
+        F: FnMut(RecordBatch) -> bool,
+    {
+        let data = map_file(&self.path)?;
+
+        match &self.partition {
+            Some(partition) => {
+                let mut cursor = BlockCursor::new(&data);
+                let (text, references) = read_bam_header_text(&mut cursor)?;
+
+                let index = read_local_index(&self.path)?;
+                let reference_id = match partition_start(&index, &references, partition)? {
+                    Some((reference_id, Some(start))) => {
+                        cursor.seek(start)?;
+                        reference_id
+                    }
+                    Some((reference_id, None)) => reference_id,
+                    None => return Ok(()),
+                };
+
+                self.mark(
+                    &mut cursor,
+                    &text,
+                    references,
+                    Some(reference_id),
+                    schema,
+                    &mut emit,
+                )
+            }
+            None => {
+                let mut reader = file_reader(&data, self.threads)?;
+                let (text, references) = read_bam_header_text(&mut reader)?;
+
+                self.mark(&mut reader, &text, references, None, schema, &mut emit)
+            }
+        }
+    }
+
+    /// Returns the records of the window no read at `position` or later can be a duplicate of,
+    /// or all of them if `position` is `None`. False once `emit` has returned false.
+    fn release<F>(
+        &self,
+        window: &mut Window,
+        batch: &mut DuplicateBatchBuilder,
+        position: Option<i32>,
+        emit: &mut F,
+    ) -> io::Result<bool>
+    where
+        F: FnMut(RecordBatch) -> bool,
+    {
+        while let Some(mut pending) = window.pop(position) {
+            batch.append(&mut pending)?;
+            window.spare.push(pending.record);
+
+            if batch.records.rows() >= self.batch_size && !emit(batch.finish()?) {
+                return Ok(false);
+            }
+        }
+
+        Ok(true)
+    }
+
+    /// Marks the records read from `reader`, only those of reference sequence `only` if set.
+    fn mark<R, F>(
+        &self,
+        reader: &mut R,
+        text: &str,
+        references: Vec<String>,
+        only: Option<i32>,
+        schema: SchemaRef,
+        emit: &mut F,
+    ) -> io::Result<()>
+    where
+        R: BgzfRead + ?Sized,
+        F: FnMut(RecordBatch) -> bool,
+    {
+        let libraries = read_group_libraries(text);
+
+        let records = BamBatchBuilder::with_projection(
+            with_reference_dictionary(&bam_schema(false)),
+            Arc::new(references),
+            self.projection.clone(),
+        );
+        let mut batch = DuplicateBatchBuilder {
+            schema,
+            records,
+            duplicates: BooleanBuilder::new(),
+        };
+
+        let mut window = Window::default();
+        let mut previous_key = (0, i32::MIN);
+
+        loop {
+            let offset = reader.virtual_offset();
+            let mut record = window.buffer();
+
+            // The duplicate key needs the base qualities and read group, past the CIGAR.
+            if !read_bam_record_prefix(reader, &mut record, RecordExtent::All)? {
+                break;
+            }
+
+            let reference_id = le_i32(&record);
+            let position = le_i32(&record[4..]);
+
+            if let Some(only) = only {
+                if reference_id != only {
+                    // The partition's records are contiguous, the ones after it are another's.
+                    if reference_id as u32 > only as u32 {
+                        break;
+                    }
+
+                    window.spare.push(record);
+                    continue;
+                }
+            }
+
+            let key = sort_key(reference_id, position);
+            if key < previous_key {
+                return Err(invalid_data(format!(
+                    "{} is not sorted by coordinate",
+                    self.path
+                )));
+            }
+
+            // Duplicates never span reference sequences.
+            let position = if key.0 == previous_key.0 {
+                Some(position)
+            } else {
+                None
+            };
+            previous_key = key;
+
+            if !self.release(&mut window, &mut batch, position, emit)? {
+                return Ok(());
+            }
+
+            let ends = ReadEnds::from_record(&record, &libraries)?;
+            window.push(record, offset, ends);
+        }
+
+        if self.release(&mut window, &mut batch, None, emit)? && batch.records.rows() > 0 {
+            emit(batch.finish()?);
+        }
+
+        Ok(())
+    }
+}
+
+struct DuplicatePartition {
+    schema: SchemaRef,
+    scan: Arc<DuplicateScan>,
+}
+
+impl PartitionStream for DuplicatePartition {
+    fn schema(&self) -> &SchemaRef {
+        &self.schema
+    }
+
+    fn execute(&self, _ctx: Arc<TaskContext>) -> SendableRecordBatchStream {
+        let scan = self.scan.clone();
+        let schema = self.schema.clone();
+
+        blocking_stream(self.schema.clone(), move |emit| scan.run(schema, emit))
+    }
+}
+
+/// Plans the partitions `new_duplicate_reader` can mark the local BAM file at `uri` in, one per
+/// reference sequence. No partitions and no error means the file should be marked as a whole,
+/// e.g. it has no index. Released with `free_scan_partitions`.
+#[no_mangle]
+pub unsafe extern "C" fn duplicate_partitions(uri: *const c_char) -> ScanPartitionsResult {
+    let uri = match CStr::from_ptr(uri).to_str() {
+        Ok(uri) => uri,
+        Err(e) => return ScanPartitionsResult::error(format!("could not parse uri: {}", e)),
+    };
+
+    let references = match map_file(uri).and_then(|data| {
+        read_bam_header_text(&mut BlockCursor::new(&data)).map(|(_, references)| references)
+    }) {
+        Ok(references) => references,
+        Err(e) => return ScanPartitionsResult::error(format!("could not read BAM header: {}", e)),
+    };
+
+    let index = match read_local_index(uri) {
+        Ok(index) => index,
+        Err(e) if e.kind() == io::ErrorKind::NotFound => return ScanPartitionsResult::empty(),
+        Err(e) => return ScanPartitionsResult::error(format!("could not read index: {}", e)),
+    };
+
+    match plan_duplicate_partitions(&index, &references) {
+        Some(partitions) => ScanPartitionsResult::regions(&partitions),
+        None => ScanPartitionsResult::empty(),
+    }
+}
+
+#[repr(C)]
+pub struct DuplicateReaderResult {
+    error: *const c_char,
+}
+
+impl DuplicateReaderResult {
+    fn error(error: String) -> Self {
+        Self {
+            error: CString::new(error).unwrap().into_raw(),
+        }
+    }
+}
+
+/// Reads the records of the local coordinate-sorted BAM file at `uri` with duplicates marked,
+/// with the columns of `duplicates_schema`. If `partition` is not null, one planned by
+/// `duplicate_partitions`, only its records are read. Only the `column_count` columns named at
+/// `columns` are decoded, the others are all null; if `columns` is null every column is decoded.
+/// `filters` is a SQL predicate applied to the marked records. Whole files are inflated by
+/// `threads` threads.
+#[no_mangle]
+pub unsafe extern "C" fn new_duplicate_reader(
+    stream_ptr: *mut ArrowArrayStream,
+    uri: *const c_char,
+    partition: *const c_char,
+    columns: *const *const c_char,
+    column_count: usize,
+    batch_size: usize,
+    threads: usize,
+    filters: *const c_char,
+) -> DuplicateReaderResult {
+    let uri = match CStr::from_ptr(uri).to_str() {
+        Ok(uri) => uri,
+        Err(e) => return DuplicateReaderResult::error(format!("could not parse uri: {}", e)),
+    };
+
+    let partition = if partition.is_null() {
+        None
+    } else {
+        match CStr::from_ptr(partition).to_str() {
+            Ok(partition) => Some(partition.to_string()),
+            Err(e) => {
+                return DuplicateReaderResult::error(format!("could not parse partition: {}", e))
+            }
+        }
+    };
+
+    let columns = match strings_from_ffi(columns, column_count) {
+        Ok(columns) => columns,
+        Err(e) => return DuplicateReaderResult::error(format!("could not parse columns: {}", e)),
+    };
+
+    let filters = if filters.is_null() {
+        ""
+    } else {
+        match CStr::from_ptr(filters).to_str() {
+            Ok(filters) => filters,
+            Err(e) => {
+                return DuplicateReaderResult::error(format!("could not parse filters: {}", e))
+            }
+        }
+    };
+
+    // The file is read when the stream is, only its header is checked here.
+    let checked = map_file(uri).and_then(|data| read_bam_header_text(&mut BlockCursor::new(&data)));
+    if let Err(e) = checked {
+        return DuplicateReaderResult::error(format!("could not read BAM header: {}", e));
+    }
+
+    let projection = bam_projection(&bam_schema(false), columns.as_deref());
+    let schema = duplicates_schema(&projection);
+
+    let rt = Arc::new(Runtime::new().unwrap());
+
+    let config = new_exon_config().with_batch_size(batch_size);
+    let ctx = SessionContext::with_config_exon(config);
+
+    rt.block_on(async {
+        let partition = Arc::new(DuplicatePartition {
+            schema: schema.clone(),
+            scan: Arc::new(DuplicateScan {
+                path: uri.to_string(),
+                partition,
+                projection,
+                batch_size,
+                threads,
+            }),
+        }) as Arc<dyn PartitionStream>;
+
+        let table = match StreamingTable::try_new(schema, vec![partition]) {
+            Ok(table) => table,
+            Err(e) => {
+                return DuplicateReaderResult::error(format!("could not create table: {}", e))
+            }
+        };
+
+        if let Err(e) = ctx.register_table("exon_table", Arc::new(table)) {
+            return DuplicateReaderResult::error(format!("could not register table: {}", e));
+        }
+
+        let mut select_string = format!("SELECT * FROM exon_table");
+        if filters != "" {
+            select_string.push_str(format!(" WHERE {}", filters).as_str());
+        }
+
+        let df = match ctx.sql(&select_string).await {
+            Ok(df) => df,
+            Err(e) => return DuplicateReaderResult::error(format!("could not execute sql: {}", e)),
+        };
+
+        match create_dataset_stream_from_table_provider(df, rt.clone(), stream_ptr).await {
+            Ok(_) => DuplicateReaderResult {
+                error: std::ptr::null(),
+            },
+            Err(e) => {
+                DuplicateReaderResult::error(format!("could not create dataset stream: {}", e))
+            }
+        }
+    })
+}
@@ -0,0 +1,448 @@
+// Copyright 2023 WHERE TRUE Technologies.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+//! Random access into FASTA files indexed with `samtools faidx`, plain or bgzipped (`.fai` plus
+//! `.gzi`). Opened files are memory mapped and kept in a process-wide cache, so fetching the
+//! context of millions of positions costs a lookup and a copy each.
+
+use std::{
+    collections::HashMap,
+    ffi::{c_char, CStr, CString},
+    fs::{self, File},
+    io,
+    num::NonZeroUsize,
+    ptr::null,
+    sync::{Arc, Mutex, OnceLock},
+    time::{Duration, Instant, SystemTime},
+};
+
+use lru::LruCache;
+use memmap2::Mmap;
+
+use crate::{bgzf, region::Region};
+
+/// Number of inflated BGZF blocks kept per bgzipped file.
+const INFLATED_BLOCK_CACHE_SIZE: usize = 64;
+
+/// Number of opened files kept mapped, least recently used first out.
+const FASTA_CACHE_SIZE: usize = 16;
+
+/// How long an opened file is trusted before its size and modification time are checked again.
+const REVALIDATE_AFTER: Duration = Duration::from_secs(1);
+
+fn invalid_data<E: Into<Box<dyn std::error::Error + Send + Sync>>>(e: E) -> io::Error {
+    io::Error::new(io::ErrorKind::InvalidData, e)
+}
+
+/// A line of a `.fai` index.
+#[derive(Clone, Debug, PartialEq, Eq)]
+pub struct FaiRecord {
+    pub name: String,
+    pub length: u64,
+    pub offset: u64,
+    pub line_bases: u64,
+    pub line_width: u64,
+}
+
+impl FaiRecord {
+    /// Offset in the uncompressed file of the zero-based `position`.
+    fn position_offset(&self, position: u64) -> u64 {
+        self.offset + position / self.line_bases * self.line_width + position % self.line_bases
+    }
+}
+
+pub fn parse_fai(text: &str) -> io::Result<Vec<FaiRecord>> {
+    text.lines()
+        .filter(|line| !line.is_empty())
+        .map(|line| {
+            let fields = line.split('\t').collect::<Vec<_>>();
+            if fields.len() < 5 {
+                return Err(invalid_data(format!("invalid fai record: {}", line)));
+            }
+
+            let parse = |value: &str| {
+                value
+                    .parse::<u64>()
+                    .map_err(|_| invalid_data(format!("invalid fai record: {}", line)))
+            };
+
+            let record = FaiRecord {
+                name: fields[0].to_string(),
+                length: parse(fields[1])?,
+                offset: parse(fields[2])?,
+                line_bases: parse(fields[3])?,
+                line_width: parse(fields[4])?,
+            };
+
+            if record.line_bases == 0 && record.length > 0 {
+                return Err(invalid_data(format!("invalid fai record: {}", line)));
+            }
+
+            Ok(record)
+        })
+        .collect()
+}
+
+/// Parses a `.gzi` index into `(compressed offset, uncompressed offset)` pairs, including the
+/// implicit first block at zero.
+pub fn parse_gzi(raw: &[u8]) -> io::Result<Vec<(u64, u64)>> {
+    let read_u64 = |position: usize| -> io::Result<u64> {
+        raw.get(position..position + 8)
+            .map(|b| u64::from_le_bytes([b[0], b[1], b[2], b[3], b[4], b[5], b[6], b[7]]))
+            .ok_or_else(|| invalid_data("truncated gzi index"))
+    };
+
+    let n = read_u64(0)? as usize;
+
+    let mut entries = Vec::with_capacity(n + 1);
+    entries.push((0, 0));
+
+    for i in 0..n {
+        entries.push((read_u64(8 + i * 16)?, read_u64(16 + i * 16)?));
+    }
+
+    Ok(entries)
+}
+
+/// A memory-mapped FASTA file with its index.
+pub struct IndexedFasta {
+    data: Mmap,
+    records: HashMap<String, FaiRecord>,
+    gzi: Option<Vec<(u64, u64)>>,
+    blocks: Mutex<LruCache<u64, Arc<Vec<u8>>>>,
+}
+
+impl IndexedFasta {
+    pub fn open(path: &str) -> io::Result<Self> {
+        let with_context = |e: io::Error, file: &str| io::Error::new(e.kind(), format!("{}: {}", file, e));
+
+        let fai_path = format!("{}.fai", path);
+        let fai = fs::read_to_string(&fai_path).map_err(|e| with_context(e, &fai_path))?;
+
+        let records = parse_fai(&fai)?
+            .into_iter()
+            .map(|record| (record.name.clone(), record))
+            .collect();
+
+        let file = File::open(path).map_err(|e| with_context(e, path))?;
+
+        // SAFETY: the map is read only; a file truncated under us is the same hazard every
+        // mmap-based genomics tool accepts.
+        let data = unsafe { Mmap::map(&file) }.map_err(|e| with_context(e, path))?;
+
+        let gzi = if data.starts_with(&[0x1f, 0x8b]) {
+            let gzi_path = format!("{}.gzi", path);
+            let raw = fs::read(&gzi_path).map_err(|e| with_context(e, &gzi_path))?;
+
+            Some(parse_gzi(&raw)?)
+        } else {
+            None
+        };
+
+        Ok(Self {
+            data,
+            records,
+            gzi,
+            blocks: Mutex::new(LruCache::new(
+                NonZeroUsize::new(INFLATED_BLOCK_CACHE_SIZE).unwrap(),
+            )),
+        })
+    }
+
+    pub fn record(&self, name: &str) -> io::Result<&FaiRecord> {
+        self.records.get(name).ok_or_else(|| {
+            io::Error::new(
+                io::ErrorKind::NotFound,
+                format!("sequence {} not found in index", name),
+            )
+        })
+    }
+
+    fn inflated_block(&self, compressed_offset: u64) -> io::Result<Arc<Vec<u8>>> {
+        if let Some(block) = self.blocks.lock().unwrap().get(&compressed_offset) {
+            return Ok(block.clone());
+        }
+
+        let start = compressed_offset as usize;
+        let data = self
+            .data
+            .get(start..)
+            .ok_or_else(|| invalid_data("gzi offset past end of file"))?;
+
+        let size = bgzf::block_size(data)?.ok_or_else(|| invalid_data("truncated BGZF block"))?;
+        let block = data
+            .get(..size)
+            .ok_or_else(|| invalid_data("truncated BGZF block"))?;
+
+        let mut inflated = Vec::new();
+        bgzf::inflate_block(block, &mut inflated)?;
+
+        let inflated = Arc::new(inflated);
+        self.blocks
+            .lock()
+            .unwrap()
+            .put(compressed_offset, inflated.clone());
+
+        Ok(inflated)
+    }
+
+    /// Appends the uncompressed bytes `[start, end)` of the file to `out`.
+    fn read_uncompressed(&self, start: u64, end: u64, out: &mut Vec<u8>) -> io::Result<()> {
+        let gzi = match &self.gzi {
+            None => {
+                let bytes = self
+                    .data
+                    .get(start as usize..end as usize)
+                    .ok_or_else(|| invalid_data("fai offset past end of file"))?;
+                out.extend_from_slice(bytes);
+                return Ok(());
+            }
+            Some(gzi) => gzi,
+        };
+
+        let mut entry = gzi.partition_point(|(_, uncompressed)| *uncompressed <= start) - 1;
+        let (mut compressed_offset, mut uncompressed_offset) = gzi[entry];
+
+        while uncompressed_offset < end {
+            let block = self.inflated_block(compressed_offset)?;
+            if block.is_empty() {
+                return Err(invalid_data("fai offset past end of file"));
+            }
+
+            let block_end = uncompressed_offset + block.len() as u64;
+            if block_end > start {
+                let from = start.saturating_sub(uncompressed_offset) as usize;
+                let to = (end.min(block_end) - uncompressed_offset) as usize;
+                out.extend_from_slice(&block[from..to]);
+            }
+
+            // Blocks past the last gzi entry are found by walking the file.
+            entry += 1;
+            compressed_offset = match gzi.get(entry) {
+                Some((next, _)) => *next,
+                None => {
+                    let data = &self.data[compressed_offset as usize..];
+                    compressed_offset + bgzf::block_size(data)?.unwrap_or(data.len()) as u64
+                }
+            };
+            uncompressed_offset = block_end;
+        }
+
+        Ok(())
+    }
+
+    /// Fetches the bases of `name` in the zero-based, half-open interval `[start, end)`, clamped
+    /// to the sequence.
+    pub fn fetch(&self, name: &str, start: u64, end: u64) -> io::Result<Vec<u8>> {
+        let record = self.record(name)?;
+        let end = end.min(record.length);
+
+        if start >= end {
+            return Ok(vec![]);
+        }
+
+        let mut raw = Vec::with_capacity((end - start) as usize + (end - start) as usize / 60 + 2);
+        self.read_uncompressed(
+            record.position_offset(start),
+            record.position_offset(end - 1) + 1,
+            &mut raw,
+        )?;
+
+        raw.retain(|b| *b != b'\n' && *b != b'\r');
+
+        Ok(raw)
+    }
+}
+
+struct CachedFasta {
+    fasta: Arc<IndexedFasta>,
+    size: u64,
+    modified: SystemTime,
+    validated: Instant,
+}
+
+static FASTA_CACHE: OnceLock<Mutex<LruCache<String, CachedFasta>>> = OnceLock::new();
+
+/// Opens `path`, reusing the mapping and index from earlier calls while the file is unchanged.
+/// A changed file's entry is dropped before it is opened again, so the old mapping is released
+/// as soon as no fetch still holds it.
+pub fn open_cached(path: &str) -> io::Result<Arc<IndexedFasta>> {
+    let cache = FASTA_CACHE
+        .get_or_init(|| Mutex::new(LruCache::new(NonZeroUsize::new(FASTA_CACHE_SIZE).unwrap())));
+
+    {
+        let mut cache = cache.lock().unwrap();
+
+        if let Some(cached) = cache.get_mut(path) {
+            if cached.validated.elapsed() < REVALIDATE_AFTER {
+                return Ok(cached.fasta.clone());
+            }
+
+            let unchanged = match fs::metadata(path) {
+                Ok(metadata) => {
+                    metadata.len() == cached.size && metadata.modified()? == cached.modified
+                }
+                Err(_) => false,
+            };
+
+            if unchanged {
+                cached.validated = Instant::now();
+                return Ok(cached.fasta.clone());
+            }
+
+            cache.pop(path);
+        }
+    }
+
+    let metadata = fs::metadata(path)?;
+    let fasta = Arc::new(IndexedFasta::open(path)?);
+
+    cache.lock().unwrap().put(
+        path.to_string(),
+        CachedFasta {
+            fasta: fasta.clone(),
+            size: metadata.len(),
+            modified: metadata.modified()?,
+            validated: Instant::now(),
+        },
+    );
+
+    Ok(fasta)
+}
+
+#[repr(C)]
+pub struct FastaFetchResult {
+    /// The sequence name, only set by `fasta_fetch_region`.
+    name: *const c_char,
+    sequence: *const c_char,
+    length: usize,
+    /// The fetched interval, one-based and inclusive, after clamping to the sequence.
+    start: u64,
+    end: u64,
+    error: *const c_char,
+}
+
+impl FastaFetchResult {
+    fn error(error: String) -> Self {
+        Self {
+            name: null(),
+            sequence: null(),
+            length: 0,
+            start: 0,
+            end: 0,
+            error: CString::new(error).unwrap().into_raw(),
+        }
+    }
+}
+
+fn fetch(path: &str, name: &str, start: u64, end: Option<u64>) -> io::Result<(Vec<u8>, u64, u64)> {
+    let fasta = open_cached(path)?;
+    let length = fasta.record(name)?.length;
+
+    let start = start.max(1);
+    let end = end.unwrap_or(length).min(length);
+
+    let sequence = fasta.fetch(name, start - 1, end)?;
+
+    Ok((sequence, start, end))
+}
+
+fn fetch_result(
+    path: &str,
+    name: &str,
+    start: u64,
+    end: Option<u64>,
+    with_name: bool,
+) -> FastaFetchResult {
+    match fetch(path, name, start, end) {
+        Ok((sequence, start, end)) => {
+            let length = sequence.len();
+
+            match CString::new(sequence) {
+                Ok(sequence) => FastaFetchResult {
+                    name: if with_name {
+                        CString::new(name).unwrap().into_raw()
+                    } else {
+                        null()
+                    },
+                    sequence: sequence.into_raw(),
+                    length,
+                    start,
+                    end,
+                    error: null(),
+                },
+                Err(_) => FastaFetchResult::error(format!("sequence {} contains a NUL byte", name)),
+            }
+        }
+        Err(e) => FastaFetchResult::error(format!("could not fetch from {}: {}", path, e)),
+    }
+}
+
+/// Fetches `name:start-end` (one-based, inclusive) from the indexed FASTA at `path`.
+#[no_mangle]
+pub unsafe extern "C" fn fasta_fetch(
+    path: *const c_char,
+    name: *const c_char,
+    start: u64,
+    end: u64,
+) -> FastaFetchResult {
+    let path = match CStr::from_ptr(path).to_str() {
+        Ok(path) => path,
+        Err(e) => return FastaFetchResult::error(format!("could not parse path: {}", e)),
+    };
+
+    let name = match CStr::from_ptr(name).to_str() {
+        Ok(name) => name,
+        Err(e) => return FastaFetchResult::error(format!("could not parse name: {}", e)),
+    };
+
+    fetch_result(path, name, start, Some(end), false)
+}
+
+/// Fetches a samtools-style region, e.g. `chr1:100-200`, from the indexed FASTA at `path`.
+#[no_mangle]
+pub unsafe extern "C" fn fasta_fetch_region(
+    path: *const c_char,
+    region: *const c_char,
+) -> FastaFetchResult {
+    let path = match CStr::from_ptr(path).to_str() {
+        Ok(path) => path,
+        Err(e) => return FastaFetchResult::error(format!("could not parse path: {}", e)),
+    };
+
+    let region = match CStr::from_ptr(region).to_str() {
+        Ok(region) => region,
+        Err(e) => return FastaFetchResult::error(format!("could not parse region: {}", e)),
+    };
+
+    let fasta = match open_cached(path) {
+        Ok(fasta) => fasta,
+        Err(e) => return FastaFetchResult::error(format!("could not fetch from {}: {}", path, e)),
+    };
+
+    match Region::parse_with(region, |name| fasta.record(name).is_ok()) {
+        Ok(region) => fetch_result(path, &region.name, region.start, region.end, true),
+        Err(e) => FastaFetchResult::error(e.to_string()),
+    }
+}
+
+/// Releases the strings of a `FastaFetchResult`.
+#[no_mangle]
+pub unsafe extern "C" fn free_fasta_fetch_result(result: FastaFetchResult) {
+    for value in [result.name, result.sequence, result.error] {
+        if !value.is_null() {
+            drop(CString::from_raw(value as *mut c_char));
+        }
+    }
+}
@@ -0,0 +1,496 @@
+// Copyright 2023 WHERE TRUE Technologies.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+//! Streams FASTA records as fixed-size, optionally overlapping windows, so chromosome-scale
+//! sequences are never held in memory whole.
+
+use std::{
+    ffi::{c_char, CStr, CString},
+    io,
+    sync::Arc,
+};
+
+use arrow::{
+    array::{ArrayRef, Int64Builder, StringBuilder},
+    datatypes::{DataType, Field, Schema, SchemaRef},
+    ffi_stream::FFI_ArrowArrayStream as ArrowArrayStream,
+    record_batch::RecordBatch,
+};
+use bytes::Bytes;
+use datafusion::{
+    datasource::{
+        file_format::file_type::FileCompressionType, listing::ListingTableUrl,
+        streaming::StreamingTable,
+    },
+    error::DataFusionError,
+    execution::TaskContext,
+    physical_plan::{
+        stream::RecordBatchStreamAdapter, streaming::PartitionStream, SendableRecordBatchStream,
+    },
+    prelude::SessionContext,
+};
+use exon::{
+    ffi::create_dataset_stream_from_table_provider, new_exon_config, ExonRuntimeEnvExt,
+    ExonSessionExt,
+};
+use futures::{stream, stream::BoxStream, StreamExt, TryStreamExt};
+use object_store::{path::Path, ObjectStore};
+use tokio::runtime::Runtime;
+
+use crate::{
+    arrow_reader::infer_compression,
+    block_cache::register_block_cache,
+    duckdb_file_system::{register_duckdb_file_system, DuckDBFileSystem},
+};
+
+/// Cuts the sequences of a FASTA stream into windows of `window_size` bases, each starting
+/// `window_size - overlap` bases after the previous one. The last window of a record holds
+/// whatever is left and may be shorter.
+pub struct FastaWindower {
+    window_size: usize,
+    step: usize,
+    id: Option<String>,
+    header: Vec<u8>,
+    in_header: bool,
+    at_line_start: bool,
+    window: Vec<u8>,
+    // One-based position of the first base of `window` in the record.
+    window_start: u64,
+    // Bases in `window` not yet part of an emitted window.
+    pending: usize,
+}
+
+impl FastaWindower {
+    pub fn new(window_size: usize, overlap: usize) -> io::Result<Self> {
+        if window_size == 0 || overlap >= window_size {
+            return Err(io::Error::new(
+                io::ErrorKind::InvalidInput,
+                "window_size must be positive and larger than overlap",
+            ));
+        }
+
+        Ok(Self {
+            window_size,
+            step: window_size - overlap,
+            id: None,
+            header: Vec::new(),
+            in_header: false,
+            at_line_start: true,
+            window: Vec::with_capacity(window_size),
+            window_start: 1,
+            pending: 0,
+        })
+    }
+
+    /// Feeds the next chunk of the file, calling `emit(id, start, bases)` for every full window.
+    pub fn push<F>(&mut self, mut data: &[u8], emit: &mut F) -> io::Result<()>
+    where
+        F: FnMut(&str, u64, &[u8]),
+    {
+        while !data.is_empty() {
+            let line_end = data.iter().position(|b| *b == b'\n');
+
+            if self.in_header {
+                match line_end {
+                    Some(i) => {
+                        self.header.extend_from_slice(&data[..i]);
+                        self.finish_header();
+                        data = &data[i + 1..];
+                    }
+                    None => {
+                        self.header.extend_from_slice(data);
+                        return Ok(());
+                    }
+                }
+            } else if self.at_line_start && data[0] == b'>' {
+                self.finish_record(emit);
+
+                self.in_header = true;
+                self.header.clear();
+                data = &data[1..];
+            } else {
+                let (line, rest, ended) = match line_end {
+                    Some(i) => (&data[..i], &data[i + 1..], true),
+                    None => (data, &data[data.len()..], false),
+                };
+
+                self.push_bases(line, emit)?;
+                self.at_line_start = ended;
+                data = rest;
+            }
+        }
+
+        Ok(())
+    }
+
+    /// Flushes the last window of the last record at the end of the file.
+    pub fn finish<F>(&mut self, emit: &mut F)
+    where
+        F: FnMut(&str, u64, &[u8]),
+    {
+        if self.in_header {
+            self.finish_header();
+        }
+
+        self.finish_record(emit);
+    }
+
+    fn finish_header(&mut self) {
+        let header = String::from_utf8_lossy(&self.header);
+        let id = header
+            .trim_end_matches('\r')
+            .split_whitespace()
+            .next()
+            .unwrap_or("")
+            .to_string();
+
+        self.id = Some(id);
+        self.in_header = false;
+        self.at_line_start = true;
+    }
+
+    fn push_bases<F>(&mut self, line: &[u8], emit: &mut F) -> io::Result<()>
+    where
+        F: FnMut(&str, u64, &[u8]),
+    {
+        let mut bases = line.strip_suffix(b"\r").unwrap_or(line);
+        if bases.is_empty() {
+            return Ok(());
+        }
+
+        let id = match &self.id {
+            Some(id) => id,
+            None => {
+                return Err(io::Error::new(
+                    io::ErrorKind::InvalidData,
+                    "invalid FASTA: sequence before the first header",
+                ))
+            }
+        };
+
+        while !bases.is_empty() {
+            let take = (self.window_size - self.window.len()).min(bases.len());
+            self.window.extend_from_slice(&bases[..take]);
+            self.pending += take;
+            bases = &bases[take..];
+
+            if self.window.len() == self.window_size {
+                emit(id, self.window_start, &self.window);
+
+                self.window.drain(..self.step);
+                self.window_start += self.step as u64;
+                self.pending = 0;
+            }
+        }
+
+        Ok(())
+    }
+
+    fn finish_record<F>(&mut self, emit: &mut F)
+    where
+        F: FnMut(&str, u64, &[u8]),
+    {
+        if let Some(id) = &self.id {
+            if self.pending > 0 {
+                emit(id, self.window_start, &self.window);
+            }
+        }
+
+        self.id = None;
+        self.window.clear();
+        self.window_start = 1;
+        self.pending = 0;
+    }
+}
+
+pub fn fasta_window_schema() -> SchemaRef {
+    Arc::new(Schema::new(vec![
+        Field::new("id", DataType::Utf8, false),
+        Field::new("start", DataType::Int64, false),
+        Field::new("sequence", DataType::Utf8, false),
+    ]))
+}
+
+/// Accumulates windows into record batches.
+struct WindowBatchBuilder {
+    schema: SchemaRef,
+    ids: StringBuilder,
+    starts: Int64Builder,
+    sequences: StringBuilder,
+    rows: usize,
+}
+
+impl WindowBatchBuilder {
+    fn new(schema: SchemaRef) -> Self {
+        Self {
+            schema,
+            ids: StringBuilder::new(),
+            starts: Int64Builder::new(),
+            sequences: StringBuilder::new(),
+            rows: 0,
+        }
+    }
+
+    fn append(&mut self, id: &str, start: u64, bases: &[u8]) {
+        self.ids.append_value(id);
+        self.starts.append_value(start as i64);
+        self.sequences.append_value(String::from_utf8_lossy(bases));
+        self.rows += 1;
+    }
+
+    fn finish(&mut self) -> Result<RecordBatch, DataFusionError> {
+        self.rows = 0;
+
+        let columns: Vec<ArrayRef> = vec![
+            Arc::new(self.ids.finish()),
+            Arc::new(self.starts.finish()),
+            Arc::new(self.sequences.finish()),
+        ];
+
+        Ok(RecordBatch::try_new(self.schema.clone(), columns)?)
+    }
+}
+
+/// One FASTA object, streamed as windows.
+struct FastaWindowPartition {
+    schema: SchemaRef,
+    store: Arc<dyn ObjectStore>,
+    location: Path,
+    compression: FileCompressionType,
+    window_size: usize,
+    overlap: usize,
+    batch_size: usize,
+}
+
+impl PartitionStream for FastaWindowPartition {
+    fn schema(&self) -> &SchemaRef {
+        &self.schema
+    }
+
+    fn execute(&self, _ctx: Arc<TaskContext>) -> SendableRecordBatchStream {
+        let store = self.store.clone();
+        let location = self.location.clone();
+        let compression = self.compression;
+        let window_size = self.window_size;
+        let overlap = self.overlap;
+        let batch_size = self.batch_size;
+        let schema = self.schema.clone();
+
+        let bytes = stream::once(async move { store.get(&location).await })
+            .map_ok(|result| result.into_stream())
+            .try_flatten()
+            .map_err(DataFusionError::from)
+            .boxed();
+
+        let state = compression.convert_stream(bytes).and_then(|bytes| {
+            let windower = FastaWindower::new(window_size, overlap)?;
+            Ok((bytes, windower))
+        });
+
+        let batches = stream::once(async move { state })
+            .map_ok(move |(bytes, windower)| {
+                let builder = WindowBatchBuilder::new(schema.clone());
+
+                stream::try_unfold(
+                    (bytes, Some((windower, builder))),
+                    move |(bytes, state)| next_window_batch(bytes, state, batch_size),
+                )
+            })
+            .try_flatten();
+
+        Box::pin(RecordBatchStreamAdapter::new(self.schema.clone(), batches))
+    }
+}
+
+type WindowState = Option<(FastaWindower, WindowBatchBuilder)>;
+
+/// Reads until `batch_size` windows are ready or the stream ends. The state is `None` once the
+/// last batch has been returned.
+async fn next_window_batch(
+    mut bytes: BoxStream<'static, Result<Bytes, DataFusionError>>,
+    state: WindowState,
+    batch_size: usize,
+) -> Result<
+    Option<(
+        RecordBatch,
+        (BoxStream<'static, Result<Bytes, DataFusionError>>, WindowState),
+    )>,
+    DataFusionError,
+> {
+    let (mut windower, mut builder) = match state {
+        Some(state) => state,
+        None => return Ok(None),
+    };
+
+    while let Some(chunk) = bytes.try_next().await? {
+        windower.push(&chunk, &mut |id, start, window| builder.append(id, start, window))?;
+
+        if builder.rows >= batch_size {
+            let batch = builder.finish()?;
+            return Ok(Some((batch, (bytes, Some((windower, builder))))));
+        }
+    }
+
+    windower.finish(&mut |id, start, window| builder.append(id, start, window));
+
+    if builder.rows == 0 {
+        return Ok(None);
+    }
+
+    let batch = builder.finish()?;
+    Ok(Some((batch, (bytes, None))))
+}
+
+#[repr(C)]
+pub struct FastaWindowReaderResult {
+    error: *const c_char,
+}
+
+impl FastaWindowReaderResult {
+    fn error(error: String) -> Self {
+        Self {
+            error: CString::new(error).unwrap().into_raw(),
+        }
+    }
+}
+
+/// Reads the FASTA file(s) at `uri` as windows of `window_size` bases overlapping by `overlap`,
+/// with the schema `id, start, sequence`. `start` is the one-based position of the window's
+/// first base in its record.
+#[no_mangle]
+pub unsafe extern "C" fn new_fasta_window_reader(
+    stream_ptr: *mut ArrowArrayStream,
+    uri: *const c_char,
+    batch_size: usize,
+    compression: *const c_char,
+    window_size: usize,
+    overlap: usize,
+    filters: *const c_char,
+    file_system: *const DuckDBFileSystem,
+) -> FastaWindowReaderResult {
+    let uri = match CStr::from_ptr(uri).to_str() {
+        Ok(uri) => uri,
+        Err(e) => return FastaWindowReaderResult::error(format!("could not parse uri: {}", e)),
+    };
+
+    let compression = match infer_compression(uri, compression) {
+        Ok(compression) => compression,
+        Err(e) => return FastaWindowReaderResult::error(e),
+    };
+
+    if let Err(e) = FastaWindower::new(window_size, overlap) {
+        return FastaWindowReaderResult::error(e.to_string());
+    }
+
+    let rt = Arc::new(Runtime::new().unwrap());
+
+    let config = new_exon_config().with_batch_size(batch_size);
+    let ctx = SessionContext::with_config_exon(config);
+
+    rt.block_on(async {
+        let registered = if file_system.is_null() {
+            ctx.runtime_env()
+                .exon_register_object_store_uri(uri)
+                .await
+                .map(|_| ())
+                .map_err(|e| e.to_string())
+        } else {
+            register_duckdb_file_system(&ctx, uri, *file_system)
+                .map(|_| ())
+                .map_err(|e| e.to_string())
+        };
+
+        if let Err(e) = registered {
+            return FastaWindowReaderResult::error(format!("could not register object store: {}", e));
+        }
+
+        if let Err(e) = register_block_cache(&ctx, uri) {
+            return FastaWindowReaderResult::error(format!("could not register block cache: {}", e));
+        }
+
+        let table_url = match ListingTableUrl::parse(uri) {
+            Ok(table_url) => table_url,
+            Err(e) => return FastaWindowReaderResult::error(format!("could not parse uri: {}", e)),
+        };
+
+        let store = match ctx.runtime_env().object_store(table_url.object_store()) {
+            Ok(store) => store,
+            Err(e) => return FastaWindowReaderResult::error(format!("could not get object store: {}", e)),
+        };
+
+        let objects = match table_url
+            .list_all_files(store.as_ref(), "")
+            .try_collect::<Vec<_>>()
+            .await
+        {
+            Ok(objects) => objects,
+            Err(e) => return FastaWindowReaderResult::error(format!("could not list files: {}", e)),
+        };
+
+        if objects.is_empty() {
+            return FastaWindowReaderResult::error(format!("no files found at {}", uri));
+        }
+
+        // One partition per file, so directories are read in parallel.
+        let schema = fasta_window_schema();
+        let partitions = objects
+            .into_iter()
+            .map(|object| {
+                Arc::new(FastaWindowPartition {
+                    schema: schema.clone(),
+                    store: store.clone(),
+                    location: object.location,
+                    compression,
+                    window_size,
+                    overlap,
+                    batch_size,
+                }) as Arc<dyn PartitionStream>
+            })
+            .collect();
+
+        let table = match StreamingTable::try_new(schema, partitions) {
+            Ok(table) => table,
+            Err(e) => return FastaWindowReaderResult::error(format!("could not create table: {}", e)),
+        };
+
+        if let Err(e) = ctx.register_table("exon_table", Arc::new(table)) {
+            return FastaWindowReaderResult::error(format!("could not register table: {}", e));
+        }
+
+        let mut select_string = format!("SELECT * FROM exon_table");
+
+        if !filters.is_null() {
+            let filters_str = match CStr::from_ptr(filters).to_str() {
+                Ok(filters_str) => filters_str,
+                Err(e) => return FastaWindowReaderResult::error(format!("could not parse filters: {}", e)),
+            };
+
+            if filters_str != "" {
+                select_string.push_str(format!(" WHERE {}", filters_str).as_str());
+            }
+        }
+
+        let df = match ctx.sql(&select_string).await {
+            Ok(df) => df,
+            Err(e) => return FastaWindowReaderResult::error(format!("could not execute sql: {}", e)),
+        };
+
+        match create_dataset_stream_from_table_provider(df, rt.clone(), stream_ptr).await {
+            Ok(_) => FastaWindowReaderResult {
+                error: std::ptr::null(),
+            },
+            Err(e) => FastaWindowReaderResult::error(format!("could not create dataset stream: {}", e)),
+        }
+    })
+}
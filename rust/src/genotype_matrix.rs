@@ -0,0 +1,650 @@
+// Copyright 2023 WHERE TRUE Technologies.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+//! Reads the genotypes of local VCF and BCF files as a matrix: one row per site, with the
+//! genotypes of the chosen samples in a single binary value. Only the GT value of each sample is
+//! looked at, straight from the record, so no other FORMAT or INFO value is decoded and no
+//! per-genotype value is built.
+//!
+//! A genotype is its dosage, the number of its alleles other than the reference, as an int8, -1
+//! if any allele is missing. Packed, genotypes take two bits each in the PLINK 1 `.bed` encoding,
+//! with the alternate allele as A1 as PLINK's VCF import makes it: 00 for two alternate alleles,
+//! 10 for one, 11 for none and 01 for missing or more than two, four samples to a byte starting
+//! from the low bits.
+
+use std::{
+    collections::HashMap,
+    ffi::{c_char, CStr, CString},
+    io,
+    ops::Range,
+    sync::Arc,
+};
+
+use arrow::{
+    array::{ArrayRef, BinaryBuilder, Int64Builder, ListBuilder, StringBuilder},
+    datatypes::{DataType, Field, Schema, SchemaRef},
+    ffi_stream::FFI_ArrowArrayStream as ArrowArrayStream,
+    record_batch::RecordBatch,
+};
+use datafusion::{
+    datasource::streaming::StreamingTable,
+    execution::TaskContext,
+    physical_plan::{streaming::PartitionStream, SendableRecordBatchStream},
+    prelude::SessionContext,
+};
+use exon::{ffi::create_dataset_stream_from_table_provider, new_exon_config};
+use tokio::runtime::Runtime;
+
+use crate::{
+    bam_reader::ReferenceColumn,
+    bam_scan::strings_from_ffi,
+    index_builder::{le_i32, le_u32},
+    partition_reader::blocking_stream,
+    region::parse_vcf_contigs,
+    subset_reader::{
+        bcf_int, bcf_type_size, chrom_names, for_each_record, index_regions, invalid_data,
+        map_file, read_bcf_descriptor, read_header, read_local_index, select_samples, string_map,
+        IndexedRegions, RawRecord, VariantFormat,
+    },
+};
+
+/// The dosage of a genotype with a missing allele.
+const MISSING_DOSAGE: i8 = -1;
+
+/// The PLINK 1 `.bed` codes of dosages 0, 1 and 2, and of missing genotypes.
+const PACKED_CODES: [u8; 3] = [0b11, 0b10, 0b00];
+const PACKED_MISSING: u8 = 0b01;
+
+/// The columns of `vcf_genotype_matrix`. If the names of the contigs are known up front, `chrom`
+/// is keys into them, which DuckDB reads as an ENUM of them.
+fn genotype_schema(contigs: &[String]) -> SchemaRef {
+    let chrom_type = if contigs.is_empty() {
+        DataType::Utf8
+    } else {
+        DataType::Dictionary(Box::new(DataType::Int32), Box::new(DataType::Utf8))
+    };
+
+    Arc::new(Schema::new(vec![
+        Field::new("chrom", chrom_type, false),
+        Field::new("pos", DataType::Int64, false),
+        Field::new("ref", DataType::Utf8, false),
+        Field::new(
+            "alt",
+            DataType::List(Arc::new(Field::new("item", DataType::Utf8, true))),
+            false,
+        ),
+        Field::new("genotypes", DataType::Binary, false),
+    ]))
+}
+
+/// The dosage of the VCF genotype `gt`, e.g. `0/1` or `1|1`.
+fn vcf_dosage(gt: &[u8]) -> i8 {
+    let mut dosage = 0i8;
+
+    for allele in gt.split(|b| *b == b'/' || *b == b'|') {
+        match std::str::from_utf8(allele)
+            .ok()
+            .and_then(|allele| allele.parse::<u32>().ok())
+        {
+            Some(0) => {}
+            Some(_) => dosage = dosage.saturating_add(1),
+            None => return MISSING_DOSAGE,
+        }
+    }
+
+    dosage
+}
+
+/// The dosage of the BCF genotype of `count` values of integer type `kind` in `data`. Each value
+/// is an allele index plus one, shifted left past the phasing bit, with 0 for a missing allele;
+/// genotypes of lower ploidy end early with the end-of-vector value.
+fn bcf_dosage(data: &[u8], kind: u8, count: usize) -> io::Result<i8> {
+    let size = bcf_type_size(kind)?;
+    let (missing, end_of_vector) = match kind {
+        1 => (i8::MIN as i32, i8::MIN as i32 + 1),
+        2 => (i16::MIN as i32, i16::MIN as i32 + 1),
+        _ => (i32::MIN, i32::MIN + 1),
+    };
+
+    let mut dosage = 0i8;
+    let mut alleles = 0;
+
+    for i in 0..count {
+        let value = bcf_int(&data[i * size..], kind)?;
+
+        if value == end_of_vector {
+            break;
+        }
+        if value == missing || value >> 1 == 0 {
+            return Ok(MISSING_DOSAGE);
+        }
+
+        alleles += 1;
+        if value >> 1 > 1 {
+            dosage = dosage.saturating_add(1);
+        }
+    }
+
+    Ok(if alleles == 0 { MISSING_DOSAGE } else { dosage })
+}
+
+/// Appends `dosages` to `out` as PLINK 1 `.bed` codes, four to a byte from the low bits.
+fn pack_dosages(dosages: &[i8], out: &mut Vec<u8>) {
+    for genotypes in dosages.chunks(4) {
+        let mut byte = 0;
+
+        for (i, dosage) in genotypes.iter().enumerate() {
+            let code = match *dosage {
+                0..=2 => PACKED_CODES[*dosage as usize],
+                _ => PACKED_MISSING,
+            };
+            byte |= code << (2 * i);
+        }
+
+        out.push(byte);
+    }
+}
+
+/// One site's position, alleles and the dosages of the chosen samples, as decoded from a
+/// record. Its buffers are reused from record to record.
+#[derive(Default)]
+struct Site {
+    chrom: String,
+    /// The index of `chrom` in the contigs of the scan, if they are known.
+    reference_id: i32,
+    position: i64,
+    reference: String,
+    alternates: Vec<String>,
+    dosages: Vec<i8>,
+}
+
+/// One file, read whole or by regions of its index, as a genotype matrix.
+struct GenotypeScan {
+    path: String,
+    format: VariantFormat,
+    /// The names `chrom` takes, the header's contigs then any undeclared ones a VCF file's index
+    /// lists, or none if they aren't known up front. BCF records refer to them by index.
+    contigs: Vec<String>,
+    contig_ids: HashMap<String, i32>,
+    /// The dictionary index of `GT` in a BCF file's header, if it declares it.
+    gt_key: Option<i32>,
+    /// The samples read, in order.
+    samples: Vec<usize>,
+    packed: bool,
+    regions: Option<IndexedRegions>,
+    schema: SchemaRef,
+    batch_size: usize,
+    threads: usize,
+}
+
+impl GenotypeScan {
+    /// Reads the file, handing each batch to `emit` until it returns false.
+    fn run<F>(&self, mut emit: F) -> io::Result<()>
+    where
+        F: FnMut(RecordBatch) -> bool,
+    {
+        let data = map_file(&self.path)?;
+
+        let mut batch = GenotypeBatch::new(self.schema.clone(), &self.contigs);
+        let mut site = Site::default();
+        let mut genotypes = vec![];
+        let mut columns = vec![];
+
+        let regions = self.regions.as_ref();
+        for_each_record(self.format, &data, regions, self.threads, |record| {
+            match self.format {
+                VariantFormat::Vcf => self.read_vcf_site(&record.data, &mut columns, &mut site)?,
+                VariantFormat::Bcf => self.read_bcf_site(record, &mut site)?,
+            }
+
+            genotypes.clear();
+            if self.packed {
+                pack_dosages(&site.dosages, &mut genotypes);
+            } else {
+                genotypes.extend(site.dosages.iter().map(|dosage| *dosage as u8));
+            }
+
+            batch.append(&site, &self.contigs, &genotypes)?;
+
+            if batch.rows >= self.batch_size {
+                return Ok(emit(batch.finish()?));
+            }
+
+            Ok(true)
+        })?;
+
+        if batch.rows > 0 {
+            emit(batch.finish()?);
+        }
+
+        Ok(())
+    }
+
+    /// Reads the VCF `line` into `site`. The line is split on tabs only as far as the last
+    /// sample read.
+    fn read_vcf_site(
+        &self,
+        line: &[u8],
+        columns: &mut Vec<Range<usize>>,
+        site: &mut Site,
+    ) -> io::Result<()> {
+        let line = line.strip_suffix(b"\n").unwrap_or(line);
+        let line = line.strip_suffix(b"\r").unwrap_or(line);
+
+        let needed = 9 + self.samples.iter().max().map_or(0, |last| last + 1);
+        columns.clear();
+        let mut start = 0;
+        for (i, b) in line.iter().enumerate() {
+            if *b == b'\t' {
+                columns.push(start..i);
+                start = i + 1;
+
+                if columns.len() == needed {
+                    break;
+                }
+            }
+        }
+        if columns.len() < needed {
+            columns.push(start..line.len());
+        }
+
+        if columns.len() < 8 {
+            return Err(invalid_data("VCF line with fewer than 8 columns"));
+        }
+
+        let column = |i: usize| columns.get(i).map(|range| &line[range.clone()]);
+        let text = |column: &[u8], out: &mut String| {
+            out.clear();
+            out.push_str(&String::from_utf8_lossy(column));
+        };
+
+        text(&line[columns[0].clone()], &mut site.chrom);
+        if !self.contigs.is_empty() {
+            site.reference_id = *self.contig_ids.get(&site.chrom).ok_or_else(|| {
+                invalid_data(format!("contig {} is not in the header", site.chrom))
+            })?;
+        }
+        site.position = std::str::from_utf8(&line[columns[1].clone()])
+            .ok()
+            .and_then(|position| position.trim().parse::<i64>().ok())
+            .ok_or_else(|| invalid_data("invalid VCF position"))?;
+        text(&line[columns[3].clone()], &mut site.reference);
+
+        let alternates = &line[columns[4].clone()];
+        site.alternates.clear();
+        if alternates != b"." {
+            site.alternates.extend(
+                alternates
+                    .split(|b| *b == b',')
+                    .map(|allele| String::from_utf8_lossy(allele).into_owned()),
+            );
+        }
+
+        // The place of GT among the colon-separated values of each sample.
+        let gt =
+            column(8).and_then(|format| format.split(|b| *b == b':').position(|key| key == b"GT"));
+
+        site.dosages.clear();
+        for sample in &self.samples {
+            let dosage = match (gt, column(9 + sample)) {
+                (Some(gt), Some(values)) => values
+                    .split(|b| *b == b':')
+                    .nth(gt)
+                    .map_or(MISSING_DOSAGE, vcf_dosage),
+                _ => MISSING_DOSAGE,
+            };
+            site.dosages.push(dosage);
+        }
+
+        Ok(())
+    }
+
+    /// Reads the BCF `record` into `site`. Of the per-sample values only GT's are read; INFO
+    /// values are never looked at.
+    fn read_bcf_site(&self, record: &RawRecord, site: &mut Site) -> io::Result<()> {
+        let truncated = || invalid_data("truncated BCF record");
+
+        let l_shared = record.l_shared;
+        if l_shared < 24 || record.data.len() < l_shared {
+            return Err(truncated());
+        }
+
+        let (shared, indiv) = record.data.split_at(l_shared);
+        let reference_id = le_i32(shared);
+        let n_allele = (le_u32(&shared[16..]) >> 16) as usize;
+        let n_fmt_sample = le_u32(&shared[20..]);
+        let n_sample = (n_fmt_sample & 0x00ff_ffff) as usize;
+        let n_fmt = (n_fmt_sample >> 24) as usize;
+
+        // The batch checks the index against the contigs as it appends the site.
+        if self.contigs.is_empty() {
+            return Err(invalid_data(format!(
+                "undeclared BCF contig {}",
+                reference_id
+            )));
+        }
+        site.reference_id = reference_id;
+        site.position = le_i32(&shared[4..]) as i64 + 1;
+
+        // The ID, then the alleles, each a typed string.
+        let mut offset = 24;
+        let (kind, count) = read_bcf_descriptor(shared, &mut offset)?;
+        offset += bcf_type_size(kind)? * count;
+
+        site.alternates.clear();
+        for i in 0..n_allele {
+            let (kind, count) = read_bcf_descriptor(shared, &mut offset)?;
+            let end = offset + bcf_type_size(kind)? * count;
+            let allele = shared.get(offset..end).ok_or_else(truncated)?;
+            offset = end;
+
+            let allele = String::from_utf8_lossy(allele)
+                .trim_end_matches('\0')
+                .to_string();
+            if i == 0 {
+                site.reference = allele;
+            } else {
+                site.alternates.push(allele);
+            }
+        }
+
+        if let Some(sample) = self.samples.iter().find(|sample| **sample >= n_sample) {
+            return Err(invalid_data(format!(
+                "BCF record has {} samples, not {}",
+                n_sample,
+                sample + 1
+            )));
+        }
+
+        site.dosages.clear();
+        let mut offset = 0;
+
+        for _ in 0..n_fmt {
+            let (key_kind, _) = read_bcf_descriptor(indiv, &mut offset)?;
+            let key = bcf_int(&indiv[offset.min(indiv.len())..], key_kind)?;
+            offset += bcf_type_size(key_kind)?;
+            let (kind, count) = read_bcf_descriptor(indiv, &mut offset)?;
+
+            let width = bcf_type_size(kind)? * count;
+            let values = offset;
+            offset += width * n_sample;
+
+            if offset > indiv.len() {
+                return Err(truncated());
+            }
+
+            if Some(key) == self.gt_key {
+                for sample in &self.samples {
+                    let start = values + sample * width;
+                    site.dosages
+                        .push(bcf_dosage(&indiv[start..start + width], kind, count)?);
+                }
+                break;
+            }
+        }
+
+        // A record without GT has every genotype missing.
+        if site.dosages.is_empty() {
+            site.dosages.resize(self.samples.len(), MISSING_DOSAGE);
+        }
+
+        Ok(())
+    }
+}
+
+/// The columns of a batch of sites being built.
+struct GenotypeBatch {
+    schema: SchemaRef,
+    chroms: ReferenceColumn,
+    positions: Int64Builder,
+    references: StringBuilder,
+    alternates: ListBuilder<StringBuilder>,
+    genotypes: BinaryBuilder,
+    rows: usize,
+}
+
+impl GenotypeBatch {
+    fn new(schema: SchemaRef, contigs: &[String]) -> Self {
+        Self {
+            chroms: ReferenceColumn::new(schema.field(0), contigs),
+            schema,
+            positions: Int64Builder::new(),
+            references: StringBuilder::new(),
+            alternates: ListBuilder::new(StringBuilder::new()),
+            genotypes: BinaryBuilder::new(),
+            rows: 0,
+        }
+    }
+
+    fn append(&mut self, site: &Site, contigs: &[String], genotypes: &[u8]) -> io::Result<()> {
+        if contigs.is_empty() {
+            self.chroms.append_name(&site.chrom)?;
+        } else {
+            self.chroms.append(contigs, site.reference_id)?;
+        }
+        self.positions.append_value(site.position);
+        self.references.append_value(&site.reference);
+        for alternate in &site.alternates {
+            self.alternates.values().append_value(alternate);
+        }
+        self.alternates.append(true);
+        self.genotypes.append_value(genotypes);
+
+        self.rows += 1;
+
+        Ok(())
+    }
+
+    fn finish(&mut self) -> io::Result<RecordBatch> {
+        self.rows = 0;
+
+        let columns: Vec<ArrayRef> = vec![
+            self.chroms.finish()?,
+            Arc::new(self.positions.finish()),
+            Arc::new(self.references.finish()),
+            Arc::new(self.alternates.finish()),
+            Arc::new(self.genotypes.finish()),
+        ];
+
+        RecordBatch::try_new(self.schema.clone(), columns).map_err(invalid_data)
+    }
+}
+
+struct GenotypePartition {
+    schema: SchemaRef,
+    scan: Arc<GenotypeScan>,
+}
+
+impl PartitionStream for GenotypePartition {
+    fn schema(&self) -> &SchemaRef {
+        &self.schema
+    }
+
+    fn execute(&self, _ctx: Arc<TaskContext>) -> SendableRecordBatchStream {
+        let scan = self.scan.clone();
+
+        blocking_stream(self.schema.clone(), move |emit| scan.run(emit))
+    }
+}
+
+#[repr(C)]
+pub struct GenotypeReaderResult {
+    error: *const c_char,
+}
+
+impl GenotypeReaderResult {
+    fn error(error: String) -> Self {
+        Self {
+            error: CString::new(error).unwrap().into_raw(),
+        }
+    }
+}
+
+/// Reads the genotypes of the local VCF or BCF file at `uri` as a matrix, a row per site with
+/// columns `chrom`, `pos`, `ref`, `alt` and `genotypes`, the latter holding the genotypes of the
+/// `sample_count` samples named at `samples`, in that order, or of every sample if null. Each
+/// genotype is an int8 dosage, or with `packed` a 2-bit PLINK 1 code. VCF files may be
+/// uncompressed or bgzipped.
+///
+/// With a null `region` the whole file is read. Otherwise the sites overlapping it, samtools-style
+/// or the path of a BED file, are read with the file's index. `filters` is a SQL predicate applied
+/// to the rows. Whole files are inflated by `threads` threads.
+#[no_mangle]
+pub unsafe extern "C" fn new_genotype_reader(
+    stream_ptr: *mut ArrowArrayStream,
+    uri: *const c_char,
+    samples: *const *const c_char,
+    sample_count: usize,
+    region: *const c_char,
+    packed: bool,
+    batch_size: usize,
+    threads: usize,
+    filters: *const c_char,
+) -> GenotypeReaderResult {
+    let uri = match CStr::from_ptr(uri).to_str() {
+        Ok(uri) => uri,
+        Err(e) => return GenotypeReaderResult::error(format!("could not parse uri: {}", e)),
+    };
+
+    let samples = match strings_from_ffi(samples, sample_count) {
+        Ok(Some(samples)) if samples.is_empty() => {
+            return GenotypeReaderResult::error("samples must name at least one sample".to_string())
+        }
+        Ok(samples) => samples,
+        Err(e) => return GenotypeReaderResult::error(format!("could not parse samples: {}", e)),
+    };
+
+    let region = if region.is_null() {
+        None
+    } else {
+        match CStr::from_ptr(region).to_str() {
+            Ok(region) => Some(region.to_string()),
+            Err(e) => return GenotypeReaderResult::error(format!("could not parse region: {}", e)),
+        }
+    };
+
+    let filters = if filters.is_null() {
+        ""
+    } else {
+        match CStr::from_ptr(filters).to_str() {
+            Ok(filters) => filters,
+            Err(e) => {
+                return GenotypeReaderResult::error(format!("could not parse filters: {}", e))
+            }
+        }
+    };
+
+    let data = match map_file(uri) {
+        Ok(data) => data,
+        Err(e) => return GenotypeReaderResult::error(format!("could not read file: {}", e)),
+    };
+
+    let (format, header) = match VariantFormat::detect(&data)
+        .and_then(|format| Ok((format, read_header(format, &data)?)))
+    {
+        Ok(header) => header,
+        Err(e) => return GenotypeReaderResult::error(format!("could not read header: {}", e)),
+    };
+
+    let sample_names = match header.samples() {
+        Ok(names) => names,
+        Err(e) => return GenotypeReaderResult::error(format!("could not read header: {}", e)),
+    };
+
+    let samples = match samples {
+        Some(requested) => match select_samples(&sample_names, &requested, true) {
+            Ok(samples) => samples,
+            Err(e) => return GenotypeReaderResult::error(format!("could not read samples: {}", e)),
+        },
+        None => (0..sample_names.len()).collect(),
+    };
+
+    let gt_key = string_map(&header.text)
+        .iter()
+        .position(|name| name.as_deref() == Some("GT"))
+        .map(|key| key as i32);
+
+    let rt = Arc::new(Runtime::new().unwrap());
+
+    let config = new_exon_config().with_batch_size(batch_size);
+    let ctx = SessionContext::with_config_exon(config);
+
+    rt.block_on(async {
+        let regions = match region {
+            None => None,
+            Some(region) => match index_regions(&ctx, uri, format, &header, &[region]).await {
+                Ok(regions) => Some(regions),
+                Err(e) => return GenotypeReaderResult::error(e),
+            },
+        };
+
+        let index = match &regions {
+            Some((index, _)) => Some(index.clone()),
+            None => read_local_index(uri, format).ok().map(Arc::new),
+        };
+
+        let contigs = chrom_names(format, parse_vcf_contigs(&header.text), index.as_deref());
+        let contig_ids = contigs
+            .iter()
+            .enumerate()
+            .map(|(id, name)| (name.clone(), id as i32))
+            .collect();
+        let schema = genotype_schema(&contigs);
+
+        let partition = Arc::new(GenotypePartition {
+            schema: schema.clone(),
+            scan: Arc::new(GenotypeScan {
+                path: uri.to_string(),
+                format,
+                contigs,
+                contig_ids,
+                gt_key,
+                samples,
+                packed,
+                regions,
+                schema: schema.clone(),
+                batch_size,
+                threads,
+            }),
+        }) as Arc<dyn PartitionStream>;
+
+        let table = match StreamingTable::try_new(schema, vec![partition]) {
+            Ok(table) => table,
+            Err(e) => return GenotypeReaderResult::error(format!("could not create table: {}", e)),
+        };
+
+        if let Err(e) = ctx.register_table("exon_table", Arc::new(table)) {
+            return GenotypeReaderResult::error(format!("could not register table: {}", e));
+        }
+
+        let mut select_string = format!("SELECT * FROM exon_table");
+        if filters != "" {
+            select_string.push_str(format!(" WHERE {}", filters).as_str());
+        }
+
+        let df = match ctx.sql(&select_string).await {
+            Ok(df) => df,
+            Err(e) => return GenotypeReaderResult::error(format!("could not execute sql: {}", e)),
+        };
+
+        match create_dataset_stream_from_table_provider(df, rt.clone(), stream_ptr).await {
+            Ok(_) => GenotypeReaderResult {
+                error: std::ptr::null(),
+            },
+            Err(e) => {
+                GenotypeReaderResult::error(format!("could not create dataset stream: {}", e))
+            }
+        }
+    })
+}
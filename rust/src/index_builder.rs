@@ -0,0 +1,1266 @@
+// Copyright 2023 WHERE TRUE Technologies.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+//! Builds BAI and CSI indexes for BAM files, CSI indexes for BCF files, tabix and CSI indexes for
+//! bgzipped VCF, GFF and BED files, and FAI and GZI indexes for FASTA files, laid out as htslib
+//! writes them.
+//!
+//! BGZF blocks are located from their headers alone, then inflated in batches spread over several
+//! threads; only walking the records, which may straddle blocks, is sequential.
+
+use std::{
+    collections::{BTreeMap, HashMap, VecDeque},
+    ffi::{c_char, CStr, CString},
+    fs, io,
+    ptr::null,
+    slice, thread,
+};
+
+use memmap2::Mmap;
+
+use crate::{
+    bgzf::{self, BgzfRead},
+    binning_index::{
+        reg2bin, Bin, BinningIndex, Chunk, IndexFormat, Metadata, ReferenceIndex, TabixHeader,
+        BAI_DEPTH, BAI_MIN_SHIFT,
+    },
+    fasta_index::FaiRecord,
+    region::parse_vcf_contig_lengths,
+};
+
+/// Blocks inflated per thread in each batch.
+const BLOCKS_PER_THREAD: usize = 64;
+
+/// Bins whose chunks span less compressed data than this are folded into their parent.
+const MIN_MARKER_DISTANCE: u64 = 0x10000;
+
+/// The largest position the tabix CSI levels are sized for, as a power of two.
+const TABIX_MAX_SHIFT: u32 = 31;
+
+const TABIX_GENERIC: i32 = 0;
+const TABIX_VCF: i32 = 2;
+const TABIX_ZERO_BASED: i32 = 0x10000;
+
+/// Linear index windows no record has started in yet.
+const MISSING_OFFSET: u64 = u64::MAX;
+
+fn invalid_data<E: Into<Box<dyn std::error::Error + Send + Sync>>>(e: E) -> io::Error {
+    io::Error::new(io::ErrorKind::InvalidData, e)
+}
+
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+pub enum SourceFormat {
+    Bam,
+    Bcf,
+    Vcf,
+    Gff,
+    Bed,
+    Fasta,
+}
+
+impl SourceFormat {
+    fn from_name(name: &str) -> Option<Self> {
+        match name.to_ascii_lowercase().as_str() {
+            "bam" => Some(Self::Bam),
+            "bcf" => Some(Self::Bcf),
+            "vcf" => Some(Self::Vcf),
+            "gff" | "gff3" | "gtf" => Some(Self::Gff),
+            "bed" => Some(Self::Bed),
+            "fasta" | "fa" | "fna" | "fas" | "faa" => Some(Self::Fasta),
+            _ => None,
+        }
+    }
+
+    /// Infers the format from the file extension, looking past a `.gz` or `.bgz` suffix.
+    pub fn from_path(path: &str) -> Option<Self> {
+        let path = path.to_ascii_lowercase();
+        let path = path
+            .strip_suffix(".gz")
+            .or_else(|| path.strip_suffix(".bgz"))
+            .unwrap_or(&path);
+
+        path.rsplit_once('.')
+            .and_then(|(_, extension)| Self::from_name(extension))
+    }
+
+    /// The tabix column layout of a text format.
+    fn tabix_header(self) -> Option<TabixHeader> {
+        let (format, col_seq, col_beg, col_end) = match self {
+            Self::Vcf => (TABIX_VCF, 1, 2, 0),
+            Self::Gff => (TABIX_GENERIC, 1, 4, 5),
+            Self::Bed => (TABIX_GENERIC | TABIX_ZERO_BASED, 1, 2, 3),
+            _ => return None,
+        };
+
+        Some(TabixHeader {
+            format,
+            col_seq,
+            col_beg,
+            col_end,
+            meta: b'#',
+            skip: 0,
+            names: vec![],
+        })
+    }
+
+    fn default_index(self) -> &'static str {
+        match self {
+            Self::Bam => "bai",
+            Self::Bcf => "csi",
+            Self::Vcf | Self::Gff | Self::Bed => "tbi",
+            Self::Fasta => "fai",
+        }
+    }
+}
+
+/// The number of CSI levels needed for references up to `max_length` long.
+pub(crate) fn csi_depth(min_shift: u32, max_length: u64) -> u32 {
+    let max_length = max_length + 256;
+
+    let mut depth = 0;
+    let mut size = 1u64 << min_shift;
+    while max_length > size {
+        depth += 1;
+        size <<= 3;
+    }
+
+    depth
+}
+
+/// The id of the first bin of `level`.
+fn bin_first(level: u32) -> u32 {
+    (((1u64 << (level * 3)) - 1) / 7) as u32
+}
+
+/// The first linear index window covered by `bin`.
+fn bin_bottom(bin: u32, depth: u32) -> usize {
+    let mut level = 0;
+    let mut b = bin;
+    while b > 0 {
+        level += 1;
+        b = (b - 1) >> 3;
+    }
+
+    ((bin - bin_first(level)) as usize) << ((depth - level) * 3)
+}
+
+#[derive(Default)]
+struct ReferenceBuilder {
+    bins: BTreeMap<u32, Vec<Chunk>>,
+    intervals: Vec<u64>,
+    metadata: Option<Metadata>,
+}
+
+impl ReferenceBuilder {
+    fn is_empty(&self) -> bool {
+        self.bins.is_empty() && self.metadata.is_none()
+    }
+
+    /// Fills the linear index gaps, records each bin's smallest offset, folds small bins into
+    /// their parents and merges chunks starting in the same BGZF block.
+    fn finish(mut self, format: IndexFormat, depth: u32) -> ReferenceIndex {
+        let mut previous = self.metadata.map(|metadata| metadata.start).unwrap_or(0);
+        for interval in self.intervals.iter_mut() {
+            if *interval == MISSING_OFFSET {
+                *interval = previous;
+            }
+
+            previous = *interval;
+        }
+
+        let loffsets = self
+            .bins
+            .keys()
+            .map(|&id| {
+                let bottom = bin_bottom(id, depth);
+                (id, self.intervals.get(bottom).copied().unwrap_or(0))
+            })
+            .collect::<HashMap<_, _>>();
+
+        for level in (1..=depth).rev() {
+            let first = bin_first(level);
+            let ids = self
+                .bins
+                .range(first..)
+                .map(|(id, _)| *id)
+                .collect::<Vec<_>>();
+
+            for id in ids {
+                let chunks = self.bins.get_mut(&id).unwrap();
+                if level < depth {
+                    chunks.sort();
+                }
+
+                let span =
+                    (chunks[chunks.len() - 1].end >> 16).saturating_sub(chunks[0].start >> 16);
+                let parent = (id - 1) >> 3;
+
+                if span < MIN_MARKER_DISTANCE && self.bins.contains_key(&parent) {
+                    let chunks = self.bins.remove(&id).unwrap();
+                    self.bins.get_mut(&parent).unwrap().extend(chunks);
+                }
+            }
+        }
+
+        if let Some(chunks) = self.bins.get_mut(&0) {
+            chunks.sort();
+        }
+
+        let bins = self
+            .bins
+            .into_iter()
+            .map(|(id, chunks)| {
+                let mut merged: Vec<Chunk> = Vec::with_capacity(chunks.len());
+                for chunk in chunks {
+                    match merged.last_mut() {
+                        Some(last) if last.end >> 16 >= chunk.start >> 16 => {
+                            last.end = last.end.max(chunk.end)
+                        }
+                        _ => merged.push(chunk),
+                    }
+                }
+
+                Bin {
+                    id,
+                    loffset: loffsets[&id],
+                    chunks: merged,
+                }
+            })
+            .collect();
+
+        ReferenceIndex {
+            bins,
+            intervals: match format {
+                IndexFormat::Csi => vec![],
+                _ => self.intervals,
+            },
+            metadata: self.metadata,
+        }
+    }
+}
+
+/// Collects records, in file order, into a binning index.
+pub struct IndexBuilder {
+    format: IndexFormat,
+    min_shift: u32,
+    depth: u32,
+    references: Vec<ReferenceBuilder>,
+    /// The reference and bin of the chunk being collected, and where the chunk starts.
+    reference: Option<usize>,
+    bin: Option<u32>,
+    chunk_start: u64,
+    /// The end of the previous record, i.e. the start of the next one.
+    last_offset: u64,
+    last_start: u64,
+    metadata_start: u64,
+    mapped: u64,
+    unmapped: u64,
+    unplaced: u64,
+    records: u64,
+}
+
+impl IndexBuilder {
+    /// `first_offset` is the virtual offset of the first record, just past the header.
+    pub fn new(
+        format: IndexFormat,
+        min_shift: u32,
+        depth: u32,
+        reference_count: usize,
+        first_offset: u64,
+    ) -> Self {
+        let mut references = Vec::with_capacity(reference_count);
+        references.resize_with(reference_count, ReferenceBuilder::default);
+
+        Self {
+            format,
+            min_shift,
+            depth,
+            references,
+            reference: None,
+            bin: None,
+            chunk_start: first_offset,
+            last_offset: first_offset,
+            last_start: 0,
+            metadata_start: first_offset,
+            mapped: 0,
+            unmapped: 0,
+            unplaced: 0,
+            records: 0,
+        }
+    }
+
+    /// Adds a record covering the zero-based, half-open `[start, end)` of `reference_id`, or an
+    /// unplaced record if `None`. `end_offset` is the virtual offset just past the record.
+    pub fn push(
+        &mut self,
+        reference_id: Option<usize>,
+        start: u64,
+        end: u64,
+        end_offset: u64,
+        mapped: bool,
+    ) -> io::Result<()> {
+        self.records += 1;
+
+        let reference_id = match reference_id {
+            Some(reference_id) => reference_id,
+            None => {
+                self.finish_reference(self.last_offset);
+                self.unplaced += 1;
+                self.last_offset = end_offset;
+
+                return Ok(());
+            }
+        };
+
+        if self.unplaced > 0 {
+            return Err(invalid_data(
+                "placed records follow unplaced ones, the file is not sorted by position",
+            ));
+        }
+
+        let end = end.max(start + 1);
+        if end > 1u64 << (self.min_shift + self.depth * 3) {
+            return Err(invalid_data(format!(
+                "position {} is too large for a {:?} index, build a CSI index instead",
+                end, self.format
+            )));
+        }
+
+        if self.reference != Some(reference_id) {
+            if self
+                .references
+                .get(reference_id)
+                .map_or(false, |reference| !reference.is_empty())
+            {
+                return Err(invalid_data(format!(
+                    "records of reference sequence {} are not contiguous, the file is not sorted by position",
+                    reference_id
+                )));
+            }
+
+            self.finish_reference(self.last_offset);
+            self.reference = Some(reference_id);
+
+            if self.references.len() <= reference_id {
+                self.references
+                    .resize_with(reference_id + 1, ReferenceBuilder::default);
+            }
+        } else if start < self.last_start {
+            return Err(invalid_data(format!(
+                "record at {} follows one at {}, the file is not sorted by position",
+                start + 1,
+                self.last_start + 1
+            )));
+        }
+
+        let reference = &mut self.references[reference_id];
+
+        // Unmapped reads placed by their mate don't move the linear index.
+        if mapped {
+            let first_window = (start >> self.min_shift) as usize;
+            let last_window = ((end - 1) >> self.min_shift) as usize;
+
+            if reference.intervals.len() <= last_window {
+                reference.intervals.resize(last_window + 1, MISSING_OFFSET);
+            }
+
+            for interval in &mut reference.intervals[first_window..=last_window] {
+                if *interval == MISSING_OFFSET {
+                    *interval = self.last_offset;
+                }
+            }
+        }
+
+        let bin = reg2bin(start, end, self.min_shift, self.depth);
+        if self.bin != Some(bin) {
+            if let Some(previous) = self.bin {
+                reference.bins.entry(previous).or_default().push(Chunk {
+                    start: self.chunk_start,
+                    end: self.last_offset,
+                });
+            }
+
+            self.chunk_start = self.last_offset;
+            self.bin = Some(bin);
+        }
+
+        if mapped {
+            self.mapped += 1;
+        } else {
+            self.unmapped += 1;
+        }
+
+        self.last_offset = end_offset;
+        self.last_start = start;
+
+        Ok(())
+    }
+
+    /// Closes the open chunk and writes the pseudo-bin of the current reference.
+    fn finish_reference(&mut self, end_offset: u64) {
+        if let (Some(reference_id), Some(bin)) = (self.reference, self.bin) {
+            let reference = &mut self.references[reference_id];
+
+            reference.bins.entry(bin).or_default().push(Chunk {
+                start: self.chunk_start,
+                end: end_offset,
+            });
+
+            reference.metadata = Some(Metadata {
+                start: self.metadata_start,
+                end: end_offset,
+                mapped: self.mapped,
+                unmapped: self.unmapped,
+            });
+
+            self.metadata_start = end_offset;
+            self.mapped = 0;
+            self.unmapped = 0;
+        }
+
+        self.reference = None;
+        self.bin = None;
+    }
+
+    /// The number of records pushed.
+    pub fn records(&self) -> u64 {
+        self.records
+    }
+
+    /// Completes the index. `end_offset` is the virtual offset just past the last record.
+    pub fn finish(mut self, end_offset: u64, tabix: Option<TabixHeader>) -> BinningIndex {
+        self.finish_reference(end_offset);
+
+        if let Some(tabix) = &tabix {
+            if self.references.len() < tabix.names.len() {
+                self.references
+                    .resize_with(tabix.names.len(), ReferenceBuilder::default);
+            }
+        }
+
+        let (format, depth) = (self.format, self.depth);
+
+        BinningIndex {
+            format,
+            min_shift: self.min_shift,
+            depth,
+            tabix,
+            references: self
+                .references
+                .into_iter()
+                .map(|reference| reference.finish(format, depth))
+                .collect(),
+            unplaced_unmapped: Some(self.unplaced),
+        }
+    }
+}
+
+/// Reads the uncompressed stream of a BGZF file, tracking the virtual offset, while the blocks
+/// ahead are inflated in parallel batches.
+pub(crate) struct BlockReader<'a> {
+    data: &'a [u8],
+    offsets: Vec<(u64, usize, usize)>,
+    next: usize,
+    threads: usize,
+    blocks: VecDeque<bgzf::Block>,
+    position: usize,
+}
+
+impl<'a> BlockReader<'a> {
+    fn new(data: &'a [u8], threads: usize) -> io::Result<Self> {
+        // Empty blocks, such as the EOF marker, hold no records to point at.
+        let mut offsets = bgzf::block_offsets(data)?;
+        offsets.retain(|(_, _, size)| *size > 0);
+
+        Ok(Self {
+            data,
+            offsets,
+            next: 0,
+            threads: threads.max(1),
+            blocks: VecDeque::new(),
+            position: 0,
+        })
+    }
+
+    /// Inflates the next batch of blocks, returns false if there are none left.
+    fn inflate_batch(&mut self) -> io::Result<bool> {
+        let end = (self.next + self.threads * BLOCKS_PER_THREAD).min(self.offsets.len());
+        if self.next == end {
+            return Ok(false);
+        }
+
+        let batch = &self.offsets[self.next..end];
+        let per_thread = (batch.len() + self.threads - 1) / self.threads;
+        let data = self.data;
+
+        let inflated = thread::scope(|scope| {
+            let handles = batch
+                .chunks(per_thread)
+                .map(|offsets| {
+                    scope.spawn(move || {
+                        offsets
+                            .iter()
+                            .map(|&(offset, size, _)| {
+                                let start = offset as usize;
+                                let mut block_data = Vec::new();
+                                bgzf::inflate_block(&data[start..start + size], &mut block_data)?;
+
+                                Ok(bgzf::Block {
+                                    compressed_offset: offset,
+                                    compressed_size: size,
+                                    data: block_data,
+                                })
+                            })
+                            .collect::<io::Result<Vec<_>>>()
+                    })
+                })
+                .collect::<Vec<_>>();
+
+            handles
+                .into_iter()
+                .map(|handle| {
+                    handle.join().unwrap_or_else(|_| {
+                        Err(io::Error::new(
+                            io::ErrorKind::Other,
+                            "inflate thread panicked",
+                        ))
+                    })
+                })
+                .collect::<io::Result<Vec<_>>>()
+        })?;
+
+        self.blocks.extend(inflated.into_iter().flatten());
+        self.next = end;
+
+        Ok(true)
+    }
+}
+
+/// Reads the whole of the BGZF file `data`, from its first block on, with blocks inflated by
+/// `threads` threads; scans pass DuckDB's own thread count.
+pub(crate) fn file_reader(data: &[u8], threads: usize) -> io::Result<BlockReader<'_>> {
+    BlockReader::new(data, threads)
+}
+
+impl<'a> BgzfRead for BlockReader<'a> {
+    /// Moves to a block with unread bytes, returns false at the end of the file. The last block
+    /// is kept once read, so the virtual offset past the last record points at the block after it.
+    fn fill(&mut self) -> io::Result<bool> {
+        loop {
+            match self.blocks.front() {
+                Some(block) if self.position < block.data.len() => return Ok(true),
+                Some(_) if self.blocks.len() > 1 => {
+                    self.blocks.pop_front();
+                    self.position = 0;
+                }
+                _ => {
+                    if !self.inflate_batch()? {
+                        return Ok(false);
+                    }
+                }
+            }
+        }
+    }
+
+    fn available(&self) -> &[u8] {
+        &self.blocks[0].data[self.position..]
+    }
+
+    fn consume(&mut self, n: usize) {
+        self.position += n;
+    }
+
+    fn virtual_offset(&self) -> u64 {
+        match self.blocks.front() {
+            Some(block) if self.position < block.data.len() => {
+                bgzf::virtual_offset(block.compressed_offset, self.position as u16)
+            }
+            Some(block) => {
+                bgzf::virtual_offset(block.compressed_offset + block.compressed_size as u64, 0)
+            }
+            None => {
+                let offset = self
+                    .offsets
+                    .get(self.next)
+                    .map_or(self.data.len() as u64, |(offset, _, _)| *offset);
+
+                bgzf::virtual_offset(offset, 0)
+            }
+        }
+    }
+}
+
+pub(crate) fn le_i32(data: &[u8]) -> i32 {
+    i32::from_le_bytes([data[0], data[1], data[2], data[3]])
+}
+
+pub(crate) fn le_u32(data: &[u8]) -> u32 {
+    u32::from_le_bytes([data[0], data[1], data[2], data[3]])
+}
+
+pub(crate) fn le_u16(data: &[u8]) -> u16 {
+    u16::from_le_bytes([data[0], data[1]])
+}
+
+fn scan_bam(reader: &mut BlockReader, format: IndexFormat) -> io::Result<(BinningIndex, u64)> {
+    let mut buf = vec![];
+
+    reader.read_header(4, &mut buf)?;
+    if buf != b"BAM\x01" {
+        return Err(invalid_data("not a BAM file"));
+    }
+
+    reader.read_header(4, &mut buf)?;
+    let l_text = le_u32(&buf) as usize;
+    reader.read_header(l_text, &mut buf)?;
+
+    reader.read_header(4, &mut buf)?;
+    let reference_count = le_u32(&buf) as usize;
+
+    let mut max_length = 0;
+    for _ in 0..reference_count {
+        reader.read_header(4, &mut buf)?;
+        let l_name = le_u32(&buf) as usize;
+        reader.read_header(l_name + 4, &mut buf)?;
+        max_length = max_length.max(le_u32(&buf[l_name..]) as u64);
+    }
+
+    let (min_shift, depth) = match format {
+        IndexFormat::Bai => (BAI_MIN_SHIFT, BAI_DEPTH),
+        IndexFormat::Csi => (BAI_MIN_SHIFT, csi_depth(BAI_MIN_SHIFT, max_length)),
+        IndexFormat::Tbi => return Err(invalid_data("BAM files take a BAI or CSI index")),
+    };
+
+    let mut builder = IndexBuilder::new(
+        format,
+        min_shift,
+        depth,
+        reference_count,
+        reader.virtual_offset(),
+    );
+
+    while reader.read_exact(4, &mut buf)? {
+        let block_size = le_u32(&buf) as usize;
+        if !reader.read_exact(block_size, &mut buf)? || block_size < 32 {
+            return Err(invalid_data("truncated BAM record"));
+        }
+
+        let reference_id = le_i32(&buf[0..]);
+        let position = le_i32(&buf[4..]);
+        let l_read_name = buf[8] as usize;
+        let n_cigar_op = le_u16(&buf[12..]) as usize;
+        let flag = le_u16(&buf[14..]);
+
+        let cigar_start = 32 + l_read_name;
+        let cigar = buf
+            .get(cigar_start..cigar_start + n_cigar_op * 4)
+            .ok_or_else(|| invalid_data("truncated BAM record"))?;
+
+        let unmapped = flag & 0x4 != 0;
+
+        // Reference bases consumed by M, D, N, = and X.
+        let mut span = 0;
+        if !unmapped {
+            for op in cigar.chunks_exact(4) {
+                let op = le_u32(op);
+                if matches!(op & 0xf, 0 | 2 | 3 | 7 | 8) {
+                    span += (op >> 4) as u64;
+                }
+            }
+        }
+
+        let reference_id = if reference_id < 0 || position < 0 {
+            None
+        } else if reference_id as usize >= reference_count {
+            return Err(invalid_data(format!(
+                "reference id {} is not in the BAM header",
+                reference_id
+            )));
+        } else {
+            Some(reference_id as usize)
+        };
+
+        let start = position.max(0) as u64;
+        builder.push(
+            reference_id,
+            start,
+            start + span.max(1),
+            reader.virtual_offset(),
+            !unmapped,
+        )?;
+    }
+
+    let records = builder.records();
+    Ok((builder.finish(reader.virtual_offset(), None), records))
+}
+
+fn scan_bcf(reader: &mut BlockReader, format: IndexFormat) -> io::Result<(BinningIndex, u64)> {
+    let mut buf = vec![];
+
+    reader.read_header(5, &mut buf)?;
+    if !buf.starts_with(b"BCF\x02") {
+        return Err(invalid_data("not a BCF file"));
+    }
+
+    reader.read_header(4, &mut buf)?;
+    let l_text = le_u32(&buf) as usize;
+    reader.read_header(l_text, &mut buf)?;
+
+    let contigs = parse_vcf_contig_lengths(String::from_utf8_lossy(&buf).trim_end_matches('\0'));
+
+    if format != IndexFormat::Csi {
+        return Err(invalid_data("BCF files take a CSI index"));
+    }
+
+    // Like bcftools, assume the largest positions when no contig declares a length.
+    let max_length = match contigs.iter().filter_map(|(_, length)| *length).max() {
+        Some(max_length) => max_length,
+        None => (1 << 31) - 1,
+    };
+
+    let mut builder = IndexBuilder::new(
+        format,
+        BAI_MIN_SHIFT,
+        csi_depth(BAI_MIN_SHIFT, max_length),
+        contigs.len(),
+        reader.virtual_offset(),
+    );
+
+    while reader.read_exact(8, &mut buf)? {
+        let size = le_u32(&buf[0..]) as usize + le_u32(&buf[4..]) as usize;
+        if !reader.read_exact(size, &mut buf)? || size < 12 {
+            return Err(invalid_data("truncated BCF record"));
+        }
+
+        let reference_id = le_i32(&buf[0..]);
+        let position = le_i32(&buf[4..]);
+        let length = le_i32(&buf[8..]);
+
+        if reference_id < 0 || position < 0 {
+            return Err(invalid_data("BCF record without a position"));
+        }
+
+        let start = position as u64;
+        builder.push(
+            Some(reference_id as usize),
+            start,
+            start + length.max(0) as u64,
+            reader.virtual_offset(),
+            true,
+        )?;
+    }
+
+    let records = builder.records();
+    Ok((builder.finish(reader.virtual_offset(), None), records))
+}
+
+/// The value of the `END` key of a VCF INFO column.
+pub(crate) fn info_end(info: &str) -> Option<u64> {
+    let value = match info.strip_prefix("END=") {
+        Some(value) => value,
+        None => &info[info.find(";END=")? + 5..],
+    };
+
+    value.split(';').next()?.parse().ok()
+}
+
+/// The reference name and zero-based, half-open interval of a tabix-style line.
+fn parse_interval<'l>(line: &'l str, header: &TabixHeader) -> io::Result<(&'l str, u64, u64)> {
+    let fields = line.split('\t').collect::<Vec<_>>();
+
+    let field = |column: i32| {
+        fields
+            .get((column - 1) as usize)
+            .copied()
+            .ok_or_else(|| invalid_data(format!("missing column {}: {}", column, line)))
+    };
+
+    let position = |column: i32| {
+        field(column)?
+            .trim()
+            .parse::<u64>()
+            .map_err(|_| invalid_data(format!("invalid position in column {}: {}", column, line)))
+    };
+
+    let name = field(header.col_seq)?;
+
+    let mut start = position(header.col_beg)?;
+    if header.format & TABIX_ZERO_BASED == 0 {
+        start = start.saturating_sub(1);
+    }
+
+    let end = if header.format & 0xffff == TABIX_VCF {
+        let end = start + field(4)?.len() as u64;
+
+        match fields.get(7).and_then(|info| info_end(info)) {
+            Some(info_end) if info_end > start => info_end,
+            _ => end,
+        }
+    } else if header.col_end > 0 {
+        position(header.col_end)?
+    } else {
+        start + 1
+    };
+
+    Ok((name, start, end))
+}
+
+fn scan_tabix(
+    reader: &mut BlockReader,
+    format: IndexFormat,
+    mut header: TabixHeader,
+) -> io::Result<(BinningIndex, u64)> {
+    let (min_shift, depth) = match format {
+        IndexFormat::Tbi => (BAI_MIN_SHIFT, BAI_DEPTH),
+        IndexFormat::Csi => (BAI_MIN_SHIFT, (TABIX_MAX_SHIFT - BAI_MIN_SHIFT + 2) / 3),
+        IndexFormat::Bai => return Err(invalid_data("BAI indexes are only for BAM files")),
+    };
+
+    let mut ids = HashMap::new();
+    let mut builder = None;
+    let mut line = vec![];
+
+    loop {
+        let line_start = reader.virtual_offset();
+        if !reader.read_line(&mut line)? {
+            break;
+        }
+
+        let text = std::str::from_utf8(&line)
+            .map_err(invalid_data)?
+            .trim_end_matches(&['\n', '\r'][..]);
+
+        if text.is_empty() || text.as_bytes()[0] == header.meta {
+            continue;
+        }
+
+        let builder = builder
+            .get_or_insert_with(|| IndexBuilder::new(format, min_shift, depth, 0, line_start));
+
+        let (name, start, end) = parse_interval(text, &header)?;
+
+        let reference_id = match ids.get(name) {
+            Some(reference_id) => *reference_id,
+            None => {
+                header.names.push(name.to_string());
+                ids.insert(name.to_string(), ids.len());
+                ids.len() - 1
+            }
+        };
+
+        builder.push(
+            Some(reference_id),
+            start,
+            end,
+            reader.virtual_offset(),
+            true,
+        )?;
+    }
+
+    let builder = builder
+        .unwrap_or_else(|| IndexBuilder::new(format, min_shift, depth, 0, reader.virtual_offset()));
+
+    let records = builder.records();
+    Ok((
+        builder.finish(reader.virtual_offset(), Some(header)),
+        records,
+    ))
+}
+
+/// Builds the FAI records of a FASTA file from its lines, each passed with its newline.
+/// Offsets count the bytes of the uncompressed file.
+fn build_fai(
+    mut next_line: impl FnMut(&mut Vec<u8>) -> io::Result<bool>,
+) -> io::Result<Vec<FaiRecord>> {
+    let mut records: Vec<FaiRecord> = vec![];
+    let mut names = HashMap::new();
+
+    let mut position = 0u64;
+    let mut line = vec![];
+
+    // Set by a line shorter than the first of its record, only the last line may be.
+    let mut short_line = false;
+
+    while next_line(&mut line)? {
+        position += line.len() as u64;
+
+        let mut content = line.as_slice();
+        while let Some((b'\n' | b'\r', rest)) = content.split_last() {
+            content = rest;
+        }
+
+        if let Some(header) = content.strip_prefix(b">") {
+            let name = header
+                .split(|b| b.is_ascii_whitespace())
+                .next()
+                .map(|name| String::from_utf8_lossy(name).to_string())
+                .unwrap_or_default();
+
+            if name.is_empty() {
+                return Err(invalid_data("FASTA record without a name"));
+            }
+
+            if names.insert(name.clone(), ()).is_some() {
+                return Err(invalid_data(format!("duplicate sequence name: {}", name)));
+            }
+
+            records.push(FaiRecord {
+                name,
+                length: 0,
+                offset: position,
+                line_bases: 0,
+                line_width: 0,
+            });
+            short_line = false;
+
+            continue;
+        }
+
+        let record = match records.last_mut() {
+            Some(record) => record,
+            None if content.is_empty() => continue,
+            None => return Err(invalid_data("sequence before the first FASTA header")),
+        };
+
+        if content.is_empty() {
+            short_line = true;
+            continue;
+        }
+
+        let bases = content.len() as u64;
+        let width = line.len() as u64;
+
+        if record.line_bases == 0 {
+            record.line_bases = bases;
+            record.line_width = width;
+        } else if short_line
+            || bases > record.line_bases
+            || width - bases != record.line_width - record.line_bases
+        {
+            return Err(invalid_data(format!(
+                "different line length in sequence '{}'",
+                record.name
+            )));
+        }
+
+        short_line = bases < record.line_bases;
+        record.length += bases;
+    }
+
+    Ok(records)
+}
+
+fn fai_bytes(records: &[FaiRecord]) -> Vec<u8> {
+    records
+        .iter()
+        .map(|record| {
+            format!(
+                "{}\t{}\t{}\t{}\t{}\n",
+                record.name, record.length, record.offset, record.line_bases, record.line_width
+            )
+        })
+        .collect::<String>()
+        .into_bytes()
+}
+
+/// The GZI entries of a BGZF file: the compressed and uncompressed offsets of every data block
+/// but the first.
+fn build_gzi(data: &[u8]) -> io::Result<Vec<(u64, u64)>> {
+    let mut entries = vec![];
+    let mut uncompressed_offset = 0;
+
+    for (offset, _, size) in bgzf::block_offsets(data)? {
+        if size == 0 {
+            continue;
+        }
+
+        if uncompressed_offset > 0 {
+            entries.push((offset, uncompressed_offset));
+        }
+
+        uncompressed_offset += size as u64;
+    }
+
+    Ok(entries)
+}
+
+fn gzi_bytes(entries: &[(u64, u64)]) -> Vec<u8> {
+    let mut out = Vec::with_capacity(8 + entries.len() * 16);
+    out.extend_from_slice(&(entries.len() as u64).to_le_bytes());
+
+    for (compressed_offset, uncompressed_offset) in entries {
+        out.extend_from_slice(&compressed_offset.to_le_bytes());
+        out.extend_from_slice(&uncompressed_offset.to_le_bytes());
+    }
+
+    out
+}
+
+/// Writes `data` to a temporary file and renames it into place, so a reader never sees a
+/// partial index.
+pub(crate) fn write_file(path: &str, data: &[u8]) -> io::Result<()> {
+    let temp_path = format!("{}.tmp", path);
+
+    fs::write(&temp_path, data)
+        .and_then(|_| fs::rename(&temp_path, path))
+        .map_err(|e| {
+            let _ = fs::remove_file(&temp_path);
+            io::Error::new(e.kind(), format!("{}: {}", path, e))
+        })
+}
+
+/// An index file written by `build`.
+#[derive(Clone, Debug, PartialEq, Eq)]
+pub struct BuiltIndex {
+    pub path: String,
+    /// Records indexed: alignments or variants or features, sequences for FAI, blocks for GZI.
+    pub records: u64,
+}
+
+/// Indexes the local file at `path`. `file_format` and `index_format` default to the ones implied
+/// by the file extension, `index_path` to the file path plus the index extension; the `.gzi` of a
+/// bgzipped FASTA is written next to its `.fai`.
+pub fn build(
+    path: &str,
+    file_format: Option<&str>,
+    index_format: Option<&str>,
+    index_path: Option<&str>,
+    threads: usize,
+) -> io::Result<Vec<BuiltIndex>> {
+    let path = path.strip_prefix("file://").unwrap_or(path);
+    if path.contains("://") {
+        return Err(io::Error::new(
+            io::ErrorKind::Unsupported,
+            "indexes can only be built for local files",
+        ));
+    }
+
+    let source = match file_format {
+        Some(file_format) => SourceFormat::from_name(file_format),
+        None => SourceFormat::from_path(path),
+    }
+    .ok_or_else(|| {
+        io::Error::new(
+            io::ErrorKind::Unsupported,
+            format!("can not infer the file format of {}", path),
+        )
+    })?;
+
+    let index_format = index_format
+        .unwrap_or_else(|| source.default_index())
+        .to_ascii_lowercase();
+
+    let file =
+        fs::File::open(path).map_err(|e| io::Error::new(e.kind(), format!("{}: {}", path, e)))?;
+    let data = unsafe { Mmap::map(&file) }?;
+    let is_bgzf = data.starts_with(&[0x1f, 0x8b]);
+
+    let not_bgzf = || {
+        invalid_data(format!(
+            "{} is not BGZF-compressed, recompress it with bgzip to index it",
+            path
+        ))
+    };
+
+    if is_bgzf && !matches!(bgzf::block_size(&data), Ok(Some(_))) {
+        return Err(not_bgzf());
+    }
+
+    let index_path = index_path
+        .map(|index_path| index_path.to_string())
+        .unwrap_or_else(|| format!("{}.{}", path, index_format));
+
+    if source == SourceFormat::Fasta {
+        if index_format != "fai" {
+            return Err(invalid_data("FASTA files take a FAI index"));
+        }
+
+        let records = if is_bgzf {
+            let mut reader = file_reader(&data, threads)?;
+            build_fai(|line| reader.read_line(line))?
+        } else {
+            let mut lines = data.split_inclusive(|b| *b == b'\n');
+            build_fai(|line| {
+                line.clear();
+                match lines.next() {
+                    Some(next) => {
+                        line.extend_from_slice(next);
+                        Ok(true)
+                    }
+                    None => Ok(false),
+                }
+            })?
+        };
+
+        write_file(&index_path, &fai_bytes(&records))?;
+
+        let mut built = vec![BuiltIndex {
+            path: index_path.clone(),
+            records: records.len() as u64,
+        }];
+
+        if is_bgzf {
+            let gzi_path = match index_path.strip_suffix(".fai") {
+                Some(stem) => format!("{}.gzi", stem),
+                None => format!("{}.gzi", index_path),
+            };
+
+            let entries = build_gzi(&data)?;
+            write_file(&gzi_path, &gzi_bytes(&entries))?;
+
+            built.push(BuiltIndex {
+                path: gzi_path,
+                records: entries.len() as u64 + 1,
+            });
+        }
+
+        return Ok(built);
+    }
+
+    let format = match index_format.as_str() {
+        "bai" => IndexFormat::Bai,
+        "tbi" => IndexFormat::Tbi,
+        "csi" => IndexFormat::Csi,
+        _ => {
+            return Err(invalid_data(format!(
+                "unknown index format {}, expected bai, tbi, csi or fai",
+                index_format
+            )))
+        }
+    };
+
+    if !is_bgzf {
+        return Err(not_bgzf());
+    }
+
+    let mut reader = file_reader(&data, threads)?;
+    let (index, records) = match source {
+        SourceFormat::Bam => scan_bam(&mut reader, format)?,
+        SourceFormat::Bcf => scan_bcf(&mut reader, format)?,
+        _ => scan_tabix(&mut reader, format, source.tabix_header().unwrap())?,
+    };
+
+    write_file(&index_path, &index.to_bytes()?)?;
+
+    Ok(vec![BuiltIndex {
+        path: index_path,
+        records,
+    }])
+}
+
+#[repr(C)]
+pub struct IndexFile {
+    path: *const c_char,
+    records: u64,
+}
+
+#[repr(C)]
+pub struct BuildIndexResult {
+    files: *const IndexFile,
+    count: usize,
+    error: *const c_char,
+}
+
+impl BuildIndexResult {
+    pub(crate) fn error(error: String) -> Self {
+        Self {
+            files: null(),
+            count: 0,
+            error: CString::new(error).unwrap().into_raw(),
+        }
+    }
+
+    pub(crate) fn built(built: Vec<BuiltIndex>) -> Self {
+        let files = built
+            .into_iter()
+            .map(|built| IndexFile {
+                path: CString::new(built.path).unwrap().into_raw(),
+                records: built.records,
+            })
+            .collect::<Vec<_>>()
+            .into_boxed_slice();
+
+        let count = files.len();
+
+        Self {
+            files: Box::into_raw(files) as *const IndexFile,
+            count,
+            error: null(),
+        }
+    }
+}
+
+pub(crate) unsafe fn optional_str<'a>(value: *const c_char) -> Result<Option<&'a str>, String> {
+    if value.is_null() {
+        return Ok(None);
+    }
+
+    match CStr::from_ptr(value).to_str() {
+        Ok("") => Ok(None),
+        Ok(value) => Ok(Some(value)),
+        Err(e) => Err(format!("could not parse argument: {}", e)),
+    }
+}
+
+/// Builds the index of the local file at `path`, see `build`. Empty or null `file_format`,
+/// `index_format` and `index_path` take their defaults.
+#[no_mangle]
+pub unsafe extern "C" fn build_index(
+    path: *const c_char,
+    file_format: *const c_char,
+    index_format: *const c_char,
+    index_path: *const c_char,
+    threads: usize,
+) -> BuildIndexResult {
+    let arguments = (
+        optional_str(path),
+        optional_str(file_format),
+        optional_str(index_format),
+        optional_str(index_path),
+    );
+
+    let (path, file_format, index_format, index_path) = match arguments {
+        (Ok(Some(path)), Ok(file_format), Ok(index_format), Ok(index_path)) => {
+            (path, file_format, index_format, index_path)
+        }
+        (Ok(None), ..) => return BuildIndexResult::error("no path given".to_string()),
+        (Err(e), ..) | (_, Err(e), ..) | (_, _, Err(e), _) | (.., Err(e)) => {
+            return BuildIndexResult::error(e)
+        }
+    };
+
+    match build(path, file_format, index_format, index_path, threads) {
+        Ok(built) => BuildIndexResult::built(built),
+        Err(e) => BuildIndexResult::error(format!("could not build index: {}", e)),
+    }
+}
+
+/// Releases the files and error of a `BuildIndexResult`.
+#[no_mangle]
+pub unsafe extern "C" fn free_build_index(result: BuildIndexResult) {
+    if !result.files.is_null() {
+        let files = Box::from_raw(slice::from_raw_parts_mut(
+            result.files as *mut IndexFile,
+            result.count,
+        ));
+
+        for file in files.iter() {
+            drop(CString::from_raw(file.path as *mut c_char));
+        }
+    }
+
+    if !result.error.is_null() {
+        drop(CString::from_raw(result.error as *mut c_char));
+    }
+}
@@ -0,0 +1,305 @@
+// Copyright 2023 WHERE TRUE Technologies.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+//! Record counts read from the pseudo-bins of BAI, CSI and tabix indexes, per reference sequence
+//! as `samtools idxstats` reports them, and for whole files so `COUNT(*)` can be answered without
+//! decoding a record.
+
+use std::{
+    collections::HashMap,
+    ffi::{c_char, CStr, CString},
+    ptr::null,
+    slice,
+};
+
+use datafusion::{
+    datasource::listing::ListingTableUrl, error::DataFusionError, prelude::SessionContext,
+};
+use exon::{new_exon_config, ExonSessionExt};
+
+use crate::{
+    binning_index::BinningIndex,
+    block_cache::{find_index, read_header_references, IndexedFormat},
+    duckdb_file_system::DuckDBFileSystem,
+    partition_reader::{indexed_format, new_runtime, register_store},
+};
+
+/// The name `samtools idxstats` gives the row of unplaced, unmapped reads.
+pub const UNPLACED_NAME: &str = "*";
+
+#[derive(Clone, Debug, PartialEq, Eq)]
+pub struct ReferenceStats {
+    pub name: String,
+    pub length: Option<u64>,
+    /// `None` when the index holds records for the reference but no pseudo-bin.
+    pub mapped: Option<u64>,
+    pub unmapped: Option<u64>,
+}
+
+/// One row per reference sequence, in index order, then for BAM files a row of unplaced reads.
+/// `references` are the names and lengths from the file header; tabix-style indexes name their
+/// own references and only take the lengths from it.
+pub fn reference_stats(
+    index: &BinningIndex,
+    references: &[(String, Option<u64>)],
+    format: IndexedFormat,
+) -> Vec<ReferenceStats> {
+    let lengths = references.iter().cloned().collect::<HashMap<_, _>>();
+
+    let names = match index.reference_names() {
+        Some(names) => names.to_vec(),
+        None => references.iter().map(|(name, _)| name.clone()).collect(),
+    };
+
+    let mut stats = names
+        .into_iter()
+        .enumerate()
+        .map(|(reference_id, name)| {
+            let (mapped, unmapped) = match index.references.get(reference_id) {
+                Some(reference) if !reference.bins.is_empty() => match reference.metadata {
+                    Some(metadata) => (Some(metadata.mapped), Some(metadata.unmapped)),
+                    None => (None, None),
+                },
+                _ => (Some(0), Some(0)),
+            };
+
+            ReferenceStats {
+                length: lengths.get(&name).copied().flatten(),
+                name,
+                mapped,
+                unmapped,
+            }
+        })
+        .collect::<Vec<_>>();
+
+    if let IndexedFormat::Bam = format {
+        stats.push(ReferenceStats {
+            name: UNPLACED_NAME.to_string(),
+            length: None,
+            mapped: Some(0),
+            unmapped: index.unplaced_unmapped,
+        });
+    }
+
+    stats
+}
+
+/// The number of records in the file described by `index`, or `None` if the index doesn't
+/// record it: a reference with records but no pseudo-bin, or a BAM index without the count of
+/// unplaced reads.
+pub fn record_count(index: &BinningIndex, format: IndexedFormat) -> Option<u64> {
+    let mut count = 0;
+
+    for reference in index.references.iter().filter(|reference| !reference.bins.is_empty()) {
+        let metadata = reference.metadata?;
+        count += metadata.mapped + metadata.unmapped;
+    }
+
+    match (format, index.unplaced_unmapped) {
+        (_, Some(unplaced)) => Some(count + unplaced),
+        (IndexedFormat::Bam, None) => None,
+        (_, None) => Some(count),
+    }
+}
+
+async fn read_stats(
+    ctx: &SessionContext,
+    uri: &str,
+    format: IndexedFormat,
+) -> Result<Vec<ReferenceStats>, DataFusionError> {
+    let table_url = ListingTableUrl::parse(uri)?;
+    let store = ctx.runtime_env().object_store(table_url.object_store())?;
+    let location = table_url.prefix();
+
+    let (_, index) = find_index(store.as_ref(), location, format).await?;
+
+    // Tabix-style indexes carry the names, the header is only needed for the lengths.
+    let references = match read_header_references(store.as_ref(), location, format).await {
+        Ok(references) => references,
+        Err(_) if index.reference_names().is_some() => vec![],
+        Err(e) => return Err(e.into()),
+    };
+
+    Ok(reference_stats(&index, &references, format))
+}
+
+async fn read_record_count(
+    ctx: &SessionContext,
+    uri: &str,
+    format: IndexedFormat,
+) -> Result<Option<u64>, DataFusionError> {
+    let table_url = ListingTableUrl::parse(uri)?;
+    let store = ctx.runtime_env().object_store(table_url.object_store())?;
+    let location = table_url.prefix();
+
+    let meta = store.head(location).await?;
+    let (index_meta, index) = find_index(store.as_ref(), location, format).await?;
+
+    // An index older than its file may not count the records appended since.
+    if index_meta.last_modified < meta.last_modified {
+        return Ok(None);
+    }
+
+    Ok(record_count(&index, format))
+}
+
+fn to_ffi_count(value: Option<u64>) -> i64 {
+    value.map(|value| value as i64).unwrap_or(-1)
+}
+
+#[repr(C)]
+pub struct IndexReferenceStats {
+    name: *const c_char,
+    /// -1 when unknown, as are `mapped` and `unmapped`.
+    length: i64,
+    mapped: i64,
+    unmapped: i64,
+}
+
+#[repr(C)]
+pub struct IndexStatsResult {
+    references: *const IndexReferenceStats,
+    count: usize,
+    error: *const c_char,
+}
+
+impl IndexStatsResult {
+    fn error(error: String) -> Self {
+        Self {
+            references: null(),
+            count: 0,
+            error: CString::new(error).unwrap().into_raw(),
+        }
+    }
+}
+
+/// Reads the per-reference record counts of the BAM, VCF or BCF file at `uri` from its index.
+#[no_mangle]
+pub unsafe extern "C" fn index_stats(
+    uri: *const c_char,
+    file_format: *const c_char,
+    file_system: *const DuckDBFileSystem,
+) -> IndexStatsResult {
+    let uri = match CStr::from_ptr(uri).to_str() {
+        Ok(uri) => uri,
+        Err(e) => return IndexStatsResult::error(format!("could not parse uri: {}", e)),
+    };
+
+    let file_type = CStr::from_ptr(file_format).to_str().unwrap();
+    let format = match indexed_format(file_type) {
+        Some(format) => format,
+        None => {
+            return IndexStatsResult::error(format!("no index for file_format {}", file_type))
+        }
+    };
+
+    let rt = new_runtime();
+    let ctx = SessionContext::with_config_exon(new_exon_config());
+
+    rt.block_on(async {
+        if let Err(e) = register_store(&ctx, uri, file_system).await {
+            return IndexStatsResult::error(e);
+        }
+
+        let stats = match read_stats(&ctx, uri, format).await {
+            Ok(stats) => stats,
+            Err(e) => return IndexStatsResult::error(format!("could not read index: {}", e)),
+        };
+
+        let references = stats
+            .into_iter()
+            .map(|stats| IndexReferenceStats {
+                name: CString::new(stats.name).unwrap().into_raw(),
+                length: to_ffi_count(stats.length),
+                mapped: to_ffi_count(stats.mapped),
+                unmapped: to_ffi_count(stats.unmapped),
+            })
+            .collect::<Vec<_>>()
+            .into_boxed_slice();
+
+        let count = references.len();
+
+        IndexStatsResult {
+            references: Box::into_raw(references) as *const IndexReferenceStats,
+            count,
+            error: null(),
+        }
+    })
+}
+
+/// Releases the references and error of an `IndexStatsResult`.
+#[no_mangle]
+pub unsafe extern "C" fn free_index_stats(result: IndexStatsResult) {
+    if !result.references.is_null() {
+        let references = Box::from_raw(slice::from_raw_parts_mut(
+            result.references as *mut IndexReferenceStats,
+            result.count,
+        ));
+
+        for reference in references.iter() {
+            drop(CString::from_raw(reference.name as *mut c_char));
+        }
+    }
+
+    if !result.error.is_null() {
+        drop(CString::from_raw(result.error as *mut c_char));
+    }
+}
+
+#[repr(C)]
+pub struct IndexRecordCountResult {
+    count: u64,
+    known: bool,
+}
+
+impl IndexRecordCountResult {
+    fn unknown() -> Self {
+        Self {
+            count: 0,
+            known: false,
+        }
+    }
+}
+
+/// The number of records in the BAM, VCF or BCF file at `uri` according to its index. `known` is
+/// false, rather than an error being raised, whenever the index can't answer: no index, an index
+/// older than the file, or one without pseudo-bins.
+#[no_mangle]
+pub unsafe extern "C" fn index_record_count(
+    uri: *const c_char,
+    file_format: *const c_char,
+    file_system: *const DuckDBFileSystem,
+) -> IndexRecordCountResult {
+    let (uri, format) = match (
+        CStr::from_ptr(uri).to_str(),
+        CStr::from_ptr(file_format).to_str().ok().and_then(indexed_format),
+    ) {
+        (Ok(uri), Some(format)) => (uri, format),
+        _ => return IndexRecordCountResult::unknown(),
+    };
+
+    let rt = new_runtime();
+    let ctx = SessionContext::with_config_exon(new_exon_config());
+
+    rt.block_on(async {
+        if register_store(&ctx, uri, file_system).await.is_err() {
+            return IndexRecordCountResult::unknown();
+        }
+
+        match read_record_count(&ctx, uri, format).await {
+            Ok(Some(count)) => IndexRecordCountResult { count, known: true },
+            _ => IndexRecordCountResult::unknown(),
+        }
+    })
+}
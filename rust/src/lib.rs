@@ -14,7 +14,32 @@
 
 pub mod arrow_reader;
 pub mod bam_query_reader;
+pub mod bam_scan;
 pub mod bcf_query_reader;
+pub mod copy_writer;
+pub mod cram_reader;
+pub mod duckdb_file_system;
+pub mod duplicates;
+pub mod fasta_window_reader;
+pub mod genotype_matrix;
+pub mod mate_pairs;
+pub mod partition_reader;
+pub mod sorted_merge;
+pub mod subset_reader;
 pub mod vcf_query_reader;
 
+pub mod bam_reader;
+pub mod bam_writer;
+pub mod bgzf;
+pub mod binning_index;
+pub mod block_cache;
+pub mod disk_cache;
+pub mod fasta_index;
+pub mod index_builder;
+pub mod index_stats;
+pub mod name_index;
+pub mod offset_reader;
+pub mod region;
+pub mod region_query;
+
 pub mod sam_functions;
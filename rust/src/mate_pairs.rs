@@ -0,0 +1,519 @@
+// Copyright 2023 WHERE TRUE Technologies.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+//! Joins the mates of read pairs in a local coordinate-sorted BAM file in one pass. A read whose
+//! mate lies further on, by its `RNEXT` and `PNEXT` fields, waits in a buffer until the mate is
+//! read and the pair is returned; a read whose mate lies behind it completes a waiting one. Reads
+//! are dropped from the buffer once the scan passes their mate's position without finding it, so
+//! the buffer only holds the reads of pairs spanning the current position, not the whole file.
+//!
+//! Only primary alignments of pairs with both mates mapped are joined. Each pair is returned once,
+//! as its leftmost mate followed by the other, when the other is read.
+
+use std::{
+    cmp::Reverse,
+    collections::{BinaryHeap, HashMap},
+    ffi::{c_char, CStr, CString},
+    io,
+    sync::Arc,
+};
+
+use arrow::{
+    array::{ArrayRef, Int32Builder, StringBuilder},
+    datatypes::{DataType, Field, Schema, SchemaRef},
+    ffi_stream::FFI_ArrowArrayStream as ArrowArrayStream,
+    record_batch::RecordBatch,
+};
+use datafusion::{
+    datasource::streaming::StreamingTable,
+    execution::TaskContext,
+    physical_plan::{streaming::PartitionStream, SendableRecordBatchStream},
+    prelude::SessionContext,
+};
+use exon::{ffi::create_dataset_stream_from_table_provider, new_exon_config};
+use tokio::runtime::Runtime;
+
+use crate::{
+    bam_reader::{
+        read_bam_header, read_bam_record_prefix, record_interval, RecordExtent, ReferenceColumn,
+    },
+    bam_scan::read_local_index,
+    bgzf::{BgzfRead, BlockCursor},
+    index_builder::{file_reader, le_i32, le_u16},
+    partition_reader::blocking_stream,
+    region::Region,
+    subset_reader::{invalid_data, map_file},
+};
+
+const PAIRED: u16 = 0x1;
+const UNMAPPED: u16 = 0x4;
+const MATE_UNMAPPED: u16 = 0x8;
+const SECONDARY: u16 = 0x100;
+const SUPPLEMENTARY: u16 = 0x800;
+
+/// The columns of `bam_mate_pairs`: the leftmost mate, the other mate and the template length
+/// recorded on the leftmost one. Positions are one-based and inclusive, as in
+/// `read_bam_file_records`.
+pub fn mate_pairs_schema() -> SchemaRef {
+    let reference_type = DataType::Dictionary(Box::new(DataType::Int32), Box::new(DataType::Utf8));
+
+    Arc::new(Schema::new(vec![
+        Field::new("name", DataType::Utf8, false),
+        Field::new("reference", reference_type.clone(), false),
+        Field::new("start", DataType::Int32, false),
+        Field::new("end", DataType::Int32, false),
+        Field::new("flag", DataType::Int32, false),
+        Field::new("mapping_quality", DataType::Int32, true),
+        Field::new("mate_reference", reference_type, false),
+        Field::new("mate_start", DataType::Int32, false),
+        Field::new("mate_end", DataType::Int32, false),
+        Field::new("mate_flag", DataType::Int32, false),
+        Field::new("mate_mapping_quality", DataType::Int32, true),
+        Field::new("template_length", DataType::Int32, false),
+    ]))
+}
+
+/// The scan order of a position: its reference sequence, unplaced last, then zero-based start.
+fn sort_key(reference_id: i32, position: i32) -> (u32, i32) {
+    (reference_id as u32, position)
+}
+
+/// The fields of one mate kept until its pair is complete.
+struct Mate {
+    reference_id: i32,
+    start: i32,
+    end: i32,
+    flag: u16,
+    mapping_quality: u8,
+    template_length: i32,
+}
+
+impl Mate {
+    fn from_record(record: &[u8]) -> io::Result<Self> {
+        let (reference_id, start, end) = record_interval(record)?;
+
+        Ok(Self {
+            reference_id,
+            start,
+            end,
+            flag: le_u16(&record[14..]),
+            mapping_quality: record[9],
+            template_length: le_i32(&record[28..]),
+        })
+    }
+}
+
+/// Accumulates joined pairs into record batches of `mate_pairs_schema`.
+struct PairBatchBuilder {
+    schema: SchemaRef,
+    references: Arc<Vec<String>>,
+    names: StringBuilder,
+    reference_names: ReferenceColumn,
+    starts: Int32Builder,
+    ends: Int32Builder,
+    flags: Int32Builder,
+    mapping_qualities: Int32Builder,
+    mate_references: ReferenceColumn,
+    mate_starts: Int32Builder,
+    mate_ends: Int32Builder,
+    mate_flags: Int32Builder,
+    mate_mapping_qualities: Int32Builder,
+    template_lengths: Int32Builder,
+    rows: usize,
+}
+
+impl PairBatchBuilder {
+    fn new(schema: SchemaRef, references: Arc<Vec<String>>) -> Self {
+        let reference_names = ReferenceColumn::new(schema.field(1), &references);
+        let mate_references = ReferenceColumn::new(schema.field(6), &references);
+
+        Self {
+            schema,
+            references,
+            names: StringBuilder::new(),
+            reference_names,
+            starts: Int32Builder::new(),
+            ends: Int32Builder::new(),
+            flags: Int32Builder::new(),
+            mapping_qualities: Int32Builder::new(),
+            mate_references,
+            mate_starts: Int32Builder::new(),
+            mate_ends: Int32Builder::new(),
+            mate_flags: Int32Builder::new(),
+            mate_mapping_qualities: Int32Builder::new(),
+            template_lengths: Int32Builder::new(),
+            rows: 0,
+        }
+    }
+
+    fn append(&mut self, name: &[u8], first: &Mate, second: &Mate) -> io::Result<()> {
+        // A mapping quality of 255 means none is available.
+        let mapping_quality = |mate: &Mate| match mate.mapping_quality {
+            255 => None,
+            quality => Some(quality as i32),
+        };
+
+        self.names.append_value(String::from_utf8_lossy(name));
+        self.reference_names
+            .append(&self.references, first.reference_id)?;
+        self.starts.append_value(first.start + 1);
+        self.ends.append_value(first.end);
+        self.flags.append_value(first.flag as i32);
+        self.mapping_qualities.append_option(mapping_quality(first));
+        self.mate_references
+            .append(&self.references, second.reference_id)?;
+        self.mate_starts.append_value(second.start + 1);
+        self.mate_ends.append_value(second.end);
+        self.mate_flags.append_value(second.flag as i32);
+        self.mate_mapping_qualities
+            .append_option(mapping_quality(second));
+        self.template_lengths.append_value(first.template_length);
+
+        self.rows += 1;
+
+        Ok(())
+    }
+
+    fn finish(&mut self) -> io::Result<RecordBatch> {
+        let columns: Vec<ArrayRef> = vec![
+            Arc::new(self.names.finish()),
+            self.reference_names.finish()?,
+            Arc::new(self.starts.finish()),
+            Arc::new(self.ends.finish()),
+            Arc::new(self.flags.finish()),
+            Arc::new(self.mapping_qualities.finish()),
+            self.mate_references.finish()?,
+            Arc::new(self.mate_starts.finish()),
+            Arc::new(self.mate_ends.finish()),
+            Arc::new(self.mate_flags.finish()),
+            Arc::new(self.mate_mapping_qualities.finish()),
+            Arc::new(self.template_lengths.finish()),
+        ];
+
+        self.rows = 0;
+
+        RecordBatch::try_new(self.schema.clone(), columns).map_err(invalid_data)
+    }
+}
+
+/// The reads waiting for their mates, by name with the position of the mate, and the order in
+/// which to give up on them.
+#[derive(Default)]
+struct PendingMates {
+    mates: HashMap<Vec<u8>, (Mate, (u32, i32))>,
+    expiry: BinaryHeap<Reverse<((u32, i32), Vec<u8>)>>,
+}
+
+impl PendingMates {
+    fn insert(&mut self, name: &[u8], mate: Mate, mate_key: (u32, i32)) {
+        self.expiry.push(Reverse((mate_key, name.to_vec())));
+        self.mates.insert(name.to_vec(), (mate, mate_key));
+    }
+
+    fn remove(&mut self, name: &[u8]) -> Option<Mate> {
+        self.mates.remove(name).map(|(mate, _)| mate)
+    }
+
+    /// Drops the reads whose mates would have been read before `key`.
+    fn expire(&mut self, key: (u32, i32)) {
+        while let Some(Reverse((mate_key, _))) = self.expiry.peek() {
+            if *mate_key >= key {
+                break;
+            }
+
+            if let Some(Reverse((_, name))) = self.expiry.pop() {
+                self.mates.remove(&name);
+            }
+        }
+    }
+
+    /// Drops the reads whose mates are on another reference sequence than `reference_id`.
+    fn retain_reference(&mut self, reference_id: i32) {
+        self.mates
+            .retain(|_, (_, mate_key)| mate_key.0 == reference_id as u32);
+    }
+}
+
+/// The pairs of one BAM file, read whole or starting in one region.
+struct MatePairScan {
+    path: String,
+    region: Option<Region>,
+    batch_size: usize,
+    threads: usize,
+}
+
+impl MatePairScan {
+    /// Joins the pairs, handing each batch to `emit` until it returns false.
+    fn run<F>(&self, schema: SchemaRef, mut emit: F) -> io::Result<()>
+    where
+        F: FnMut(RecordBatch) -> bool,
+    {
+        let data = map_file(&self.path)?;
+
+        match &self.region {
+            Some(region) => {
+                let mut cursor = BlockCursor::new(&data);
+                let references = Arc::new(read_bam_header(&mut cursor)?);
+
+                let reference_id = references
+                    .iter()
+                    .position(|name| *name == region.name)
+                    .ok_or_else(|| {
+                        invalid_data(format!(
+                            "reference sequence {} is not in the BAM header",
+                            region.name
+                        ))
+                    })?;
+
+                let index = read_local_index(&self.path)?;
+                let (start, end) = region.zero_based(i32::MAX as u64);
+
+                // Records are sorted, so the pairs starting in the region are read from its first
+                // chunk on, past its end for as long as mates are still missing.
+                match index.query(reference_id, start, end).first() {
+                    Some(chunk) => cursor.seek(chunk.start)?,
+                    None => return Ok(()),
+                }
+
+                let bounds = (
+                    sort_key(reference_id as i32, start as i32),
+                    sort_key(reference_id as i32, end as i32),
+                );
+                self.join(&mut cursor, references, Some(bounds), schema, &mut emit)
+            }
+            None => {
+                let mut reader = file_reader(&data, self.threads)?;
+                let references = Arc::new(read_bam_header(&mut reader)?);
+
+                self.join(&mut reader, references, None, schema, &mut emit)
+            }
+        }
+    }
+
+    /// Joins the pairs of the records read from `reader`. With `bounds`, only pairs whose leftmost
+    /// mate starts within them are returned, and reading stops past them once no mate is missing.
+    fn join<R, F>(
+        &self,
+        reader: &mut R,
+        references: Arc<Vec<String>>,
+        bounds: Option<((u32, i32), (u32, i32))>,
+        schema: SchemaRef,
+        emit: &mut F,
+    ) -> io::Result<()>
+    where
+        R: BgzfRead + ?Sized,
+        F: FnMut(RecordBatch) -> bool,
+    {
+        let mut builder = PairBatchBuilder::new(schema, references);
+        let mut pending = PendingMates::default();
+        let mut record = vec![];
+        let mut previous_key = (0, i32::MIN);
+
+        while read_bam_record_prefix(reader, &mut record, RecordExtent::Cigar)? {
+            let reference_id = le_i32(&record);
+            let key = sort_key(reference_id, le_i32(&record[4..]));
+
+            if key < previous_key {
+                return Err(invalid_data(format!(
+                    "{} is not sorted by coordinate",
+                    self.path
+                )));
+            }
+            previous_key = key;
+
+            pending.expire(key);
+
+            let past_bounds = match bounds {
+                Some((start, _)) if key < start => continue,
+                Some((_, end)) if key >= end => {
+                    // Mates on other reference sequences would be far off, they aren't waited for.
+                    pending.retain_reference(reference_id);
+                    if pending.mates.is_empty() {
+                        break;
+                    }
+                    true
+                }
+                _ => false,
+            };
+
+            let flag = le_u16(&record[14..]);
+            if flag & PAIRED == 0
+                || flag & (UNMAPPED | MATE_UNMAPPED | SECONDARY | SUPPLEMENTARY) != 0
+            {
+                continue;
+            }
+
+            let name_end = 32 + (record[8] as usize).saturating_sub(1);
+            let name = &record[32..name_end];
+            let mate_key = sort_key(le_i32(&record[20..]), le_i32(&record[24..]));
+
+            if mate_key < key || (mate_key == key && pending.mates.contains_key(name)) {
+                if let Some(first) = pending.remove(name) {
+                    builder.append(name, &first, &Mate::from_record(&record)?)?;
+
+                    if builder.rows >= self.batch_size && !emit(builder.finish()?) {
+                        return Ok(());
+                    }
+                }
+            } else if !past_bounds {
+                pending.insert(name, Mate::from_record(&record)?, mate_key);
+            }
+        }
+
+        if builder.rows > 0 {
+            emit(builder.finish()?);
+        }
+
+        Ok(())
+    }
+}
+
+struct MatePairPartition {
+    schema: SchemaRef,
+    scan: Arc<MatePairScan>,
+}
+
+impl PartitionStream for MatePairPartition {
+    fn schema(&self) -> &SchemaRef {
+        &self.schema
+    }
+
+    fn execute(&self, _ctx: Arc<TaskContext>) -> SendableRecordBatchStream {
+        let scan = self.scan.clone();
+        let schema = self.schema.clone();
+
+        blocking_stream(self.schema.clone(), move |emit| scan.run(schema, emit))
+    }
+}
+
+#[repr(C)]
+pub struct MatePairReaderResult {
+    error: *const c_char,
+}
+
+impl MatePairReaderResult {
+    fn error(error: String) -> Self {
+        Self {
+            error: CString::new(error).unwrap().into_raw(),
+        }
+    }
+}
+
+/// Reads the read pairs of the local coordinate-sorted BAM file at `uri` with the columns of
+/// `mate_pairs_schema`. If `region` is not null, a samtools-style region read with the file's
+/// index, only pairs whose leftmost mate starts in it and whose other mate is on the same
+/// reference sequence are read. `filters` is a SQL predicate applied to the pairs. Whole files are
+/// inflated by `threads` threads.
+#[no_mangle]
+pub unsafe extern "C" fn new_mate_pair_reader(
+    stream_ptr: *mut ArrowArrayStream,
+    uri: *const c_char,
+    region: *const c_char,
+    batch_size: usize,
+    threads: usize,
+    filters: *const c_char,
+) -> MatePairReaderResult {
+    let uri = match CStr::from_ptr(uri).to_str() {
+        Ok(uri) => uri,
+        Err(e) => return MatePairReaderResult::error(format!("could not parse uri: {}", e)),
+    };
+
+    let region = if region.is_null() {
+        None
+    } else {
+        match CStr::from_ptr(region).to_str() {
+            Ok(region) => Some(region),
+            Err(_) => return MatePairReaderResult::error("could not parse region".to_string()),
+        }
+    };
+
+    let filters = if filters.is_null() {
+        ""
+    } else {
+        match CStr::from_ptr(filters).to_str() {
+            Ok(filters) => filters,
+            Err(e) => {
+                return MatePairReaderResult::error(format!("could not parse filters: {}", e))
+            }
+        }
+    };
+
+    // The file is read when the stream is, only its header and index are checked here.
+    let references = match map_file(uri)
+        .and_then(|data| read_bam_header(&mut BlockCursor::new(&data)))
+    {
+        Ok(references) => references,
+        Err(e) => return MatePairReaderResult::error(format!("could not read BAM header: {}", e)),
+    };
+
+    let is_reference = |name: &str| references.iter().any(|reference| reference == name);
+    let region = match region.map(|region| Region::parse_with(region, is_reference)) {
+        None => None,
+        Some(Ok(region)) => Some(region),
+        Some(Err(_)) => return MatePairReaderResult::error("could not parse region".to_string()),
+    };
+
+    if region.is_some() {
+        if let Err(e) = read_local_index(uri) {
+            return MatePairReaderResult::error(format!("could not read index: {}", e));
+        }
+    }
+
+    let schema = mate_pairs_schema();
+
+    let rt = Arc::new(Runtime::new().unwrap());
+
+    let config = new_exon_config().with_batch_size(batch_size);
+    let ctx = SessionContext::with_config_exon(config);
+
+    rt.block_on(async {
+        let partition = Arc::new(MatePairPartition {
+            schema: schema.clone(),
+            scan: Arc::new(MatePairScan {
+                path: uri.to_string(),
+                region,
+                batch_size,
+                threads,
+            }),
+        }) as Arc<dyn PartitionStream>;
+
+        let table = match StreamingTable::try_new(schema, vec![partition]) {
+            Ok(table) => table,
+            Err(e) => return MatePairReaderResult::error(format!("could not create table: {}", e)),
+        };
+
+        if let Err(e) = ctx.register_table("exon_table", Arc::new(table)) {
+            return MatePairReaderResult::error(format!("could not register table: {}", e));
+        }
+
+        let mut select_string = format!("SELECT * FROM exon_table");
+        if filters != "" {
+            select_string.push_str(format!(" WHERE {}", filters).as_str());
+        }
+
+        let df = match ctx.sql(&select_string).await {
+            Ok(df) => df,
+            Err(e) => return MatePairReaderResult::error(format!("could not execute sql: {}", e)),
+        };
+
+        match create_dataset_stream_from_table_provider(df, rt.clone(), stream_ptr).await {
+            Ok(_) => MatePairReaderResult {
+                error: std::ptr::null(),
+            },
+            Err(e) => {
+                MatePairReaderResult::error(format!("could not create dataset stream: {}", e))
+            }
+        }
+    })
+}
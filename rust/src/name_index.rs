@@ -0,0 +1,292 @@
+// Copyright 2023 WHERE TRUE Technologies.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+//! A read name index for BAM files, which BAI and CSI indexes can't answer. The `.nai` file next
+//! to the BAM lists a hash of every record's name with the record's virtual offset, sorted by
+//! hash, behind a Bloom filter of the hashes so most names that aren't in the file are turned
+//! away without searching the list.
+//!
+//! Hashes may collide, so the offsets found for a name are candidates and the records read from
+//! them must still be filtered on the name. The index records the length of the BAM it was built
+//! from and isn't used once the file has changed.
+//!
+//! The file is little-endian:
+//!
+//! ```text
+//! magic         b"NAI\x01"
+//! bam_length    u64
+//! hash_count    u32       Bloom filter probes per name
+//! word_count    u64       64-bit words of the Bloom filter
+//! entry_count   u64
+//! words         [u64; word_count]
+//! entries       [(hash u64, virtual offset u64); entry_count]
+//! ```
+
+use std::{ffi::c_char, fs::File, io};
+
+use memmap2::Mmap;
+
+use crate::{
+    bam_reader::{read_bam_header, read_bam_record_prefix, RecordExtent},
+    bgzf::BgzfRead,
+    index_builder::{file_reader, optional_str, write_file, BuildIndexResult, BuiltIndex},
+};
+
+const MAGIC: &[u8; 4] = b"NAI\x01";
+
+const HEADER_SIZE: usize = 32;
+
+const ENTRY_SIZE: usize = 16;
+
+/// Bloom filter bits per record, which with `HASH_COUNT` probes lets about 1% of absent names
+/// through.
+const BITS_PER_RECORD: usize = 10;
+
+const HASH_COUNT: u32 = 7;
+
+fn invalid_data<E: Into<Box<dyn std::error::Error + Send + Sync>>>(e: E) -> io::Error {
+    io::Error::new(io::ErrorKind::InvalidData, e)
+}
+
+fn le_u64(data: &[u8]) -> u64 {
+    u64::from_le_bytes(data[..8].try_into().unwrap())
+}
+
+/// The path of the name index of the BAM file at `path`.
+pub fn name_index_path(path: &str) -> String {
+    format!("{}.nai", path)
+}
+
+/// The 64-bit FNV-1a hash of `name`, finished with the SplitMix64 mixer so the Bloom filter
+/// probes derived from it are spread evenly.
+pub fn name_hash(name: &[u8]) -> u64 {
+    let mut hash = 0xcbf2_9ce4_8422_2325_u64;
+    for byte in name {
+        hash = (hash ^ *byte as u64).wrapping_mul(0x0100_0000_01b3);
+    }
+
+    hash = (hash ^ (hash >> 30)).wrapping_mul(0xbf58_476d_1ce4_e5b9);
+    hash = (hash ^ (hash >> 27)).wrapping_mul(0x94d0_49bb_1331_11eb);
+    hash ^ (hash >> 31)
+}
+
+/// The Bloom filter bits probed for `hash`, by double hashing its halves.
+fn bloom_bits(hash: u64, hash_count: u32, bit_count: u64) -> impl Iterator<Item = u64> {
+    let h1 = hash & 0xffff_ffff;
+    let h2 = (hash >> 32) | 1;
+
+    (0..hash_count as u64).map(move |i| h1.wrapping_add(i.wrapping_mul(h2)) % bit_count)
+}
+
+/// The read name of a BAM record without its length prefix, read at least to the name.
+fn record_name(record: &[u8]) -> io::Result<&[u8]> {
+    let length = *record
+        .get(8)
+        .ok_or_else(|| invalid_data("truncated BAM record"))? as usize;
+
+    // The name is NUL-terminated, the length counts the NUL.
+    record
+        .get(32..32 + length.saturating_sub(1))
+        .ok_or_else(|| invalid_data("truncated BAM record name"))
+}
+
+/// Builds the name index of the local BAM file at `path`, writing it next to the file.
+pub fn build_name_index(path: &str, threads: usize) -> io::Result<BuiltIndex> {
+    let path = path.strip_prefix("file://").unwrap_or(path);
+    if path.contains("://") {
+        return Err(io::Error::new(
+            io::ErrorKind::Unsupported,
+            "name indexes can only be built for local files",
+        ));
+    }
+
+    let file =
+        File::open(path).map_err(|e| io::Error::new(e.kind(), format!("{}: {}", path, e)))?;
+
+    // SAFETY: the map is read only, as in the index builder.
+    let data = unsafe { Mmap::map(&file) }?;
+
+    let mut reader = file_reader(&data, threads)?;
+    read_bam_header(&mut reader)?;
+
+    let mut entries = vec![];
+    let mut record = vec![];
+
+    loop {
+        let offset = reader.virtual_offset();
+        if !read_bam_record_prefix(&mut reader, &mut record, RecordExtent::Cigar)? {
+            break;
+        }
+
+        entries.push((name_hash(record_name(&record)?), offset));
+    }
+
+    entries.sort_unstable();
+
+    let word_count = ((entries.len() * BITS_PER_RECORD + 63) / 64).max(1);
+    let bit_count = word_count as u64 * 64;
+
+    let mut words = vec![0u64; word_count];
+    for (hash, _) in &entries {
+        for bit in bloom_bits(*hash, HASH_COUNT, bit_count) {
+            words[(bit / 64) as usize] |= 1 << (bit % 64);
+        }
+    }
+
+    let mut out = Vec::with_capacity(HEADER_SIZE + word_count * 8 + entries.len() * ENTRY_SIZE);
+    out.extend_from_slice(MAGIC);
+    out.extend_from_slice(&(data.len() as u64).to_le_bytes());
+    out.extend_from_slice(&HASH_COUNT.to_le_bytes());
+    out.extend_from_slice(&(word_count as u64).to_le_bytes());
+    out.extend_from_slice(&(entries.len() as u64).to_le_bytes());
+
+    for word in &words {
+        out.extend_from_slice(&word.to_le_bytes());
+    }
+
+    for (hash, offset) in &entries {
+        out.extend_from_slice(&hash.to_le_bytes());
+        out.extend_from_slice(&offset.to_le_bytes());
+    }
+
+    let index_path = name_index_path(path);
+    write_file(&index_path, &out)?;
+
+    Ok(BuiltIndex {
+        path: index_path,
+        records: entries.len() as u64,
+    })
+}
+
+/// The name index of a BAM file, mapped rather than read.
+pub struct NameIndex {
+    data: Mmap,
+    hash_count: u32,
+    word_count: usize,
+    entry_count: usize,
+}
+
+impl NameIndex {
+    /// Opens the name index of the BAM file at `path`, which is `bam_length` bytes long. `None` if
+    /// there is no index or it was built from another version of the file.
+    pub fn open(path: &str, bam_length: u64) -> io::Result<Option<Self>> {
+        let index_path = name_index_path(path);
+
+        let file = match File::open(&index_path) {
+            Ok(file) => file,
+            Err(e) if e.kind() == io::ErrorKind::NotFound => return Ok(None),
+            Err(e) => return Err(io::Error::new(e.kind(), format!("{}: {}", index_path, e))),
+        };
+
+        // SAFETY: the map is read only, as in the index builder.
+        let data = unsafe { Mmap::map(&file) }?;
+
+        if data.len() < HEADER_SIZE || &data[..4] != MAGIC {
+            return Err(invalid_data(format!("{} is not a name index", index_path)));
+        }
+
+        if le_u64(&data[4..]) != bam_length {
+            return Ok(None);
+        }
+
+        let hash_count = u32::from_le_bytes(data[12..16].try_into().unwrap());
+        let word_count = le_u64(&data[16..]) as usize;
+        let entry_count = le_u64(&data[24..]) as usize;
+
+        let expected = word_count
+            .checked_mul(8)
+            .zip(entry_count.checked_mul(ENTRY_SIZE))
+            .and_then(|(words, entries)| words.checked_add(entries))
+            .and_then(|size| size.checked_add(HEADER_SIZE));
+
+        if word_count == 0 || expected != Some(data.len()) {
+            return Err(invalid_data(format!("{} is truncated", index_path)));
+        }
+
+        Ok(Some(Self {
+            data,
+            hash_count,
+            word_count,
+            entry_count,
+        }))
+    }
+
+    fn word(&self, i: usize) -> u64 {
+        le_u64(&self.data[HEADER_SIZE + i * 8..])
+    }
+
+    fn entry(&self, i: usize) -> (u64, u64) {
+        let start = HEADER_SIZE + self.word_count * 8 + i * ENTRY_SIZE;
+        (le_u64(&self.data[start..]), le_u64(&self.data[start + 8..]))
+    }
+
+    fn may_contain(&self, hash: u64) -> bool {
+        bloom_bits(hash, self.hash_count, self.word_count as u64 * 64)
+            .all(|bit| self.word((bit / 64) as usize) & (1 << (bit % 64)) != 0)
+    }
+
+    /// The virtual offsets of the records that may be named one of `names`, in file order.
+    pub fn offsets(&self, names: &[&str]) -> Vec<u64> {
+        let mut offsets = vec![];
+
+        for name in names {
+            let hash = name_hash(name.as_bytes());
+            if !self.may_contain(hash) {
+                continue;
+            }
+
+            // The first entry with the hash, by binary search over the sorted entries.
+            let (mut low, mut high) = (0, self.entry_count);
+            while low < high {
+                let middle = low + (high - low) / 2;
+                if self.entry(middle).0 < hash {
+                    low = middle + 1;
+                } else {
+                    high = middle;
+                }
+            }
+
+            for i in low..self.entry_count {
+                let (entry_hash, offset) = self.entry(i);
+                if entry_hash != hash {
+                    break;
+                }
+
+                offsets.push(offset);
+            }
+        }
+
+        offsets.sort_unstable();
+        offsets.dedup();
+        offsets
+    }
+}
+
+/// Builds the name index of the local BAM file at `path`, see `build_name_index`.
+#[no_mangle]
+pub unsafe extern "C" fn build_bam_name_index(
+    path: *const c_char,
+    threads: usize,
+) -> BuildIndexResult {
+    let path = match optional_str(path) {
+        Ok(Some(path)) => path,
+        Ok(None) => return BuildIndexResult::error("no path given".to_string()),
+        Err(e) => return BuildIndexResult::error(e),
+    };
+
+    match build_name_index(path, threads) {
+        Ok(built) => BuildIndexResult::built(vec![built]),
+        Err(e) => BuildIndexResult::error(format!("could not build name index: {}", e)),
+    }
+}
@@ -0,0 +1,504 @@
+// Copyright 2023 WHERE TRUE Technologies.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+//! Scans BAM and bgzipped VCF files with the BGZF virtual offset of every record, and re-reads
+//! records by those offsets. A query can filter on the cheap columns of a first scan and then
+//! decode whole records only for the offsets that survive.
+//!
+//! VCF lines are decoded by exon's VCF reader, fed chunks of lines behind the file's header
+//! through an in-memory object store, so both passes return the columns of
+//! `read_vcf_file_records`.
+
+use std::{
+    ffi::{c_char, CStr, CString},
+    fs::File,
+    io, slice,
+    str::FromStr,
+    sync::Arc,
+};
+
+use arrow::{
+    array::{ArrayRef, Int64Array},
+    datatypes::{DataType, Field, Schema, SchemaRef},
+    ffi_stream::FFI_ArrowArrayStream as ArrowArrayStream,
+    record_batch::RecordBatch,
+};
+use bytes::Bytes;
+use datafusion::{
+    datasource::{file_format::file_type::FileCompressionType, streaming::StreamingTable},
+    error::DataFusionError,
+    execution::TaskContext,
+    physical_plan::{streaming::PartitionStream, SendableRecordBatchStream},
+    prelude::SessionContext,
+};
+use exon::{
+    datasources::{ExonFileType, ExonReadOptions},
+    ffi::create_dataset_stream_from_table_provider,
+    new_exon_config, ExonSessionExt,
+};
+use memmap2::Mmap;
+use object_store::{memory::InMemory, path::Path, ObjectStore};
+use tokio::runtime::Runtime;
+use url::Url;
+
+use crate::{
+    bam_reader::{
+        bam_schema, read_bam_header, read_bam_record, BamBatchBuilder, VIRTUAL_OFFSET_COLUMN,
+    },
+    bgzf::{self, BgzfRead, BlockCursor},
+    index_builder::{file_reader, BlockReader},
+    partition_reader::{blocking_stream, new_runtime},
+};
+
+/// VCF lines handed to exon's reader at once. Each chunk costs a session and a table
+/// registration, so chunks are much larger than a batch.
+pub(crate) const VCF_CHUNK_LINES: usize = 16384;
+
+/// Where chunks are stored for exon, completed with the file type's extension.
+const CHUNK_URL: &str = "memory:///chunk";
+
+fn invalid_data<E: Into<Box<dyn std::error::Error + Send + Sync>>>(e: E) -> io::Error {
+    io::Error::new(io::ErrorKind::InvalidData, e)
+}
+
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+enum OffsetFormat {
+    Bam,
+    Vcf,
+}
+
+impl OffsetFormat {
+    fn from_name(name: &str) -> Option<Self> {
+        match name.to_lowercase().as_str() {
+            "bam" => Some(Self::Bam),
+            "vcf" => Some(Self::Vcf),
+            _ => None,
+        }
+    }
+}
+
+fn map_file(path: &str) -> io::Result<Mmap> {
+    let file =
+        File::open(path).map_err(|e| io::Error::new(e.kind(), format!("{}: {}", path, e)))?;
+
+    // SAFETY: the map is read only, as in the index builder.
+    let data = unsafe { Mmap::map(&file) }?;
+
+    if !matches!(bgzf::block_size(&data), Ok(Some(_))) {
+        return Err(invalid_data(format!(
+            "{} is not BGZF-compressed, virtual offsets need a bgzipped file",
+            path
+        )));
+    }
+
+    Ok(data)
+}
+
+/// Reads the `#` lines at the start of a VCF file.
+pub(crate) fn read_vcf_header(reader: &mut dyn BgzfRead) -> io::Result<Vec<u8>> {
+    let mut header = vec![];
+    let mut line = vec![];
+
+    while reader.fill()? && reader.available()[0] == b'#' {
+        reader.read_line(&mut line)?;
+        header.extend_from_slice(&line);
+    }
+
+    Ok(header)
+}
+
+/// Decodes VCF `lines` under `header` with exon's VCF reader, returning the schema and batches.
+async fn decode_vcf(
+    header: &[u8],
+    lines: &[u8],
+    batch_size: usize,
+) -> Result<(SchemaRef, Vec<RecordBatch>), DataFusionError> {
+    let mut data = Vec::with_capacity(header.len() + lines.len());
+    data.extend_from_slice(header);
+    data.extend_from_slice(lines);
+
+    decode_file("vcf", data, batch_size).await
+}
+
+/// Decodes the whole `file_type` file `data`, e.g. a header and a chunk of records, with exon's
+/// reader for it, returning the schema and batches.
+pub(crate) async fn decode_file(
+    file_type: &str,
+    data: Vec<u8>,
+    batch_size: usize,
+) -> Result<(SchemaRef, Vec<RecordBatch>), DataFusionError> {
+    let chunk_url = format!("{}.{}", CHUNK_URL, file_type);
+    let url = Url::parse(&chunk_url).map_err(|e| DataFusionError::External(Box::new(e)))?;
+
+    let store = InMemory::new();
+    store
+        .put(&Path::from(url.path()), Bytes::from(data))
+        .await?;
+
+    let config = new_exon_config().with_batch_size(batch_size);
+    let ctx = SessionContext::with_config_exon(config);
+    ctx.runtime_env()
+        .register_object_store(&url, Arc::new(store));
+
+    let exon_file_type = ExonFileType::from_str(file_type).map_err(|_| {
+        DataFusionError::Execution(format!("could not parse file_format {}", file_type))
+    })?;
+    let options =
+        ExonReadOptions::new(exon_file_type).with_compression(FileCompressionType::UNCOMPRESSED);
+
+    ctx.register_exon_table("exon_table", &chunk_url, options)
+        .await
+        .map_err(|e| DataFusionError::Execution(e.to_string()))?;
+
+    let df = ctx.table("exon_table").await?;
+    let schema: Schema = df.schema().into();
+    let batches = df.collect().await?;
+
+    Ok((Arc::new(schema), batches))
+}
+
+/// `schema` with the virtual offset column appended.
+fn with_offset_field(schema: &Schema) -> SchemaRef {
+    let mut fields = schema
+        .fields()
+        .iter()
+        .map(|field| field.as_ref().clone())
+        .collect::<Vec<_>>();
+    fields.push(Field::new(VIRTUAL_OFFSET_COLUMN, DataType::Int64, false));
+
+    Arc::new(Schema::new(fields))
+}
+
+/// The records to read: every record in file order, or the records at the given virtual offsets.
+enum Records<'a> {
+    All(BlockReader<'a>),
+    At(BlockCursor<&'a [u8]>, std::vec::IntoIter<u64>),
+}
+
+impl<'a> Records<'a> {
+    fn reader(&mut self) -> &mut dyn BgzfRead {
+        match self {
+            Records::All(reader) => reader,
+            Records::At(cursor, _) => cursor,
+        }
+    }
+
+    /// Reads the next record into `buf` with `read`, returning its virtual offset, or `None`
+    /// once every record has been read.
+    fn next<F>(&mut self, buf: &mut Vec<u8>, mut read: F) -> io::Result<Option<u64>>
+    where
+        F: FnMut(&mut dyn BgzfRead, &mut Vec<u8>) -> io::Result<bool>,
+    {
+        match self {
+            Records::All(reader) => {
+                let offset = reader.virtual_offset();
+                Ok(read(reader, buf)?.then_some(offset))
+            }
+            Records::At(cursor, offsets) => {
+                let offset = match offsets.next() {
+                    Some(offset) => offset,
+                    None => return Ok(None),
+                };
+
+                cursor.seek(offset)?;
+                if !read(cursor, buf)? {
+                    return Err(invalid_data(format!(
+                        "no record at virtual offset {}",
+                        offset
+                    )));
+                }
+
+                Ok(Some(offset))
+            }
+        }
+    }
+}
+
+/// One file, read whole or at `offsets`, sorted and without duplicates.
+struct OffsetScan {
+    path: String,
+    format: OffsetFormat,
+    offsets: Option<Vec<u64>>,
+    batch_size: usize,
+    threads: usize,
+}
+
+impl OffsetScan {
+    /// Reads the file, handing each batch to `emit` until it returns false.
+    fn run<F>(&self, schema: SchemaRef, mut emit: F) -> io::Result<()>
+    where
+        F: FnMut(RecordBatch) -> bool,
+    {
+        let data = map_file(&self.path)?;
+
+        let mut records = match &self.offsets {
+            Some(offsets) => Records::At(BlockCursor::new(&data[..]), offsets.clone().into_iter()),
+            None => Records::All(file_reader(&data, self.threads)?),
+        };
+
+        match self.format {
+            OffsetFormat::Bam => self.run_bam(&mut records, schema, &mut emit),
+            OffsetFormat::Vcf => self.run_vcf(&mut records, schema, &mut emit),
+        }
+    }
+
+    fn run_bam<F>(&self, records: &mut Records, schema: SchemaRef, emit: &mut F) -> io::Result<()>
+    where
+        F: FnMut(RecordBatch) -> bool,
+    {
+        let references = Arc::new(read_bam_header(records.reader())?);
+        let mut builder = BamBatchBuilder::new(schema, references);
+        let mut record = vec![];
+
+        while let Some(offset) =
+            records.next(&mut record, |reader, buf| read_bam_record(reader, buf))?
+        {
+            builder.append(&record, offset)?;
+
+            if builder.rows() >= self.batch_size && !emit(builder.finish()?) {
+                return Ok(());
+            }
+        }
+
+        if builder.rows() > 0 {
+            emit(builder.finish()?);
+        }
+
+        Ok(())
+    }
+
+    fn run_vcf<F>(&self, records: &mut Records, schema: SchemaRef, emit: &mut F) -> io::Result<()>
+    where
+        F: FnMut(RecordBatch) -> bool,
+    {
+        let header = read_vcf_header(records.reader())?;
+        let rt = new_runtime();
+
+        let mut lines = vec![];
+        let mut offsets = vec![];
+        let mut line = vec![];
+
+        loop {
+            let offset = records.next(&mut line, |reader, buf| reader.read_line(buf))?;
+
+            if let Some(offset) = offset {
+                if line.iter().all(|b| b.is_ascii_whitespace()) {
+                    continue;
+                }
+
+                lines.extend_from_slice(&line);
+                if !line.ends_with(b"\n") {
+                    lines.push(b'\n');
+                }
+                offsets.push(offset);
+
+                if offsets.len() < VCF_CHUNK_LINES {
+                    continue;
+                }
+            }
+
+            if !offsets.is_empty() {
+                let (_, batches) = rt
+                    .block_on(decode_vcf(&header, &lines, self.batch_size))
+                    .map_err(|e| io::Error::new(io::ErrorKind::Other, e))?;
+
+                let mut start = 0;
+                for batch in batches {
+                    let rows = batch.num_rows();
+                    let batch_offsets = &offsets[start..start + rows];
+                    start += rows;
+
+                    let mut columns: Vec<ArrayRef> = batch.columns().to_vec();
+                    columns.push(Arc::new(Int64Array::from_iter_values(
+                        batch_offsets.iter().map(|offset| *offset as i64),
+                    )));
+
+                    let batch =
+                        RecordBatch::try_new(schema.clone(), columns).map_err(invalid_data)?;
+                    if !emit(batch) {
+                        return Ok(());
+                    }
+                }
+
+                lines.clear();
+                offsets.clear();
+            }
+
+            if offset.is_none() {
+                return Ok(());
+            }
+        }
+    }
+}
+
+struct OffsetPartition {
+    schema: SchemaRef,
+    scan: Arc<OffsetScan>,
+}
+
+impl PartitionStream for OffsetPartition {
+    fn schema(&self) -> &SchemaRef {
+        &self.schema
+    }
+
+    fn execute(&self, _ctx: Arc<TaskContext>) -> SendableRecordBatchStream {
+        let scan = self.scan.clone();
+        let schema = self.schema.clone();
+
+        blocking_stream(self.schema.clone(), move |emit| scan.run(schema, emit))
+    }
+}
+
+#[repr(C)]
+pub struct OffsetReaderResult {
+    error: *const c_char,
+}
+
+impl OffsetReaderResult {
+    fn error(error: String) -> Self {
+        Self {
+            error: CString::new(error).unwrap().into_raw(),
+        }
+    }
+}
+
+/// Reads the local BAM or bgzipped VCF file at `uri` with a trailing `virtual_offset` column
+/// holding the BGZF virtual offset of each record. If `offsets` is not null only the
+/// `offset_count` records starting at those virtual offsets are read, in file order. `filters` is
+/// a SQL predicate applied to the records. Whole files are inflated by `threads` threads.
+#[no_mangle]
+pub unsafe extern "C" fn new_offset_reader(
+    stream_ptr: *mut ArrowArrayStream,
+    uri: *const c_char,
+    file_format: *const c_char,
+    offsets: *const u64,
+    offset_count: usize,
+    batch_size: usize,
+    threads: usize,
+    filters: *const c_char,
+) -> OffsetReaderResult {
+    let uri = match CStr::from_ptr(uri).to_str() {
+        Ok(uri) => uri,
+        Err(e) => return OffsetReaderResult::error(format!("could not parse uri: {}", e)),
+    };
+
+    let file_format = CStr::from_ptr(file_format).to_str().unwrap_or("");
+    let format = match OffsetFormat::from_name(file_format) {
+        Some(format) => format,
+        None => {
+            return OffsetReaderResult::error(format!(
+                "virtual offsets are only supported for BAM and VCF files, not {}",
+                file_format
+            ))
+        }
+    };
+
+    let filters = if filters.is_null() {
+        ""
+    } else {
+        match CStr::from_ptr(filters).to_str() {
+            Ok(filters) => filters,
+            Err(e) => return OffsetReaderResult::error(format!("could not parse filters: {}", e)),
+        }
+    };
+
+    let offsets = if offsets.is_null() {
+        None
+    } else {
+        let mut offsets = slice::from_raw_parts(offsets, offset_count).to_vec();
+        offsets.sort_unstable();
+        offsets.dedup();
+
+        Some(offsets)
+    };
+
+    let data = match map_file(uri) {
+        Ok(data) => data,
+        Err(e) => return OffsetReaderResult::error(format!("could not read file: {}", e)),
+    };
+
+    let rt = Arc::new(Runtime::new().unwrap());
+
+    let config = new_exon_config().with_batch_size(batch_size);
+    let ctx = SessionContext::with_config_exon(config);
+
+    rt.block_on(async {
+        let schema = match format {
+            OffsetFormat::Bam => match read_bam_header(&mut BlockCursor::new(&data)) {
+                Ok(_) => bam_schema(true),
+                Err(e) => {
+                    return OffsetReaderResult::error(format!("could not read BAM header: {}", e))
+                }
+            },
+            OffsetFormat::Vcf => {
+                let header = match read_vcf_header(&mut BlockCursor::new(&data)) {
+                    Ok(header) => header,
+                    Err(e) => {
+                        return OffsetReaderResult::error(format!(
+                            "could not read VCF header: {}",
+                            e
+                        ))
+                    }
+                };
+
+                match decode_vcf(&header, &[], batch_size).await {
+                    Ok((schema, _)) => with_offset_field(&schema),
+                    Err(e) => {
+                        return OffsetReaderResult::error(format!(
+                            "could not read VCF header: {}",
+                            e
+                        ))
+                    }
+                }
+            }
+        };
+
+        let partition = Arc::new(OffsetPartition {
+            schema: schema.clone(),
+            scan: Arc::new(OffsetScan {
+                path: uri.to_string(),
+                format,
+                offsets,
+                batch_size,
+                threads,
+            }),
+        }) as Arc<dyn PartitionStream>;
+
+        let table = match StreamingTable::try_new(schema, vec![partition]) {
+            Ok(table) => table,
+            Err(e) => return OffsetReaderResult::error(format!("could not create table: {}", e)),
+        };
+
+        if let Err(e) = ctx.register_table("exon_table", Arc::new(table)) {
+            return OffsetReaderResult::error(format!("could not register table: {}", e));
+        }
+
+        let mut select_string = format!("SELECT * FROM exon_table");
+        if filters != "" {
+            select_string.push_str(format!(" WHERE {}", filters).as_str());
+        }
+
+        let df = match ctx.sql(&select_string).await {
+            Ok(df) => df,
+            Err(e) => return OffsetReaderResult::error(format!("could not execute sql: {}", e)),
+        };
+
+        match create_dataset_stream_from_table_provider(df, rt.clone(), stream_ptr).await {
+            Ok(_) => OffsetReaderResult {
+                error: std::ptr::null(),
+            },
+            Err(e) => OffsetReaderResult::error(format!("could not create dataset stream: {}", e)),
+        }
+    })
+}
@@ -0,0 +1,486 @@
+// Copyright 2023 WHERE TRUE Technologies.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+//! Splits full scans of indexed BAM, VCF and BCF files into regions planned from the index, so
+//! each region can be decoded by a different DuckDB thread rather than all records going through
+//! one BGZF and decode loop.
+//!
+//! Every record is returned by exactly one partition: a partition starting past the first base of
+//! its reference sequence drops the records starting before it, which the partition before it
+//! returned.
+
+use std::{
+    ffi::{c_char, CStr, CString},
+    io,
+    ptr::null,
+    slice,
+    sync::Arc,
+    thread,
+};
+
+use arrow::{
+    datatypes::SchemaRef, ffi_stream::FFI_ArrowArrayStream as ArrowArrayStream,
+    record_batch::RecordBatch,
+};
+use datafusion::{
+    datasource::listing::ListingTableUrl,
+    error::DataFusionError,
+    physical_plan::{stream::RecordBatchStreamAdapter, SendableRecordBatchStream},
+    prelude::{col, lit, SessionContext},
+};
+use exon::{
+    ffi::create_dataset_stream_from_table_provider, new_exon_config, ExonRuntimeEnvExt,
+    ExonSessionExt,
+};
+use futures::{channel::mpsc, executor::block_on, SinkExt};
+use object_store::path::Path;
+use tokio::runtime::{Builder, Runtime};
+
+use crate::{
+    arrow_reader::encode_dictionaries,
+    binning_index::BinningIndex,
+    block_cache::{
+        read_header_names, read_index, register_block_cache, CachingObjectStore, IndexedFormat,
+    },
+    duckdb_file_system::{register_duckdb_file_system, DuckDBFileSystem},
+    region::Region,
+};
+
+/// References are only split into partitions of at least this many compressed bytes, smaller
+/// ones cost more in per-partition setup than they gain.
+pub const MIN_PARTITION_BYTES: u64 = 8 * 1024 * 1024;
+
+/// Width of a linear index window.
+const LINEAR_WINDOW_SIZE: u64 = 1 << 14;
+
+pub(crate) fn indexed_format(file_format: &str) -> Option<IndexedFormat> {
+    match file_format.to_lowercase().as_str() {
+        "bam" => Some(IndexedFormat::Bam),
+        "vcf" => Some(IndexedFormat::Vcf),
+        "bcf" => Some(IndexedFormat::Bcf),
+        _ => None,
+    }
+}
+
+/// The one-based start position column of `format`'s schema.
+fn position_column(format: IndexedFormat) -> &'static str {
+    match format {
+        IndexedFormat::Bam => "start",
+        IndexedFormat::Vcf | IndexedFormat::Bcf => "pos",
+    }
+}
+
+/// Plans about `target_partitions` regions covering every record of the file described by
+/// `index`, following the file order. References are split on linear index windows into pieces
+/// of roughly equal compressed size, no smaller than `MIN_PARTITION_BYTES`; indexes without a
+/// linear index (CSI) are split per reference.
+///
+/// Returns `None` when the file can't be covered by region queries or splitting gains nothing:
+/// fewer than two partitions, reference names missing, or BAM files with unmapped reads, which
+/// region queries don't reliably return.
+pub fn plan_partitions(
+    index: &BinningIndex,
+    names: &[String],
+    format: IndexedFormat,
+    target_partitions: usize,
+) -> Option<Vec<Region>> {
+    if let IndexedFormat::Bam = format {
+        if index.unplaced_unmapped != Some(0) {
+            return None;
+        }
+    }
+
+    // (reference id, first compressed offset, last compressed offset) of every reference with records.
+    let mut spans = vec![];
+    for (reference_id, reference) in index.references.iter().enumerate() {
+        if reference.bins.is_empty() {
+            continue;
+        }
+
+        if let IndexedFormat::Bam = format {
+            match reference.metadata {
+                Some(metadata) if metadata.unmapped == 0 => {}
+                _ => return None,
+            }
+        }
+
+        let chunks = index.reference_chunks(reference_id);
+        let (start, end) = match reference.metadata {
+            Some(metadata) => (metadata.start, metadata.end),
+            None => match (chunks.first(), chunks.last()) {
+                (Some(first), Some(last)) => (first.start, last.end),
+                _ => continue,
+            },
+        };
+
+        spans.push((reference_id, start >> 16, end >> 16));
+    }
+
+    if spans.iter().any(|(reference_id, _, _)| *reference_id >= names.len()) {
+        return None;
+    }
+
+    let total_bytes = spans
+        .iter()
+        .map(|(_, start, end)| end.saturating_sub(*start))
+        .sum::<u64>();
+    let target_bytes = (total_bytes / target_partitions.max(1) as u64).max(MIN_PARTITION_BYTES);
+
+    let mut partitions = vec![];
+    for (reference_id, start, end) in spans {
+        let name = &names[reference_id];
+        let intervals = &index.references[reference_id].intervals;
+
+        let mut piece_start = 1;
+        let mut piece_offset = start;
+
+        if end.saturating_sub(start) > target_bytes {
+            for (window, interval) in intervals.iter().enumerate().skip(1) {
+                let offset = interval >> 16;
+
+                if *interval == 0 || offset.saturating_sub(piece_offset) < target_bytes {
+                    continue;
+                }
+
+                let window_start = window as u64 * LINEAR_WINDOW_SIZE + 1;
+                partitions.push(Region::new(name, piece_start, Some(window_start - 1)));
+
+                piece_start = window_start;
+                piece_offset = offset;
+            }
+        }
+
+        partitions.push(Region::new(name, piece_start, None));
+    }
+
+    if partitions.len() < 2 {
+        return None;
+    }
+
+    Some(partitions)
+}
+
+pub(crate) fn new_runtime() -> Arc<Runtime> {
+    // The calling DuckDB thread drives the runtime, so each partition is decoded on the thread
+    // that scans it rather than on a pool of its own.
+    Arc::new(Builder::new_current_thread().enable_all().build().unwrap())
+}
+
+/// Streams the batches `run` hands to the callback it is given, running it on a thread of its own:
+/// the readers behind it block on file reads and decoding, which must stay off the async runtime.
+/// The callback returns false once the stream has been dropped, and `run` should then return.
+pub(crate) fn blocking_stream<F>(schema: SchemaRef, run: F) -> SendableRecordBatchStream
+where
+    F: FnOnce(&mut dyn FnMut(RecordBatch) -> bool) -> io::Result<()> + Send + 'static,
+{
+    let (mut tx, rx) = mpsc::channel(2);
+
+    thread::spawn(move || {
+        let result = run(&mut |batch| block_on(tx.send(Ok(batch))).is_ok());
+
+        if let Err(e) = result {
+            let _ = block_on(tx.send(Err(DataFusionError::IoError(e))));
+        }
+    });
+
+    Box::pin(RecordBatchStreamAdapter::new(schema, rx))
+}
+
+/// Registers the object store of `uri`, or the DuckDB file system if `file_system` isn't null,
+/// wrapped with the block cache unless the file is local, returning the caching store if any.
+pub(crate) async fn register_store(
+    ctx: &SessionContext,
+    uri: &str,
+    file_system: *const DuckDBFileSystem,
+) -> Result<Option<(Arc<CachingObjectStore>, Path)>, String> {
+    let registered = if file_system.is_null() {
+        ctx.runtime_env()
+            .exon_register_object_store_uri(uri)
+            .await
+            .map(|_| ())
+            .map_err(|e| e.to_string())
+    } else {
+        register_duckdb_file_system(ctx, uri, *file_system)
+            .map(|_| ())
+            .map_err(|e| e.to_string())
+    };
+
+    if let Err(e) = registered {
+        return Err(format!("could not register object store: {}", e));
+    }
+
+    register_block_cache(ctx, uri).map_err(|e| format!("could not register block cache: {}", e))
+}
+
+async fn plan_file(
+    ctx: &SessionContext,
+    uri: &str,
+    format: IndexedFormat,
+    target_partitions: usize,
+) -> Result<Option<Vec<Region>>, DataFusionError> {
+    let table_url = ListingTableUrl::parse(uri)?;
+    let store = ctx.runtime_env().object_store(table_url.object_store())?;
+    let location = table_url.prefix();
+
+    // No index, or one we can't read, just means a sequential scan.
+    let index = match read_index(store.as_ref(), location, format).await {
+        Ok(index) => index,
+        Err(_) => return Ok(None),
+    };
+
+    let names = match index.reference_names() {
+        Some(names) => names.to_vec(),
+        None => match read_header_names(store.as_ref(), location, format).await {
+            Ok(names) => names,
+            Err(_) => return Ok(None),
+        },
+    };
+
+    Ok(plan_partitions(&index, &names, format, target_partitions))
+}
+
+#[repr(C)]
+pub struct ScanPartitionsResult {
+    regions: *const *const c_char,
+    count: usize,
+    error: *const c_char,
+}
+
+impl ScanPartitionsResult {
+    pub(crate) fn empty() -> Self {
+        Self {
+            regions: null(),
+            count: 0,
+            error: null(),
+        }
+    }
+
+    pub(crate) fn error(error: String) -> Self {
+        Self {
+            regions: null(),
+            count: 0,
+            error: CString::new(error).unwrap().into_raw(),
+        }
+    }
+
+    /// The planned `regions`, released by `free_scan_partitions`.
+    pub(crate) fn regions<T: ToString>(regions: &[T]) -> Self {
+        let regions = regions
+            .iter()
+            .map(|region| CString::new(region.to_string()).unwrap().into_raw() as *const c_char)
+            .collect::<Vec<_>>()
+            .into_boxed_slice();
+
+        let count = regions.len();
+
+        Self {
+            regions: Box::into_raw(regions) as *const *const c_char,
+            count,
+            error: null(),
+        }
+    }
+}
+
+/// Plans about `target_partitions` regions for a full scan of the BAM, VCF or BCF file at `uri`,
+/// each to be read with `new_partition_reader`. No regions and no error means the file should be
+/// scanned as a whole, e.g. it has no index or holds unmapped reads.
+#[no_mangle]
+pub unsafe extern "C" fn scan_partitions(
+    uri: *const c_char,
+    file_format: *const c_char,
+    target_partitions: usize,
+    file_system: *const DuckDBFileSystem,
+) -> ScanPartitionsResult {
+    let uri = match CStr::from_ptr(uri).to_str() {
+        Ok(uri) => uri,
+        Err(e) => return ScanPartitionsResult::error(format!("could not parse uri: {}", e)),
+    };
+
+    let format = match CStr::from_ptr(file_format).to_str().ok().and_then(indexed_format) {
+        Some(format) => format,
+        None => return ScanPartitionsResult::empty(),
+    };
+
+    let rt = new_runtime();
+    let ctx = SessionContext::with_config_exon(new_exon_config());
+
+    rt.block_on(async {
+        if let Err(e) = register_store(&ctx, uri, file_system).await {
+            return ScanPartitionsResult::error(e);
+        }
+
+        let regions = match plan_file(&ctx, uri, format, target_partitions).await {
+            Ok(Some(regions)) => regions,
+            Ok(None) => return ScanPartitionsResult::empty(),
+            Err(e) => {
+                return ScanPartitionsResult::error(format!("could not plan partitions: {}", e))
+            }
+        };
+
+        ScanPartitionsResult::regions(&regions)
+    })
+}
+
+/// Releases the regions and error of a `ScanPartitionsResult`.
+#[no_mangle]
+pub unsafe extern "C" fn free_scan_partitions(result: ScanPartitionsResult) {
+    if !result.regions.is_null() {
+        let regions = Box::from_raw(slice::from_raw_parts_mut(
+            result.regions as *mut *const c_char,
+            result.count,
+        ));
+
+        for region in regions.iter() {
+            drop(CString::from_raw(*region as *mut c_char));
+        }
+    }
+
+    if !result.error.is_null() {
+        drop(CString::from_raw(result.error as *mut c_char));
+    }
+}
+
+#[repr(C)]
+pub struct PartitionReaderResult {
+    error: *const c_char,
+}
+
+/// Reads one partition planned by `scan_partitions` from the file at `uri`, applying the SQL
+/// `filters` as a full scan would.
+#[no_mangle]
+pub unsafe extern "C" fn new_partition_reader(
+    stream_ptr: *mut ArrowArrayStream,
+    uri: *const c_char,
+    file_format: *const c_char,
+    region: *const c_char,
+    batch_size: usize,
+    filters: *const c_char,
+    file_system: *const DuckDBFileSystem,
+) -> PartitionReaderResult {
+    let uri = match CStr::from_ptr(uri).to_str() {
+        Ok(uri) => uri,
+        Err(e) => {
+            let error = CString::new(format!("could not parse uri: {}", e)).unwrap();
+            return PartitionReaderResult {
+                error: error.into_raw(),
+            };
+        }
+    };
+
+    let file_type = CStr::from_ptr(file_format).to_str().unwrap();
+    let format = match indexed_format(file_type) {
+        Some(format) => format,
+        None => {
+            let error = CString::new(format!("could not partition file_format {}", file_type)).unwrap();
+            return PartitionReaderResult {
+                error: error.into_raw(),
+            };
+        }
+    };
+
+    let region = match CStr::from_ptr(region).to_str().map(|region| region.parse::<Region>()) {
+        Ok(Ok(region)) => region,
+        _ => {
+            let error = CString::new("could not parse region").unwrap();
+            return PartitionReaderResult {
+                error: error.into_raw(),
+            };
+        }
+    };
+
+    let filters = if filters.is_null() {
+        ""
+    } else {
+        match CStr::from_ptr(filters).to_str() {
+            Ok(filters) => filters,
+            Err(e) => {
+                let error = CString::new(format!("could not parse filters: {}", e)).unwrap();
+                return PartitionReaderResult {
+                    error: error.into_raw(),
+                };
+            }
+        }
+    };
+
+    let rt = new_runtime();
+
+    // DuckDB parallelises across partitions, so each one is a single DataFusion partition.
+    let config = new_exon_config()
+        .with_batch_size(batch_size)
+        .with_target_partitions(1);
+    let ctx = SessionContext::with_config_exon(config);
+
+    rt.block_on(async {
+        if let Err(e) = register_store(&ctx, uri, file_system).await {
+            let error = CString::new(e).unwrap();
+            return PartitionReaderResult {
+                error: error.into_raw(),
+            };
+        }
+
+        let region_string = region.to_string();
+        let df = match format {
+            IndexedFormat::Bam => ctx.query_bam_file(uri, &region_string).await,
+            IndexedFormat::Vcf => ctx.query_vcf_file(uri, &region_string).await,
+            IndexedFormat::Bcf => ctx.query_bcf_file(uri, &region_string).await,
+        };
+
+        let df = df.and_then(|df| {
+            if region.start > 1 {
+                df.filter(col(position_column(format)).gt_eq(lit(region.start as i64)))
+            } else {
+                Ok(df)
+            }
+        });
+
+        let df = match df {
+            Ok(df) if filters.is_empty() => Ok(df),
+            Ok(df) => match ctx.register_table("exon_table", df.into_view()) {
+                Ok(_) => {
+                    ctx.sql(&format!("SELECT * FROM exon_table WHERE {}", filters))
+                        .await
+                }
+                Err(e) => Err(e),
+            },
+            Err(e) => Err(e),
+        };
+
+        // Typed as the whole-file scan the columns were bound from.
+        let df = df.and_then(|df| encode_dictionaries(df, file_type));
+
+        let df = match df {
+            Ok(df) => df,
+            Err(e) => {
+                let error = CString::new(format!("could not read partition {}: {}", region, e))
+                    .unwrap();
+                return PartitionReaderResult {
+                    error: error.into_raw(),
+                };
+            }
+        };
+
+        match create_dataset_stream_from_table_provider(df, rt.clone(), stream_ptr).await {
+            Ok(_) => PartitionReaderResult {
+                error: std::ptr::null(),
+            },
+            Err(e) => {
+                let error =
+                    CString::new(format!("could not create dataset stream: {}", e)).unwrap();
+                return PartitionReaderResult {
+                    error: error.into_raw(),
+                };
+            }
+        }
+    })
+}
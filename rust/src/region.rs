@@ -0,0 +1,311 @@
+// Copyright 2023 WHERE TRUE Technologies.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+use std::{collections::HashMap, fmt, io, str::FromStr};
+
+/// A genomic region in samtools notation, `name`, `name:start` or `name:start-end`, with
+/// one-based, inclusive coordinates.
+#[derive(Clone, Debug, PartialEq, Eq)]
+pub struct Region {
+    pub name: String,
+    pub start: u64,
+    pub end: Option<u64>,
+}
+
+impl Region {
+    pub fn new(name: &str, start: u64, end: Option<u64>) -> Self {
+        Self {
+            name: name.to_string(),
+            start,
+            end,
+        }
+    }
+
+    /// The region as a zero-based, half-open interval, with an open end clamped to `max_end`.
+    pub fn zero_based(&self, max_end: u64) -> (u64, u64) {
+        (
+            self.start.saturating_sub(1),
+            self.end.unwrap_or(max_end).min(max_end),
+        )
+    }
+
+    /// True if the one-based, inclusive interval `[start, end]` overlaps the region.
+    pub fn overlaps(&self, start: u64, end: u64) -> bool {
+        start <= self.end.unwrap_or(u64::MAX) && end >= self.start
+    }
+
+    /// Parses `s` against the reference sequences of a header. As in samtools, a string that is
+    /// the name of a reference sequence, e.g. `HLA-A*01:01:01:01`, is the whole sequence, and
+    /// only other strings are split at their last colon.
+    pub fn parse_with<F>(s: &str, is_reference: F) -> io::Result<Self>
+    where
+        F: Fn(&str) -> bool,
+    {
+        if !s.is_empty() && is_reference(s) {
+            return Ok(Self::new(s, 1, None));
+        }
+
+        s.parse()
+    }
+}
+
+/// Largest end position samtools-style tools accept, used to write out open-ended regions.
+const MAX_POSITION: u64 = (1 << 31) - 1;
+
+impl fmt::Display for Region {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        match (self.start, self.end) {
+            // A name with a colon keeps its interval, so the string parses back without a header.
+            (1, None) if !self.name.contains(':') => write!(f, "{}", self.name),
+            (start, end) => write!(f, "{}:{}-{}", self.name, start, end.unwrap_or(MAX_POSITION)),
+        }
+    }
+}
+
+impl FromStr for Region {
+    type Err = io::Error;
+
+    fn from_str(s: &str) -> Result<Self, Self::Err> {
+        let invalid = || {
+            io::Error::new(
+                io::ErrorKind::InvalidInput,
+                format!("invalid region: {}", s),
+            )
+        };
+
+        let (name, interval) = match s.rsplit_once(':') {
+            Some((name, interval)) if interval.chars().next().map_or(false, |c| c.is_ascii_digit()) => {
+                (name, Some(interval))
+            }
+            _ => (s, None),
+        };
+
+        if name.is_empty() {
+            return Err(invalid());
+        }
+
+        let parse_position = |value: &str| -> Result<u64, io::Error> {
+            value.replace(',', "").parse::<u64>().map_err(|_| invalid())
+        };
+
+        let (start, end) = match interval {
+            None => (1, None),
+            Some(interval) => match interval.split_once('-') {
+                Some((start, "")) => (parse_position(start)?, None),
+                Some((start, end)) => (parse_position(start)?, Some(parse_position(end)?)),
+                None => (parse_position(interval)?, None),
+            },
+        };
+
+        if start == 0 || end.map_or(false, |end| end < start) {
+            return Err(invalid());
+        }
+
+        Ok(Self::new(name, start, end))
+    }
+}
+
+/// A merged region and, for all but the first region on its reference sequence, the end of the
+/// previous one. Records starting at or before that end overlap the previous region and were
+/// already returned by it.
+#[derive(Clone, Debug, PartialEq, Eq)]
+pub struct MergedRegion {
+    pub region: Region,
+    pub previous_end: Option<u64>,
+}
+
+/// Sorts `regions` by reference sequence (in order of first appearance) and start, merging
+/// overlapping and adjacent regions.
+pub fn merge_regions(regions: &[Region]) -> Vec<MergedRegion> {
+    let mut order: HashMap<&str, usize> = HashMap::new();
+    for region in regions {
+        let next = order.len();
+        order.entry(region.name.as_str()).or_insert(next);
+    }
+
+    let mut sorted = regions.to_vec();
+    sorted.sort_by_key(|region| (order[region.name.as_str()], region.start));
+
+    let mut merged: Vec<Region> = Vec::with_capacity(sorted.len());
+    for region in sorted {
+        match merged.last_mut() {
+            Some(last)
+                if last.name == region.name
+                    && last.end.map_or(true, |end| region.start <= end + 1) =>
+            {
+                last.end = match (last.end, region.end) {
+                    (Some(a), Some(b)) => Some(a.max(b)),
+                    _ => None,
+                };
+            }
+            _ => merged.push(region),
+        }
+    }
+
+    let mut result: Vec<MergedRegion> = Vec::with_capacity(merged.len());
+    for region in merged {
+        let previous_end = match result.last() {
+            Some(previous) if previous.region.name == region.name => previous.region.end,
+            _ => None,
+        };
+
+        result.push(MergedRegion {
+            region,
+            previous_end,
+        });
+    }
+
+    result
+}
+
+/// Regions from a BED file. BED intervals are zero-based and half-open, so `chr1 0 100` is
+/// `chr1:1-100`.
+pub fn parse_bed(text: &str) -> io::Result<Vec<Region>> {
+    text.lines()
+        .map(|line| line.trim_end_matches('\r'))
+        .filter(|line| {
+            !(line.is_empty()
+                || line.starts_with('#')
+                || line.starts_with("track")
+                || line.starts_with("browser"))
+        })
+        .map(|line| {
+            let invalid = || {
+                io::Error::new(
+                    io::ErrorKind::InvalidData,
+                    format!("invalid BED record: {}", line),
+                )
+            };
+
+            let mut fields = line.split('\t');
+            let name = fields.next().ok_or_else(invalid)?;
+            let start = fields
+                .next()
+                .and_then(|start| start.parse::<u64>().ok())
+                .ok_or_else(invalid)?;
+            let end = fields
+                .next()
+                .and_then(|end| end.parse::<u64>().ok())
+                .ok_or_else(invalid)?;
+
+            if end <= start {
+                return Err(invalid());
+            }
+
+            Ok(Region::new(name, start + 1, Some(end)))
+        })
+        .collect()
+}
+
+/// Reference sequence names and lengths from the binary header at the start of a BAM file, or
+/// `None` if `data` (the uncompressed stream) does not yet hold the whole header.
+pub fn parse_bam_references(data: &[u8]) -> io::Result<Option<Vec<(String, u64)>>> {
+    if data.len() < 8 {
+        return Ok(None);
+    }
+
+    if &data[0..4] != b"BAM\x01" {
+        return Err(io::Error::new(
+            io::ErrorKind::InvalidData,
+            "invalid BAM header",
+        ));
+    }
+
+    let read_i32 = |position: usize| -> Option<i32> {
+        data.get(position..position + 4)
+            .map(|b| i32::from_le_bytes([b[0], b[1], b[2], b[3]]))
+    };
+
+    // Lengths and counts are signed in the format, a negative one is a corrupt header rather
+    // than one still to be read.
+    let read_length = |position: usize| -> io::Result<Option<usize>> {
+        match read_i32(position) {
+            Some(value) if value < 0 => Err(io::Error::new(
+                io::ErrorKind::InvalidData,
+                format!("invalid BAM header: negative length {}", value),
+            )),
+            value => Ok(value.map(|value| value as usize)),
+        }
+    };
+
+    let l_text = match read_length(4)? {
+        Some(l_text) => l_text,
+        None => return Ok(None),
+    };
+    let mut position = 8 + l_text;
+
+    let n_ref = match read_length(position)? {
+        Some(n_ref) => n_ref,
+        None => return Ok(None),
+    };
+    position += 4;
+
+    // Capped by what the header could hold, so a corrupt count can't reserve gigabytes.
+    let mut references = Vec::with_capacity(n_ref.min(data.len() / 9));
+    for _ in 0..n_ref {
+        let l_name = match read_length(position)? {
+            Some(l_name) => l_name,
+            None => return Ok(None),
+        };
+        position += 4;
+
+        let name = match data.get(position..position + l_name) {
+            Some(name) => String::from_utf8_lossy(name.strip_suffix(&[0]).unwrap_or(name)).to_string(),
+            None => return Ok(None),
+        };
+        position += l_name;
+
+        let l_ref = match read_length(position)? {
+            Some(l_ref) => l_ref as u64,
+            None => return Ok(None),
+        };
+        position += 4;
+
+        references.push((name, l_ref));
+    }
+
+    Ok(Some(references))
+}
+
+/// Reference sequence names and lengths, in dictionary order, from the `##contig` lines of a VCF
+/// header. The length is `None` for contigs declared without one.
+pub fn parse_vcf_contig_lengths(header: &str) -> Vec<(String, Option<u64>)> {
+    header
+        .lines()
+        .filter_map(|line| line.strip_prefix("##contig=<"))
+        .filter_map(|fields| {
+            let fields = fields.trim_end_matches('>').split(',');
+            let mut id = None;
+            let mut length = None;
+
+            for field in fields {
+                if let Some(value) = field.strip_prefix("ID=") {
+                    id = Some(value.to_string());
+                } else if let Some(value) = field.strip_prefix("length=") {
+                    length = value.parse::<u64>().ok();
+                }
+            }
+
+            id.map(|id| (id, length))
+        })
+        .collect()
+}
+
+/// Reference sequence names, in dictionary order, from the `##contig` lines of a VCF header.
+pub fn parse_vcf_contigs(header: &str) -> Vec<String> {
+    parse_vcf_contig_lengths(header)
+        .into_iter()
+        .map(|(name, _)| name)
+        .collect()
+}
@@ -0,0 +1,114 @@
+// Copyright 2023 WHERE TRUE Technologies.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+//! Shared plumbing for the region query readers: turning the region list handed over FFI into
+//! regions, and applying the filters DuckDB pushed down to the records read.
+
+use std::{
+    ffi::{c_char, CStr},
+    slice,
+    sync::Arc,
+};
+
+use datafusion::{
+    datasource::{listing::ListingTableUrl, TableProvider},
+    error::DataFusionError,
+    prelude::{DataFrame, SessionContext},
+};
+use exon::ExonRuntimeEnvExt;
+
+use crate::region::{parse_bed, Region};
+
+/// Reads the `count` region strings at `regions`.
+pub unsafe fn regions_from_ffi(
+    regions: *const *const c_char,
+    count: usize,
+) -> Result<Vec<String>, String> {
+    if regions.is_null() || count == 0 {
+        return Err("no regions given".to_string());
+    }
+
+    slice::from_raw_parts(regions, count)
+        .iter()
+        .map(|region| {
+            CStr::from_ptr(*region)
+                .to_str()
+                .map(|region| region.to_string())
+                .map_err(|e| format!("could not parse region: {}", e))
+        })
+        .collect()
+}
+
+async fn read_bed(ctx: &SessionContext, path: &str) -> Result<Vec<Region>, DataFusionError> {
+    let url = ListingTableUrl::parse(path)?;
+
+    let store = match ctx.runtime_env().object_store(url.object_store()) {
+        Ok(store) => store,
+        Err(_) => {
+            ctx.runtime_env()
+                .exon_register_object_store_uri(path)
+                .await
+                .map_err(|e| DataFusionError::Execution(e.to_string()))?;
+
+            ctx.runtime_env().object_store(url.object_store())?
+        }
+    };
+
+    let bytes = store.get(url.prefix()).await?.bytes().await?;
+
+    Ok(parse_bed(&String::from_utf8_lossy(&bytes))?)
+}
+
+/// Parses region strings, reading any entry ending in `.bed` as a BED file of regions. An entry
+/// naming one of `references` whole is that sequence, even if the name has a colon in it.
+pub async fn resolve_regions(
+    ctx: &SessionContext,
+    entries: &[String],
+    references: &[String],
+) -> Result<Vec<Region>, DataFusionError> {
+    let mut regions = vec![];
+
+    for entry in entries {
+        if entry.ends_with(".bed") {
+            regions.extend(read_bed(ctx, entry).await?);
+        } else {
+            let is_reference = |name: &str| references.iter().any(|reference| reference == name);
+            regions.push(Region::parse_with(entry, is_reference)?);
+        }
+    }
+
+    if regions.is_empty() {
+        return Err(DataFusionError::Execution("no regions given".to_string()));
+    }
+
+    Ok(regions)
+}
+
+/// The rows of `table` matching `filters`, a SQL predicate, or all of them if it is empty.
+/// DuckDB drops the filters it pushes down into a scan from its own plan, so the readers given
+/// them must apply them.
+pub async fn filtered_table(
+    ctx: &SessionContext,
+    table: Arc<dyn TableProvider>,
+    filters: &str,
+) -> Result<DataFrame, DataFusionError> {
+    ctx.register_table("exon_table", table)?;
+
+    let mut select_string = format!("SELECT * FROM exon_table");
+    if filters != "" {
+        select_string.push_str(format!(" WHERE {}", filters).as_str());
+    }
+
+    ctx.sql(&select_string).await
+}
@@ -0,0 +1,308 @@
+// Copyright 2023 WHERE TRUE Technologies.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+//! Merges local coordinate-sorted BAM files into one coordinate-sorted stream, e.g. the per-lane
+//! files of a sample. Every input is read in file order and only the next record of each is held,
+//! in a heap keyed by reference sequence and position, so memory is one record per input plus
+//! the batch being built, however large the files.
+//!
+//! The inputs must share their reference sequences, whose header order is the merge order, with
+//! unplaced records last. Records are checked to be in order as they are read, a file that isn't
+//! sorted by coordinate is an error rather than a silently unsorted result.
+
+use std::{
+    cmp::Reverse,
+    collections::BinaryHeap,
+    ffi::{c_char, CStr, CString},
+    io,
+    sync::Arc,
+};
+
+use arrow::{
+    datatypes::SchemaRef, ffi_stream::FFI_ArrowArrayStream as ArrowArrayStream,
+    record_batch::RecordBatch,
+};
+use datafusion::{
+    datasource::streaming::StreamingTable,
+    execution::TaskContext,
+    physical_plan::{streaming::PartitionStream, SendableRecordBatchStream},
+    prelude::SessionContext,
+};
+use exon::{ffi::create_dataset_stream_from_table_provider, new_exon_config};
+use tokio::runtime::Runtime;
+
+use crate::{
+    bam_reader::{
+        bam_projection, bam_schema, projected_schema, read_bam_header, read_bam_record_prefix,
+        with_reference_dictionary, BamBatchBuilder, RecordExtent,
+    },
+    bam_scan::strings_from_ffi,
+    bgzf::{BgzfRead, BlockCursor},
+    index_builder::le_i32,
+    partition_reader::blocking_stream,
+    subset_reader::{invalid_data, map_file},
+};
+
+/// The merge order of a record: its reference sequence, unplaced records last, then position.
+fn sort_key(record: &[u8]) -> (u32, i32) {
+    (le_i32(record) as u32, le_i32(&record[4..]))
+}
+
+/// One input of the merge and its next record.
+struct MergeInput<'a> {
+    path: &'a str,
+    cursor: BlockCursor<&'a [u8]>,
+    record: Vec<u8>,
+    offset: u64,
+}
+
+impl MergeInput<'_> {
+    /// Reads the next record, returning its merge order or `None` at the end of the file.
+    fn advance(&mut self, extent: RecordExtent) -> io::Result<Option<(u32, i32)>> {
+        self.offset = self.cursor.virtual_offset();
+        if !read_bam_record_prefix(&mut self.cursor, &mut self.record, extent)? {
+            return Ok(None);
+        }
+
+        Ok(Some(sort_key(&self.record)))
+    }
+}
+
+/// Checks the BAM files at `paths` share their reference sequences.
+fn check_references(paths: &[String]) -> io::Result<()> {
+    let mut references: Option<Vec<String>> = None;
+
+    for path in paths {
+        let data = map_file(path)?;
+        let names = read_bam_header(&mut BlockCursor::new(&data))?;
+
+        match &references {
+            Some(references) if *references != names => {
+                return Err(invalid_data(format!(
+                    "{} has other reference sequences than {}",
+                    path, paths[0]
+                )))
+            }
+            Some(_) => {}
+            None => references = Some(names),
+        }
+    }
+
+    Ok(())
+}
+
+/// The merge of several BAM files sharing reference sequences.
+struct SortedMerge {
+    paths: Vec<String>,
+    projection: Vec<bool>,
+    batch_size: usize,
+}
+
+impl SortedMerge {
+    /// Merges the files, handing each batch to `emit` until it returns false.
+    fn run<F>(&self, schema: SchemaRef, mut emit: F) -> io::Result<()>
+    where
+        F: FnMut(RecordBatch) -> bool,
+    {
+        let data = self
+            .paths
+            .iter()
+            .map(|path| map_file(path))
+            .collect::<io::Result<Vec<_>>>()?;
+
+        let mut inputs = vec![];
+        let mut references = vec![];
+
+        for (path, data) in self.paths.iter().zip(&data) {
+            let mut cursor = BlockCursor::new(&data[..]);
+            references = read_bam_header(&mut cursor)?;
+
+            inputs.push(MergeInput {
+                path,
+                cursor,
+                record: vec![],
+                offset: 0,
+            });
+        }
+
+        let mut builder =
+            BamBatchBuilder::with_projection(schema, Arc::new(references), self.projection.clone());
+
+        // The merge order is read from the fixed-length fields.
+        let extent = builder.extent().max(RecordExtent::Fixed);
+
+        // Ties go to the earlier input, so records keep the order of the paths.
+        let mut heap = BinaryHeap::with_capacity(inputs.len());
+        for (i, input) in inputs.iter_mut().enumerate() {
+            if let Some(key) = input.advance(extent)? {
+                heap.push(Reverse((key, i)));
+            }
+        }
+
+        while let Some(Reverse((key, i))) = heap.pop() {
+            let input = &mut inputs[i];
+            builder.append(&input.record, input.offset)?;
+
+            if let Some(next) = input.advance(extent)? {
+                if next < key {
+                    return Err(invalid_data(format!(
+                        "{} is not sorted by coordinate",
+                        input.path
+                    )));
+                }
+
+                heap.push(Reverse((next, i)));
+            }
+
+            if builder.rows() >= self.batch_size && !emit(builder.finish()?) {
+                return Ok(());
+            }
+        }
+
+        if builder.rows() > 0 {
+            emit(builder.finish()?);
+        }
+
+        Ok(())
+    }
+}
+
+struct SortedMergePartition {
+    schema: SchemaRef,
+    merge: Arc<SortedMerge>,
+}
+
+impl PartitionStream for SortedMergePartition {
+    fn schema(&self) -> &SchemaRef {
+        &self.schema
+    }
+
+    fn execute(&self, _ctx: Arc<TaskContext>) -> SendableRecordBatchStream {
+        let merge = self.merge.clone();
+        let schema = self.schema.clone();
+
+        blocking_stream(self.schema.clone(), move |emit| merge.run(schema, emit))
+    }
+}
+
+#[repr(C)]
+pub struct SortedMergeReaderResult {
+    error: *const c_char,
+}
+
+impl SortedMergeReaderResult {
+    fn error(error: String) -> Self {
+        Self {
+            error: CString::new(error).unwrap().into_raw(),
+        }
+    }
+}
+
+/// Reads the `uri_count` local coordinate-sorted BAM files at `uris` as one stream sorted by
+/// reference sequence, in the order of their shared header, then position, with the columns of
+/// `read_bam_file_records`. Only the `column_count` columns named at `columns` are decoded, the
+/// others are all null; if `columns` is null every column is decoded. `filters` is a SQL predicate
+/// applied to the records.
+#[no_mangle]
+pub unsafe extern "C" fn new_sorted_merge_reader(
+    stream_ptr: *mut ArrowArrayStream,
+    uris: *const *const c_char,
+    uri_count: usize,
+    columns: *const *const c_char,
+    column_count: usize,
+    batch_size: usize,
+    filters: *const c_char,
+) -> SortedMergeReaderResult {
+    let paths = match strings_from_ffi(uris, uri_count) {
+        Ok(Some(paths)) if !paths.is_empty() => paths
+            .iter()
+            .map(|path| path.to_string())
+            .collect::<Vec<_>>(),
+        Ok(_) => return SortedMergeReaderResult::error("no files to merge".to_string()),
+        Err(e) => return SortedMergeReaderResult::error(format!("could not parse uris: {}", e)),
+    };
+
+    let columns = match strings_from_ffi(columns, column_count) {
+        Ok(columns) => columns,
+        Err(e) => return SortedMergeReaderResult::error(format!("could not parse columns: {}", e)),
+    };
+
+    let filters = if filters.is_null() {
+        ""
+    } else {
+        match CStr::from_ptr(filters).to_str() {
+            Ok(filters) => filters,
+            Err(e) => {
+                return SortedMergeReaderResult::error(format!("could not parse filters: {}", e))
+            }
+        }
+    };
+
+    // The files are read when the stream is, only their headers are checked here.
+    if let Err(e) = check_references(&paths) {
+        return SortedMergeReaderResult::error(format!("could not merge files: {}", e));
+    }
+
+    let schema = with_reference_dictionary(&bam_schema(false));
+    let projection = bam_projection(&schema, columns.as_deref());
+    let schema = projected_schema(&schema, &projection);
+
+    let rt = Arc::new(Runtime::new().unwrap());
+
+    let config = new_exon_config().with_batch_size(batch_size);
+    let ctx = SessionContext::with_config_exon(config);
+
+    rt.block_on(async {
+        let partition = Arc::new(SortedMergePartition {
+            schema: schema.clone(),
+            merge: Arc::new(SortedMerge {
+                paths,
+                projection,
+                batch_size,
+            }),
+        }) as Arc<dyn PartitionStream>;
+
+        let table = match StreamingTable::try_new(schema, vec![partition]) {
+            Ok(table) => table,
+            Err(e) => {
+                return SortedMergeReaderResult::error(format!("could not create table: {}", e))
+            }
+        };
+
+        if let Err(e) = ctx.register_table("exon_table", Arc::new(table)) {
+            return SortedMergeReaderResult::error(format!("could not register table: {}", e));
+        }
+
+        let mut select_string = format!("SELECT * FROM exon_table");
+        if filters != "" {
+            select_string.push_str(format!(" WHERE {}", filters).as_str());
+        }
+
+        let df = match ctx.sql(&select_string).await {
+            Ok(df) => df,
+            Err(e) => {
+                return SortedMergeReaderResult::error(format!("could not execute sql: {}", e))
+            }
+        };
+
+        match create_dataset_stream_from_table_provider(df, rt.clone(), stream_ptr).await {
+            Ok(_) => SortedMergeReaderResult {
+                error: std::ptr::null(),
+            },
+            Err(e) => {
+                SortedMergeReaderResult::error(format!("could not create dataset stream: {}", e))
+            }
+        }
+    })
+}
@@ -0,0 +1,1464 @@
+// Copyright 2023 WHERE TRUE Technologies.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+//! Reads local VCF and BCF files keeping only some of their samples and INFO keys. Before exon
+//! decodes a record it is cut down to those: VCF lines are split on tabs only as far as the last
+//! requested sample, and BCF INFO values and per-sample FORMAT values are copied by offset, the
+//! others skipped by their byte length without being parsed. The subset records go behind a
+//! header declaring just those samples and keys through an in-memory object store, so the
+//! columns are those of `read_vcf_file_records` and `read_bcf_file_records` with a narrower
+//! `formats` list and `info` struct.
+//!
+//! Region queries keeping every sample and INFO key, of local files or not, read the chunks of
+//! all their regions through the file's object store, planned from one read of its index.
+//!
+//! Columns DuckDB doesn't project are cut too: without `formats` a single sample is kept, and
+//! without `info` every INFO value is dropped, so the schema is unchanged while next to nothing
+//! of them is decoded.
+
+use std::{
+    collections::HashSet,
+    ffi::{c_char, CStr, CString},
+    fs::{self, File},
+    io,
+    ops::Range,
+    sync::Arc,
+};
+
+use arrow::{
+    datatypes::SchemaRef, ffi_stream::FFI_ArrowArrayStream as ArrowArrayStream,
+    record_batch::RecordBatch,
+};
+use datafusion::{
+    datasource::{listing::ListingTableUrl, streaming::StreamingTable},
+    execution::TaskContext,
+    physical_plan::{streaming::PartitionStream, SendableRecordBatchStream},
+    prelude::SessionContext,
+};
+use exon::{ffi::create_dataset_stream_from_table_provider, new_exon_config};
+use memmap2::Mmap;
+use object_store::{path::Path, ObjectStore};
+use tokio::runtime::Runtime;
+
+use crate::{
+    bam_scan::strings_from_ffi,
+    bgzf::{self, BgzfRead, BlockCursor, BlockSource},
+    binning_index::BinningIndex,
+    block_cache::{
+        parse_bcf_header, parse_vcf_header, prefetch_chunks, read_header_prefix, read_index,
+        IndexedFormat, ObjectBlocks,
+    },
+    duckdb_file_system::DuckDBFileSystem,
+    index_builder::{file_reader, info_end, le_i32, le_u32},
+    offset_reader::{decode_file, read_vcf_header, VCF_CHUNK_LINES},
+    partition_reader::{blocking_stream, new_runtime, register_store},
+    region::{merge_regions, parse_vcf_contigs},
+    region_query::{regions_from_ffi, resolve_regions},
+};
+
+/// Bytes of subset records handed to exon at once, bounding chunks of very wide files.
+const CHUNK_BYTES: usize = 32 << 20;
+
+/// The fixed columns of a VCF line before the first sample, FORMAT included.
+const VCF_FIXED_COLUMNS: usize = 9;
+
+/// The index of the INFO column of a VCF line.
+const VCF_INFO_COLUMN: usize = 7;
+
+pub(crate) fn invalid_data<E: Into<Box<dyn std::error::Error + Send + Sync>>>(e: E) -> io::Error {
+    io::Error::new(io::ErrorKind::InvalidData, e)
+}
+
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+pub(crate) enum VariantFormat {
+    Vcf,
+    Bcf,
+}
+
+impl VariantFormat {
+    pub(crate) fn from_name(name: &str) -> Option<Self> {
+        match name.to_lowercase().as_str() {
+            "vcf" => Some(Self::Vcf),
+            "bcf" => Some(Self::Bcf),
+            _ => None,
+        }
+    }
+
+    pub(crate) fn name(self) -> &'static str {
+        match self {
+            Self::Vcf => "vcf",
+            Self::Bcf => "bcf",
+        }
+    }
+
+    pub(crate) fn indexed_format(self) -> IndexedFormat {
+        match self {
+            Self::Vcf => IndexedFormat::Vcf,
+            Self::Bcf => IndexedFormat::Bcf,
+        }
+    }
+
+    /// The format of the VCF or BCF file `data`, by whether it decompresses to BCF's magic bytes.
+    pub(crate) fn detect(data: &[u8]) -> io::Result<Self> {
+        if !is_bgzf(data) {
+            return Ok(Self::Vcf);
+        }
+
+        let mut cursor = BlockCursor::new(data);
+        cursor.fill()?;
+
+        if cursor.available().starts_with(b"BCF") {
+            Ok(Self::Bcf)
+        } else {
+            Ok(Self::Vcf)
+        }
+    }
+}
+
+pub(crate) fn map_file(path: &str) -> io::Result<Mmap> {
+    let file =
+        File::open(path).map_err(|e| io::Error::new(e.kind(), format!("{}: {}", path, e)))?;
+
+    // SAFETY: the map is read only, as in the index builder.
+    unsafe { Mmap::map(&file) }
+}
+
+pub(crate) fn is_bgzf(data: &[u8]) -> bool {
+    matches!(bgzf::block_size(data), Ok(Some(_)))
+}
+
+/// Reads a file that isn't compressed as a single block, with byte offsets for virtual offsets.
+pub(crate) struct PlainReader<'a> {
+    pub(crate) data: &'a [u8],
+    pub(crate) position: usize,
+}
+
+impl BgzfRead for PlainReader<'_> {
+    fn fill(&mut self) -> io::Result<bool> {
+        Ok(self.position < self.data.len())
+    }
+
+    fn available(&self) -> &[u8] {
+        &self.data[self.position..]
+    }
+
+    fn consume(&mut self, n: usize) {
+        self.position += n;
+    }
+
+    fn virtual_offset(&self) -> u64 {
+        self.position as u64
+    }
+}
+
+/// The header of a VCF or BCF file: its text and, for BCF, the magic bytes before it.
+pub(crate) struct Header {
+    magic: Vec<u8>,
+    pub(crate) text: String,
+}
+
+impl Header {
+    pub(crate) fn read(format: VariantFormat, reader: &mut dyn BgzfRead) -> io::Result<Self> {
+        match format {
+            VariantFormat::Vcf => {
+                let text = read_vcf_header(reader)?;
+
+                Ok(Self {
+                    magic: vec![],
+                    text: String::from_utf8(text).map_err(invalid_data)?,
+                })
+            }
+            VariantFormat::Bcf => {
+                let mut magic = vec![];
+                reader.read_header(5, &mut magic)?;
+                if !magic.starts_with(b"BCF\x02") {
+                    return Err(invalid_data("not a BCF file"));
+                }
+
+                let mut buf = vec![];
+                reader.read_header(4, &mut buf)?;
+                let l_text = le_u32(&buf) as usize;
+                reader.read_header(l_text, &mut buf)?;
+
+                let text = String::from_utf8_lossy(&buf)
+                    .trim_end_matches('\0')
+                    .to_string();
+
+                Ok(Self { magic, text })
+            }
+        }
+    }
+
+    /// The sample names of the `#CHROM` line.
+    pub(crate) fn samples(&self) -> io::Result<Vec<&str>> {
+        let line = self
+            .text
+            .lines()
+            .find(|line| line.starts_with("#CHROM"))
+            .ok_or_else(|| invalid_data("the header has no #CHROM line"))?;
+
+        Ok(line.split('\t').skip(VCF_FIXED_COLUMNS).collect())
+    }
+
+    /// The IDs of the `##INFO` lines.
+    fn info_keys(&self) -> Vec<&str> {
+        self.text.lines().filter_map(info_id).collect()
+    }
+
+    /// The header text listing only the samples at `samples` and the INFO keys in `info_keys`,
+    /// every one of them if `None`.
+    fn subset_text(
+        &self,
+        samples: Option<&[usize]>,
+        info_keys: Option<&HashSet<String>>,
+    ) -> io::Result<String> {
+        let names = self.samples()?;
+
+        let mut text = String::with_capacity(self.text.len());
+        for line in self.text.lines() {
+            match (info_id(line), info_keys) {
+                (Some(id), Some(info_keys)) if !info_keys.contains(id) => continue,
+                _ => {}
+            }
+
+            match samples {
+                Some(samples) if line.starts_with("#CHROM") => {
+                    let mut columns = line.split('\t').take(VCF_FIXED_COLUMNS).collect::<Vec<_>>();
+                    columns.extend(samples.iter().map(|sample| names[*sample]));
+                    text.push_str(&columns.join("\t"));
+                }
+                _ => text.push_str(line),
+            }
+            text.push('\n');
+        }
+
+        Ok(text)
+    }
+
+    /// `text` as the header bytes a file of this format starts with.
+    fn bytes(&self, text: &str) -> Vec<u8> {
+        let mut out = self.magic.clone();
+        if !out.is_empty() {
+            out.extend_from_slice(&(text.len() as u32 + 1).to_le_bytes());
+            out.extend_from_slice(text.as_bytes());
+            out.push(0);
+        } else {
+            out.extend_from_slice(text.as_bytes());
+        }
+
+        out
+    }
+}
+
+/// The value of attribute `key` of a structured header line's `attributes`, e.g. `ID`.
+fn header_attribute<'a>(attributes: &'a str, key: &str) -> Option<&'a str> {
+    attributes
+        .trim_end_matches('>')
+        .split(',')
+        .find_map(|attribute| attribute.strip_prefix(key)?.strip_prefix('='))
+}
+
+/// The ID of a `##INFO` header line.
+fn info_id(line: &str) -> Option<&str> {
+    header_attribute(line.strip_prefix("##INFO=<")?, "ID")
+}
+
+/// The dictionary BCF records refer to FILTER, INFO and FORMAT IDs by, read from header `text`.
+/// `PASS` comes first; a line with an `IDX` attribute takes that index, the others the next one.
+pub(crate) fn string_map(text: &str) -> Vec<Option<String>> {
+    let mut map = vec![Some("PASS".to_string())];
+
+    for line in text.lines() {
+        let attributes = match ["##FILTER=<", "##INFO=<", "##FORMAT=<"]
+            .iter()
+            .find_map(|prefix| line.strip_prefix(prefix))
+        {
+            Some(attributes) => attributes,
+            None => continue,
+        };
+
+        let id = match header_attribute(attributes, "ID") {
+            Some(id) => id,
+            None => continue,
+        };
+
+        if map.iter().any(|name| name.as_deref() == Some(id)) {
+            continue;
+        }
+
+        match header_attribute(attributes, "IDX").and_then(|idx| idx.parse::<usize>().ok()) {
+            Some(idx) => {
+                if map.len() <= idx {
+                    map.resize(idx + 1, None);
+                }
+                map[idx] = Some(id.to_string());
+            }
+            None => map.push(Some(id.to_string())),
+        }
+    }
+
+    map
+}
+
+/// The index in dictionary `to` of every entry of dictionary `from`, or `None` if both are the
+/// same and records need no renumbering.
+fn renumbering(from: &[Option<String>], to: &[Option<String>]) -> Option<Vec<Option<u32>>> {
+    if from == to {
+        return None;
+    }
+
+    Some(
+        from.iter()
+            .map(|name| {
+                let name = name.as_ref()?;
+                to.iter()
+                    .position(|other| other.as_ref() == Some(name))
+                    .map(|idx| idx as u32)
+            })
+            .collect(),
+    )
+}
+
+/// The positions in the header of the `requested` samples, in the order asked for. Only the
+/// first is kept when the genotypes aren't decoded.
+pub(crate) fn select_samples(
+    names: &[&str],
+    requested: &[&str],
+    decode: bool,
+) -> io::Result<Vec<usize>> {
+    let mut samples = vec![];
+
+    for name in requested {
+        let sample = names
+            .iter()
+            .position(|n| n == name)
+            .ok_or_else(|| invalid_data(format!("sample {} is not in the header", name)))?;
+
+        if !samples.contains(&sample) {
+            samples.push(sample);
+        }
+    }
+
+    if !decode {
+        samples.truncate(1);
+    }
+
+    Ok(samples)
+}
+
+/// What the records of a file with `header` keep of the requested `samples` and `info_keys`,
+/// every one if `None`, and the header the subset records are decoded behind.
+fn select(
+    header: &Header,
+    format: VariantFormat,
+    samples: Option<&[&str]>,
+    decode_samples: bool,
+    info_keys: Option<&[&str]>,
+    decode_info: bool,
+) -> io::Result<(Vec<u8>, Subset)> {
+    let names = header.samples()?;
+    let samples = match samples {
+        Some(requested) => Some(select_samples(&names, requested, decode_samples)?),
+        None if !decode_samples && !names.is_empty() => Some(vec![0]),
+        None => None,
+    };
+
+    let info_keys = match info_keys {
+        Some(requested) => {
+            let declared = header.info_keys();
+            if let Some(key) = requested.iter().find(|key| !declared.contains(*key)) {
+                return Err(invalid_data(format!(
+                    "INFO field {} is not in the header",
+                    key
+                )));
+            }
+
+            Some(
+                requested
+                    .iter()
+                    .map(|key| key.to_string())
+                    .collect::<HashSet<_>>(),
+            )
+        }
+        None => None,
+    };
+
+    let text = header.subset_text(samples.as_deref(), info_keys.as_ref())?;
+
+    // BCF records refer to keys by their place in the header, which dropped INFO lines move.
+    let keys = match format {
+        VariantFormat::Vcf => None,
+        VariantFormat::Bcf => renumbering(&string_map(&header.text), &string_map(&text)),
+    };
+
+    let subset = Subset {
+        samples,
+        info: decode_info,
+        info_keys,
+        keys,
+    };
+
+    Ok((header.bytes(&text), subset))
+}
+
+/// What records keep of their INFO and genotype columns.
+struct Subset {
+    /// The samples kept, in order, or `None` for all of them.
+    samples: Option<Vec<usize>>,
+    /// Whether INFO values are kept at all.
+    info: bool,
+    /// The INFO keys kept, or `None` for all of them.
+    info_keys: Option<HashSet<String>>,
+    /// For BCF, the index in the subset header's dictionary of every entry of the file's, or
+    /// `None` if they are the same.
+    keys: Option<Vec<Option<u32>>>,
+}
+
+impl Subset {
+    /// Appends the VCF `info` column to `out` with only the kept keys.
+    fn write_vcf_info(&self, info: &[u8], out: &mut Vec<u8>) {
+        let info_keys = match (&self.info_keys, self.info) {
+            (_, false) => return out.push(b'.'),
+            (None, true) => return out.extend_from_slice(info),
+            (Some(info_keys), true) => info_keys,
+        };
+
+        let start = out.len();
+        for entry in info.split(|b| *b == b';') {
+            let key = entry.split(|b| *b == b'=').next().unwrap_or(entry);
+
+            if std::str::from_utf8(key).map_or(false, |key| info_keys.contains(key)) {
+                if out.len() > start {
+                    out.push(b';');
+                }
+                out.extend_from_slice(entry);
+            }
+        }
+
+        if out.len() == start {
+            out.push(b'.');
+        }
+    }
+
+    /// Appends the VCF `line` to `out` with only the kept samples and INFO keys. Columns past
+    /// the last of them are never looked at.
+    fn write_vcf_line(&self, line: &[u8], columns: &mut Vec<Range<usize>>, out: &mut Vec<u8>) {
+        let line = match line.strip_suffix(b"\n") {
+            Some(line) => line.strip_suffix(b"\r").unwrap_or(line),
+            None => line,
+        };
+
+        // The columns up to INFO, or up to the last sample kept.
+        let needed = match &self.samples {
+            Some(samples) => VCF_FIXED_COLUMNS + samples.iter().max().map_or(0, |last| last + 1),
+            None => VCF_INFO_COLUMN + 1,
+        };
+
+        columns.clear();
+        let mut start = 0;
+        for (i, b) in line.iter().enumerate() {
+            if *b == b'\t' {
+                columns.push(start..i);
+                start = i + 1;
+
+                if columns.len() == needed {
+                    break;
+                }
+            }
+        }
+        if columns.len() < needed {
+            columns.push(start..line.len());
+        }
+
+        if columns.len() <= VCF_INFO_COLUMN {
+            out.extend_from_slice(line);
+            out.push(b'\n');
+            return;
+        }
+
+        let info = columns[VCF_INFO_COLUMN].clone();
+        out.extend_from_slice(&line[..info.start]);
+        self.write_vcf_info(&line[info.clone()], out);
+
+        match &self.samples {
+            Some(samples) if columns.len() > VCF_FIXED_COLUMNS => {
+                out.push(b'\t');
+                out.extend_from_slice(&line[columns[VCF_FIXED_COLUMNS - 1].clone()]);
+
+                for sample in samples {
+                    out.push(b'\t');
+                    match columns.get(VCF_FIXED_COLUMNS + sample) {
+                        Some(column) => out.extend_from_slice(&line[column.clone()]),
+                        None => out.push(b'.'),
+                    }
+                }
+            }
+            Some(_) => {
+                if let Some(format) = columns.get(VCF_FIXED_COLUMNS - 1) {
+                    out.push(b'\t');
+                    out.extend_from_slice(&line[format.clone()]);
+                }
+            }
+            None => out.extend_from_slice(&line[info.end..]),
+        }
+
+        out.push(b'\n');
+    }
+
+    /// Appends the dictionary indexes of type `kind` in `data` to `out`, renumbered for the
+    /// subset header. Indexes only ever move down, so each keeps its width.
+    fn write_bcf_keys(&self, data: &[u8], kind: u8, out: &mut Vec<u8>) -> io::Result<()> {
+        let keys = match &self.keys {
+            Some(keys) => keys,
+            None => {
+                out.extend_from_slice(data);
+                return Ok(());
+            }
+        };
+
+        let size = bcf_type_size(kind)?;
+        if size == 0 {
+            return Ok(());
+        }
+
+        for value in data.chunks_exact(size) {
+            let key = bcf_int(value, kind)?;
+
+            // Missing and end-of-vector values are negative.
+            let key =
+                if key < 0 {
+                    key
+                } else {
+                    keys.get(key as usize).copied().flatten().ok_or_else(|| {
+                        invalid_data(format!("undeclared BCF dictionary key {}", key))
+                    })? as i32
+                };
+
+            match kind {
+                1 => out.push(key as i8 as u8),
+                2 => out.extend_from_slice(&(key as i16).to_le_bytes()),
+                _ => out.extend_from_slice(&key.to_le_bytes()),
+            }
+        }
+
+        Ok(())
+    }
+
+    /// Whether the INFO key with dictionary index `key` is kept.
+    fn keeps_bcf_info(&self, key: i32) -> bool {
+        self.info
+            && key >= 0
+            && self.keys.as_ref().map_or(true, |keys| {
+                keys.get(key as usize).copied().flatten().is_some()
+            })
+    }
+
+    /// Appends the BCF record `record`, its shared part the first `l_shared` bytes, to `out`
+    /// with its lengths, keeping only the kept samples and INFO keys. Every INFO value and every
+    /// sample's FORMAT values have their length up front, so the others are skipped by offset
+    /// without being parsed.
+    fn write_bcf_record(
+        &self,
+        record: &[u8],
+        l_shared: usize,
+        out: &mut Vec<u8>,
+    ) -> io::Result<()> {
+        let truncated = || invalid_data("truncated BCF record");
+
+        if l_shared < 24 || record.len() < l_shared {
+            return Err(truncated());
+        }
+
+        let (shared, indiv) = record.split_at(l_shared);
+        let n_allele_info = le_u32(&shared[16..]);
+        let n_allele = (n_allele_info >> 16) as usize;
+        let n_info = (n_allele_info & 0xffff) as usize;
+        let n_fmt_sample = le_u32(&shared[20..]);
+        let n_sample = (n_fmt_sample & 0x00ff_ffff) as usize;
+        let n_fmt = (n_fmt_sample >> 24) as usize;
+
+        if let Some(samples) = &self.samples {
+            if let Some(sample) = samples.iter().find(|sample| **sample >= n_sample) {
+                return Err(invalid_data(format!(
+                    "BCF record has {} samples, not {}",
+                    n_sample,
+                    sample + 1
+                )));
+            }
+        }
+        let n_kept = self.samples.as_ref().map_or(n_sample, Vec::len) as u32;
+
+        let lengths_at = out.len();
+        out.extend_from_slice(&[0; 8]);
+
+        out.extend_from_slice(&shared[..16]);
+        let n_allele_info_at = out.len();
+        out.extend_from_slice(&[0; 4]);
+        out.extend_from_slice(&((n_fmt_sample & 0xff00_0000) | n_kept).to_le_bytes());
+
+        // ID and alleles are copied as they are.
+        let mut position = 24;
+        for _ in 0..1 + n_allele {
+            let (kind, count) = read_bcf_descriptor(shared, &mut position)?;
+            position += bcf_type_size(kind)? * count;
+        }
+
+        let (kind, count) = read_bcf_descriptor(shared, &mut position)?;
+        let filter_end = position + bcf_type_size(kind)? * count;
+        if filter_end > shared.len() {
+            return Err(truncated());
+        }
+
+        out.extend_from_slice(&shared[24..position]);
+        self.write_bcf_keys(&shared[position..filter_end], kind, out)?;
+        position = filter_end;
+
+        let mut n_info_kept = 0;
+        for _ in 0..n_info {
+            let field_start = position;
+            let (key_kind, _) = read_bcf_descriptor(shared, &mut position)?;
+            let key_at = position;
+            position += bcf_type_size(key_kind)?;
+            let (kind, count) = read_bcf_descriptor(shared, &mut position)?;
+            position += bcf_type_size(kind)? * count;
+
+            if position > shared.len() {
+                return Err(truncated());
+            }
+
+            if self.keeps_bcf_info(bcf_int(&shared[key_at..], key_kind)?) {
+                let key_end = key_at + bcf_type_size(key_kind)?;
+                out.extend_from_slice(&shared[field_start..key_at]);
+                self.write_bcf_keys(&shared[key_at..key_end], key_kind, out)?;
+                out.extend_from_slice(&shared[key_end..position]);
+                n_info_kept += 1;
+            }
+        }
+
+        let n_allele_info = (n_allele_info & 0xffff_0000) | n_info_kept;
+        out[n_allele_info_at..n_allele_info_at + 4].copy_from_slice(&n_allele_info.to_le_bytes());
+
+        let indiv_start = out.len();
+        let mut position = 0;
+
+        for _ in 0..n_fmt {
+            let (key_kind, _) = read_bcf_descriptor(indiv, &mut position)?;
+            let key_at = position;
+            let key_end = key_at + bcf_type_size(key_kind)?;
+            position = key_end;
+            let (kind, count) = read_bcf_descriptor(indiv, &mut position)?;
+
+            let width = bcf_type_size(kind)? * count;
+            let values = position;
+            position += width * n_sample;
+
+            if position > indiv.len() {
+                return Err(truncated());
+            }
+
+            out.push(indiv[key_at - 1]);
+            self.write_bcf_keys(&indiv[key_at..key_end], key_kind, out)?;
+            out.extend_from_slice(&indiv[key_end..values]);
+
+            match &self.samples {
+                Some(samples) => {
+                    for sample in samples {
+                        let start = values + sample * width;
+                        out.extend_from_slice(&indiv[start..start + width]);
+                    }
+                }
+                None => out.extend_from_slice(&indiv[values..position]),
+            }
+        }
+
+        let l_shared = (indiv_start - lengths_at - 8) as u32;
+        let l_indiv = (out.len() - indiv_start) as u32;
+        out[lengths_at..lengths_at + 4].copy_from_slice(&l_shared.to_le_bytes());
+        out[lengths_at + 4..lengths_at + 8].copy_from_slice(&l_indiv.to_le_bytes());
+
+        Ok(())
+    }
+}
+
+/// The size of one value of BCF type `kind`.
+pub(crate) fn bcf_type_size(kind: u8) -> io::Result<usize> {
+    match kind {
+        0 => Ok(0),
+        1 | 7 => Ok(1),
+        2 => Ok(2),
+        3 | 5 => Ok(4),
+        _ => Err(invalid_data(format!("invalid BCF type {}", kind))),
+    }
+}
+
+/// The BCF integer of type `kind` at the start of `data`.
+pub(crate) fn bcf_int(data: &[u8], kind: u8) -> io::Result<i32> {
+    let truncated = || invalid_data("truncated BCF record");
+
+    match kind {
+        1 => data.first().map(|b| *b as i8 as i32).ok_or_else(truncated),
+        2 => data
+            .get(..2)
+            .map(|b| i16::from_le_bytes([b[0], b[1]]) as i32)
+            .ok_or_else(truncated),
+        3 => data.get(..4).map(le_i32).ok_or_else(truncated),
+        _ => Err(invalid_data(format!("invalid BCF integer type {}", kind))),
+    }
+}
+
+/// Reads the BCF type descriptor at `data[*position]`, returning the type and the value count,
+/// which for counts of 15 or more follows as a typed integer.
+pub(crate) fn read_bcf_descriptor(data: &[u8], position: &mut usize) -> io::Result<(u8, usize)> {
+    let descriptor = *data
+        .get(*position)
+        .ok_or_else(|| invalid_data("truncated BCF record"))?;
+    *position += 1;
+
+    let kind = descriptor & 0x0f;
+    let count = (descriptor >> 4) as usize;
+    if count < 15 {
+        return Ok((kind, count));
+    }
+
+    let (int_kind, _) = read_bcf_descriptor(data, position)?;
+    let count = bcf_int(&data[(*position).min(data.len())..], int_kind)?;
+    *position += bcf_type_size(int_kind)?;
+
+    Ok((kind, count.max(0) as usize))
+}
+
+/// The names the chrom column of a file of `format` declaring `contigs` takes, in the order of
+/// the ENUM DuckDB reads it as, or none if they can't be known without reading every record. BCF
+/// records refer to the declared contigs by index. VCF records may name contigs the header
+/// doesn't declare, which only the file's `index` lists up front: they follow the declared ones,
+/// in the order of the index.
+pub(crate) fn chrom_names(
+    format: VariantFormat,
+    contigs: Vec<String>,
+    index: Option<&BinningIndex>,
+) -> Vec<String> {
+    if format == VariantFormat::Bcf {
+        return contigs;
+    }
+
+    let indexed = match index.and_then(BinningIndex::reference_names) {
+        Some(indexed) => indexed,
+        None => return vec![],
+    };
+
+    let declared = contigs.iter().cloned().collect::<HashSet<_>>();
+
+    let mut names = contigs;
+    names.extend(
+        indexed
+            .iter()
+            .filter(|name| !declared.contains(*name))
+            .cloned(),
+    );
+
+    names
+}
+
+/// Reads the `.tbi` or `.csi` index next to the file at `path`.
+pub(crate) fn read_local_index(path: &str, format: VariantFormat) -> io::Result<BinningIndex> {
+    for extension in format.indexed_format().index_extensions() {
+        if let Ok(raw) = fs::read(format!("{}.{}", path, extension)) {
+            return BinningIndex::parse(&raw);
+        }
+    }
+
+    Err(io::Error::new(
+        io::ErrorKind::NotFound,
+        format!("no index found for {}", path),
+    ))
+}
+
+/// A region of one reference sequence, as a zero-based, half-open interval. Only records
+/// starting past the one-based position `min_start` are read, earlier ones were returned by the
+/// region before it.
+pub(crate) struct ScanRegion {
+    pub(crate) reference_id: usize,
+    pub(crate) name: String,
+    pub(crate) start: u64,
+    pub(crate) end: u64,
+    pub(crate) min_start: u64,
+}
+
+/// One record as read from the file: a VCF line, or a BCF record without its two length fields.
+pub(crate) struct RawRecord {
+    pub(crate) data: Vec<u8>,
+    pub(crate) l_shared: usize,
+}
+
+impl RawRecord {
+    /// Reads the next record, returns false at the end of the file.
+    pub(crate) fn read(
+        &mut self,
+        format: VariantFormat,
+        reader: &mut dyn BgzfRead,
+    ) -> io::Result<bool> {
+        match format {
+            VariantFormat::Vcf => loop {
+                if !reader.read_line(&mut self.data)? {
+                    return Ok(false);
+                }
+
+                if !self.data.iter().all(|b| b.is_ascii_whitespace()) {
+                    return Ok(true);
+                }
+            },
+            VariantFormat::Bcf => {
+                if !reader.read_exact(8, &mut self.data)? {
+                    return Ok(false);
+                }
+
+                self.l_shared = le_u32(&self.data) as usize;
+                let size = self.l_shared + le_u32(&self.data[4..]) as usize;
+
+                if !reader.read_exact(size, &mut self.data)? {
+                    return Err(invalid_data("truncated BCF record"));
+                }
+
+                Ok(true)
+            }
+        }
+    }
+
+    /// Whether the record is on `region`'s reference sequence, and its zero-based, half-open
+    /// interval.
+    fn interval(&self, format: VariantFormat, region: &ScanRegion) -> io::Result<(bool, u64, u64)> {
+        match format {
+            VariantFormat::Vcf => {
+                let columns = self.data.splitn(9, |b| *b == b'\t').collect::<Vec<_>>();
+                if columns.len() < 8 {
+                    return Err(invalid_data("VCF line with fewer than 8 columns"));
+                }
+
+                let start = std::str::from_utf8(columns[1])
+                    .ok()
+                    .and_then(|position| position.trim().parse::<u64>().ok())
+                    .ok_or_else(|| invalid_data("invalid VCF position"))?
+                    .saturating_sub(1);
+
+                let end = std::str::from_utf8(columns[7])
+                    .ok()
+                    .and_then(|info| info_end(info.trim_end()))
+                    .filter(|end| *end > start)
+                    .unwrap_or(start + columns[3].len() as u64);
+
+                Ok((columns[0] == region.name.as_bytes(), start, end))
+            }
+            VariantFormat::Bcf => {
+                if self.data.len() < 12 {
+                    return Err(invalid_data("truncated BCF record"));
+                }
+
+                let reference_id = le_i32(&self.data);
+                let position = le_i32(&self.data[4..]);
+                let length = le_i32(&self.data[8..]);
+
+                if reference_id < 0 || position < 0 {
+                    return Ok((false, 0, 0));
+                }
+
+                let start = position as u64;
+                Ok((
+                    reference_id as usize == region.reference_id,
+                    start,
+                    start + length.max(0) as u64,
+                ))
+            }
+        }
+    }
+}
+
+/// An index and the regions of it to read, in order.
+pub(crate) type IndexedRegions = (Arc<BinningIndex>, Vec<ScanRegion>);
+
+/// Reads the header of the VCF or BCF file `data`, which may be uncompressed or bgzipped.
+pub(crate) fn read_header(format: VariantFormat, data: &[u8]) -> io::Result<Header> {
+    if is_bgzf(data) {
+        Header::read(format, &mut BlockCursor::new(data))
+    } else if format == VariantFormat::Vcf && !data.starts_with(&[0x1f, 0x8b]) {
+        Header::read(format, &mut PlainReader { data, position: 0 })
+    } else {
+        Err(invalid_data(
+            "only uncompressed or bgzipped files can be read",
+        ))
+    }
+}
+
+/// The regions of the index of the file at `path` covering `regions`, each samtools-style or
+/// the path of a BED file. Overlapping regions are merged, and regions on sequences the file
+/// has no records for dropped.
+pub(crate) async fn index_regions(
+    ctx: &SessionContext,
+    path: &str,
+    format: VariantFormat,
+    header: &Header,
+    regions: &[String],
+) -> Result<IndexedRegions, String> {
+    let index =
+        read_local_index(path, format).map_err(|e| format!("could not read index: {}", e))?;
+
+    plan_regions(ctx, index, header, regions).await
+}
+
+/// The regions of `index` covering `regions`, as `index_regions` plans them for a file with
+/// `header`.
+async fn plan_regions(
+    ctx: &SessionContext,
+    index: BinningIndex,
+    header: &Header,
+    regions: &[String],
+) -> Result<IndexedRegions, String> {
+    // Tabix indexes name their reference sequences, BCF numbers them as the header's contigs.
+    let references = match index.reference_names() {
+        Some(names) => names.to_vec(),
+        None => parse_vcf_contigs(&header.text),
+    };
+
+    let regions = resolve_regions(ctx, regions, &references)
+        .await
+        .map_err(|e| format!("could not read regions: {}", e))?;
+
+    // Sequences with no records aren't in a tabix index and have nothing to read.
+    let scan_regions = merge_regions(&regions)
+        .into_iter()
+        .filter_map(|merged| {
+            let reference_id = references
+                .iter()
+                .position(|name| *name == merged.region.name)?;
+            let (start, end) = merged.region.zero_based(i32::MAX as u64);
+
+            Some(ScanRegion {
+                reference_id,
+                name: merged.region.name,
+                start,
+                end,
+                min_start: merged.previous_end.unwrap_or(0),
+            })
+        })
+        .collect();
+
+    Ok((Arc::new(index), scan_regions))
+}
+
+/// Hands every record of the VCF or BCF file `data` to `visit` until it returns false: all of
+/// them, inflated by `threads` threads, or with `regions` those overlapping any of them, each once.
+pub(crate) fn for_each_record<F>(
+    format: VariantFormat,
+    data: &[u8],
+    regions: Option<&IndexedRegions>,
+    threads: usize,
+    mut visit: F,
+) -> io::Result<()>
+where
+    F: FnMut(&RawRecord) -> io::Result<bool>,
+{
+    let mut record = RawRecord {
+        data: vec![],
+        l_shared: 0,
+    };
+
+    match regions {
+        None => {
+            let mut reader: Box<dyn BgzfRead + '_> = if is_bgzf(data) {
+                Box::new(file_reader(data, threads)?)
+            } else {
+                Box::new(PlainReader { data, position: 0 })
+            };
+
+            Header::read(format, reader.as_mut())?;
+
+            while record.read(format, reader.as_mut())? {
+                if !visit(&record)? {
+                    return Ok(());
+                }
+            }
+        }
+        Some(regions) => {
+            let mut cursor = BlockCursor::new(data);
+            for_each_region_record(format, &mut cursor, regions, visit)?;
+        }
+    }
+
+    Ok(())
+}
+
+/// Hands the records of the file read by `cursor` overlapping any of `regions` to `visit`, each
+/// once, until it returns false.
+fn for_each_region_record<D, F>(
+    format: VariantFormat,
+    cursor: &mut BlockCursor<D>,
+    (index, regions): &IndexedRegions,
+    mut visit: F,
+) -> io::Result<()>
+where
+    D: BlockSource,
+    F: FnMut(&RawRecord) -> io::Result<bool>,
+{
+    let mut record = RawRecord {
+        data: vec![],
+        l_shared: 0,
+    };
+
+    Header::read(format, cursor)?;
+
+    for region in regions {
+        'chunks: for index_chunk in index.query(region.reference_id, region.start, region.end) {
+            cursor.seek(index_chunk.start)?;
+
+            while cursor.virtual_offset() < index_chunk.end {
+                if !record.read(format, cursor)? {
+                    break;
+                }
+
+                let (on_reference, start, end) = record.interval(format, region)?;
+                if !on_reference {
+                    continue;
+                }
+
+                // Records are sorted by start, none past this one can overlap.
+                if start >= region.end {
+                    break 'chunks;
+                }
+
+                if end <= region.start || start + 1 <= region.min_start {
+                    continue;
+                }
+
+                if !visit(&record)? {
+                    return Ok(());
+                }
+            }
+        }
+    }
+
+    Ok(())
+}
+
+/// Where a scan reads its file from.
+enum ScanSource {
+    /// A local file, mapped.
+    Path(String),
+    /// A file read through an object store, only ever by regions.
+    Object(ObjectBlocks),
+}
+
+/// One file, read whole or by regions of its index, its records cut down to `subset` and
+/// decoded behind `header`.
+struct SubsetScan {
+    source: ScanSource,
+    format: VariantFormat,
+    header: Vec<u8>,
+    subset: Subset,
+    regions: Option<IndexedRegions>,
+    batch_size: usize,
+    threads: usize,
+}
+
+impl SubsetScan {
+    /// Reads the file, handing each batch to `emit` until it returns false.
+    fn run<F>(&self, mut emit: F) -> io::Result<()>
+    where
+        F: FnMut(RecordBatch) -> bool,
+    {
+        let rt = new_runtime();
+
+        let mut chunk = vec![];
+        let mut records = 0;
+        let mut columns = vec![];
+
+        let visit = |record: &RawRecord| {
+            match self.format {
+                VariantFormat::Vcf => {
+                    self.subset
+                        .write_vcf_line(&record.data, &mut columns, &mut chunk)
+                }
+                VariantFormat::Bcf => {
+                    self.subset
+                        .write_bcf_record(&record.data, record.l_shared, &mut chunk)?
+                }
+            }
+            records += 1;
+
+            if records >= VCF_CHUNK_LINES || chunk.len() >= CHUNK_BYTES {
+                return self.decode(&rt, &mut chunk, &mut records, &mut emit);
+            }
+
+            Ok(true)
+        };
+
+        match (&self.source, &self.regions) {
+            (ScanSource::Path(path), regions) => {
+                let data = map_file(path)?;
+                for_each_record(self.format, &data, regions.as_ref(), self.threads, visit)?;
+            }
+            (ScanSource::Object(blocks), Some(regions)) => {
+                let mut cursor = BlockCursor::new(blocks.clone());
+                for_each_region_record(self.format, &mut cursor, regions, visit)?;
+            }
+            (ScanSource::Object(_), None) => {
+                return Err(invalid_data(
+                    "files read through an object store need regions",
+                ))
+            }
+        }
+
+        if records > 0 {
+            self.decode(&rt, &mut chunk, &mut records, &mut emit)?;
+        }
+
+        Ok(())
+    }
+
+    /// Decodes the subset records in `chunk` with exon and emits the batches, returning false if
+    /// `emit` asked to stop.
+    fn decode<F>(
+        &self,
+        rt: &Runtime,
+        chunk: &mut Vec<u8>,
+        records: &mut usize,
+        emit: &mut F,
+    ) -> io::Result<bool>
+    where
+        F: FnMut(RecordBatch) -> bool,
+    {
+        let data = file_bytes(self.format, &self.header, chunk)?;
+        chunk.clear();
+        *records = 0;
+
+        let (_, batches) = rt
+            .block_on(decode_file(self.format.name(), data, self.batch_size))
+            .map_err(|e| io::Error::new(io::ErrorKind::Other, e))?;
+
+        Ok(batches.into_iter().all(|batch| emit(batch)))
+    }
+}
+
+/// A whole file of `format` with `header` and `records`, BGZF-compressed for BCF.
+fn file_bytes(format: VariantFormat, header: &[u8], records: &[u8]) -> io::Result<Vec<u8>> {
+    let mut data = Vec::with_capacity(header.len() + records.len());
+    data.extend_from_slice(header);
+    data.extend_from_slice(records);
+
+    match format {
+        VariantFormat::Vcf => Ok(data),
+        VariantFormat::Bcf => bgzf::deflate_all(&data),
+    }
+}
+
+struct SubsetPartition {
+    schema: SchemaRef,
+    scan: Arc<SubsetScan>,
+}
+
+impl PartitionStream for SubsetPartition {
+    fn schema(&self) -> &SchemaRef {
+        &self.schema
+    }
+
+    fn execute(&self, _ctx: Arc<TaskContext>) -> SendableRecordBatchStream {
+        let scan = self.scan.clone();
+
+        blocking_stream(self.schema.clone(), move |emit| scan.run(emit))
+    }
+}
+
+/// Reads the header of the VCF or BCF file at `location` in `store`.
+async fn read_object_header(
+    store: &dyn ObjectStore,
+    location: &Path,
+    format: VariantFormat,
+) -> io::Result<Header> {
+    read_header_prefix(store, location, format.indexed_format(), |data| {
+        Ok(match format {
+            VariantFormat::Vcf => parse_vcf_header(data).map(|text| Header {
+                magic: vec![],
+                text,
+            }),
+            VariantFormat::Bcf => {
+                if data.len() >= 4 && !data.starts_with(b"BCF\x02") {
+                    return Err(invalid_data("not a BCF file"));
+                }
+
+                parse_bcf_header(data).map(|text| Header {
+                    magic: data[..5].to_vec(),
+                    text,
+                })
+            }
+        })
+    })
+    .await
+}
+
+/// The records of the indexed VCF or BCF file at `uri` overlapping any of `entries`, each
+/// samtools-style or the path of a BED file, read through its object store, or the DuckDB file
+/// system if `file_system` isn't null, with the columns of `read_vcf_file_records` or
+/// `read_bcf_file_records`. Overlapping regions are merged and every record is returned once.
+/// The index is read once for all regions, whose chunks are read in order by one cursor, a
+/// planned run of nearby chunks per request, and fetched ahead in parallel through the block
+/// cache.
+pub(crate) async fn object_region_table(
+    ctx: &SessionContext,
+    uri: &str,
+    file_system: *const DuckDBFileSystem,
+    format: VariantFormat,
+    entries: &[String],
+    batch_size: usize,
+    rt: Arc<Runtime>,
+) -> Result<StreamingTable, String> {
+    let cache = register_store(ctx, uri, file_system).await?;
+
+    let table_url = ListingTableUrl::parse(uri).map_err(|e| e.to_string())?;
+    let store = ctx
+        .runtime_env()
+        .object_store(table_url.object_store())
+        .map_err(|e| e.to_string())?;
+    let location = table_url.prefix();
+
+    let header = read_object_header(store.as_ref(), location, format)
+        .await
+        .map_err(|e| format!("could not read header: {}", e))?;
+
+    let index = read_index(store.as_ref(), location, format.indexed_format())
+        .await
+        .map_err(|e| format!("could not read index: {}", e))?;
+    let (index, regions) = plan_regions(ctx, index, &header, entries).await?;
+
+    let chunks = regions
+        .iter()
+        .flat_map(|region| index.query(region.reference_id, region.start, region.end))
+        .collect::<Vec<_>>();
+
+    if let Some((cache, _)) = cache {
+        // A failed prefetch only costs the latency it was meant to hide, the reader below still
+        // fetches what it needs.
+        let _ = prefetch_chunks(&cache, location, &chunks).await;
+    }
+
+    let mut blocks = ObjectBlocks::open(store, location.clone(), rt)
+        .await
+        .map_err(|e| format!("could not read file: {}", e))?;
+    blocks.plan(&chunks);
+
+    // Every sample and INFO key is kept, the records are copied as they are.
+    let (header, subset) = select(&header, format, None, true, None, true)
+        .map_err(|e| format!("could not read header: {}", e))?;
+
+    let schema = match file_bytes(format, &header, &[]) {
+        Ok(empty) => decode_file(format.name(), empty, batch_size)
+            .await
+            .map(|(schema, _)| schema)
+            .map_err(|e| format!("could not read header: {}", e))?,
+        Err(e) => return Err(format!("could not read header: {}", e)),
+    };
+
+    let partition = Arc::new(SubsetPartition {
+        schema: schema.clone(),
+        scan: Arc::new(SubsetScan {
+            source: ScanSource::Object(blocks),
+            format,
+            header,
+            subset,
+            regions: Some((index, regions)),
+            batch_size,
+            threads: 1,
+        }),
+    }) as Arc<dyn PartitionStream>;
+
+    StreamingTable::try_new(schema, vec![partition])
+        .map_err(|e| format!("could not create table: {}", e))
+}
+
+#[repr(C)]
+pub struct SubsetReaderResult {
+    error: *const c_char,
+}
+
+impl SubsetReaderResult {
+    fn error(error: String) -> Self {
+        Self {
+            error: CString::new(error).unwrap().into_raw(),
+        }
+    }
+}
+
+/// Reads the local VCF or BCF file at `uri`, keeping only the `sample_count` samples named at
+/// `samples` in its `formats` column, in that order, and the `info_field_count` INFO keys named
+/// at `info_fields` in its `info` column. A null list keeps everything. If `decode_samples` is
+/// false the `formats` column isn't needed and a single sample is decoded; if `decode_info` is
+/// false no INFO values are. VCF files may be uncompressed or bgzipped.
+///
+/// With no regions the whole file is read. Otherwise the records overlapping any of the
+/// `region_count` regions at `regions` are read with the file's index, each samtools-style or
+/// the path of a BED file; overlapping regions are merged and every record is returned once.
+/// `filters` is a SQL predicate applied to the records. Whole files are inflated by `threads`
+/// threads.
+#[no_mangle]
+pub unsafe extern "C" fn new_subset_reader(
+    stream_ptr: *mut ArrowArrayStream,
+    uri: *const c_char,
+    file_format: *const c_char,
+    samples: *const *const c_char,
+    sample_count: usize,
+    decode_samples: bool,
+    info_fields: *const *const c_char,
+    info_field_count: usize,
+    decode_info: bool,
+    regions: *const *const c_char,
+    region_count: usize,
+    batch_size: usize,
+    threads: usize,
+    filters: *const c_char,
+) -> SubsetReaderResult {
+    let uri = match CStr::from_ptr(uri).to_str() {
+        Ok(uri) => uri,
+        Err(e) => return SubsetReaderResult::error(format!("could not parse uri: {}", e)),
+    };
+
+    let file_format = CStr::from_ptr(file_format).to_str().unwrap_or("");
+    let format = match VariantFormat::from_name(file_format) {
+        Some(format) => format,
+        None => {
+            return SubsetReaderResult::error(format!(
+                "only VCF and BCF records can be subset, not {}",
+                file_format
+            ))
+        }
+    };
+
+    let samples = match strings_from_ffi(samples, sample_count) {
+        Ok(Some(samples)) if samples.is_empty() => {
+            return SubsetReaderResult::error("samples must name at least one sample".to_string())
+        }
+        Ok(samples) => samples,
+        Err(e) => return SubsetReaderResult::error(format!("could not parse samples: {}", e)),
+    };
+
+    let info_fields = match strings_from_ffi(info_fields, info_field_count) {
+        Ok(Some(info_fields)) if info_fields.is_empty() => {
+            return SubsetReaderResult::error(
+                "info_fields must name at least one INFO field".to_string(),
+            )
+        }
+        Ok(info_fields) => info_fields,
+        Err(e) => return SubsetReaderResult::error(format!("could not parse info_fields: {}", e)),
+    };
+
+    let regions = if region_count == 0 {
+        None
+    } else {
+        match regions_from_ffi(regions, region_count) {
+            Ok(regions) => Some(regions),
+            Err(e) => return SubsetReaderResult::error(e),
+        }
+    };
+
+    let filters = if filters.is_null() {
+        ""
+    } else {
+        match CStr::from_ptr(filters).to_str() {
+            Ok(filters) => filters,
+            Err(e) => return SubsetReaderResult::error(format!("could not parse filters: {}", e)),
+        }
+    };
+
+    let data = match map_file(uri) {
+        Ok(data) => data,
+        Err(e) => return SubsetReaderResult::error(format!("could not read file: {}", e)),
+    };
+
+    let header = match read_header(format, &data) {
+        Ok(header) => header,
+        Err(e) => return SubsetReaderResult::error(format!("could not read header: {}", e)),
+    };
+
+    let (subset_header, subset) = match select(
+        &header,
+        format,
+        samples.as_deref(),
+        decode_samples,
+        info_fields.as_deref(),
+        decode_info,
+    ) {
+        Ok(selected) => selected,
+        Err(e) => return SubsetReaderResult::error(format!("could not subset records: {}", e)),
+    };
+
+    let rt = Arc::new(Runtime::new().unwrap());
+
+    let config = new_exon_config().with_batch_size(batch_size);
+    let ctx = SessionContext::with_config_exon(config);
+
+    rt.block_on(async {
+        let schema = match file_bytes(format, &subset_header, &[]) {
+            Ok(empty) => match decode_file(format.name(), empty, batch_size).await {
+                Ok((schema, _)) => schema,
+                Err(e) => {
+                    return SubsetReaderResult::error(format!("could not read header: {}", e))
+                }
+            },
+            Err(e) => return SubsetReaderResult::error(format!("could not read header: {}", e)),
+        };
+
+        let regions = match regions {
+            None => None,
+            Some(regions) => match index_regions(&ctx, uri, format, &header, &regions).await {
+                Ok(regions) => Some(regions),
+                Err(e) => return SubsetReaderResult::error(e),
+            },
+        };
+
+        let partition = Arc::new(SubsetPartition {
+            schema: schema.clone(),
+            scan: Arc::new(SubsetScan {
+                source: ScanSource::Path(uri.to_string()),
+                format,
+                header: subset_header,
+                subset,
+                regions,
+                batch_size,
+                threads,
+            }),
+        }) as Arc<dyn PartitionStream>;
+
+        let table = match StreamingTable::try_new(schema, vec![partition]) {
+            Ok(table) => table,
+            Err(e) => return SubsetReaderResult::error(format!("could not create table: {}", e)),
+        };
+
+        if let Err(e) = ctx.register_table("exon_table", Arc::new(table)) {
+            return SubsetReaderResult::error(format!("could not register table: {}", e));
+        }
+
+        let mut select_string = format!("SELECT * FROM exon_table");
+        if filters != "" {
+            select_string.push_str(format!(" WHERE {}", filters).as_str());
+        }
+
+        let df = match ctx.sql(&select_string).await {
+            Ok(df) => df,
+            Err(e) => return SubsetReaderResult::error(format!("could not execute sql: {}", e)),
+        };
+
+        match create_dataset_stream_from_table_provider(df, rt.clone(), stream_ptr).await {
+            Ok(_) => SubsetReaderResult {
+                error: std::ptr::null(),
+            },
+            Err(e) => SubsetReaderResult::error(format!("could not create dataset stream: {}", e)),
+        }
+    })
+}
@@ -22,25 +22,50 @@ use datafusion::prelude::{SessionConfig, SessionContext};
 use exon::{ffi::create_dataset_stream_from_table_provider, new_exon_config, ExonSessionExt};
 use tokio::runtime::Runtime;
 
+use crate::{
+    duckdb_file_system::DuckDBFileSystem,
+    region_query::{filtered_table, regions_from_ffi},
+    subset_reader::{object_region_table, VariantFormat},
+};
+
 #[repr(C)]
 pub struct VCFReaderResult {
     error: *const c_char,
 }
 
+impl VCFReaderResult {
+    fn error(error: String) -> Self {
+        Self {
+            error: CString::new(error).unwrap().into_raw(),
+        }
+    }
+}
+
+/// Reads the records of the indexed file at `uri` overlapping any of the `region_count` regions at
+/// `regions`. Each region is samtools-style, e.g. `chr1:100-200`, or the path of a BED file.
+/// Overlapping regions are merged and every record is returned once. `filters` is a SQL
+/// predicate applied to the records.
 #[no_mangle]
 pub unsafe extern "C" fn vcf_query_reader(
     stream_ptr: *mut ArrowArrayStream,
     uri: *const c_char,
-    query: *const c_char,
+    regions: *const *const c_char,
+    region_count: usize,
     batch_size: usize,
+    file_system: *const DuckDBFileSystem,
+    filters: *const c_char,
 ) -> VCFReaderResult {
     let uri = match CStr::from_ptr(uri).to_str() {
         Ok(uri) => uri,
-        Err(e) => {
-            let error = CString::new(format!("could not parse uri: {}", e)).unwrap();
-            return VCFReaderResult {
-                error: error.into_raw(),
-            };
+        Err(e) => return VCFReaderResult::error(format!("could not parse uri: {}", e)),
+    };
+
+    let filters = if filters.is_null() {
+        ""
+    } else {
+        match CStr::from_ptr(filters).to_str() {
+            Ok(filters) => filters,
+            Err(e) => return VCFReaderResult::error(format!("could not parse filters: {}", e)),
         }
     };
 
@@ -49,38 +74,37 @@ pub unsafe extern "C" fn vcf_query_reader(
     let config = new_exon_config().with_batch_size(batch_size);
     let ctx = SessionContext::with_config_exon(config);
 
-    let query = match CStr::from_ptr(query).to_str() {
-        Ok(query) => query,
-        Err(e) => {
-            let error = CString::new(format!("could not parse query: {}", e)).unwrap();
-            return VCFReaderResult {
-                error: error.into_raw(),
-            };
-        }
+    let regions = match regions_from_ffi(regions, region_count) {
+        Ok(regions) => regions,
+        Err(e) => return VCFReaderResult::error(e),
     };
 
     rt.block_on(async {
-        let df = match ctx.query_vcf_file(uri, query).await {
+        let table = match object_region_table(
+            &ctx,
+            uri,
+            file_system,
+            VariantFormat::Vcf,
+            &regions,
+            batch_size,
+            rt.clone(),
+        )
+        .await
+        {
+            Ok(table) => table,
+            Err(e) => return VCFReaderResult::error(e),
+        };
+
+        let df = match filtered_table(&ctx, Arc::new(table), filters).await {
             Ok(df) => df,
-            Err(e) => {
-                let error = CString::new(format!("could not read VCF file: {}", e)).unwrap();
-                return VCFReaderResult {
-                    error: error.into_raw(),
-                };
-            }
+            Err(e) => return VCFReaderResult::error(format!("could not read VCF file: {}", e)),
         };
 
         match create_dataset_stream_from_table_provider(df, rt.clone(), stream_ptr).await {
             Ok(_) => VCFReaderResult {
                 error: std::ptr::null(),
             },
-            Err(e) => {
-                let error =
-                    CString::new(format!("could not create dataset stream: {}", e)).unwrap();
-                return VCFReaderResult {
-                    error: error.into_raw(),
-                };
-            }
+            Err(e) => VCFReaderResult::error(format!("could not create dataset stream: {}", e)),
         }
     })
 }